@@ -0,0 +1,237 @@
+#include <defaultInclude.h>
+#include <stdio.h>
+#include <debug.h>
+#include "frame.h"
+#include "arch/i686/memory_i686.h"
+
+#define MODULE "frame"
+
+/*
+ * Physical frame allocator
+ *
+ * Every 4 KiB frame below the highest usable address has a bit in frame_used.
+ * Free frames are also kept on a stack so frameAlloc/frameFree are O(1).
+ * frameAllocRange takes frames straight out of the bitmap, the stack entries
+ * for those frames go stale and are skipped when they are popped. frame_stacked
+ * remembers which frames already have an entry so a frame is never on the
+ * stack twice.
+ */
+
+uint32_t *frame_used = NULL;
+uint32_t *frame_stacked = NULL;
+uint32_t *frame_stack = NULL;
+uint32_t frame_stack_top = 0;
+uint32_t frame_stack_size = 0;
+
+uint32_t frame_count = 0; // frames covered by the bitmap
+uint32_t frame_total = 0; // usable frames
+uint32_t frame_free = 0;
+
+static inline bool bitTest(uint32_t *map, uint32_t frame)
+{
+	return map[frame >> 5] & (1 << (frame & 31));
+}
+
+static inline void bitSet(uint32_t *map, uint32_t frame)
+{
+	map[frame >> 5] |= 1 << (frame & 31);
+}
+
+static inline void bitClear(uint32_t *map, uint32_t frame)
+{
+	map[frame >> 5] &= ~(1 << (frame & 31));
+}
+
+// clips a region to 32 bits and whole frames
+static bool regionFrames(MemoryRegion *region, uint32_t *first, uint32_t *last)
+{
+	uint64_t begin = region->Begin;
+	uint64_t end = region->Begin + region->Length;
+	if (begin >= 0x100000000ULL)
+		return false;
+	if (end > 0x100000000ULL)
+		end = 0x100000000ULL;
+
+	*first = (begin + FRAME_SIZE - 1) >> FRAME_SHIFT;
+	*last = end >> FRAME_SHIFT;
+	return *first < *last;
+}
+
+static void frameMarkUsed(uint32_t first, uint32_t last)
+{
+	for (uint32_t frame = first; frame < last && frame < frame_count; frame++)
+		bitSet(frame_used, frame);
+}
+
+static void frameMarkFree(uint32_t first, uint32_t last)
+{
+	for (uint32_t frame = first; frame < last && frame < frame_count; frame++)
+		bitClear(frame_used, frame);
+}
+
+static void framePush(uint32_t frame)
+{
+	if (bitTest(frame_stacked, frame) || frame_stack_top >= frame_stack_size)
+		return;
+	bitSet(frame_stacked, frame);
+	frame_stack[frame_stack_top++] = frame;
+}
+
+void frameInit(MemoryRegion *regions, int regionCount, uint32_t kernel_end)
+{
+	MemoryRegion fallback = {0, 0x400000, MEMORY_AVAILABLE, 0};
+	if (regions == NULL || regionCount == 0)
+	{
+		log_warn(MODULE, "No memory map from the bootloader, assuming 4 MiB");
+		regions = &fallback;
+		regionCount = 1;
+	}
+
+	uint32_t first, last;
+	for (int i = 0; i < regionCount; i++)
+	{
+		if (regions[i].Type != MEMORY_AVAILABLE || !regionFrames(&regions[i], &first, &last))
+			continue;
+		if (last > frame_count)
+			frame_count = last;
+	}
+
+	// bitmaps and the stack go right after the kernel
+	uint32_t mapSize = ((frame_count + 31) / 32) * sizeof(uint32_t);
+	uint32_t metaStart = (kernel_end + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+	frame_used = (uint32_t *)metaStart;
+	frame_stacked = (uint32_t *)(metaStart + mapSize);
+	frame_stack = (uint32_t *)(metaStart + mapSize * 2);
+	memset(frame_used, 0xFF, mapSize);
+	memset(frame_stacked, 0, mapSize);
+
+	for (int i = 0; i < regionCount; i++)
+	{
+		if (regions[i].Type == MEMORY_AVAILABLE && regionFrames(&regions[i], &first, &last))
+			frameMarkFree(first, last);
+	}
+	// regions can overlap, anything that is reserved anywhere stays reserved
+	for (int i = 0; i < regionCount; i++)
+	{
+		if (regions[i].Type != MEMORY_AVAILABLE && regionFrames(&regions[i], &first, &last))
+			frameMarkUsed(first, last);
+	}
+
+	uint32_t freeFrames = 0;
+	for (uint32_t frame = 0; frame < frame_count; frame++)
+	{
+		if (!bitTest(frame_used, frame))
+			freeFrames++;
+	}
+
+	uint32_t metaEnd = (uint32_t)(frame_stack + freeFrames);
+	metaEnd = (metaEnd + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+	// low memory, the kernel image and the metadata itself
+	frameMarkUsed(0, metaEnd >> FRAME_SHIFT);
+	frame_stack_size = freeFrames;
+
+	// push high frames first so low memory is handed out first
+	frame_stack_top = 0;
+	frame_free = 0;
+	for (uint32_t frame = frame_count; frame-- > 0;)
+	{
+		if (bitTest(frame_used, frame))
+			continue;
+		framePush(frame);
+		frame_free++;
+	}
+	frame_total = frame_free;
+
+	log_info(MODULE, "%u MiB usable, %u frames free, metadata %x-%x", (frame_total * FRAME_SIZE) >> 20, frame_free, metaStart, metaEnd);
+}
+
+uint32_t frameAlloc()
+{
+	while (frame_stack_top > 0)
+	{
+		uint32_t frame = frame_stack[--frame_stack_top];
+		bitClear(frame_stacked, frame);
+		if (bitTest(frame_used, frame))
+			continue; // taken by frameAllocRange
+		bitSet(frame_used, frame);
+		frame_free--;
+		return frame << FRAME_SHIFT;
+	}
+	return 0;
+}
+
+void frameFree(uint32_t address)
+{
+	uint32_t frame = address >> FRAME_SHIFT;
+	if (frame >= frame_count || !bitTest(frame_used, frame))
+	{
+		log_err(MODULE, "frameFree: %x was not allocated", address);
+		return;
+	}
+	bitClear(frame_used, frame);
+	framePush(frame);
+	frame_free++;
+}
+
+uint32_t frameAllocRange(uint32_t count)
+{
+	if (count == 0)
+		return 0;
+	if (count == 1)
+		return frameAlloc();
+
+	uint32_t run = 0;
+	for (uint32_t frame = 0; frame < frame_count; frame++)
+	{
+		// skip full words quickly
+		if (run == 0 && (frame & 31) == 0 && frame_used[frame >> 5] == 0xFFFFFFFF)
+		{
+			frame += 31;
+			continue;
+		}
+
+		if (bitTest(frame_used, frame))
+		{
+			run = 0;
+			continue;
+		}
+
+		if (++run == count)
+		{
+			uint32_t first = frame + 1 - count;
+			frameMarkUsed(first, frame + 1);
+			frame_free -= count;
+			return first << FRAME_SHIFT;
+		}
+	}
+	return 0;
+}
+
+void frameFreeRange(uint32_t address, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+		frameFree(address + (i << FRAME_SHIFT));
+}
+
+uint32_t frameFreeCount()
+{
+	return frame_free;
+}
+
+uint32_t frameTotalCount()
+{
+	return frame_total;
+}
+
+uint32_t frameMemoryEnd()
+{
+	if (frame_count >= (0xFFFFFFFF >> FRAME_SHIFT))
+		return 0xFFFFF000;
+	return frame_count << FRAME_SHIFT;
+}
+
+void framePrintStatus()
+{
+	fprintf(VFS_FD_DEBUG, "Frames: %u free of %u (%u KiB free)\n", frame_free, frame_total, frame_free * (FRAME_SIZE / 1024));
+	fprintf(VFS_FD_DEBUG, "Frame stack: %u entries\n", frame_stack_top);
+}
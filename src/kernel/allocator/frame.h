@@ -0,0 +1,20 @@
+#pragma once
+
+#include "defaultInclude.h"
+
+#define FRAME_SIZE 4096
+#define FRAME_SHIFT 12
+
+// frames are handed out as physical addresses, 0 means out of memory
+void frameInit(MemoryRegion *regions, int regionCount, uint32_t kernel_end);
+uint32_t frameAlloc();
+void frameFree(uint32_t frame);
+
+// physically contiguous frames, for the heap and DMA buffers
+uint32_t frameAllocRange(uint32_t count);
+void frameFreeRange(uint32_t frame, uint32_t count);
+
+uint32_t frameFreeCount();
+uint32_t frameTotalCount();
+uint32_t frameMemoryEnd(); // end of the highest usable frame
+void framePrintStatus();
@@ -1,175 +1,565 @@
-
 #include <defaultInclude.h>
 #include <stdio.h>
 #include <debug.h>
+#include "memory.h"
+#include "frame.h"
 #include "arch/i686/memory_i686.h"
+#include "arch/i686/io.h"
 
 #define MODULE "malloc"
 
-#define MAXPAGEALIGNEDALLOC 32
+/*
+ * Kernel heap
+ *
+ * The heap is split into 4 KiB pages. Every page has a descriptor in
+ * heap_pages[] (kept at the start of the heap) that says what the page is used for:
+ *
+ *  - small allocations (<= SLAB_MAX_SIZE) are served from slab pages. A slab page
+ *    only holds objects of a single size class and keeps its own free list, so
+ *    malloc/free of a small block is a couple of pointer moves.
+ *  - large allocations are a run of whole pages (page aligned).
+ *  - free pages are kept as runs in a list, neighbouring runs are merged on free.
+ *
+ * A run is described by its head and its last page only, so splitting and
+ * merging runs costs the same however long they are. Pages in between keep
+ * whatever they said before, but never the type of a head.
+ */
+
+#define HEAP_PAGE_SIZE 4096
+#define HEAP_PAGE_SHIFT 12
+
+#define SLAB_MIN_SHIFT 4 // smallest class is 16 bytes
+#define SLAB_CLASS_COUNT 8 // 16, 32, 64, 128, 256, 512, 1024, 2048
+#define SLAB_MAX_SIZE (1 << (SLAB_MIN_SHIFT + SLAB_CLASS_COUNT - 1))
+
+#define HEAP_NO_PAGE 0xFFFFFFFF
+
+// the heap gets half of the free frames but never less than the 4 MiB it used to have
+#define HEAP_MIN_PAGES 1024
+
+typedef enum
+{
+	HEAP_PAGE_RESERVED = 0, // page descriptors live here
+	HEAP_PAGE_FREE,
+	HEAP_PAGE_SLAB,
+	HEAP_PAGE_LARGE,
+	HEAP_PAGE_TAIL, // part of a run past its head
+} heap_page_type;
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t sizeClass; // slab: index in g_SlabClasses
+	uint16_t inUse;	   // slab: allocated objects in this page
+	uint32_t pages;	   // run head: length of the run, last page: index of the run head
+	uint32_t size;	   // large: bytes requested by the caller
+	uint32_t prev;	   // free run list / slab partial list
+	uint32_t next;
+	void *freeList; // slab: first free object in this page
+} heap_page_t;
+
+typedef struct
+{
+	uint32_t objectSize;
+	uint32_t objectsPerPage;
+	uint32_t partial; // first slab page with at least one free object
+	uint32_t pages;	  // slab pages owned by this class
+	uint32_t inUse;	  // objects handed out
+} slab_class_t;
 
-uint32_t last_alloc = 0;
 uint32_t heap_end = 0;
 uint32_t heap_begin = 0;
-uint32_t pheap_begin = 0;
-uint32_t pheap_end = 0;
-uint8_t *pheap_desc = 0;
 uint32_t memory_used = 0;
 
-void mmInit(uint32_t kernel_end)
+heap_page_t *heap_pages = 0;
+uint32_t heap_page_count = 0;
+uint32_t heap_free_runs = HEAP_NO_PAGE;
+uint32_t heap_free_pages = 0;
+
+slab_class_t g_SlabClasses[SLAB_CLASS_COUNT];
+
+static inline void *heapPageAddress(uint32_t page)
+{
+	return (void *)(heap_begin + (page << HEAP_PAGE_SHIFT));
+}
+
+static inline uint32_t heapPageIndex(void *mem)
+{
+	return ((uint32_t)mem - heap_begin) >> HEAP_PAGE_SHIFT;
+}
+
+static inline int slabClassFor(size_t size)
+{
+	int sizeClass = 0;
+	size_t objectSize = 1 << SLAB_MIN_SHIFT;
+	while (objectSize < size)
+	{
+		objectSize <<= 1;
+		sizeClass++;
+	}
+	return sizeClass;
+}
+
+// marks the head of a run and makes its last page point back to it
+static void heapSetRun(uint32_t head, uint32_t pages, heap_page_type type)
+{
+	heap_pages[head].type = type;
+	heap_pages[head].pages = pages;
+	if (pages > 1)
+	{
+		heap_pages[head + pages - 1].type = HEAP_PAGE_TAIL;
+		heap_pages[head + pages - 1].pages = head;
+	}
+}
+
+static void heapListRemove(uint32_t *list, uint32_t page)
+{
+	heap_page_t *desc = &heap_pages[page];
+	if (desc->prev != HEAP_NO_PAGE)
+		heap_pages[desc->prev].next = desc->next;
+	else
+		*list = desc->next;
+	if (desc->next != HEAP_NO_PAGE)
+		heap_pages[desc->next].prev = desc->prev;
+	desc->prev = HEAP_NO_PAGE;
+	desc->next = HEAP_NO_PAGE;
+}
+
+static void heapListPush(uint32_t *list, uint32_t page)
 {
-	last_alloc = kernel_end + 0x1000;
-	heap_begin = last_alloc;
-	pheap_end = 0x400000;
-	pheap_begin = pheap_end - (MAXPAGEALIGNEDALLOC * 4096);
-	heap_end = pheap_begin;
-	memset((char *)heap_begin, 0, heap_end - heap_begin);
-	pheap_desc = (uint8_t *)malloc(MAXPAGEALIGNEDALLOC);
-	log_debug(MODULE, "Kernel heap starts at %x", last_alloc);
+	heap_page_t *desc = &heap_pages[page];
+	desc->prev = HEAP_NO_PAGE;
+	desc->next = *list;
+	if (*list != HEAP_NO_PAGE)
+		heap_pages[*list].prev = page;
+	*list = page;
+}
+
+// takes a run of pages out of the free runs, first fit
+static uint32_t heapAllocPages(uint32_t pages)
+{
+	for (uint32_t run = heap_free_runs; run != HEAP_NO_PAGE; run = heap_pages[run].next)
+	{
+		uint32_t runPages = heap_pages[run].pages;
+		if (runPages < pages)
+			continue;
+
+		heapListRemove(&heap_free_runs, run);
+		if (runPages > pages)
+		{
+			// give the rest of the run back
+			heapSetRun(run + pages, runPages - pages, HEAP_PAGE_FREE);
+			heapListPush(&heap_free_runs, run + pages);
+		}
+		heapSetRun(run, pages, HEAP_PAGE_LARGE);
+		heap_free_pages -= pages;
+		return run;
+	}
+	return HEAP_NO_PAGE;
+}
+
+// returns a run of pages and merges it with free neighbours
+static void heapFreePages(uint32_t head)
+{
+	uint32_t pages = heap_pages[head].pages;
+	heap_free_pages += pages;
+
+	uint32_t next = head + pages;
+	if (next < heap_page_count && heap_pages[next].type == HEAP_PAGE_FREE)
+	{
+		heapListRemove(&heap_free_runs, next);
+		pages += heap_pages[next].pages;
+		heap_pages[next].type = HEAP_PAGE_TAIL;
+	}
+
+	if (head > 0)
+	{
+		uint32_t prev = head - 1;
+		if (heap_pages[prev].type == HEAP_PAGE_TAIL)
+			prev = heap_pages[prev].pages;
+		if (heap_pages[prev].type == HEAP_PAGE_FREE)
+		{
+			heapListRemove(&heap_free_runs, prev);
+			pages += heap_pages[prev].pages;
+			heap_pages[head].type = HEAP_PAGE_TAIL;
+			head = prev;
+		}
+	}
+
+	heapSetRun(head, pages, HEAP_PAGE_FREE);
+	heapListPush(&heap_free_runs, head);
+}
+
+// carves a fresh page into objects for a size class
+static uint32_t slabGrow(int sizeClass)
+{
+	slab_class_t *slab = &g_SlabClasses[sizeClass];
+	uint32_t page = heapAllocPages(1);
+	if (page == HEAP_NO_PAGE)
+		return HEAP_NO_PAGE;
+
+	heap_page_t *desc = &heap_pages[page];
+	desc->type = HEAP_PAGE_SLAB;
+	desc->sizeClass = sizeClass;
+	desc->inUse = 0;
+
+	uint8_t *base = (uint8_t *)heapPageAddress(page);
+	void *list = NULL;
+	for (int i = slab->objectsPerPage - 1; i >= 0; i--)
+	{
+		void **object = (void **)(base + i * slab->objectSize);
+		*object = list;
+		list = object;
+	}
+	desc->freeList = list;
+
+	heapListPush(&slab->partial, page);
+	slab->pages++;
+	return page;
+}
+
+static void *slabAlloc(int sizeClass)
+{
+	slab_class_t *slab = &g_SlabClasses[sizeClass];
+	uint32_t page = slab->partial;
+	if (page == HEAP_NO_PAGE)
+	{
+		page = slabGrow(sizeClass);
+		if (page == HEAP_NO_PAGE)
+			return NULL;
+	}
+
+	heap_page_t *desc = &heap_pages[page];
+	void **object = (void **)desc->freeList;
+	desc->freeList = *object;
+	desc->inUse++;
+	slab->inUse++;
+
+	// page is full, stop looking at it until something is freed
+	if (desc->freeList == NULL)
+		heapListRemove(&slab->partial, page);
+
+	return object;
+}
+
+static void slabFree(uint32_t page, void *mem)
+{
+	heap_page_t *desc = &heap_pages[page];
+	slab_class_t *slab = &g_SlabClasses[desc->sizeClass];
+
+	bool wasFull = desc->freeList == NULL;
+	*(void **)mem = desc->freeList;
+	desc->freeList = mem;
+	desc->inUse--;
+	slab->inUse--;
+
+	if (wasFull)
+		heapListPush(&slab->partial, page);
+
+	// keep one empty page per class around so alloc/free pairs do not bounce pages
+	if (desc->inUse == 0 && !(slab->partial == page && desc->next == HEAP_NO_PAGE))
+	{
+		heapListRemove(&slab->partial, page);
+		slab->pages--;
+		desc->pages = 1;
+		heapFreePages(page);
+	}
+}
+
+void mmInit()
+{
+	uint32_t pages = frameFreeCount() / 2;
+	if (pages < HEAP_MIN_PAGES)
+		pages = frameFreeCount() < HEAP_MIN_PAGES ? frameFreeCount() : HEAP_MIN_PAGES;
+
+	// the heap has to be physically contiguous, shrink it until it fits
+	heap_begin = 0;
+	while (pages && (heap_begin = frameAllocRange(pages)) == 0)
+		pages -= pages / 8 + 1;
+	if (heap_begin == 0)
+	{
+		log_crit(MODULE, "No memory for the kernel heap");
+		panic();
+	}
+	heap_end = heap_begin + (pages << HEAP_PAGE_SHIFT);
+	heap_page_count = pages;
+
+	// page descriptors take the first pages of the heap
+	heap_pages = (heap_page_t *)heap_begin;
+	uint32_t descPages = (heap_page_count * sizeof(heap_page_t) + HEAP_PAGE_SIZE - 1) >> HEAP_PAGE_SHIFT;
+	memset(heap_pages, 0, descPages << HEAP_PAGE_SHIFT);
+
+	for (uint32_t i = 0; i < heap_page_count; i++)
+	{
+		heap_pages[i].prev = HEAP_NO_PAGE;
+		heap_pages[i].next = HEAP_NO_PAGE;
+	}
+	heapSetRun(0, descPages, HEAP_PAGE_RESERVED);
+
+	heap_free_runs = HEAP_NO_PAGE;
+	heap_free_pages = heap_page_count - descPages;
+	heapSetRun(descPages, heap_free_pages, HEAP_PAGE_FREE);
+	heapListPush(&heap_free_runs, descPages);
+
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		g_SlabClasses[i].objectSize = 1 << (SLAB_MIN_SHIFT + i);
+		g_SlabClasses[i].objectsPerPage = HEAP_PAGE_SIZE / g_SlabClasses[i].objectSize;
+		g_SlabClasses[i].partial = HEAP_NO_PAGE;
+		g_SlabClasses[i].pages = 0;
+		g_SlabClasses[i].inUse = 0;
+	}
+
+	memory_used = descPages << HEAP_PAGE_SHIFT;
+	log_debug(MODULE, "Kernel heap %x-%x, %u pages (%u for descriptors)", heap_begin, heap_end, heap_page_count, descPages);
 }
 
 void mmPrintStatus()
 {
 	fprintf(VFS_FD_DEBUG, "Memory used: %d bytes\n", memory_used);
-	fprintf(VFS_FD_DEBUG, "Memory free: %d bytes\n", heap_end - heap_begin - memory_used);
+	fprintf(VFS_FD_DEBUG, "Memory free: %d bytes\n", heap_free_pages * HEAP_PAGE_SIZE);
 	fprintf(VFS_FD_DEBUG, "Heap size: %d bytes\n", heap_end - heap_begin);
 	fprintf(VFS_FD_DEBUG, "Heap start: 0x%x\n", heap_begin);
 	fprintf(VFS_FD_DEBUG, "Heap end: 0x%x\n", heap_end);
-	fprintf(VFS_FD_DEBUG, "PHeap start: 0x%x\n", pheap_begin);
-	fprintf(VFS_FD_DEBUG, "PHeap end: 0x%x\n", pheap_end);
+	framePrintStatus();
+	fprintf(VFS_FD_DEBUG, "Slab  size  pages  in use / total\n");
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		slab_class_t *slab = &g_SlabClasses[i];
+		fprintf(VFS_FD_DEBUG, "%4d %5u %6u %7u / %u\n", i, slab->objectSize, slab->pages, slab->inUse, slab->pages * slab->objectsPerPage);
+	}
 }
 
-void free(void *mem)
+static void heapFree(void *mem)
 {
-	alloc_t *alloc = (mem - sizeof(alloc_t));
-	memory_used -= alloc->size + sizeof(alloc_t);
-	alloc->status = 0;
+	if (mem == NULL)
+		return;
+
+	if ((uint32_t)mem < heap_begin || (uint32_t)mem >= heap_end)
+	{
+		log_err(MODULE, "free: %p is not in the heap", mem);
+		return;
+	}
+
+	uint32_t page = heapPageIndex(mem);
+	heap_page_t *desc = &heap_pages[page];
+	switch (desc->type)
+	{
+	case HEAP_PAGE_SLAB:
+		memory_used -= g_SlabClasses[desc->sizeClass].objectSize;
+		slabFree(page, mem);
+		break;
+	case HEAP_PAGE_LARGE:
+		if (mem != heapPageAddress(page))
+		{
+			log_err(MODULE, "free: %p is inside an allocation", mem);
+			return;
+		}
+		memory_used -= desc->pages << HEAP_PAGE_SHIFT;
+		heapFreePages(page);
+		break;
+	default:
+		log_err(MODULE, "free: %p was not allocated (page type %u)", mem, desc->type);
+		break;
+	}
 }
 
-void pfree(void *mem)
+
+// large allocations are whole pages, so they are always page aligned
+static void *largeAlloc(size_t size)
 {
-	if((uint32_t)mem < pheap_begin || (uint32_t)mem > pheap_end) return;
-	/* Determine which page is it */
-	uint32_t ad = (uint32_t)mem;
-	ad -= pheap_begin;
-	ad /= 4096;
-	/* Now, ad has the id of the page */
-	pheap_desc[ad] = 0;
-	return;
+	uint32_t pages = (size + HEAP_PAGE_SIZE - 1) >> HEAP_PAGE_SHIFT;
+	uint32_t page = heapAllocPages(pages);
+	if (page == HEAP_NO_PAGE)
+		return NULL;
+	heap_pages[page].size = size;
+	memory_used += pages << HEAP_PAGE_SHIFT;
+	return heapPageAddress(page);
 }
 
-void* pmalloc(size_t size)
+static void *heapPMalloc(size_t size)
 {
-	/* Loop through the avail_list */
-	for(int i = 0; i < MAXPAGEALIGNEDALLOC; i++)
+	void *mem = largeAlloc(size ? size : 1);
+	if (mem == NULL)
 	{
-		if(pheap_desc[i]) continue;
-		pheap_desc[i] = 1;
-		log_debug(MODULE, "PAllocated from 0x%x to 0x%x", pheap_begin + i*4096, pheap_begin + (i+1)*4096);
-		return (char *)(pheap_begin + i*4096);
+		log_debug(MODULE, "pmalloc: FATAL: failure!");
+		return 0;
 	}
-	log_debug(MODULE, "pmalloc: FATAL: failure!");
-	return 0;
+	memset(mem, 0, size);
+	return mem;
 }
 
-void* malloc(size_t size)
+static void *heapMalloc(size_t size)
 {
 	if(!size) return 0;
 
-	/* Loop through blocks and find a block sized the same or bigger */
-	uint8_t *mem = (uint8_t *)heap_begin;
-	while((uint32_t)mem < last_alloc)
-	{
-		alloc_t *a = (alloc_t *)mem;
-		/* If the alloc has no size, we have reaced the end of allocation */
-		//log_debug(MODULE, "mem=0x%x a={.status=%d, .size=%d}", mem, a->status, a->size);
-		if(!a->size)
-			goto nalloc;
-		/* If the alloc has a status of 1 (allocated), then add its size
-		 * and the sizeof alloc_t to the memory and continue looking.
-		 */
-		if(a->status) {
-			mem += a->size;
-			mem += sizeof(alloc_t);
-			mem += 4;
-			continue;
-		}
-		/* If the is not allocated, and its size is bigger or equal to the
-		 * requested size, then adjust its size, set status and return the location.
-		 */
-		if(a->size >= size)
-		{
-			/* Set to allocated */
-			a->status = 1;
-
-			// log_debug(MODULE, "Allocated %d bytes from 0x%x to 0x%x", size, mem + sizeof(alloc_t), mem + sizeof(alloc_t) + size);
-			memset(mem + sizeof(alloc_t), 0, size);
-			memory_used += size + sizeof(alloc_t);
-			return (char *)(mem + sizeof(alloc_t));
-		}
-		/* If it isn't allocated, but the size is not good, then
-		 * add its size and the sizeof alloc_t to the pointer and
-		 * continue;
-		 */
-		mem += a->size;
-		mem += sizeof(alloc_t);
-		mem += 4;
+	void *mem;
+	if (size > SLAB_MAX_SIZE)
+	{
+		mem = largeAlloc(size);
 	}
-
-	nalloc:;
-	if(last_alloc+size+sizeof(alloc_t) >= heap_end)
+	else
 	{
-		// set_task(0);
-		panicMSG("Cannot allocate %d bytes! Out of memory.", size);
+		int sizeClass = slabClassFor(size);
+		mem = slabAlloc(sizeClass);
+		if (mem)
+			memory_used += g_SlabClasses[sizeClass].objectSize;
 	}
-	alloc_t *alloc = (alloc_t *)last_alloc;
-	alloc->status = 1;
-	alloc->size = size;
-
-	last_alloc += size;
-	last_alloc += sizeof(alloc_t);
-	last_alloc += 4;
-	// log_debug(MODULE, "Allocated %d bytes from 0x%x to 0x%x", size, (uint32_t)alloc + sizeof(alloc_t), last_alloc);
-	memory_used += size + 4 + sizeof(alloc_t);
-	memset((char *)((uint32_t)alloc + sizeof(alloc_t)), 0, size);
-	return (char *)((uint32_t)alloc + sizeof(alloc_t));
-/*
-	char* ret = (char*)last_alloc;
-	last_alloc += size;
-	if(last_alloc >= heap_end)
+
+	if (mem == NULL)
 	{
-		set_task(0);
 		panicMSG("Cannot allocate %d bytes! Out of memory.", size);
 	}
-	log_debug(MODULE, "Allocated %d bytes from 0x%x to 0x%x", size, ret, last_alloc);
-	return ret;*/
+	// the whole slab object is cleared so realloc can grow inside it without clearing
+	if (size <= SLAB_MAX_SIZE)
+		size = g_SlabClasses[slabClassFor(size)].objectSize;
+	memset(mem, 0, size);
+	return mem;
 }
 
 void* calloc(size_t num, size_t size)
 {
-    size_t total_size = num * size;
-    void *ptr = malloc(total_size);
-    if (ptr)
+    if (size && num > (size_t)-1 / size)
     {
-        memset(ptr, 0, size);
-        return ptr;
+        return NULL;
     }
-    return NULL;
+    // malloc already hands out zeroed memory
+    return malloc(num * size);
+}
+// grows a large allocation into the free pages right after it
+static bool largeGrow(uint32_t head, uint32_t pages)
+{
+	uint32_t oldPages = heap_pages[head].pages;
+	uint32_t next = head + oldPages;
+	uint32_t needed = pages - oldPages;
+	if (next >= heap_page_count || heap_pages[next].type != HEAP_PAGE_FREE || heap_pages[next].pages < needed)
+		return false;
+
+	uint32_t freePages = heap_pages[next].pages;
+	heapListRemove(&heap_free_runs, next);
+	heap_pages[next].type = HEAP_PAGE_TAIL;
+	if (freePages > needed)
+	{
+		heapSetRun(next + needed, freePages - needed, HEAP_PAGE_FREE);
+		heapListPush(&heap_free_runs, next + needed);
+	}
+	heapSetRun(head, pages, HEAP_PAGE_LARGE);
+	heap_free_pages -= needed;
+	memory_used += needed << HEAP_PAGE_SHIFT;
+	return true;
 }
+
+// gives the pages past the new end of a large allocation back
+static void largeShrink(uint32_t head, uint32_t pages)
+{
+	uint32_t oldPages = heap_pages[head].pages;
+	if (pages >= oldPages)
+		return;
+
+	heapSetRun(head, pages, HEAP_PAGE_LARGE);
+	heapSetRun(head + pages, oldPages - pages, HEAP_PAGE_LARGE);
+	heapFreePages(head + pages);
+	memory_used -= (oldPages - pages) << HEAP_PAGE_SHIFT;
+}
+
+static void *heapRealloc(void* ptr, size_t size)
+{
+	if (!ptr)
+	{
+		return heapMalloc(size); // If ptr is NULL, realloc behaves like malloc
+	}
+
+	if (size == 0)
+	{
+		heapFree(ptr); // If size is 0, realloc behaves like free
+		return NULL;
+	}
+
+	if ((uint32_t)ptr < heap_begin || (uint32_t)ptr >= heap_end)
+	{
+		log_err(MODULE, "realloc: %p is not in the heap", ptr);
+		return NULL;
+	}
+
+	uint32_t page = heapPageIndex(ptr);
+	heap_page_t *desc = &heap_pages[page];
+	size_t oldSize;
+	if (desc->type == HEAP_PAGE_SLAB)
+	{
+		uint32_t objectSize = g_SlabClasses[desc->sizeClass].objectSize;
+		if (size <= objectSize)
+		{
+			// still fits in the object, keep the part past the new size cleared
+			memset((uint8_t *)ptr + size, 0, objectSize - size);
+			return ptr;
+		}
+		oldSize = objectSize;
+	}
+	else if (desc->type == HEAP_PAGE_LARGE && ptr == heapPageAddress(page))
+	{
+		uint32_t pages = (size + HEAP_PAGE_SIZE - 1) >> HEAP_PAGE_SHIFT;
+		oldSize = desc->size;
+		if (pages <= desc->pages)
+		{
+			largeShrink(page, pages);
+			if (size > oldSize)
+				memset((uint8_t *)ptr + oldSize, 0, size - oldSize);
+			desc->size = size;
+			return ptr;
+		}
+		if (largeGrow(page, pages))
+		{
+			memset((uint8_t *)ptr + oldSize, 0, size - oldSize);
+			desc->size = size;
+			return ptr;
+		}
+	}
+	else
+	{
+		log_err(MODULE, "realloc: %p was not allocated (page type %u)", ptr, desc->type);
+		return NULL;
+	}
+
+	// no room where it is, move it
+	void *mem = heapMalloc(size);
+	memcpy(mem, ptr, oldSize < size ? oldSize : size);
+	heapFree(ptr);
+	return mem;
+}
+
+// tasks can be preempted, the heap is only touched with interrupts off
+void* malloc(size_t size)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	void *mem = heapMalloc(size);
+	i686_RestoreInterrupts(flags);
+	return mem;
+}
+
+void* pmalloc(size_t size)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	void *mem = heapPMalloc(size);
+	i686_RestoreInterrupts(flags);
+	return mem;
+}
+
 void* realloc(void* ptr, size_t size)
 {
-    if (!ptr)
-    {
-        return malloc(size); // If ptr is NULL, realloc behaves like malloc
-    }
+	uint32_t flags = i686_SaveInterrupts();
+	void *mem = heapRealloc(ptr, size);
+	i686_RestoreInterrupts(flags);
+	return mem;
+}
 
-    if (size == 0)
-    {
-        free(ptr); // If size is 0, realloc behaves like free
-        return NULL;
-    }
+void free(void *mem)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	heapFree(mem);
+	i686_RestoreInterrupts(flags);
+}
 
-    // Since we are not handling memory copying in this simple version,
-    // this part would require more advanced management for full support.
-    return malloc(size); // For now, just treat realloc as malloc.
-}
\ No newline at end of file
+void pfree(void *mem)
+{
+	free(mem);
+}
@@ -1,27 +1,56 @@
-
 // org code https://github.com/levex/osdev/blob/bba025f8cfced6ad1addc625aaf9dab8fa7aef80/memory/paging.c
 
 #include <defaultInclude.h>
 #include <stdio.h>
 #include <debug.h>
 #include "arch/i686/memory_i686.h"
+#include "frame.h"
 
 #define MODULE "paging"
 
 #define PAGE_SIZE 0x1000
-#define PAGE_PRESENT 0x1
-#define PAGE_WRITE   0x2
+#define PAGE_FRAME_MASK 0xFFFFF000
+
+/*
+ * Address space layout
+ *
+ * 0x00000000 - RAM end      identity mapped, the kernel is linked at 1 MiB and
+ *                           drivers hand heap pointers to DMA engines as is;
+ *                           only the user program image and the stacks of
+ *                           running processes are reachable from ring 3
+ * 0xC0000000 - 0xE0000000   KERNEL_VIRTUAL_BASE, all of RAM mapped again (PHYS_TO_VIRT)
+ * 0xE0000000 - 0xFFC00000   MMIO window, handed out by pagingMapMMIO
+ *
+ * Page tables are allocated from the frame allocator the first time an address
+ * in their 4 MiB is mapped. They are reached through the identity map.
+ */
 
 static uint32_t* page_directory = 0;
 static uint32_t page_dir_loc = 0;
-static uint32_t* last_page = 0;
+static bool paging_enabled = false;
+static uint32_t mmio_next = PAGING_MMIO_BASE;
+
+#define MAX_MMIO_MAPPINGS 16
+
+typedef struct {
+    uint32_t phys;
+    uint32_t size;
+    uint32_t virt;
+} mmio_mapping_t;
+
+static mmio_mapping_t mmio_mappings[MAX_MMIO_MAPPINGS];
+static int mmio_mapping_count = 0;
 
 extern char __end; // from linker script
 extern char KernelStart; // from linker script
+extern char __userProg_start, __userProg_end;
 
 static uint32_t* allocPageTable() {
-    uint32_t* pt = last_page;
-    last_page = (uint32_t*)((uint32_t)last_page + PAGE_SIZE);
+    uint32_t* pt = (uint32_t*)frameAlloc();
+    if (pt == NULL) {
+        log_crit(MODULE, "Out of frames for page tables");
+        return NULL;
+    }
 
     // Clear the page table
     for (int i = 0; i < 1024; i++)
@@ -30,86 +59,183 @@ static uint32_t* allocPageTable() {
     return pt;
 }
 
+static inline void invlpg(uint32_t virt) {
+    if (paging_enabled)
+        __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+// returns the page table entry for virt, the table is made when create is set
+static uint32_t* pagingGetEntry(uint32_t virt, bool create, uint32_t flags) {
+    uint32_t pd_index = virt >> 22;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+
+    if (!(page_directory[pd_index] & PAGE_PRESENT)) {
+        if (!create)
+            return NULL;
+        uint32_t* new_table = allocPageTable();
+        if (new_table == NULL)
+            return NULL;
+        page_directory[pd_index] = ((uint32_t)new_table) | PAGE_PRESENT | PAGE_WRITE;
+    }
+    // a user page needs the user bit in the directory entry too
+    page_directory[pd_index] |= flags & PAGE_USER;
+
+    uint32_t* page_table = (uint32_t*)(page_directory[pd_index] & PAGE_FRAME_MASK);
+    return &page_table[pt_index];
+}
+
+bool pagingMap(uint32_t virt, uint32_t phys, uint32_t flags) {
+    uint32_t* entry = pagingGetEntry(virt, true, flags);
+    if (entry == NULL)
+        return false;
+
+    *entry = (phys & PAGE_FRAME_MASK) | (flags & 0xFFF) | PAGE_PRESENT;
+    invlpg(virt);
+    return true;
+}
+
+void pagingUnmap(uint32_t virt) {
+    uint32_t* entry = pagingGetEntry(virt, false, 0);
+    if (entry == NULL)
+        return;
+
+    *entry = 0;
+    invlpg(virt);
+}
+
+// physical address for virt, 0 if it is not mapped
+uint32_t pagingTranslate(uint32_t virt) {
+    if (!page_directory)
+        return virt;
+
+    uint32_t* entry = pagingGetEntry(virt, false, 0);
+    if (entry == NULL || !(*entry & PAGE_PRESENT))
+        return 0;
+    return (*entry & PAGE_FRAME_MASK) | (virt & 0xFFF);
+}
+
 void pagingMapVirtToPhys(uint32_t virt, uint32_t phys)
 {
     uint16_t id = virt >> 22;
 
-    for (int i = 0; i < 1024; i++)
-    {
-        last_page[i] = 0 | PAGE_WRITE;
-        phys += 4096;
-    }
-
-    page_directory[id] = ((uint32_t)last_page) | PAGE_PRESENT | PAGE_WRITE;
-    last_page = (uint32_t *)(((uint32_t)last_page) + 4096);
+    // maps the whole 4 MiB the directory entry covers
+    pagingMapRange(virt & 0xFFC00000, phys & 0xFFC00000, 0x400000);
     log_debug(MODULE, "Mapping %x (%d) to %x", virt, id, phys);
 }
 
-void pagingMapRange(uint32_t virt_start, uint32_t phys_start, uint32_t size) {
+static bool pagingMapRangeFlags(uint32_t virt_start, uint32_t phys_start, uint32_t size, uint32_t flags) {
     uint32_t virt_end = virt_start + size;
+
+    for (uint32_t v = virt_start, p = phys_start; v < virt_end && v >= virt_start; v += PAGE_SIZE, p += PAGE_SIZE) {
+        if (!pagingMap(v, p, flags))
+            return false;
+    }
+    return true;
+}
+
+void pagingMapRange(uint32_t virt_start, uint32_t phys_start, uint32_t size) {
     log_debug(MODULE, "Mapping range: virt_start=0x%x, phys_start=0x%x, size=0x%x", virt_start, phys_start, size);
+    pagingMapRangeFlags(virt_start, phys_start, size, PAGE_PRESENT | PAGE_WRITE);
+}
+
+// lets ring 3 reach the mapped pages in the range, or takes that away again
+void pagingSetUser(uint32_t virt_start, uint32_t size, bool user) {
+    uint32_t virt_end = virt_start + size;
 
-    for (uint32_t v = virt_start, p = phys_start; v < virt_end; v += PAGE_SIZE, p += PAGE_SIZE) {
-        uint32_t pd_index = v >> 22;
-        uint32_t pt_index = (v >> 12) & 0x3FF;
+    for (uint32_t v = virt_start & PAGE_FRAME_MASK; v < virt_end && v >= (virt_start & PAGE_FRAME_MASK); v += PAGE_SIZE) {
+        uint32_t* entry = pagingGetEntry(v, false, user ? PAGE_USER : 0);
+        if (entry == NULL || !(*entry & PAGE_PRESENT))
+            continue;
+        *entry = user ? (*entry | PAGE_USER) : (*entry & ~PAGE_USER);
+        invlpg(v);
+    }
+}
 
-        // Allocate a page table if not present
-        if (!(page_directory[pd_index] & PAGE_PRESENT)) {
-            uint32_t* new_table = allocPageTable();
-            page_directory[pd_index] = ((uint32_t)new_table) | PAGE_PRESENT | PAGE_WRITE;
-        }
+// maps device memory into the MMIO window, caching off
+void* pagingMapMMIO(uint32_t phys, uint32_t size) {
+    if (!page_directory)
+        return (void*)phys;
 
-        uint32_t* page_table = (uint32_t*)(page_directory[pd_index] & 0xFFFFF000);
-        page_table[pt_index] = (p & 0xFFFFF000) | PAGE_PRESENT | PAGE_WRITE;
+    // drivers map the same BAR or framebuffer again on every mode switch or probe
+    for (int i = 0; i < mmio_mapping_count; i++) {
+        mmio_mapping_t* mapping = &mmio_mappings[i];
+        if (phys >= mapping->phys && phys + size <= mapping->phys + mapping->size)
+            return (void*)(mapping->virt + (phys - mapping->phys));
     }
+
+    uint32_t offset = phys & 0xFFF;
+    size = (size + offset + PAGE_SIZE - 1) & PAGE_FRAME_MASK;
+    if (mmio_next + size > PAGING_MMIO_END || mmio_next + size < mmio_next) {
+        log_err(MODULE, "MMIO window is full, cannot map %x (%u bytes)", phys, size);
+        return NULL;
+    }
+
+    uint32_t virt = mmio_next;
+    if (!pagingMapRangeFlags(virt, phys & PAGE_FRAME_MASK, size, PAGE_PRESENT | PAGE_WRITE | PAGE_WRITETHROUGH | PAGE_NOCACHE))
+        return NULL;
+    mmio_next += size;
+
+    if (mmio_mapping_count < MAX_MMIO_MAPPINGS) {
+        mmio_mappings[mmio_mapping_count].phys = phys & PAGE_FRAME_MASK;
+        mmio_mappings[mmio_mapping_count].size = size;
+        mmio_mappings[mmio_mapping_count].virt = virt;
+        mmio_mapping_count++;
+    }
+
+    log_debug(MODULE, "MMIO %x-%x mapped at %x", phys, phys + size, virt);
+    return (void*)(virt + offset);
 }
 
 void* getPhysAddress(void* virt)
 {
-    uint32_t virt_addr = (uint32_t)virt;
-    uint16_t pdid = virt_addr >> 22;
-    uint16_t ptid = (virt_addr >> 12) & 0x3FF; // Get the page table index
-    uint32_t page_table = page_directory[pdid] & 0xFFFFF000; // Get the page table address
-    uint32_t offset = virt_addr & 0x00000FFF; // Get the offset within the page
-
-    return (void*)(page_table + (ptid * 4096) + offset);
-    
+    return (void*)pagingTranslate((uint32_t)virt);
 }
 
 void pagingEnable()
 {
-    __asm__ volatile("mov %%eax, %%cr3": :"a"(page_dir_loc));	
+    uint32_t cr0;
     log_debug(MODULE, "Enabling paging with page directory at %x", page_dir_loc);
-	__asm__ volatile("mov %cr0, %eax");
-    log_debug(MODULE, "CR0 before paging enable");
-	__asm__ volatile("orl $0x80000000, %eax");
-    log_debug(MODULE, "CR0 after paging enable");
-	__asm__ volatile("mov %eax, %cr0");
+    __asm__ volatile("mov %0, %%cr3" : : "r"(page_dir_loc) : "memory");
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= 0x80000000;
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+    paging_enabled = true;
     log_debug(MODULE, "Paging enabled");
 }
 
 void pagingInit()
 {
     log_info(MODULE, "Initializing paging...");
-    page_directory = (uint32_t*)0x400000;
+    page_directory = (uint32_t*)frameAlloc();
     page_dir_loc = (uint32_t)page_directory;
-    last_page = (uint32_t *)0x404000;
-    
+    if (page_directory == NULL) {
+        log_crit(MODULE, "No frame for the page directory, paging stays off");
+        return;
+    }
+
     for (int i = 0; i < 1024; i++)
     {
-        page_directory[i] = 0 | 2; // Set all entries to present and writable
+        page_directory[i] = 0;
     }
 
-    // Identity map from 0x00000000 to __end (rounded up to page boundary)
     uint32_t kernel_end = ((uint32_t)&__end);
-    log_info(MODULE, "Kernel end address: 0x%08X", kernel_end);
-    pagingMapRange(0x00000000, 0x00000000, kernel_end);
-
-    // VGA text buffer
-    pagingMapRange(0x000B8000, 0x000B8000, PAGE_SIZE);
-
-    pagingMapVirtToPhys(0x400000, 0x400000); // Map 0x400000 to itself
-
-    // pagingEnable();
+    uint32_t memory_end = frameMemoryEnd();
+    if (memory_end < kernel_end)
+        memory_end = kernel_end;
+    if (memory_end > KERNEL_VIRTUAL_BASE)
+        memory_end = KERNEL_VIRTUAL_BASE;
+    log_info(MODULE, "Kernel end address: 0x%08X, memory end 0x%08X", kernel_end, memory_end);
+
+    pagingMapRangeFlags(0x00000000, 0x00000000, memory_end, PAGE_PRESENT | PAGE_WRITE);
+    // the program the shell loads runs from its image, processes open their own stacks
+    uint32_t user_start = (uint32_t)&__userProg_start;
+    pagingSetUser(user_start, (uint32_t)&__userProg_end - user_start, true);
+
+    uint32_t physmap_size = memory_end;
+    if (physmap_size > PAGING_MMIO_BASE - KERNEL_VIRTUAL_BASE)
+        physmap_size = PAGING_MMIO_BASE - KERNEL_VIRTUAL_BASE;
+    pagingMapRangeFlags(KERNEL_VIRTUAL_BASE, 0x00000000, physmap_size, PAGE_PRESENT | PAGE_WRITE);
+
+    pagingEnable();
     log_info(MODULE, "Paging initialized successfully.");
-}
\ No newline at end of file
+}
@@ -0,0 +1,175 @@
+#include "clock.h"
+#include "pit.h"
+#include "io.h"
+#include "i8259.h"
+#include "debug.h"
+#include <cpuid.h>
+
+#define MODULE "CLOCK"
+
+/*
+ * Monotonic clock
+ *
+ * When the CPU has a TSC the clock is rdtsc scaled to nanoseconds, the scale
+ * comes from counting TSC cycles over a fixed PIT channel 2 countdown at boot. Without one it is the PIT tick count plus the latched channel 0 count,
+ * which gives about 1 us resolution.
+ */
+
+#define CPUID_EDX_TSC (1 << 4)
+
+#define PIT_GATE_PORT 0x61
+#define PIT_GATE_CHANNEL2 0x01
+#define PIT_GATE_SPEAKER 0x02
+#define PIT_GATE_OUT2 0x20
+
+#define CALIBRATE_MS 50
+#define CALIBRATE_COUNT (PIT_BASE_FREQUENCY * CALIBRATE_MS / 1000) // has to fit 16 bits
+#define CALIBRATE_ROUNDS 3
+#define CALIBRATE_SPIN_LIMIT 100000000
+
+// ns per TSC cycle in 8.24 fixed point
+#define CLOCK_MULT_SHIFT 24
+// slower TSCs overflow the 32 bit multiplier
+#define CLOCK_MIN_TSC_HZ 16000000ULL
+
+// nanoseconds per PIT input clock in 1/1000 ns
+#define PIT_PS_PER_CLOCK 838095
+
+static bool clock_tsc = false;
+static uint64_t clock_tsc_hz = 0;
+static uint32_t clock_tsc_mult = 0;
+static uint64_t clock_tsc_base = 0;
+static uint64_t clock_tsc_offset_ns = 0;
+
+static uint32_t clock_last_ticks = 0;
+static uint32_t clock_tick_epoch = 0; // timer_ticks wraps
+static uint64_t clock_last_ns = 0;
+
+static bool tscSupported()
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (edx & CPUID_EDX_TSC) != 0;
+}
+
+// TSC cycles per second, 0 if channel 2 never ran out
+static uint64_t tscCalibrate()
+{
+    uint64_t best = (uint64_t)-1;
+    uint32_t flags = i686_SaveInterrupts();
+    uint8_t gate = i686_inb(PIT_GATE_PORT);
+
+    // the shortest run had the least SMI or emulator noise in it
+    for (int round = 0; round < CALIBRATE_ROUNDS; round++)
+    {
+        i686_outb(PIT_GATE_PORT, (gate & ~PIT_GATE_SPEAKER) | PIT_GATE_CHANNEL2);
+        i686_outb(CommandRegister, SelectChannel2 | lobyteAndHibyte | InterruptOnTerminalCount | Mode16BitBin);
+        i686_outb(Channel2, CALIBRATE_COUNT & 0xFF);
+        i686_outb(Channel2, CALIBRATE_COUNT >> 8);
+
+        uint64_t start = rdtsc();
+        uint32_t spins = 0;
+        while (!(i686_inb(PIT_GATE_PORT) & PIT_GATE_OUT2))
+        {
+            if (++spins == CALIBRATE_SPIN_LIMIT)
+                break;
+        }
+        uint64_t end = rdtsc();
+
+        if (spins == CALIBRATE_SPIN_LIMIT)
+        {
+            best = 0;
+            break;
+        }
+        if (end - start < best)
+            best = end - start;
+    }
+
+    i686_outb(PIT_GATE_PORT, gate);
+    i686_RestoreInterrupts(flags);
+    return best * PIT_BASE_FREQUENCY / CALIBRATE_COUNT;
+}
+
+static inline uint64_t tscToNs(uint64_t cycles)
+{
+    // 64x32 multiply split in two so nothing overflows
+    uint32_t lo = (uint32_t)cycles;
+    uint32_t hi = (uint32_t)(cycles >> 32);
+    return (((uint64_t)hi * clock_tsc_mult) << (32 - CLOCK_MULT_SHIFT)) +
+           (((uint64_t)lo * clock_tsc_mult) >> CLOCK_MULT_SHIFT);
+}
+
+static uint64_t pitNs()
+{
+    if (pit_divisor == 0)
+        return 0;
+
+    uint32_t flags = i686_SaveInterrupts();
+    uint32_t count = read_pit_count();
+    uint32_t ticks = timer_ticks;
+
+    // the counter reloaded but IRQ 0 has not been handled yet
+    if ((i8259_ReadIrqRequestRegister() & 1) && count > pit_divisor / 2)
+        ticks++;
+
+    if (ticks < clock_last_ticks)
+        clock_tick_epoch++;
+    clock_last_ticks = ticks;
+
+    uint32_t elapsed = count <= pit_divisor ? pit_divisor - count : 0;
+    uint64_t ns = (((uint64_t)clock_tick_epoch << 32) | ticks) * (NSEC_PER_SEC / PIT_HZ);
+    ns += elapsed * PIT_PS_PER_CLOCK / 1000;
+
+    // the IRR guess can be off by one read, never hand out an earlier time
+    if (ns < clock_last_ns)
+        ns = clock_last_ns;
+    clock_last_ns = ns;
+    i686_RestoreInterrupts(flags);
+    return ns;
+}
+
+uint64_t clock_monotonic_ns()
+{
+    if (clock_tsc)
+        return clock_tsc_offset_ns + tscToNs(rdtsc() - clock_tsc_base);
+    return pitNs();
+}
+
+bool clock_uses_tsc()
+{
+    return clock_tsc;
+}
+
+uint64_t clock_tsc_frequency()
+{
+    return clock_tsc_hz;
+}
+
+void clock_init()
+{
+    if (!tscSupported())
+    {
+        log_info(MODULE, "No TSC, using the PIT");
+        return;
+    }
+
+    uint64_t hz = tscCalibrate();
+    if (hz < CLOCK_MIN_TSC_HZ)
+    {
+        log_warn(MODULE, "TSC calibration failed (%u Hz), using the PIT", (uint32_t)hz);
+        return;
+    }
+
+    clock_tsc_hz = hz;
+    clock_tsc_mult = (uint32_t)((NSEC_PER_SEC << CLOCK_MULT_SHIFT) / hz);
+
+    // carry on from the PIT time so the clock does not jump
+    uint32_t flags = i686_SaveInterrupts();
+    clock_tsc_offset_ns = pitNs();
+    clock_tsc_base = rdtsc();
+    clock_tsc = true;
+    i686_RestoreInterrupts(flags);
+
+    log_info(MODULE, "TSC running at %u kHz", (uint32_t)(hz / 1000));
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// calibrates the TSC against PIT channel 2, call after pit_init
+void clock_init();
+
+// nanoseconds since pit_init, never goes backwards
+uint64_t clock_monotonic_ns();
+
+bool clock_uses_tsc();
+uint64_t clock_tsc_frequency(); // 0 when the clock runs off the PIT
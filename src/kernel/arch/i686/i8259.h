@@ -4,3 +4,4 @@
 
 const PICDriver* i8259_GetDriver();
 void i8259_SendEOI(int irq);
+uint16_t i8259_ReadIrqRequestRegister();
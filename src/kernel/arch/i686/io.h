@@ -23,11 +23,14 @@ void ASMCALL i686_SetStack(uint32_t address);
 
 uint8_t ASMCALL i686_EnableInterrupts();
 uint8_t ASMCALL i686_DisableInterrupts();
+uint32_t ASMCALL i686_SaveInterrupts();
+void ASMCALL i686_RestoreInterrupts(uint32_t flags);
 
 void ASMCALL i686_HLT();
 void ASMCALL i686_int2();
 
 void ASMCALL i686_EnableMCE();
+void ASMCALL i686_EnableSSE();
 
 void i686_iowait();
 void ASMCALL i686_Panic();
\ No newline at end of file
@@ -134,6 +134,23 @@ i686_DisableInterrupts:
     cli
     ret
     
+; uint32_t ASMCALL i686_SaveInterrupts(); returns eflags and disables interrupts
+global i686_SaveInterrupts
+i686_SaveInterrupts:
+    pushfd
+    pop eax
+    cli
+    ret
+
+; void ASMCALL i686_RestoreInterrupts(uint32_t flags); enables interrupts again if they were on
+global i686_RestoreInterrupts
+i686_RestoreInterrupts:
+    test dword [esp + 4], 0x200
+    jz .done
+    sti
+.done:
+    ret
+
 global i686_HLT
 i686_HLT:
     hlt
@@ -153,6 +170,21 @@ i686_EnableMCE:
     pop     eax
     ret
     
+; clears EM and TS so the FPU is used, and tells the CPU fxsave and SSE are handled
+global i686_EnableSSE
+i686_EnableSSE:
+    push    eax
+    mov     eax,    cr0
+    and     eax,    ~0x0C   ; EM, TS
+    or      eax,    0x02    ; MP
+    mov     cr0,    eax
+    mov     eax,    cr4
+    or      eax,    0x600   ; OSFXSR, OSXMMEXCPT
+    mov     cr4,    eax
+    fninit
+    pop     eax
+    ret
+    
 global crash_me
 crash_me:
     ; div by 0
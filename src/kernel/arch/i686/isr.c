@@ -9,6 +9,7 @@
 #define MODULE          "ISR"
 
 ISRHandler g_ISRHandlers[256];
+ISRSwitchHandler g_ISRSwitchHandler = NULL;
 
 static const char* const g_Exceptions[] = {
     "Divide by zero error",
@@ -56,9 +57,8 @@ void i686_ISR_Initialize()
     i686_IDT_DisableGate(0x80);
 }
 
-void __attribute__((cdecl)) i686_ISR_Handler(Registers* regs)
+Registers* __attribute__((cdecl)) i686_ISR_Handler(Registers* regs)
 {
-    set_kernel_stack(regs->esp);
     // log_debug("ISR", "interrupt here %d", regs->interrupt);
     if (g_ISRHandlers[regs->interrupt] != NULL)
     {
@@ -87,6 +87,18 @@ void __attribute__((cdecl)) i686_ISR_Handler(Registers* regs)
 
         i686_Panic();
     }
+
+    // the scheduler can hand back another task's frame
+    if (g_ISRSwitchHandler != NULL)
+    {
+        return g_ISRSwitchHandler(regs);
+    }
+    return regs;
+}
+
+void i686_ISR_RegisterSwitchHandler(ISRSwitchHandler handler)
+{
+    g_ISRSwitchHandler = handler;
 }
 
 void i686_ISR_RegisterHandler(int interrupt, ISRHandler handler)
@@ -49,8 +49,10 @@ typedef struct
 #define ISR_STACK_SIZE 16384 // 16 KB for ISR stack
 
 typedef void (*ISRHandler)(Registers *regs);
+typedef Registers *(*ISRSwitchHandler)(Registers *regs);
 
 #define RETURNINTRUPT() asm volatile("iret")
 
 void i686_ISR_Initialize();
 void i686_ISR_RegisterHandler(int interrupt, ISRHandler handler);
+void i686_ISR_RegisterSwitchHandler(ISRSwitchHandler handler);
@@ -40,7 +40,7 @@ isr_common:
     
     push esp            ; pass pointer to stack to C, so we can access all the pushed information
     call i686_ISR_Handler
-    add esp, 4
+    mov esp, eax        ; the handler returns the frame to resume, another task's after a task switch
 
     pop eax             ; restore old segment
     mov ds, ax
@@ -10,49 +10,299 @@
 section .text
 
 ;
-; memcpy(void *dest, const void *src, size_t n)
+; The copy and fill helpers take their arguments in registers:
+;   esi = source, edi = destination, ecx = count, eax = fill pattern (all four bytes set)
+; and may change eax, ecx, edx, esi and edi. The direction flag must be clear.
+;
+; Below MEMORY_SMALL bytes the count is taken apart bit by bit, no loop at all.
+; Larger blocks are brought to an aligned dword of the destination and moved with
+; rep movsd/stosd. From g_MemoryNonTemporalMin bytes on, SSE2 moves 64 bytes at a
+; time with non-temporal stores, so a large copy does not push everything else out
+; of the cache. memory_cpu_init lowers that limit once it has turned SSE on.
+;
+
+MEMORY_SMALL equ 16
+MEMORY_NT_BLOCK equ 64
+MEMORY_NT_CHUNK equ 4096    ; bytes moved between two chances for an interrupt
+
+section .data
+
+global g_MemoryNonTemporalMin
+g_MemoryNonTemporalMin: dd 0xFFFFFFFF
+
+section .text
+
+copy_bytes:
+    rep movsb
+    ret
+
+copy_dwords:
+    cmp ecx, MEMORY_SMALL
+    jb copy_small
+    mov edx, edi
+    neg edx
+    and edx, 3              ; bytes up to the next aligned dword of dest
+    sub ecx, edx
+    xchg ecx, edx
+    rep movsb
+    mov ecx, edx
+    shr ecx, 2
+    rep movsd
+    mov ecx, edx
+    and ecx, 3
+    rep movsb
+    ret
+
+copy_small:
+    test cl, 8
+    jz .dword
+    mov eax, [esi]
+    mov edx, [esi + 4]
+    mov [edi], eax
+    mov [edi + 4], edx
+    add esi, 8
+    add edi, 8
+.dword:
+    test cl, 4
+    jz .word
+    mov eax, [esi]
+    mov [edi], eax
+    add esi, 4
+    add edi, 4
+.word:
+    test cl, 2
+    jz .byte
+    mov ax, [esi]
+    mov [edi], ax
+    add esi, 2
+    add edi, 2
+.byte:
+    test cl, 1
+    jz .done
+    mov al, [esi]
+    mov [edi], al
+.done:
+    ret
+
+; the scheduler does not keep SSE state, so the registers are saved here and
+; interrupts stay off while a chunk is in flight
+copy_nontemporal:
+    cmp ecx, 2 * MEMORY_NT_BLOCK
+    jb copy_dwords
+    sub esp, 64
+    movdqu [esp], xmm0
+    movdqu [esp + 16], xmm1
+    movdqu [esp + 32], xmm2
+    movdqu [esp + 48], xmm3
+
+    mov edx, edi
+    neg edx
+    and edx, 15             ; movntdq wants dest on 16 bytes
+    sub ecx, edx
+    xchg ecx, edx
+    rep movsb
+    mov ecx, edx
+
+.chunk:
+    mov edx, ecx
+    shr edx, 6              ; blocks left
+    jz .tail
+    cmp edx, MEMORY_NT_CHUNK / MEMORY_NT_BLOCK
+    jbe .blocks
+    mov edx, MEMORY_NT_CHUNK / MEMORY_NT_BLOCK
+.blocks:
+    pushfd
+    cli
+.loop:
+    movdqu xmm0, [esi]
+    movdqu xmm1, [esi + 16]
+    movdqu xmm2, [esi + 32]
+    movdqu xmm3, [esi + 48]
+    movntdq [edi], xmm0
+    movntdq [edi + 16], xmm1
+    movntdq [edi + 32], xmm2
+    movntdq [edi + 48], xmm3
+    add esi, MEMORY_NT_BLOCK
+    add edi, MEMORY_NT_BLOCK
+    sub ecx, MEMORY_NT_BLOCK
+    dec edx
+    jnz .loop
+    popfd
+    jmp .chunk
+
+.tail:
+    sfence
+    movdqu xmm0, [esp]
+    movdqu xmm1, [esp + 16]
+    movdqu xmm2, [esp + 32]
+    movdqu xmm3, [esp + 48]
+    add esp, 64
+    jmp copy_dwords
+
+copy_auto:
+    cmp ecx, [g_MemoryNonTemporalMin]
+    jae copy_nontemporal
+    jmp copy_dwords
+
+fill_bytes:
+    rep stosb
+    ret
+
+fill_dwords:
+    cmp ecx, MEMORY_SMALL
+    jb fill_small
+    mov edx, edi
+    neg edx
+    and edx, 3
+    sub ecx, edx
+    xchg ecx, edx
+    rep stosb
+    mov ecx, edx
+    shr ecx, 2
+    rep stosd
+    mov ecx, edx
+    and ecx, 3
+    rep stosb
+    ret
+
+fill_small:
+    test cl, 8
+    jz .dword
+    mov [edi], eax
+    mov [edi + 4], eax
+    add edi, 8
+.dword:
+    test cl, 4
+    jz .word
+    mov [edi], eax
+    add edi, 4
+.word:
+    test cl, 2
+    jz .byte
+    mov [edi], ax
+    add edi, 2
+.byte:
+    test cl, 1
+    jz .done
+    mov [edi], al
+.done:
+    ret
+
+fill_nontemporal:
+    cmp ecx, 2 * MEMORY_NT_BLOCK
+    jb fill_dwords
+    sub esp, 16
+    movdqu [esp], xmm0
+
+    mov edx, edi
+    neg edx
+    and edx, 15
+    sub ecx, edx
+    xchg ecx, edx
+    rep stosb
+    mov ecx, edx
+
+.chunk:
+    mov edx, ecx
+    shr edx, 6
+    jz .tail
+    cmp edx, MEMORY_NT_CHUNK / MEMORY_NT_BLOCK
+    jbe .blocks
+    mov edx, MEMORY_NT_CHUNK / MEMORY_NT_BLOCK
+.blocks:
+    pushfd
+    cli
+    movd xmm0, eax
+    pshufd xmm0, xmm0, 0
+.loop:
+    movntdq [edi], xmm0
+    movntdq [edi + 16], xmm0
+    movntdq [edi + 32], xmm0
+    movntdq [edi + 48], xmm0
+    add edi, MEMORY_NT_BLOCK
+    sub ecx, MEMORY_NT_BLOCK
+    dec edx
+    jnz .loop
+    popfd
+    jmp .chunk
+
+.tail:
+    sfence
+    movdqu xmm0, [esp]
+    add esp, 16
+    jmp fill_dwords
+
+fill_auto:
+    cmp ecx, [g_MemoryNonTemporalMin]
+    jae fill_nontemporal
+    jmp fill_dwords
+
+;
+; void *name(void *dest, const void *src, size_t n) around a copy helper
 ;
-global memcpy
-memcpy:
+%macro COPY_FUNCTION 2
+global %1
+%1:
     push ebp
     mov ebp, esp
     cld
     push esi
     push edi
 
-    mov edi, [ebp + 8]    ; dest
-    mov esi, [ebp + 12]   ; src
-    mov ecx, [ebp + 16]   ; n
-
-    rep movsb
-    mov eax, [ebp + 8]    ; return dest
+    mov edi, [ebp + 8]      ; dest
+    mov esi, [ebp + 12]     ; src
+    mov ecx, [ebp + 16]     ; n
+    call %2
+    mov eax, [ebp + 8]      ; return dest
 
     pop edi
     pop esi
     pop ebp
     ret
+%endmacro
 
 ;
-; memset(void *s, int c, size_t n)
+; void *name(void *s, int c, size_t n) around a fill helper
 ;
-global memset
-memset:
+%macro FILL_FUNCTION 2
+global %1
+%1:
     push ebp
     mov ebp, esp
     cld
     push edi
 
-    mov edi, [ebp + 8]    ; s
-    mov al, [ebp + 12]    ; c
-    mov ecx, [ebp + 16]   ; n
-
-    rep stosb
+    mov edi, [ebp + 8]      ; s
+    movzx eax, byte [ebp + 12]
+    imul eax, eax, 0x01010101 ; c in every byte
+    mov ecx, [ebp + 16]     ; n
+    call %2
 
-    mov eax, [ebp + 8]    ; return s
+    mov eax, [ebp + 8]      ; return s
     pop edi
     pop ebp
     ret
-    
+%endmacro
+
+;
+; memcpy(void *dest, const void *src, size_t n)
+;
+COPY_FUNCTION memcpy, copy_auto
+
+; the single variants, for comparing them
+COPY_FUNCTION memcpy_bytes, copy_bytes
+COPY_FUNCTION memcpy_dwords, copy_dwords
+COPY_FUNCTION memcpy_nontemporal, copy_nontemporal
+
+;
+; memset(void *s, int c, size_t n)
+;
+FILL_FUNCTION memset, fill_auto
+
+FILL_FUNCTION memset_bytes, fill_bytes
+FILL_FUNCTION memset_dwords, fill_dwords
+FILL_FUNCTION memset_nontemporal, fill_nontemporal
+
 ;
 ; memset16(uint16 *s, uint16 c, uint16 n)
 ;
@@ -64,7 +314,7 @@ memset16:
     push edi
 
     mov edi, [ebp + 8]    ; s
-    mov al, [ebp + 12]    ; c
+    mov ax, [ebp + 12]    ; c
     mov ecx, [ebp + 16]   ; n
     
     
@@ -86,7 +336,7 @@ memset32:
     push edi
 
     mov edi, [ebp + 8]    ; s
-    mov al, [ebp + 12]    ; c
+    mov eax, [ebp + 12]   ; c
     mov ecx, [ebp + 16]   ; n
     
     
@@ -148,26 +398,33 @@ memmove:
     mov esi, [ebp + 12]   ; src
     mov ecx, [ebp + 16]   ; n
 
-    cmp edi, esi
-    je .done
-    jc .forward
+    mov eax, edi
+    sub eax, esi
+    jz .exit
+    cmp eax, ecx
+    jae .forward          ; dest below src or past its end, a forward copy never reads what it wrote
 
-    ; Backward copy for overlap
+    ; Backward copy for overlap, the odd bytes at the end first
     lea esi, [esi + ecx - 1]
     lea edi, [edi + ecx - 1]
+    mov edx, ecx
+    and ecx, 3
     std
     rep movsb
+    sub esi, 3
+    sub edi, 3
+    mov ecx, edx
+    shr ecx, 2
+    rep movsd
     cld
     jmp .exit
 
 .forward:
-    cld
-    rep movsb
+    call copy_auto
 
 .exit:
     mov eax, [ebp + 8]    ; return dest
 
-.done:
     pop edi
     pop esi
     pop ebp
@@ -0,0 +1,26 @@
+#include "memory_i686.h"
+#include "io.h"
+#include "debug.h"
+
+#include <cpuid.h>
+
+#define MODULE "MEM"
+
+void memory_cpu_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & bit_FXSAVE) || !(edx & bit_SSE2))
+    {
+        log_info(MODULE, "no SSE2, large copies use rep movsd");
+        return;
+    }
+
+    i686_EnableSSE();
+    g_MemoryNonTemporalMin = MEMORY_NONTEMPORAL_MIN;
+    log_info(MODULE, "SSE2 non-temporal copies from %u KiB", MEMORY_NONTEMPORAL_MIN / 1024);
+}
+
+bool memory_has_nontemporal()
+{
+    return g_MemoryNonTemporalMin != UINT32_MAX;
+}
@@ -16,6 +16,43 @@ ASMCALL void* memmove(void* dst, const void* src, size_t num);
 ASMCALL int memcmp(const void* ptr1, const void* ptr2, size_t num);
 ASMCALL void* memchr(const void* ptr, int value, size_t num);
 
+// copies and fills from this size on use SSE2 non-temporal stores, when the CPU has them
+#define MEMORY_NONTEMPORAL_MIN (256 * 1024)
+
+extern uint32_t g_MemoryNonTemporalMin; // UINT32_MAX until memory_cpu_init found SSE2
+
+// picks the memcpy/memset variants for this CPU
+void memory_cpu_init();
+bool memory_has_nontemporal();
+
+// the single variants behind memcpy and memset, the non-temporal ones need SSE2
+ASMCALL void* memcpy_bytes(void* dst, const void* src, size_t num);
+ASMCALL void* memcpy_dwords(void* dst, const void* src, size_t num);
+ASMCALL void* memcpy_nontemporal(void* dst, const void* src, size_t num);
+ASMCALL void* memset_bytes(void* ptr, int value, size_t num);
+ASMCALL void* memset_dwords(void* ptr, int value, size_t num);
+ASMCALL void* memset_nontemporal(void* ptr, int value, size_t num);
+
+#define PAGE_PRESENT      0x001
+#define PAGE_WRITE        0x002
+#define PAGE_USER         0x004
+#define PAGE_WRITETHROUGH 0x008
+#define PAGE_NOCACHE      0x010
+
+#define KERNEL_VIRTUAL_BASE 0xC0000000
+#define PAGING_MMIO_BASE    0xE0000000
+#define PAGING_MMIO_END     0xFFC00000
+
+// RAM is mapped a second time from KERNEL_VIRTUAL_BASE
+#define PHYS_TO_VIRT(addr) ((void*)((uint32_t)(addr) + KERNEL_VIRTUAL_BASE))
+#define VIRT_TO_PHYS(addr) ((uint32_t)(addr) - KERNEL_VIRTUAL_BASE)
+
 void pagingInit();
+bool pagingMap(uint32_t virt, uint32_t phys, uint32_t flags);
+void pagingUnmap(uint32_t virt);
+uint32_t pagingTranslate(uint32_t virt);
+void* pagingMapMMIO(uint32_t phys, uint32_t size);
 void pagingMapVirtToPhys(uint32_t virt, uint32_t phys);
+void pagingMapRange(uint32_t virt_start, uint32_t phys_start, uint32_t size);
+void pagingSetUser(uint32_t virt_start, uint32_t size, bool user);
 void* getPhysAddress(void* virt);
\ No newline at end of file
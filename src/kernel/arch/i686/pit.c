@@ -5,8 +5,11 @@
 #include "irq.h"
 #include "i8259.h"
 #include "debug.h"
+#include "task/sched.h"
+#include "task/wait.h"
 
-int timer_ticks = 0;
+volatile uint32_t timer_ticks = 0;
+uint32_t pit_divisor = 0;
 
 #define MILISECOND_PER_PIT_TICK 2
 #define SECOUND_PER_PIT_TICK 1000 / MILISECOND_PER_PIT_TICK
@@ -17,22 +20,24 @@ uint32_t read_pit_count(void)
 {
     uint32_t count = 0;
 
-    i686_DisableInterrupts();
+    uint32_t flags = i686_SaveInterrupts();
 
     i686_outb(CommandRegister, SelectChannel0 | LatchCountValueCommand | InterruptOnTerminalCount | Mode16BitBin);
 
     count = i686_inb(Channel0);
     count |= i686_inb(Channel0) << 8;
 
-    i686_EnableInterrupts();
+    i686_RestoreInterrupts(flags);
 
     return count;
 }
 
 void set_pit(int hz)
 {
-    int divisor = 1193180 / hz;                                                                        /* Calculate our divisor */
-    i686_outb(CommandRegister, SelectChannel0 | lobyteAndHibyte | squareWaveGenerator | Mode16BitBin); /* Set our command byte 0x36/0b00110110 */
+    int divisor = PIT_BASE_FREQUENCY / hz;                                                         /* Calculate our divisor */
+    pit_divisor = divisor;
+    // mode 2 counts down by one per input clock, so the latched count is the time since the last IRQ
+    i686_outb(CommandRegister, SelectChannel0 | lobyteAndHibyte | rateGenerator | Mode16BitBin); /* Set our command byte 0x34/0b00110100 */
     i686_outb(Channel0, divisor & 0xFF);                                                               /* Set low byte of divisor */
     i686_outb(Channel0, divisor >> 8);                                                                 /* Set high byte of divisor */
 }
@@ -58,16 +63,15 @@ void timer_handler(Registers *r)
         // log_debug("TIMER", "One second has passed\n");
         // printf("One second has passed\n");
     }
-    i8259_SendEOI(0);
+    // EOI is sent by i686_IRQ_Handler
+    waitTick(timer_ticks);
+    schedTick();
 }
 
 void timer_wait(int ticks)
 {
-    timer_ticks = 0;
-    while (timer_ticks < ticks)
-    {
-        i686_HLT();
-    }
+    // other tasks sleep too, so the tick count is never reset
+    waitUntil(timer_ticks + ticks);
 }
 
 void sleep_ms(int ms)
@@ -90,8 +94,8 @@ void pit_init()
     // i686_ISR_RegisterHandler(32, timer_handler);
 
     log_debug(MODULE, "Initializing PIT");
-    set_pit(500);
-    log_debug(MODULE, "PIT set to 500Hz");
+    set_pit(PIT_HZ);
+    log_debug(MODULE, "PIT set to %uHz", PIT_HZ);
     timer_ticks = 0;
     
 
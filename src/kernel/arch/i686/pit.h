@@ -36,7 +36,12 @@ enum ModeSelect
 #define Mode16BitBin 0
 #define ModeBCD 1
 
-extern int timer_ticks;
+#define PIT_BASE_FREQUENCY 1193182
+#define PIT_HZ 500
+
+// PIT ticks since pit_init, never reset, wraps after ~99 days at 500 Hz
+extern volatile uint32_t timer_ticks;
+extern uint32_t pit_divisor;
 
 /*
 Bits         Usage
@@ -0,0 +1,38 @@
+#include "serial.h"
+#include <arch/i686/io.h>
+
+#define SERIAL_DATA 0
+#define SERIAL_INTERRUPTS 1
+#define SERIAL_DIVISOR_LOW 0
+#define SERIAL_DIVISOR_HIGH 1
+#define SERIAL_FIFO 2
+#define SERIAL_LINE_CONTROL 3
+#define SERIAL_MODEM_CONTROL 4
+#define SERIAL_LINE_STATUS 5
+#define SERIAL_SCRATCH 7
+
+#define SERIAL_LINE_THR_EMPTY 0x20
+
+bool serial_init(uint16_t port)
+{
+    // a UART keeps what is written to its scratch register
+    i686_outb(port + SERIAL_SCRATCH, 0xA5);
+    if (i686_inb(port + SERIAL_SCRATCH) != 0xA5)
+        return false;
+
+    i686_outb(port + SERIAL_INTERRUPTS, 0x00);
+    i686_outb(port + SERIAL_LINE_CONTROL, 0x80); // divisor latch
+    i686_outb(port + SERIAL_DIVISOR_LOW, 3);     // 115200 / 3
+    i686_outb(port + SERIAL_DIVISOR_HIGH, 0);
+    i686_outb(port + SERIAL_LINE_CONTROL, 0x03); // 8N1
+    i686_outb(port + SERIAL_FIFO, 0xC7);         // FIFO on and cleared, 14 byte threshold
+    i686_outb(port + SERIAL_MODEM_CONTROL, 0x03);
+    return true;
+}
+
+void serial_putc(uint16_t port, char c)
+{
+    while ((i686_inb(port + SERIAL_LINE_STATUS) & SERIAL_LINE_THR_EMPTY) == 0)
+        ;
+    i686_outb(port + SERIAL_DATA, c);
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SERIAL_COM1 0x3F8
+
+// 38400 baud, 8N1, no interrupts, false when no UART answers
+bool serial_init(uint16_t port);
+void serial_putc(uint16_t port, char c);
@@ -9,6 +9,13 @@
 
 section .text
 
+;
+; The copies find the length with repne scasb first and leave the moving to
+; memcpy, which does it a dword or more at a time.
+;
+extern memcpy
+extern memset
+
 ;
 ; type strcpy(char *dest, const char *src)
 ;
@@ -19,21 +26,21 @@ strcpy:
     mov ebp, esp
     cld
     push edi
-    push esi
     
-    mov edi, [ebp + 8] ; dest
-    mov esi, [ebp + 12] ; src
+    mov edi, [ebp + 12] ; src
+    mov ecx, -1
+    xor eax, eax
+    repne scasb ; scan for null terminator
+    not ecx ; length including the terminator
     
-    .L1:
-    lodsb
-    stosb
-    test al, al
-    jne .L1
+    push ecx
+    push dword [ebp + 12]
+    push dword [ebp + 8]
+    call memcpy
+    add esp, 12
     
-    mov eax, edi ; return dest
+    mov eax, [ebp + 8] ; return dest
     pop edi
-    pop esi
-    
     pop ebp
     ret
 
@@ -45,39 +52,32 @@ global strncpy
 strncpy:
     push ebp
     mov ebp, esp
-    cld
-    push edi
-    push esi
-    push ecx
+    push ebx
     
-    mov edi, [ebp + 8] ; dest
-    mov esi, [ebp + 12] ; src
-    mov ecx, [ebp + 16] ; count
-    xor eax, eax ; clear eax for null terminator
-
-    .L1:
-    test ecx, ecx
-    je .L4 ; if count is zero, jump to end
-    lodsb ; load byte from src
-    stosb ; store byte to dest
-    test al, al ; check for null terminator
-    jnz .L3 ; if not null, continue copying
-    .L2:
+    push dword [ebp + 16] ; count
+    push dword [ebp + 12] ; src
+    call strnlen
+    add esp, 8
+    mov ebx, eax ; characters to copy
     
-    dec ecx ; decrement count
-    jz .L4 ; if count
-    stosb
-    jmp .L2 ; continue filling with nulls
+    push eax
+    push dword [ebp + 12]
+    push dword [ebp + 8]
+    call memcpy
+    add esp, 12
     
-.L3:
-    dec ecx ; decrement count
-    jmp .L1 ; continue copying
+    mov eax, [ebp + 8]
+    add eax, ebx
+    mov ecx, [ebp + 16]
+    sub ecx, ebx ; the rest of dest is filled with nulls
+    push ecx
+    push 0
+    push eax
+    call memset
+    add esp, 12
     
-.L4:
-    mov eax, edi ; return dest
-    pop ecx
-    pop esi
-    pop edi
+    mov eax, [ebp + 8] ; return dest
+    pop ebx
     pop ebp
     ret
 
@@ -89,29 +89,18 @@ global strcat
 strcat:
     push ebp
     mov ebp, esp
-    cld
-    push edi
-    push esi
     
-    mov edi, [ebp + 8] ; dest
-    mov esi, edi
+    push dword [ebp + 8] ; dest
+    call strlen
+    add esp, 4
+    add eax, [ebp + 8] ; end of dest
     
-    .find_end:
-    lodsb ; load byte from dest
-    test al, al ; check for null terminator
-    jnz .find_end ; if null, jump to end
-    dec esi ; move to next character in dest
-    mov edi, esi ; update edi to point to end of dest
-    mov esi, [ebp + 12] ; src
-.copy_loop:
-    lodsb ; load byte from src
-    stosb ; store byte to dest
-    test al, al ; check for null terminator
-    jnz .copy_loop ; if not null, continue copying
+    push dword [ebp + 12]
+    push eax
+    call strcpy
+    add esp, 8
     
     mov eax, [ebp + 8] ; return dest
-    pop esi
-    pop edi
     pop ebp
     ret
 
@@ -123,37 +112,31 @@ global strncat
 strncat:
     push ebp
     mov ebp, esp
-    cld
-    push edi
+    push ebx
     push esi
-    push ecx
     
-    mov edi, [ebp + 8] ; dest
-    mov esi, edi
+    push dword [ebp + 8] ; dest
+    call strlen
+    add esp, 4
+    mov ebx, eax
+    add ebx, [ebp + 8] ; end of dest
+    
+    push dword [ebp + 16] ; count
+    push dword [ebp + 12] ; src
+    call strnlen
+    add esp, 8
+    mov esi, eax ; characters to append
+    
+    push eax
+    push dword [ebp + 12]
+    push ebx
+    call memcpy
+    add esp, 12
+    mov byte [ebx + esi], 0 ; null terminate dest
     
-    .find_end:
-    lodsb ; load byte from dest
-    test al, al ; check for null terminator
-    jnz .find_end ; if null, jump to end
-    dec esi ; move to next character in dest
-    mov edi, esi ; update edi to point to end of dest
-    mov esi, [ebp + 12] ; src
-    mov ecx, [ebp + 16] ; count
-.copy_loop:
-    test ecx, ecx
-    je .null_term
-    lodsb ; load byte from src
-    stosb ; store byte to dest
-    test al, al ; check for null terminator
-    je .null_term ; if null, jump to end
-    dec ecx ; decrement count
-    jmp .copy_loop ; continue copying
-.null_term:
-    mov byte [edi], 0 ; null terminate dest
     mov eax, [ebp + 8] ; return dest
-    pop ecx
     pop esi
-    pop edi
+    pop ebx
     pop ebp
     ret
 
@@ -303,18 +286,22 @@ strnlen:
     push ebp
     mov ebp, esp
     cld
-    push esi
-    push ecx
+    push edi
     
-    mov esi, [ebp + 8] ; s
+    mov edi, [ebp + 8] ; s
     mov ecx, [ebp + 12] ; count
     xor eax, eax ; length
-
+    test ecx, ecx
+    je .done
+    
     repne scasb ; scan for null terminator
-    mov eax, [ebp - 12]
-    sub eax, ecx ; adjust count
-
-    pop ecx
-    pop esi
+    jne .limit ; none in the first count bytes
+    lea eax, [edi - 1]
+    sub eax, [ebp + 8] ; adjust count
+    jmp .done
+.limit:
+    mov eax, [ebp + 12]
+.done:
+    pop edi
     pop ebp
     ret
@@ -1,41 +1,45 @@
 #include "debug.h"
+#include "logring.h"
 #include <stdio.h>
-#include <printfDriver/printf.h>
 
-static const char* const g_LogSeverityColors[] =
+void logf(const char* module, DebugLevel level, const char* fmt, ...)
 {
-    [LVL_DEBUG]        = "\033[2;37m",
-    [LVL_INFO]         = "\033[37m",
-    [LVL_WARN]         = "\033[1;33m",
-    [LVL_ERROR]        = "\033[1;31m",
-    [LVL_CRITICAL]     = "\033[1;37;41m",
-};
+    if (!logEnabled(module, level))
+        return;
 
-static const char* const g_ColorReset = "\033[0m";
+    va_list args;
+    va_start(args, fmt);
+    logWrite(module, level, fmt, args);
+    va_end(args);
+}
 
-void logf(const char* module, DebugLevel level, const char* fmt, ...)
+void logfSite(volatile DebugLevel** site, const char* module, DebugLevel level, const char* fmt, ...)
 {
+    if (*site == &g_LogUnresolvedLevel)
+    {
+        *site = logModuleLevel(module);
+        if (level < **site)
+            return;
+    }
+
     va_list args;
     va_start(args, fmt);
-    
-    if (level < MIN_LOG_LEVEL)
-    return;
-    fputs(g_LogSeverityColors[level], VFS_FD_DEBUG);    // set color depending on level
-    fprintf(VFS_FD_DEBUG, "[%s] ", module);             // write module
-    vprintf(VFS_FD_DEBUG, fmt, args);                  // write text
-    fputs(g_ColorReset, VFS_FD_DEBUG);                  // reset format
-    fputs("\r\n", VFS_FD_DEBUG);                        // newline
+    logWrite(module, level, fmt, args);
+    va_end(args);
+}
 
-    va_end(args);  
+static void strlogfv(DebugLevel level, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    logWrite(NULL, level, fmt, args);
+    va_end(args);
 }
 
 void strlogf(DebugLevel level, const char* str)
 {
-    if (level < MIN_LOG_LEVEL)
-    return;
-    
-    fputs(g_LogSeverityColors[level], VFS_FD_DEBUG);    // set color depending on level
-    fprintf(VFS_FD_DEBUG, str);                         // write text
-    fputs(g_ColorReset, VFS_FD_DEBUG);                  // reset format
-    fputs("\r\n", VFS_FD_DEBUG);                        // newline
-}
\ No newline at end of file
+    if (!logEnabled(NULL, level))
+        return;
+
+    strlogfv(level, "%s", str);
+}
@@ -2,6 +2,12 @@
 #include <stdio.h>
 #define MIN_LOG_LEVEL LVL_DEBUG
 
+// a file may define LOG_LEVEL before its includes, calls below it are compiled out;
+// files with logging on a per-sector or per-call path use it to keep LVL_DEBUG out of the build
+#ifndef LOG_LEVEL
+#define LOG_LEVEL MIN_LOG_LEVEL
+#endif
+
 #ifdef i686
 #include "arch/i686/i686Debug.h"
 #else
@@ -22,11 +28,25 @@ typedef enum {
 
 void logf(const char* module, DebugLevel level, const char* fmt, ...);
 void strlogf(DebugLevel level, const char* str);
-#define log_debug(module, ...)          logf(module, LVL_DEBUG, __VA_ARGS__)
-#define log_info(module, ...)           logf(module, LVL_INFO, __VA_ARGS__)
-#define log_warn(module, ...)           logf(module, LVL_WARN, __VA_ARGS__)
-#define log_err(module, ...)            logf(module, LVL_ERROR, __VA_ARGS__)
-#define log_crit(module, ...)           logf(module, LVL_CRITICAL, __VA_ARGS__)
+
+// every call site keeps a pointer to the runtime level of its module, it starts out at
+// g_LogUnresolvedLevel and is pointed at the module on the first call that gets through
+extern volatile DebugLevel g_LogUnresolvedLevel;
+void logfSite(volatile DebugLevel** site, const char* module, DebugLevel level, const char* fmt, ...);
+
+// a disabled call costs one compare, its arguments are not evaluated
+#define log_at(module, level, ...)                                              \
+    do {                                                                        \
+        static volatile DebugLevel* _logSite = &g_LogUnresolvedLevel;           \
+        if ((level) >= LOG_LEVEL && (level) >= *_logSite)                       \
+            logfSite(&_logSite, module, level, __VA_ARGS__);                    \
+    } while (0)
+
+#define log_debug(module, ...)          log_at(module, LVL_DEBUG, __VA_ARGS__)
+#define log_info(module, ...)           log_at(module, LVL_INFO, __VA_ARGS__)
+#define log_warn(module, ...)           log_at(module, LVL_WARN, __VA_ARGS__)
+#define log_err(module, ...)            log_at(module, LVL_ERROR, __VA_ARGS__)
+#define log_crit(module, ...)           log_at(module, LVL_CRITICAL, __VA_ARGS__)
 
 #define _log_debug(str)          strlogf(LVL_DEBUG, str)
 #define _log_info(str)           strlogf(LVL_INFO, str)
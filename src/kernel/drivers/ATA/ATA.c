@@ -1,3 +1,5 @@
+#define LOG_LEVEL LVL_INFO
+
 #include "ATA.h"
 #include "drivers/ahci/ahci.h"
 
@@ -16,6 +18,9 @@
 #include "unistd.h"
 
 #include "drivers/ide/ide_controller.h"
+#include "drivers/pci/pci.h"
+#include "drivers/block/block.h"
+#include "drivers/block/bcache.h"
 
 #include "fs/disk.h"
 
@@ -34,8 +39,8 @@
 #define ATA_PRIMARY_DCR_AS 0x3F6
 #define ATA_SECONDARY_DCR_AS 0x376
 
-#define ATA_PRIMARY_IRQ 46
-#define ATA_SECONDARY_IRQ 47
+#define ATA_PRIMARY_IRQ 14
+#define ATA_SECONDARY_IRQ 15
 
 #define ATA_MasterDrive 0xA0
 #define ATA_SlaveDirve 0xB0
@@ -140,7 +145,7 @@ void ide_primary_irq(Registers *regs)
 		ide_print_error(ATA_PRIMARY, 2);
 	}
 
-	i8259_SendEOI(ATA_PRIMARY_IRQ);
+	ide_irq();
 }
 
 void ide_secondary_irq(Registers *regs)
@@ -152,7 +157,7 @@ void ide_secondary_irq(Registers *regs)
 		ide_print_error(ATA_SECONDARY, 2);
 	}
 
-	i8259_SendEOI(ATA_SECONDARY_IRQ);
+	ide_irq();
 }
 
 void ide_poll(uint16_t ioBase)
@@ -173,78 +178,80 @@ void ATACacheFlush(uint16_t channel)
 	ATA_CheakStatus(ATA_SR_DRQ);
 }
 
-void ata_read_one(uint8_t *buf, uint32_t lba, uint32_t offset, device_t *device)
-{
-	lba &= 0x00FFFFFF; /* 24 bit LBA */
-	/* We only support LBA so far */
-	uint16_t channel = 0;
-	uint16_t drive = 0;
-
-	uint16_t ATADevice = ((ide_private_data *)(device->priv))->drive;
-	ATA_GetIO(ATADevice, &channel, &drive);
-
-	uint8_t cmd = (drive == ATA_MASTER ? 0xE0 : 0xF0);
-
-	log_info(MODULE, "drive = %X", drive);
-
-	log_info(MODULE, "channel = %X, drive = %X", channel, drive);
-
-	i686_outb(channel + ATA_REG_HDDEVSEL, (cmd | (uint8_t)((lba >> 24 & 0x0F))));
-	i686_outb(channel + 1, 0x00);
-	i686_outb(channel + ATA_REG_SECCOUNT0, 1);
-	i686_outb(channel + ATA_REG_LBA0, (uint8_t)((lba)));
-	i686_outb(channel + ATA_REG_LBA1, (uint8_t)((lba) >> 8));
-	i686_outb(channel + ATA_REG_LBA2, (uint8_t)((lba) >> 16));
-	i686_outb(channel + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
-
-	sleepms(1); // Wait for the command to be sent
-
-	ATA_CheakStatus(ATA_SR_DRQ);
-
-	ide_poll(channel);
+// 64 KiB per command, one PRD table covers it many times over
+#define ATA_MAX_SECTORS_PER_COMMAND 128
+#define ATA_SECTOR_SIZE 512
 
-	uint16_t count = 0;
-	// set_task(0);
-	// ide_read_buffer(channel, ATA_REG_DATA, (uint32_t)buf, 256);
-	for (int i = 0; i < 256; i++)
+// moves numsects sectors in as few commands as possible, returns how many made it
+static uint32_t ATA_transfer(uint8_t direction, void *buf, uint64_t lba, uint32_t numsects, device_t *device)
+{
+	uint16_t drive = ((ide_private_data *)(device->priv))->drive;
+	uint64_t size = ide_devices[drive].Size;
+	if (lba >= size)
+	{
+		log_err(MODULE, "LBA %u is past the end of %s", (uint32_t)lba, ide_devices[drive].Model);
+		return 0;
+	}
+	if (lba + numsects > size)
 	{
-		uint16_t data = i686_inw(channel + ATA_REG_DATA);
-		uint8_t b1 = data & 0x00FF;
-		uint8_t b2 = (data >> 8);
-
-		buf[(i * 2) + offset] = b1;
-		buf[(i * 2) + offset + 1] = b2;
-		// log_debug(MODULE, "%X, %X", b1, b2);
-		count++;
+		numsects = (uint32_t)(size - lba);
 	}
-	log_info(MODULE, "readed %u words", count);
 
-	ide_400ns_delay(channel);
+	uint32_t edi = (uint32_t)buf;
+	uint32_t done = 0;
+	while (done < numsects)
+	{
+		uint32_t count = numsects - done;
+		if (count > ATA_MAX_SECTORS_PER_COMMAND)
+		{
+			count = ATA_MAX_SECTORS_PER_COMMAND;
+		}
 
-	// ATACacheFlush(channel);
-	// set_task(1);
+		uint8_t err = ide_ata_access(direction, drive, (uint32_t)lba + done, (uint8_t)count, i686_GDT_DATA_SEGMENT, edi);
+		if (err)
+		{
+			ide_print_error(drive, err);
+			break;
+		}
+		done += count;
+		edi += count * ATA_SECTOR_SIZE;
+	}
+	return done;
 }
 
 uint32_t ATA_read(void *buf, uint64_t lba, uint32_t numsects, device_t *device)
 {
-	uint8_t* result = (uint8_t*)buf;
-	uint32_t offset = 0;
-	log_info(MODULE, "Reading %u sectors from LBA %u", numsects, lba);
-	uint32_t sectorsReaded = 0;
-	for (int i = 0; i < numsects; i++)
-	{
-		log_debug(MODULE, "Reading LBA %u, offset %u", lba + i, offset);
-		ata_read_one(result, lba + i, offset, device);
-		sectorsReaded++;
-		offset += 512;
-	}
-	return sectorsReaded;
+	return ATA_transfer(ATA_READ, buf, lba, numsects, device);
+}
+
+uint32_t ATA_write(void *buf, uint64_t lba, uint32_t numsects, device_t *device)
+{
+	return ATA_transfer(ATA_WRITE, buf, lba, numsects, device);
 }
+
+// block layer hook, the transfer is done before it returns
+static bool ATA_submit(device_t *device, block_request *req)
+{
+	uint32_t done = ATA_transfer(req->write ? ATA_WRITE : ATA_READ, req->buffer, req->lba, req->count, device);
+	blockComplete(req, done == req->count);
+	return true;
+}
+
 uint16_t ATA_DeviceIndex;
 void ATA_init()
 {
 	printf("Checking for ATA drives\n");
-	if (ide_initialize(0x1F0, 0x3F6, 0x170, 0x376, 0x000) == false)
+	// QEMU's PIIX IDE is function 1, BAR4 there is the bus master block
+	uint32_t bus, slot, function;
+	uint32_t bar4 = 0;
+	if (pciFindClass(0x01, 0x01, &bus, &slot, &function))
+	{
+		pciEnableIOBusmastering(bus, slot, function);
+		bar4 = pciReadIOBar(bus, slot, function, PCI_BAR4);
+		log_info(MODULE, "Bus master IDE at %x", bar4);
+	}
+
+	if (ide_initialize(0x1F0, 0x3F6, 0x170, 0x376, bar4) == false)
 	{
 		return;
 	}
@@ -257,9 +264,6 @@ void ATA_init()
 	
 	for (size_t i = 0; i < ide_devices_count; i++)
 	{
-		device_t *dev = (device_t *)malloc(sizeof(device_t));
-		log_debug(MODULE, "dev is at %p", dev);
-		ide_private_data *priv = (ide_private_data *)malloc(sizeof(ide_private_data));
 		if (ide_devices[i].Reserved == 0)
 		{
 			continue; // Skip if the device is not reserved.
@@ -270,6 +274,10 @@ void ATA_init()
 			continue; // Skip if the device is not ATA.
 		}
 
+		device_t *dev = (device_t *)malloc(sizeof(device_t));
+		log_debug(MODULE, "dev is at %p", dev);
+		ide_private_data *priv = (ide_private_data *)malloc(sizeof(ide_private_data));
+
 		ide_device ide_device = ide_devices[i];
 		log_info(MODULE, "Found %s Drive %dGB - %s",
                    (const char *[]){"ATA", "ATAPI"}[ide_device.Type], /* Type */
@@ -279,9 +287,9 @@ void ATA_init()
 		// log_debug(MODULE, "After mallocing others, file %s:%u", __FILE__, __LINE__);
 		// log_debug(MODULE, "ATA Mod %s", ide_devices[0].Model);
 		
-		priv->drive = (ide_device.Channel << 1) | ide_device.Drive;
+		priv->drive = i;
 		
-		char *temp = ide_device.Model;
+		char *temp = ide_devices[i].Model;
 		
 		// log_warn(MODULE, "IdentifyPage.prosses: %u, file %s:%u", IdentifyPage.prosses, __FILE__, __LINE__);
 		
@@ -289,7 +297,13 @@ void ATA_init()
 		dev->id = ATA_DeviceIndex + i;
 		dev->dev_type = DEVICE_BLOCK;
 		dev->priv = priv;
-		dev->read = ATA_read;
+		dev->read = bcacheRead;
+		dev->write = bcacheWrite;
+		dev->prefetch = bcachePrefetch;
+		// one channel, one command at a time, and ATA_submit only returns once it is done
+		block_queue *queue = blockCreateQueue(dev, ATA_submit, 1, BLOCK_MAX_SECTORS);
+		if (queue)
+			queue->synchronous = true;
 		ata_Device = addDevice(dev);
 	}
 }
@@ -75,4 +75,5 @@ extern uint16_t ata_Device;
 extern uint16_t ATA_DeviceIndex;
 
 void ATA_init();
-uint32_t ATA_read(void *buf, uint64_t lba, uint32_t numsects, device_t *device);
\ No newline at end of file
+uint32_t ATA_read(void *buf, uint64_t lba, uint32_t numsects, device_t *device);
+uint32_t ATA_write(void *buf, uint64_t lba, uint32_t numsects, device_t *device);
\ No newline at end of file
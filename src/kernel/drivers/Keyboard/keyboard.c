@@ -16,6 +16,8 @@
 #include "drivers/PS2/8042_controller.h"
 #include "drivers/PS2/PS2_keyboard.h"
 
+#include "task/wait.h"
+
 #include <printfDriver/printf.h>
 
 #define LED_SCROLL_LOCK 0x01
@@ -62,6 +64,8 @@ uint32_t *keycache = 0;
 int16_t ReadPointer;
 int16_t WritePointer;
 
+wait_queue_t keyboard_wait_queue = WAIT_QUEUE_INIT;
+
 keyboardLEDs keyboard_leds_state;
 keyboardKeys keyboard_keys_state;
 
@@ -75,6 +79,7 @@ void PutBuffer(uint32_t data)
 	{
 		WritePointer = 0;
 	}
+	waitWakeAll(&keyboard_wait_queue);
 }
 uint32_t TakeBuffer()
 {
@@ -121,21 +126,29 @@ uint16_t KeyboardGetKey()
 	return c;
 }
 
-void PressAnyKeyLoop()
+// sleeps until a key that maps to a character is pressed
+uint16_t KeyboardWaitKey()
 {
-	fprintf(VFS_FD_DEBUG, "Press any key...");
+	// a prompt without a newline is still sitting in the stdout buffer
+	fflush(stdout);
 	while (true)
 	{
+		waitEvent(&keyboard_wait_queue, ReadPointer != WritePointer);
 		uint16_t key = KeyboardGetKey();
-		if (key == '\0')
+		if (key != '\0')
 		{
-			continue;
+			return key;
 		}
-		fprintf(VFS_FD_DEBUG, "Key %u", key);
-		break;
 	}
 }
 
+void PressAnyKeyLoop()
+{
+	fprintf(VFS_FD_DEBUG, "Press any key...");
+	uint16_t key = KeyboardWaitKey();
+	fprintf(VFS_FD_DEBUG, "Key %u", key);
+}
+
 void keyboard_update_keys_state()
 {
 	keyboard_keys_state.shift = 0;
@@ -163,8 +176,8 @@ void keyboard_process_code(uint32_t key)
 
 void keyboard_init()
 {
-	keycache = (uint32_t *)malloc(CACHE_SIZE);
-	memset(keycache, 0, CACHE_SIZE);
+	keycache = (uint32_t *)malloc(CACHE_SIZE * sizeof(uint32_t));
+	memset(keycache, 0, CACHE_SIZE * sizeof(uint32_t));
 	ReadPointer = 0;
 	WritePointer = 0;
 
@@ -117,4 +117,5 @@ void keyboard_update_keys_state();
 void keyboard_init();
 void PressAnyKeyLoop();
 uint16_t KeyboardGetKey();
+uint16_t KeyboardWaitKey();
 void keyboard_process_code(uint32_t key);
\ No newline at end of file
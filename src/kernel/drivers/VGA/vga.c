@@ -3,6 +3,7 @@
 #include "vga_modes.h"
 #include "vga_text.h"
 #include "debug.h"
+#include "stdio.h"
 
 #include "memory.h"
 #include "arch/i686/bios.h"
@@ -203,8 +204,10 @@ void VGA_CursorScanLine(uint8_t start, uint8_t end)
     WriteRegister(CRT_Controller_Registers, CRTC_Cursor_End_Register, CursorEndRegister);
 }
 
+// pending stdout text belongs where the cursor was, so it is flushed before the cursor moves
 void VGA_clrscr()
 {
+    fflush(stdout);
     log_debug(MODULE, "CurrentMode = %u", CurrentMode);
     if (CurrentMode == VGA_MODE_GRAPH)
     {
@@ -217,10 +220,12 @@ void VGA_clrscr()
 }
 void VGA_setcursor(int x, int y)
 {
+    fflush(stdout);
     VGAText_setcursor(x, y);
 }
 void VGA_getcursor(int *x, int *y)
 {
+    fflush(stdout);
     VGAText_getcursor(x, y);
 }
 
@@ -229,6 +234,16 @@ void VGA_putc(char c)
     VGAText_putc(c);
 }
 
+void VGA_write(const char *data, size_t size)
+{
+    VGAText_write(data, size);
+}
+
+int VGA_ScrollView(int lines)
+{
+    return VGAText_ScrollView(lines);
+}
+
 void VGA_putpixel(uint32_t x, uint32_t y, uint32_t color)
 {
     VGAGrap_put(x, y, color);
@@ -140,6 +140,8 @@ void VGA_clrscr();
 void VGA_setcursor(int x, int y);
 void VGA_getcursor(int *x, int *y);
 void VGA_putc(char c);
+void VGA_write(const char *data, size_t size);
+int VGA_ScrollView(int lines);
 void VGA_putpixel(uint32_t x, uint32_t y, uint32_t color);
 void vga_initialize();
 void VGA_SetMode(uint16_t mode);
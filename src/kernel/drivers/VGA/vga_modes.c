@@ -3,6 +3,7 @@
 #include "vga_text.h"
 
 #include "debug.h"
+#include "memory.h"
 
 #include "arch/i686/bios.h"
 #include "vga.h"
@@ -71,6 +72,11 @@ void mode_SetMode(uint16_t mode)
     */
 
     VGA_Framebuffer = (uint8_t *)selectedMode.framebuffer; // Set the framebuffer address for graphics mode
+    if (selectedMode.framebuffer >= 0x100000)
+    {
+        // linear framebuffers sit above RAM and are not identity mapped
+        VGA_Framebuffer = (uint8_t *)pagingMapMMIO(selectedMode.framebuffer, selectedMode.pitch * selectedMode.height);
+    }
     if (VGA_Framebuffer == NULL)
     {
         VGA_Framebuffer = (uint8_t*)0xA0000;
@@ -7,7 +7,6 @@
 #define MODULE "VGA_TEXT"
 
 extern char default8x16Font;
-uint16_t* buffer;
 
 static const uint8_t sequencer[5] = {
     0x03, 0x01, 0x03, 0x00, 0x06
@@ -36,10 +35,79 @@ static const uint8_t attribute_ctrl[21] = {
 
 extern char VGAModesAddr;
 const uint8_t DEFAULT_COLOR = 0x7;
+#define TEXT_COLOR 0x0F
+
+/*
+ * Text console
+ *
+ * Output goes to a shadow copy of the screen in RAM. Rows that changed are
+ * marked dirty and copied to VRAM by VGAText_flush, which is also the only
+ * place the hardware cursor is moved, so a write of many characters costs
+ * one copy per touched row and one cursor update. Scrolling moves the shadow
+ * with memmove and never reads VRAM. Rows scrolled off the top are kept in
+ * a ring that VGAText_ScrollView can show again.
+ */
 
 bool VGA_mono;
 int ScreenX = 0, ScreenY = 0;
 
+static uint16_t g_Shadow[VGA_TEXT_MAX_ROWS * VGA_TEXT_MAX_COLS];
+static bool g_DirtyRows[VGA_TEXT_MAX_ROWS];
+static int g_Cols = 0, g_Rows = 0;
+static int g_CursorPos = -1; // where the hardware cursor is
+
+static uint16_t g_History[VGA_SCROLLBACK_LINES][VGA_TEXT_MAX_COLS];
+static int g_HistoryHead = 0; // next row to overwrite
+static int g_HistoryCount = 0;
+static int g_ViewOffset = 0; // rows scrolled back, 0 shows the live screen
+
+static inline uint16_t VGAText_cell(char c, uint8_t color)
+{
+    return (uint8_t)c | (color << 8);
+}
+
+static void VGAText_markAll()
+{
+    for (int y = 0; y < g_Rows; y++)
+        g_DirtyRows[y] = true;
+}
+
+static void VGAText_moveCursor(int pos)
+{
+    if (pos == g_CursorPos)
+        return;
+    g_CursorPos = pos;
+    WriteRegister(CRT_Controller_Registers, CRTC_Cursor_Location_Low_Register, (uint8_t)(pos & 0xFF));
+    WriteRegister(CRT_Controller_Registers, CRTC_Cursor_Location_High_Register, (uint8_t)((pos >> 8) & 0xFF));
+}
+
+// the row displayed at y, from the history while scrolled back
+static const uint16_t *VGAText_viewRow(int y)
+{
+    if (y < g_ViewOffset)
+    {
+        int index = g_HistoryHead - g_ViewOffset + y;
+        if (index < 0)
+            index += VGA_SCROLLBACK_LINES;
+        return g_History[index];
+    }
+    return &g_Shadow[(y - g_ViewOffset) * g_Cols];
+}
+
+void VGAText_flush()
+{
+    uint16_t *vram = (uint16_t *)VGA_Framebuffer;
+    for (int y = 0; y < g_Rows; y++)
+    {
+        if (!g_DirtyRows[y])
+            continue;
+        memcpy(vram + y * ScreenWidth, VGAText_viewRow(y), g_Cols * sizeof(uint16_t));
+        g_DirtyRows[y] = false;
+    }
+    if (g_ViewOffset == 0)
+        VGAText_moveCursor(ScreenY * ScreenWidth + ScreenX);
+}
+
 void VGAText_getcursor(int *x, int *y)
 {
     *x = ScreenX;
@@ -48,45 +116,40 @@ void VGAText_getcursor(int *x, int *y)
 
 void VGAText_putchr(int x, int y, char c)
 {
-    buffer[2 * (y * ScreenWidth + x)] = c;
+    uint16_t *cell = &g_Shadow[y * g_Cols + x];
+    *cell = (*cell & 0xFF00) | (uint8_t)c;
+    g_DirtyRows[y] = true;
 }
 
 void VGA_putcolor(int x, int y, uint8_t color)
 {
-    buffer[2 * (y * ScreenWidth + x) + 1] = color;
+    uint16_t *cell = &g_Shadow[y * g_Cols + x];
+    *cell = (*cell & 0x00FF) | (color << 8);
+    g_DirtyRows[y] = true;
 }
 
 void VGA_put(int x, int y, char c, uint8_t color)
 {
-    uint16_t* ptr = (uint16_t*)VGA_Framebuffer + y * ScreenWidth + x;
-    *ptr = (c | (color << 8));
-    /*
-    log_debug(MODULE, "(%u, %u) buffer[%i] = %x, buffer[%i] = %x",
-        x, y,
-        index, priv,
-        index, *ptr
-    );
-    */
+    g_Shadow[y * g_Cols + x] = VGAText_cell(c, color);
+    g_DirtyRows[y] = true;
 }
 
 char VGA_getchr(int x, int y)
 {
-    return buffer[2 * (y * ScreenWidth + x)];
+    return g_Shadow[y * g_Cols + x] & 0xFF;
 }
 
 uint8_t VGA_getcolor(int x, int y)
 {
-    return buffer[2 * (y * ScreenWidth + x) + 1];
+    return g_Shadow[y * g_Cols + x] >> 8;
 }
 
 void VGAText_setcursor(int x, int y)
 {
-    int pos = y * ScreenWidth + x;
     ScreenX = x;
     ScreenY = y;
-
-    WriteRegister(CRT_Controller_Registers, CRTC_Cursor_Location_Low_Register, (uint8_t)(pos & 0xFF));
-    WriteRegister(CRT_Controller_Registers, CRTC_Cursor_Location_High_Register, (uint8_t)((pos >> 8) & 0xFF));
+    if (g_ViewOffset == 0)
+        VGAText_moveCursor(y * ScreenWidth + x);
 }
 
 void VGAText_LoadFont(uint8_t* font)
@@ -116,35 +179,38 @@ void VGAText_LoadFont(uint8_t* font)
 void VGAText_clrscr()
 {
     log_debug(MODULE, "enter VGA_clrscr");
-    for (int y = 0; y < ScreenHeight; y++)
-        for (int x = 0; x < ScreenWidth; x++)
-        {
-            VGA_put(x, y, '\0', DEFAULT_COLOR);
-        }
+    for (int i = 0; i < g_Rows * g_Cols; i++)
+        g_Shadow[i] = VGAText_cell('\0', DEFAULT_COLOR);
 
+    g_ViewOffset = 0;
+    VGAText_markAll();
     ScreenX = 0;
     ScreenY = 0;
-    VGAText_setcursor(ScreenX, ScreenY);
+    VGAText_flush();
 }
 
 void VGA_scrollback(int lines)
 {
-    for (int y = lines; y < ScreenHeight; y++)
-        for (int x = 0; x < ScreenWidth; x++)
-        {
-            VGA_put(x, y - lines, VGA_getchr(x, y), VGA_getcolor(x, y));
-        }
-
-    for (int y = ScreenHeight - lines; y < ScreenHeight; y++)
-        for (int x = 0; x < ScreenWidth; x++)
-        {
-            VGA_put(x, y, '\0', DEFAULT_COLOR);
-        }
+    if (lines > g_Rows)
+        lines = g_Rows;
+    for (int y = 0; y < lines; y++)
+    {
+        memcpy(g_History[g_HistoryHead], &g_Shadow[y * g_Cols], g_Cols * sizeof(uint16_t));
+        g_HistoryHead = (g_HistoryHead + 1) % VGA_SCROLLBACK_LINES;
+        if (g_HistoryCount < VGA_SCROLLBACK_LINES)
+            g_HistoryCount++;
+    }
+
+    memmove(g_Shadow, &g_Shadow[lines * g_Cols], (g_Rows - lines) * g_Cols * sizeof(uint16_t));
+    for (int i = (g_Rows - lines) * g_Cols; i < g_Rows * g_Cols; i++)
+        g_Shadow[i] = VGAText_cell('\0', DEFAULT_COLOR);
 
+    VGAText_markAll();
     ScreenY -= lines;
 }
 
-void VGAText_putc(char c)
+// puts c into the shadow buffer, the screen catches up on the next flush
+static void VGAText_emit(char c)
 {
     switch (c)
     {
@@ -154,8 +220,8 @@ void VGAText_putc(char c)
         break;
 
     case '\t':
-        for (int i = 0; i < 4 - (ScreenX % 4); i++)
-            VGAText_putc(' ');
+        for (int i = 4 - (ScreenX % 4); i > 0; i--)
+            VGAText_emit(' ');
         break;
 
     case '\r':
@@ -163,20 +229,53 @@ void VGAText_putc(char c)
         break;
 
     default:
-        VGA_put(ScreenX, ScreenY, c, 0x0F);
+        g_Shadow[ScreenY * g_Cols + ScreenX] = VGAText_cell(c, TEXT_COLOR);
+        g_DirtyRows[ScreenY] = true;
         ScreenX++;
         break;
     }
 
-    if (ScreenX >= ScreenWidth)
+    if (ScreenX >= g_Cols)
     {
         ScreenY++;
         ScreenX = 0;
     }
-    if (ScreenY >= ScreenHeight)
+    if (ScreenY >= g_Rows)
         VGA_scrollback(1);
+}
+
+void VGAText_write(const char *data, size_t size)
+{
+    // new output brings the live screen back
+    if (g_ViewOffset)
+    {
+        g_ViewOffset = 0;
+        VGAText_markAll();
+    }
+    for (size_t i = 0; i < size; i++)
+        VGAText_emit(data[i]);
+    VGAText_flush();
+}
 
-    VGAText_setcursor(ScreenX, ScreenY);
+void VGAText_putc(char c)
+{
+    VGAText_write(&c, 1);
+}
+
+int VGAText_ScrollView(int lines)
+{
+    int offset = g_ViewOffset + lines;
+    if (offset > g_HistoryCount)
+        offset = g_HistoryCount;
+    if (offset < 0)
+        offset = 0;
+    if (offset != g_ViewOffset)
+    {
+        g_ViewOffset = offset;
+        VGAText_markAll();
+        VGAText_flush();
+    }
+    return g_ViewOffset;
 }
 
 void SwitchMono()
@@ -217,7 +316,12 @@ void VGAText_init(vga_mode_t *mode)
 {
     ScreenWidth = mode->width;
     ScreenHeight = mode->height;
-    buffer = (uint16_t *)0xB8000;
+    g_Cols = ScreenWidth < VGA_TEXT_MAX_COLS ? ScreenWidth : VGA_TEXT_MAX_COLS;
+    g_Rows = ScreenHeight < VGA_TEXT_MAX_ROWS ? ScreenHeight : VGA_TEXT_MAX_ROWS;
+    g_HistoryHead = 0;
+    g_HistoryCount = 0;
+    g_ViewOffset = 0;
+    g_CursorPos = -1;
     VGA_ModeBPP = mode->bpp;
     ScreenX = 0;
     ScreenY = 0;
@@ -13,10 +13,20 @@ extern bool VGA_mono;
 #define VGA_CRTControllerRegOffset          (VGA_mono) ? 0x3B0 : 0x3D0 
 #define VGA_MiscOffset                      0x3C1
 
+// sizes of the shadow buffer, larger text modes only use this much of the screen
+#define VGA_TEXT_MAX_COLS 132
+#define VGA_TEXT_MAX_ROWS 60
+#define VGA_SCROLLBACK_LINES 256
+
 void VGAText_LoadFont(uint8_t* font);
 void VGAText_clrscr();
 void VGAText_putc(char c);
 void VGAText_init(vga_mode_t* mode);
 void VGAText_putchr(int x, int y, char c);
 void VGAText_setcursor(int x, int y);
-void VGAText_getcursor(int *x, int *y);
\ No newline at end of file
+void VGAText_getcursor(int *x, int *y);
+// writes the batch to the shadow buffer, then copies the dirty rows to VRAM and moves the cursor once
+void VGAText_write(const char *data, size_t size);
+void VGAText_flush();
+// scrolls the view back (positive) or forward through the history, returns how far back it is
+int VGAText_ScrollView(int lines);
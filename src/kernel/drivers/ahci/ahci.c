@@ -5,6 +5,12 @@
 #include "debug.h"
 #include "arch/i686/io.h"
 #include "arch/i686/i8259.h"
+#include "arch/i686/irq.h"
+#include "arch/i686/pit.h"
+#include "arch/i686/memory_i686.h"
+#include "task/wait.h"
+#include "drivers/block/block.h"
+#include "drivers/block/bcache.h"
 
 #include "memory.h"
 
@@ -15,6 +21,16 @@
 #define SATA_SIG_SEMB 0xC33C0101  // Enclosure management bridge
 #define SATA_SIG_PM 0x96690101	  // Port multiplier
 
+#define HBA_GHC_IE (1 << 1)
+#define HBA_PxIS_TFES (1 << 30)
+// interface, host bus data and host bus fatal errors plus task file errors
+#define HBA_PxIS_ERRORS (0x78000000)
+// D2H register, PIO setup, DMA setup and set device bits FIS, and the errors
+#define HBA_PxIE_DEFAULT (0x0000000F | HBA_PxIS_ERRORS)
+
+// 5 s at 500 Hz
+#define AHCI_TIMEOUT_TICKS 2500
+
 /*
 Enable interrupts, DMA, and memory space access in the PCI command register
 Memory map BAR 5 register as uncacheable.
@@ -35,83 +51,337 @@ For all the implemented ports:
 	Send IDENTIFY ATA command to connected drives. Get their sector size and count.
 */
 
+#define HBA_GHC_AE (1u << 31)
+#define HBA_CAP_SNCQ (1 << 30)
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+
+// identify word 76, serial ATA capabilities
+#define SATA_CAP_NCQ (1 << 8)
+// identify word 83, 48 bit addresses
+#define SATA_CMDSET_LBA48 (1 << 10)
+
+#define AHCI_SECTOR_SIZE 512
+#define AHCI_CMD_TABLE_SIZE 4096
+#define AHCI_PRDT_ENTRIES ((AHCI_CMD_TABLE_SIZE - sizeof(HBA_CMD_TBL)) / sizeof(HBA_PRDT_ENTRY) + 1)
+#define AHCI_MAX_PRD_BYTES (4 * 1024 * 1024)
+#define AHCI_NO_SLOT 0xFFFFFFFF
+
+// the synchronous read/write path keeps this many chunks in flight
+#define AHCI_SYNC_CHUNK_SECTORS 256
+#define AHCI_SYNC_REQUESTS 8
+
 typedef struct
 {
 	HBAData *abar;
 	HBAPort *port;
+	uint32_t index; // port number in the HBA
 	void *clb;
 	void *fb;
 	void *ctba[32];
-	void *unused[28]; // Even out the data size to 256 bytes
+
+	uint32_t depth; // commands in flight at once, 1 without NCQ
+	bool ncq;
+	uint64_t sectors;
+
+	volatile uint32_t inflight; // slots with a command issued
+	volatile bool exclusive;	// a non-queued command owns the port
+	ahci_request *requests[32];
+
+	device_t *device;
+	char name[41];
 } ahci_port;
 
 ahci_port *ports;
 int num_ports;
 
-uint32_t find_cmdslot(ahci_port aport)
+HBAData *ahci_abar = NULL;
+uint8_t ahci_irq_line = 0xFF;
+static ahci_port *ahci_port_by_index[32];
+static wait_queue_t ahci_wait_queue = WAIT_QUEUE_INIT;
+
+static bool ahci_is_queued(uint8_t command)
+{
+	return command == SATA_READ_FPDMA_QUEUED || command == SATA_WRITE_FPDMA_QUEUED;
+}
+
+static void ahci_finish(ahci_request *req, bool error)
+{
+	// the owner may reuse req once done is set, the callback has to be read first
+	void (*complete)(ahci_request *) = req->complete;
+	req->error = error;
+	req->done = true;
+	if (complete)
+		complete(req);
+}
+
+// every command is lost with the error, fail them all and restart the port
+static void ahci_port_error(ahci_port *aport, uint32_t is)
 {
-	HBAPort *port = aport.port;
-	uint32_t slots = (port->sact | port->ci);
-	uint32_t cmdslots = (aport.abar->cap & 0x0f00) >> 8;
-	for (uint32_t i = 0; i < cmdslots; i++)
+	volatile HBAPort *port = aport->port;
+	log_err(MODULE, "port %u error, is %x tfd %x serr %x", aport->index, is, port->tfd, port->serr);
+
+	port->cmd &= ~HBA_CMD_ST;
+	for (uint32_t spin = 0; spin < 1000000 && (port->cmd & HBA_CMD_CR); spin++)
+		;
+	port->serr = (uint32_t)-1;
+	port->is = (uint32_t)-1;
+	port->cmd |= HBA_CMD_ST;
+
+	for (uint32_t slot = 0; slot < 32; slot++)
 	{
-		if ((slots & 1) == 0)
-			return i;
-		slots >>= 1;
+		ahci_request *req = aport->requests[slot];
+		if (req == NULL)
+			continue;
+		aport->requests[slot] = NULL;
+		ahci_finish(req, true);
 	}
-	return 0xFFFFFFFF;
+	aport->inflight = 0;
+	aport->exclusive = false;
+	waitWakeAll(&ahci_wait_queue);
 }
 
-uint8_t ahci_identify_device(ahci_port aport, void *buf)
+// retires finished commands, called from the IRQ and by waiters every tick, interrupts off
+static void ahci_complete(ahci_port *aport)
 {
-	HBAPort *port = aport.port;
-	port->is = 0xFFFFFFFF;
-	uint32_t slot = find_cmdslot(aport);
-	if (slot == 0xFFFFFFFF)
-		return 1;
+	volatile HBAPort *port = aport->port;
+	uint32_t is = port->is;
+	port->is = is;
+	if (is & HBA_PxIS_ERRORS)
+	{
+		ahci_port_error(aport, is);
+		return;
+	}
+	if (aport->inflight == 0)
+		return;
 
-	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)aport.clb;
-	cmdheader += slot;
-	cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-	cmdheader->w = 0;
+	uint32_t done = aport->inflight & ~(port->ci | port->sact);
+	if (done == 0)
+		return;
+	while (done)
+	{
+		uint32_t slot = __builtin_ctz(done);
+		done &= done - 1;
+		ahci_request *req = aport->requests[slot];
+		aport->requests[slot] = NULL;
+		aport->inflight &= ~(1u << slot);
+		ahci_finish(req, false);
+	}
+	if (aport->inflight == 0)
+		aport->exclusive = false;
+	waitWakeAll(&ahci_wait_queue);
+}
 
-	HBA_CMD_TBL *cmdtable = (HBA_CMD_TBL *)aport.ctba[slot];
+void ahci_irq(Registers *regs)
+{
+	HBAData *abar = ahci_abar;
+	uint32_t is = abar->is;
+	for (int i = 0; i < 32; i++)
+	{
+		if (!(is & (1u << i)))
+			continue;
+		if (ahci_port_by_index[i])
+			ahci_complete(ahci_port_by_index[i]);
+		else
+			abar->ports[i].is = abar->ports[i].is;
+	}
+	abar->is = is;
+}
+
+static uint32_t ahci_free_slot(ahci_port *aport)
+{
+	uint32_t mask = aport->depth == 32 ? 0xFFFFFFFF : (1u << aport->depth) - 1;
+	uint32_t free = ~aport->inflight & mask;
+	if (free == 0)
+		return AHCI_NO_SLOT;
+	return __builtin_ctz(free);
+}
 
-	cmdtable->prdt_entry[0].dba = (uint32_t)buf;
-	cmdtable->prdt_entry[0].dbau = 0;
-	cmdtable->prdt_entry[0].dbc = 511;
-	cmdtable->prdt_entry[0].i = 1;
+// scatter-gather list for the buffer, one entry per physically contiguous run, -1 if it does not fit
+static int ahci_build_prdt(HBA_CMD_TBL *cmdtbl, uint32_t buffer, uint32_t bytes)
+{
+	if (buffer & 1)
+		return -1;
 
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtable->cfis);
+	int n = 0;
+	uint32_t lastPhys = 0, lastSize = 0;
+	while (bytes)
+	{
+		uint32_t phys = pagingTranslate(buffer);
+		uint32_t chunk = 0x1000 - (buffer & 0xFFF);
+		if (chunk > bytes)
+			chunk = bytes;
+		if (phys == 0)
+			return -1;
+
+		if (n > 0 && phys == lastPhys + lastSize && lastSize + chunk <= AHCI_MAX_PRD_BYTES)
+		{
+			lastSize += chunk;
+			cmdtbl->prdt_entry[n - 1].dbc = lastSize - 1;
+		}
+		else
+		{
+			if (n == AHCI_PRDT_ENTRIES)
+				return -1;
+			HBA_PRDT_ENTRY *prd = &cmdtbl->prdt_entry[n++];
+			prd->dba = phys;
+			prd->dbau = 0;
+			prd->rsv0 = 0;
+			prd->dbc = chunk - 1;
+			prd->rsv1 = 0;
+			prd->i = 0;
+			lastPhys = phys;
+			lastSize = chunk;
+		}
+		buffer += chunk;
+		bytes -= chunk;
+	}
+	return n;
+}
 
-	cmdfis->fis_type = FIS_TYPE_REG_H2D; // Host to device
-	cmdfis->c = 1;
-	cmdfis->command = SATA_IDENTIFY_DEVICE;
+static bool ahci_issue(ahci_port *aport, ahci_request *req, uint32_t slot)
+{
+	volatile HBAPort *port = aport->port;
+	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)aport->clb + slot;
+	HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL *)aport->ctba[slot];
 
+	int prdtl = ahci_build_prdt(cmdtbl, (uint32_t)req->buffer, req->count * AHCI_SECTOR_SIZE);
+	if (prdtl < 0)
+	{
+		log_err(MODULE, "buffer %p (%u sectors) does not fit a PRDT", req->buffer, req->count);
+		return false;
+	}
+
+	cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t); // Command FIS size
+	cmdheader->w = req->write;
+	cmdheader->prdtl = prdtl;
+	cmdheader->prdbc = 0;
+
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtbl->cfis);
+	memset(cmdfis, 0, sizeof(FIS_REG_H2D));
+	cmdfis->fis_type = FIS_TYPE_REG_H2D;
+	cmdfis->c = 1; // Command
+	cmdfis->command = req->command;
 	cmdfis->device = 1 << 6;
 
-	for (uint32_t spin = 0; spin < 1000000; spin++)
+	cmdfis->lba0 = (uint8_t)req->lba;
+	cmdfis->lba1 = (uint8_t)(req->lba >> 8);
+	cmdfis->lba2 = (uint8_t)(req->lba >> 16);
+	cmdfis->lba3 = (uint8_t)(req->lba >> 24);
+	cmdfis->lba4 = (uint8_t)(req->lba >> 32);
+	cmdfis->lba5 = (uint8_t)(req->lba >> 40);
+
+	bool queued = ahci_is_queued(req->command);
+	if (queued)
 	{
-		if (!(port->tfd & (SATA_BUSY | SATA_DRQ)))
-			break;
+		// NCQ moves the count to the feature register, the tag goes in the count register
+		cmdfis->featurel = req->count & 0xFF;
+		cmdfis->featureh = (req->count >> 8) & 0xFF;
+		cmdfis->countl = slot << 3;
+	}
+	else
+	{
+		cmdfis->countl = req->count & 0xFF;
+		cmdfis->counth = (req->count >> 8) & 0xFF;
 	}
-	if ((port->tfd & (SATA_BUSY | SATA_DRQ)))
-		return 2;
 
-	port->ci = (1 << slot);
+	req->done = false;
+	req->error = false;
+	req->deadline = timer_ticks + AHCI_TIMEOUT_TICKS;
+	aport->requests[slot] = req;
+	aport->inflight |= 1u << slot;
+	if (queued)
+		port->sact = 1u << slot;
+	else
+		aport->exclusive = true;
+	port->ci = 1u << slot; // Issue command
+	return true;
+}
+
+// takes a free slot and issues req, sleeps while the port is full
+static bool ahci_submit_port(ahci_port *aport, ahci_request *req)
+{
+	bool queued = ahci_is_queued(req->command);
+	uint32_t slot = AHCI_NO_SLOT;
 
-	while (1)
+	uint32_t flags = i686_SaveInterrupts();
+	while (true)
 	{
-		if (!(port->ci & (1 << slot)))
+		// picks up completions on controllers without a working IRQ
+		ahci_complete(aport);
+		if (!aport->exclusive)
+		{
+			if (queued)
+				slot = ahci_free_slot(aport);
+			else if (aport->inflight == 0)
+				slot = 0;
+			if (slot != AHCI_NO_SLOT)
+				break;
+		}
+		waitSleepTimeout(&ahci_wait_queue, timer_ticks + 1);
+	}
+	bool ok = ahci_issue(aport, req, slot);
+	i686_RestoreInterrupts(flags);
+	return ok;
+}
+
+// picks up completions without an IRQ and gives up on commands past their deadline, interrupts off
+static void ahci_check_port(ahci_port *aport)
+{
+	ahci_complete(aport);
+	uint32_t inflight = aport->inflight;
+	while (inflight)
+	{
+		uint32_t slot = __builtin_ctz(inflight);
+		inflight &= inflight - 1;
+		ahci_request *req = aport->requests[slot];
+		if ((int32_t)(timer_ticks - req->deadline) >= 0)
+		{
+			log_err(MODULE, "command %x at LBA %u timed out", req->command, (uint32_t)req->lba);
+			ahci_port_error(aport, 0);
+			return;
+		}
+	}
+}
+
+// sleeps until req is done, woken by the IRQ or the next tick when there is none
+static bool ahci_wait_request(ahci_port *aport, ahci_request *req)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	while (!req->done)
+	{
+		ahci_check_port(aport);
+		if (req->done)
 			break;
-		if (port->is & (1 << 30))
-			return 3;
+		waitSleepTimeout(&ahci_wait_queue, timer_ticks + 1);
 	}
+	i686_RestoreInterrupts(flags);
+	return !req->error;
+}
+
+static bool ahci_exec(ahci_port *aport, uint8_t command, void *buffer, uint32_t count)
+{
+	ahci_request req;
+	memset(&req, 0, sizeof(req));
+	req.command = command;
+	req.buffer = buffer;
+	req.count = count;
+	if (!ahci_submit_port(aport, &req))
+		return false;
+	return ahci_wait_request(aport, &req);
+}
 
-	if (port->is & (1 << 30))
-		return 3;
+bool ahci_identify_device(ahci_port *aport, sata_identify_packet *info)
+{
+	volatile HBAPort *port = aport->port;
+	for (uint32_t spin = 0; spin < 1000000; spin++)
+	{
+		if (!(port->tfd & (SATA_BUSY | SATA_DRQ)))
+			break;
+	}
+	if ((port->tfd & (SATA_BUSY | SATA_DRQ)))
+		return false;
 
-	return 0;
+	return ahci_exec(aport, SATA_IDENTIFY_DEVICE, info, 1);
 }
 
 void initialize_port(ahci_port *aport)
@@ -123,15 +393,16 @@ void initialize_port(ahci_port *aport)
 	while ((port->cmd & HBA_CMD_FR) || (port->cmd & HBA_CMD_CR))
 		;
 
+	// whole pages, so the 1 KiB and 256 byte alignment rules hold
 	void *mapped_clb = malloc(4096);
 	memset(mapped_clb, 0, 4096);
-	port->clb = (uint32_t)mapped_clb;
+	port->clb = pagingTranslate((uint32_t)mapped_clb);
 	port->clbu = 0;
 	aport->clb = mapped_clb;
 
 	void *mapped_fb = malloc(4096);
 	memset(mapped_fb, 0, 4096);
-	port->fb = (uint32_t)mapped_fb;
+	port->fb = pagingTranslate((uint32_t)mapped_fb);
 	port->fbu = 0;
 	aport->fb = mapped_fb;
 
@@ -139,10 +410,10 @@ void initialize_port(ahci_port *aport)
 
 	for (uint8_t i = 0; i < 32; i++)
 	{
-		cmdheader[i].prdtl = 1;
-		void *ctba_buf = calloc(1, 4096);
+		cmdheader[i].prdtl = 0;
+		void *ctba_buf = calloc(1, AHCI_CMD_TABLE_SIZE);
 		aport->ctba[i] = ctba_buf;
-		cmdheader[i].ctba = (uint32_t)ctba_buf;
+		cmdheader[i].ctba = pagingTranslate((uint32_t)ctba_buf);
 		cmdheader[i].ctbau = 0;
 	}
 
@@ -150,6 +421,10 @@ void initialize_port(ahci_port *aport)
 		;
 	port->cmd |= HBA_CMD_FRE;
 	port->cmd |= HBA_CMD_ST;
+
+	port->serr = (uint32_t)-1;
+	port->is = (uint32_t)-1;
+	port->ie = HBA_PxIE_DEFAULT;
 }
 
 bool is_sata(HBAPort *port)
@@ -161,142 +436,263 @@ bool is_sata(HBAPort *port)
 	return true;
 }
 
-void InitAbar(HBAData *abar, device_t* dev)
+static ahci_port *ahci_device_port(device_t *device)
 {
-	uint32_t pi = abar->pi;
-	for (uint8_t i = 0; i < 32; i++)
-	{
-		if (pi & 1)
-		{
-			if (is_sata(&abar->ports[i]))
-			{
-				memset(&ports[num_ports], 0, 256);
-				ports[num_ports].abar = abar;
-				ports[num_ports].port = &abar->ports[i];
-				initialize_port(&ports[num_ports]);
-				sata_identify_packet info;
-				ahci_identify_device(ports[num_ports], &info);
-				ide_private_data* priv = dev->priv;
-				priv->drive = num_ports;
-				log_debug(MODULE, "Port %u initialized", num_ports);
-				char name[41] = {0};
-				for (int i = 0; i < 40; i += 2)
-				{
-					name[i] = info.model_number[i + 1];
-					name[i + 1] = info.model_number[i];
-				}
-				dev->name = name;
-				printf("Detected SATA drive: %s (%u MiB)\n", name, info.total_sectors / 2048);
-				log_debug(MODULE, "Detected SATA drive: %s (%u MiB)", name, info.total_sectors / 2048);
-				num_ports++;
-			}
-		}
-		pi >>= 1;
-	}
+	uint32_t drive_num = ((ide_private_data *)(device->priv))->drive;
+	if (drive_num >= (uint32_t)num_ports)
+		return NULL;
+	return &ports[drive_num];
 }
 
-bool ahci_read_sectors_internal(ahci_port aport, uint32_t startl, uint32_t starth, uint32_t count, uint16_t *buf)
+uint32_t ahci_queue_depth(device_t *device)
 {
-	HBAPort *port = aport.port;
-	port->is = (uint32_t)-1; // Clear pending interrupt bits
-	uint32_t slot = find_cmdslot(aport);
+	ahci_port *aport = ahci_device_port(device);
+	return aport ? aport->depth : 0;
+}
 
-	if (slot == -1)
+bool ahci_submit(device_t *device, ahci_request *req)
+{
+	ahci_port *aport = ahci_device_port(device);
+	if (aport == NULL || req->count == 0 || req->count > AHCI_MAX_SECTORS_PER_COMMAND)
+		return false;
+	if (req->lba + req->count > aport->sectors)
 		return false;
 
-	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)aport.clb;
-	cmdheader += slot;
-	cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t); // Command FIS size
-	cmdheader->w = 0;										 // Read from device
+	if (aport->ncq)
+		req->command = req->write ? SATA_WRITE_FPDMA_QUEUED : SATA_READ_FPDMA_QUEUED;
+	else
+		req->command = req->write ? SATA_WRITE_DMA_EX : SATA_READ_DMA_EX;
+	return ahci_submit_port(aport, req);
+}
 
-	HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL *)(aport.ctba[slot]);
+void ahci_poll(device_t *device)
+{
+	ahci_port *aport = ahci_device_port(device);
+	if (aport == NULL)
+		return;
+	uint32_t flags = i686_SaveInterrupts();
+	ahci_check_port(aport);
+	i686_RestoreInterrupts(flags);
+}
 
-	cmdtbl->prdt_entry[0].dba = (uint32_t)buf;
-	cmdtbl->prdt_entry[0].dbc = (count * 512) - 1; // 8K bytes (this value should always be set to 1 less than the actual value)
-	cmdtbl->prdt_entry[0].dbau = 0;
-	cmdtbl->prdt_entry[0].i = 1;
+bool ahci_wait(device_t *device, ahci_request *req)
+{
+	ahci_port *aport = ahci_device_port(device);
+	if (aport == NULL)
+		return false;
+	return ahci_wait_request(aport, req);
+}
 
-	// Setup command
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtbl->cfis);
+// splits the transfer into chunks and keeps several of them queued, returns the sectors done in order
+static uint32_t ahci_transfer(void *buf, uint64_t start_sector, uint32_t count, device_t *device, bool write)
+{
+	ahci_request reqs[AHCI_SYNC_REQUESTS];
+	uint8_t *buffer = (uint8_t *)buf;
+	uint32_t submitted = 0, completed = 0;
+	int head = 0, tail = 0, used = 0;
+	bool failed = false;
 
-	cmdfis->fis_type = FIS_TYPE_REG_H2D;
-	cmdfis->c = 1; // Command
-	cmdfis->command = ATA_CMD_READ_DMA_EXT;
+	while ((submitted < count && !failed) || used > 0)
+	{
+		if (submitted < count && !failed && used < AHCI_SYNC_REQUESTS)
+		{
+			ahci_request *req = &reqs[tail];
+			memset(req, 0, sizeof(ahci_request));
+			req->write = write;
+			req->lba = start_sector + submitted;
+			req->count = count - submitted;
+			if (req->count > AHCI_SYNC_CHUNK_SECTORS)
+				req->count = AHCI_SYNC_CHUNK_SECTORS;
+			req->buffer = buffer + submitted * AHCI_SECTOR_SIZE;
+			if (!ahci_submit(device, req))
+			{
+				failed = true;
+				continue;
+			}
+			submitted += req->count;
+			tail = (tail + 1) % AHCI_SYNC_REQUESTS;
+			used++;
+			continue;
+		}
 
-	cmdfis->lba0 = (uint8_t)startl;
-	cmdfis->lba1 = (uint8_t)(startl >> 8);
-	cmdfis->lba2 = (uint8_t)(startl >> 16);
-	cmdfis->device = 1 << 6;
+		ahci_request *req = &reqs[head];
+		if (!ahci_wait(device, req))
+			failed = true;
+		else if (!failed)
+			completed += req->count;
+		head = (head + 1) % AHCI_SYNC_REQUESTS;
+		used--;
+	}
+	return completed;
+}
 
-	cmdfis->lba3 = (uint8_t)(startl >> 24);
-	cmdfis->lba4 = (uint8_t)(starth);
-	cmdfis->lba5 = (uint8_t)(starth >> 8);
+uint32_t ahci_read_sectors(void *buf, uint64_t start_sector, uint32_t count, device_t *device)
+{
+	return ahci_transfer(buf, start_sector, count, device, false);
+}
 
-	cmdfis->countl = (count & 0xFF);
-	cmdfis->counth = (count >> 8);
+uint32_t ahci_write_sectors(void *buf, uint64_t start_sector, uint32_t count, device_t *device)
+{
+	uint32_t written = ahci_transfer(buf, start_sector, count, device, true);
+	ahci_port *aport = ahci_device_port(device);
+	// FLUSH CACHE EXT is not queued, it waits for the writes still in flight
+	if (written && aport && !ahci_exec(aport, SATA_FLUSH_CACHE_EX, NULL, 0))
+		log_warn(MODULE, "cache flush on port %u failed", aport->index);
+	return written;
+}
 
-	for (uint32_t spin = 0; spin < 1000000; spin++)
+static bool ahci_flush(device_t *device)
+{
+	ahci_port *aport = ahci_device_port(device);
+	return aport && ahci_exec(aport, SATA_FLUSH_CACHE_EX, NULL, 0);
+}
+
+static void ahci_block_done(ahci_request *areq)
+{
+	block_request *req = (block_request *)areq->priv;
+	bool ok = !areq->error;
+	free(areq);
+	blockComplete(req, ok);
+}
+
+// block layer hook, the request completes from the port interrupt
+static bool ahci_block_submit(device_t *device, block_request *req)
+{
+	ahci_request *areq = (ahci_request *)calloc(1, sizeof(ahci_request));
+	if (areq == NULL)
+		return false;
+	areq->write = req->write;
+	areq->lba = req->lba;
+	areq->count = req->count;
+	areq->buffer = req->buffer;
+	areq->complete = ahci_block_done;
+	areq->priv = req;
+	if (!ahci_submit(device, areq))
 	{
-		if (!(port->tfd & (SATA_BUSY | SATA_DRQ)))
-		{
-			break;
-		}
+		free(areq);
+		return false;
 	}
-	if ((port->tfd & (SATA_BUSY | SATA_DRQ)))
+	return true;
+}
+
+device_t *AHCI_GetDevice(int index)
+{
+	if (index < 0 || index >= num_ports)
+		return NULL;
+	return ports[index].device;
+}
+
+static void InitPort(HBAData *abar, uint32_t index)
+{
+	ahci_port *aport = &ports[num_ports];
+	memset(aport, 0, sizeof(ahci_port));
+	aport->abar = abar;
+	aport->port = &abar->ports[index];
+	aport->index = index;
+	aport->depth = 1;
+	initialize_port(aport);
+	ahci_port_by_index[index] = aport;
+
+	uint16_t *words = (uint16_t *)malloc(sizeof(sata_identify_packet));
+	sata_identify_packet *info = (sata_identify_packet *)words;
+	if (!ahci_identify_device(aport, info))
 	{
-		return 2;
+		log_err(MODULE, "IDENTIFY failed on port %u", index);
+		ahci_port_by_index[index] = NULL;
+		free(info);
+		return;
 	}
 
-	port->ci = 1 << slot; // Issue command
+	if (words[83] & SATA_CMDSET_LBA48)
+		aport->sectors = info->total_sectors;
+	else
+		aport->sectors = info->user_addressable_sectors;
 
-	while (1)
+	// the tag has to stay below both the HBA's slot count and the drive's queue depth
+	if ((abar->cap & HBA_CAP_SNCQ) && (words[76] & SATA_CAP_NCQ))
 	{
-		if (!(port->ci & (1 << slot)))
-			break;
-		if (port->is & (1 << 30))
-			return 3;
+		aport->ncq = true;
+		aport->depth = HBA_CAP_NCS(abar->cap);
+		if (aport->depth > (uint32_t)(info->max_queue_depth & 0x1F) + 1)
+			aport->depth = (info->max_queue_depth & 0x1F) + 1;
 	}
 
-	if (port->is & (1 << 30))
-		return 3;
+	for (int i = 0; i < 40; i += 2)
+	{
+		aport->name[i] = info->model_number[i + 1];
+		aport->name[i + 1] = info->model_number[i];
+	}
+	for (int i = 39; i >= 0 && aport->name[i] == ' '; i--)
+		aport->name[i] = 0;
+	free(info);
 
-	return true;
+	device_t *dev = (device_t *)malloc(sizeof(device_t));
+	ide_private_data *priv = (ide_private_data *)malloc(sizeof(ide_private_data));
+	memset(dev, 0, sizeof(device_t));
+	priv->drive = num_ports;
+	dev->name = aport->name;
+	dev->id = 32 + num_ports;
+	dev->dev_type = DEVICE_BLOCK;
+	dev->priv = priv;
+	dev->read = bcacheRead;
+	dev->write = bcacheWrite;
+	dev->prefetch = bcachePrefetch;
+	aport->device = dev;
+
+	block_queue *queue = blockCreateQueue(dev, ahci_block_submit, aport->depth, AHCI_MAX_SECTORS_PER_COMMAND);
+	queue->poll = ahci_poll;
+	queue->flush = ahci_flush;
+
+	printf("Detected SATA drive: %s (%u MiB)\n", aport->name, (uint32_t)(aport->sectors / 2048));
+	log_info(MODULE, "Port %u: %s, %u MiB, %s, queue depth %u", index, aport->name, (uint32_t)(aport->sectors / 2048),
+			 aport->ncq ? "NCQ" : "no NCQ", aport->depth);
+	num_ports++;
 }
 
-uint32_t ahci_read_sectors(void *buf, uint64_t start_sector, uint32_t count, device_t* device)
+void InitAbar(HBAData *abar)
 {
-	uint32_t drive_num = ((ide_private_data*)(device->priv))->drive;
-	if (ports[drive_num].abar != 0)
+	uint32_t pi = abar->pi;
+	for (uint8_t i = 0; i < 32; i++)
 	{
-		uint16_t* u16Buffer = (uint16_t*)buf;
-		if (ahci_read_sectors_internal(ports[drive_num], start_sector & 0xFFFFFFFF, (start_sector >> 32) & 0xFFFFFFFF, count, u16Buffer))
+		if ((pi & 1) && is_sata(&abar->ports[i]) && abar->ports[i].sig == SATA_SIG_ATA)
 		{
-			return count;
+			InitPort(abar, i);
 		}
+		pi >>= 1;
 	}
-	else
-	{
-		return 4;
-	}
-	return 5;
 }
+
 uint16_t AHCI_DeviceIndex;
-void AHCI_init(uint32_t bar5)
+void AHCI_init(uint32_t bar5, uint8_t irq)
 {
-	ports = (ahci_port *)malloc(sizeof(ahci_port) * 4);
-	device_t *dev = (device_t *)malloc(sizeof(device_t));
-	ide_private_data *priv = (ide_private_data *)malloc(sizeof(ide_private_data));
+	HBAData *abar = (HBAData *)pagingMapMMIO(bar5 & 0xFFFFFFF0, sizeof(HBAData) + 31 * sizeof(HBAPort));
+	if (abar == NULL)
+	{
+		log_crit(MODULE, "Cannot map ABAR %x", bar5);
+		return;
+	}
+	ahci_abar = abar;
+	abar->ghc |= HBA_GHC_AE;
 
-	dev->priv = priv;
-	
-	InitAbar((HBAData *)bar5, dev);
+	ports = (ahci_port *)malloc(sizeof(ahci_port) * __builtin_popcount(abar->pi));
+	num_ports = 0;
 
-	dev->id = 32;
-	ATA_DeviceIndex = 33;
-	
-	dev->dev_type = DEVICE_BLOCK;	
-	dev->read = ahci_read_sectors;
+	// the interrupt line from PCI config space, 0xFF when there is none
+	if (irq < 16)
+	{
+		ahci_irq_line = irq;
+		i686_IRQ_RegisterHandler(irq, ahci_irq);
+		abar->is = (uint32_t)-1;
+		abar->ghc |= HBA_GHC_IE;
+	}
+	InitAbar(abar);
 
-	addDevice(dev);
-	log_crit(MODULE, "exiting init");
+	for (int i = 0; i < num_ports; i++)
+	{
+		int index = addDevice(ports[i].device);
+		if (i == 0)
+			AHCI_DeviceIndex = index;
+	}
+	ATA_DeviceIndex = 32 + (num_ports ? num_ports : 1);
+	log_info(MODULE, "%d SATA drive(s), %u command slots", num_ports, HBA_CAP_NCS(abar->cap));
 }
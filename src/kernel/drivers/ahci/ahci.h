@@ -10,6 +10,9 @@
 #define SATA_READ_DMA_EX 	0x25
 #define SATA_WRITE_DMA_EX 	0x35
 #define SATA_IDENTIFY_DEVICE 0xEC
+#define SATA_FLUSH_CACHE_EX 0xEA
+#define SATA_READ_FPDMA_QUEUED 0x60
+#define SATA_WRITE_FPDMA_QUEUED 0x61
 #define HBA_CMD_CR 			(1 << 15)
 #define HBA_CMD_FR 			(1 << 14)
 #define HBA_CMD_FRE 		(1 << 4)
@@ -341,7 +344,36 @@ typedef struct
 	uint16_t checksum;
 } __attribute__((packed)) sata_identify_packet;
 
+// 512 KiB, at most 129 PRDT entries even when no two pages are contiguous
+#define AHCI_MAX_SECTORS_PER_COMMAND 1024
+
+// one command, ahci_submit issues it and returns, ahci_wait sleeps until it is done
+typedef struct ahci_request
+{
+	bool write;
+	uint64_t lba;
+	uint32_t count; // sectors
+	void *buffer;	// mapped and 2 byte aligned, handed to the HBA by physical address
+
+	// optional, called once done is set, from the IRQ handler or a waiter with interrupts off
+	void (*complete)(struct ahci_request *req);
+	void *priv;
+
+	uint8_t command; // filled in by ahci_submit
+	uint32_t deadline;
+	volatile bool done;
+	volatile bool error;
+} ahci_request;
+
 extern uint16_t AHCI_DeviceIndex;
 
 uint32_t ahci_read_sectors(void *buf, uint64_t start_sector, uint32_t count, device_t* device);
-void AHCI_init(uint32_t bar5);
+uint32_t ahci_write_sectors(void *buf, uint64_t start_sector, uint32_t count, device_t* device);
+
+bool ahci_submit(device_t *device, ahci_request *req);
+bool ahci_wait(device_t *device, ahci_request *req);
+uint32_t ahci_queue_depth(device_t *device);
+void ahci_poll(device_t *device);
+device_t *AHCI_GetDevice(int index);
+
+void AHCI_init(uint32_t bar5, uint8_t irq);
@@ -0,0 +1,601 @@
+#include "bcache.h"
+#include "block.h"
+#include "debug.h"
+#include "stdio.h"
+#include "memory.h"
+#include "arch/i686/pit.h"
+#include "task/sched.h"
+#include "task/wait.h"
+
+#define MODULE "BCACHE"
+
+/*
+ * Buffer cache
+ *
+ * Every sector read or written through a block device_t lands in a buffer
+ * keyed by (device, LBA). Buffers are found through a hash table and reused
+ * in LRU order, clean ones first. Writes only dirty the buffer; the flusher
+ * thread writes back buffers that stayed dirty for a while, bcacheSync writes
+ * back all of them.
+ *
+ * A buffer is busy while one task reads it in, fills it or writes it back,
+ * everybody else sleeps on g_BcacheWait. A task that holds busy buffers never
+ * sleeps on somebody else's, so two readers cannot deadlock.
+ *
+ * Readahead buffers are busy without an owner while their bio is in flight.
+ * Whoever needs one waits for the bio itself and then reaps the buffer.
+ */
+
+typedef struct bcache_buffer
+{
+	device_t *device; // NULL while unused
+	uint64_t lba;
+	uint8_t *data;
+	bool valid;
+	bool dirty;
+	bool busy;
+	bool readahead;	 // busy with a readahead bio in flight
+	bool prefetched; // read ahead and not asked for yet
+	uint32_t dirtyTick;
+	block_bio bio;
+
+	struct bcache_buffer *hashNext;
+	struct bcache_buffer *lruPrev;
+	struct bcache_buffer *lruNext;
+} bcache_buffer;
+
+bcache_stats g_BcacheStats;
+
+static bcache_buffer *g_Buffers = NULL;
+static bcache_buffer *g_Hash[BCACHE_HASH_SIZE];
+static bcache_buffer *g_LruHead = NULL; // most recently used
+static bcache_buffer *g_LruTail = NULL;
+static wait_queue_t g_BcacheWait = WAIT_QUEUE_INIT;
+static uint32_t g_ReadaheadInflight = 0;
+
+static inline uint32_t bcacheHash(device_t *device, uint64_t lba)
+{
+	return ((uint32_t)lba + device->id * 0x9E3779B1) & (BCACHE_HASH_SIZE - 1);
+}
+
+static inline bool tickReached(uint32_t now, uint32_t deadline)
+{
+	return (int32_t)(now - deadline) >= 0;
+}
+
+// the list and hash helpers all run with interrupts off
+static void lruRemove(bcache_buffer *b)
+{
+	if (b->lruPrev)
+		b->lruPrev->lruNext = b->lruNext;
+	else
+		g_LruHead = b->lruNext;
+	if (b->lruNext)
+		b->lruNext->lruPrev = b->lruPrev;
+	else
+		g_LruTail = b->lruPrev;
+	b->lruPrev = b->lruNext = NULL;
+}
+
+static void lruPushHead(bcache_buffer *b)
+{
+	b->lruPrev = NULL;
+	b->lruNext = g_LruHead;
+	if (g_LruHead)
+		g_LruHead->lruPrev = b;
+	else
+		g_LruTail = b;
+	g_LruHead = b;
+}
+
+static void lruPushTail(bcache_buffer *b)
+{
+	b->lruNext = NULL;
+	b->lruPrev = g_LruTail;
+	if (g_LruTail)
+		g_LruTail->lruNext = b;
+	else
+		g_LruHead = b;
+	g_LruTail = b;
+}
+
+static bcache_buffer *hashLookup(device_t *device, uint64_t lba)
+{
+	for (bcache_buffer *b = g_Hash[bcacheHash(device, lba)]; b; b = b->hashNext)
+	{
+		if (b->device == device && b->lba == lba)
+			return b;
+	}
+	return NULL;
+}
+
+static void hashInsert(bcache_buffer *b)
+{
+	uint32_t index = bcacheHash(b->device, b->lba);
+	b->hashNext = g_Hash[index];
+	g_Hash[index] = b;
+}
+
+static void hashRemove(bcache_buffer *b)
+{
+	bcache_buffer **link = &g_Hash[bcacheHash(b->device, b->lba)];
+	while (*link && *link != b)
+		link = &(*link)->hashNext;
+	if (*link)
+		*link = b->hashNext;
+	b->hashNext = NULL;
+}
+
+// takes b out of the cache, it goes to the LRU tail to be reused first
+static void bcacheDrop(bcache_buffer *b)
+{
+	if (b->device)
+		hashRemove(b);
+	if (b->dirty)
+		g_BcacheStats.dirty--;
+	b->device = NULL;
+	b->valid = false;
+	b->dirty = false;
+	b->prefetched = false;
+	lruRemove(b);
+	lruPushTail(b);
+}
+
+static void bcacheRelease(bcache_buffer *b)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	b->busy = false;
+	if (!b->valid)
+		bcacheDrop(b);
+	waitWakeAll(&g_BcacheWait);
+	i686_RestoreInterrupts(flags);
+}
+
+// interrupts off, hands a buffer whose readahead bio finished back to the cache
+static void bcacheReap(bcache_buffer *b)
+{
+	if (!b->readahead || !b->bio.done)
+		return;
+	b->readahead = false;
+	b->valid = !b->bio.error;
+	g_ReadaheadInflight--;
+	bcacheRelease(b);
+}
+
+// interrupts off, returns with the readahead on b finished and reaped
+static void bcacheWaitReadahead(bcache_buffer *b, uint32_t *flags)
+{
+	if (!b->bio.done)
+	{
+		i686_RestoreInterrupts(*flags);
+		blockWait(b->device, &b->bio);
+		*flags = i686_SaveInterrupts();
+	}
+	bcacheReap(b);
+}
+
+// writes back n busy buffers of one device, they stay busy
+static bool bcacheWriteBack(device_t *device, bcache_buffer **list, uint32_t n)
+{
+	blockPlug(device);
+	for (uint32_t i = 0; i < n; i++)
+	{
+		block_bio *bio = &list[i]->bio;
+		bio->write = true;
+		bio->lba = list[i]->lba;
+		bio->count = 1;
+		bio->buffer = list[i]->data;
+		blockSubmit(device, bio);
+	}
+	blockUnplug(device);
+
+	bool ok = true;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		if (!blockWait(device, &list[i]->bio))
+		{
+			log_err(MODULE, "writeback of sector %u on %s failed", (uint32_t)list[i]->lba, device->name);
+			ok = false;
+			continue;
+		}
+		uint32_t flags = i686_SaveInterrupts();
+		list[i]->dirty = false;
+		g_BcacheStats.dirty--;
+		g_BcacheStats.writebacks++;
+		i686_RestoreInterrupts(flags);
+	}
+	return ok;
+}
+
+// interrupts off, a clean buffer if there is one, NULL when all are busy
+static bcache_buffer *bcacheVictim()
+{
+	bcache_buffer *dirty = NULL;
+	for (bcache_buffer *b = g_LruTail; b; b = b->lruPrev)
+	{
+		bcacheReap(b);
+		if (b->busy)
+			continue;
+		if (!b->dirty)
+			return b;
+		if (dirty == NULL)
+			dirty = b;
+	}
+	return dirty;
+}
+
+// returns the buffer for (device, lba) marked busy, valid tells if it holds the data already;
+// NULL only with noWait, when that would have to sleep on a busy buffer
+static bcache_buffer *bcacheGet(device_t *device, uint64_t lba, bool noWait)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	while (true)
+	{
+		bcache_buffer *b = hashLookup(device, lba);
+		if (b && b->readahead)
+		{
+			// nobody owns it, waiting for the bio cannot deadlock
+			bcacheWaitReadahead(b, &flags);
+			continue;
+		}
+		if (b == NULL)
+			b = bcacheVictim();
+
+		if (b == NULL || b->busy)
+		{
+			if (noWait)
+			{
+				i686_RestoreInterrupts(flags);
+				return NULL;
+			}
+			waitSleep(&g_BcacheWait);
+			continue;
+		}
+
+		if (b->device == device && b->lba == lba)
+		{
+			g_BcacheStats.hits++;
+			if (b->prefetched)
+			{
+				g_BcacheStats.readaheadHits++;
+				b->prefetched = false;
+			}
+			b->busy = true;
+			lruRemove(b);
+			lruPushHead(b);
+			i686_RestoreInterrupts(flags);
+			return b;
+		}
+
+		if (b->dirty)
+		{
+			// only dirty buffers are left, write the oldest one back and look again
+			b->busy = true;
+			i686_RestoreInterrupts(flags);
+			bool written = bcacheWriteBack(b->device, &b, 1);
+			flags = i686_SaveInterrupts();
+			if (!written)
+				bcacheDrop(b);
+			b->busy = false;
+			waitWakeAll(&g_BcacheWait);
+			continue;
+		}
+
+		if (b->device)
+		{
+			hashRemove(b);
+			g_BcacheStats.evictions++;
+		}
+		g_BcacheStats.misses++;
+		b->device = device;
+		b->lba = lba;
+		b->valid = false;
+		b->prefetched = false;
+		b->busy = true;
+		hashInsert(b);
+		lruRemove(b);
+		lruPushHead(b);
+		i686_RestoreInterrupts(flags);
+		return b;
+	}
+}
+
+// drops cached sectors in the range, a direct write is about to replace them
+static void bcacheInvalidate(device_t *device, uint64_t lba, uint32_t count)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	for (uint32_t i = 0; i < BCACHE_BUFFERS; i++)
+	{
+		bcache_buffer *b = &g_Buffers[i];
+		if (b->device != device || b->lba < lba || b->lba >= lba + count)
+			continue;
+		while (b->busy)
+		{
+			if (b->readahead)
+				bcacheWaitReadahead(b, &flags);
+			else
+				waitSleep(&g_BcacheWait);
+		}
+		if (b->device == device && b->lba >= lba && b->lba < lba + count)
+			bcacheDrop(b);
+	}
+	i686_RestoreInterrupts(flags);
+}
+
+static uint32_t bcacheReadDirect(void *buffer, uint64_t lba, uint32_t count, device_t *device)
+{
+	uint32_t done = blockRead(buffer, lba, count, device);
+
+	// the disk does not have what was written to the cache yet
+	uint32_t flags = i686_SaveInterrupts();
+	g_BcacheStats.bypassed += count;
+	for (uint32_t i = 0; i < BCACHE_BUFFERS; i++)
+	{
+		bcache_buffer *b = &g_Buffers[i];
+		if (b->device == device && b->dirty && b->lba >= lba && b->lba < lba + done)
+			memcpy((uint8_t *)buffer + (b->lba - lba) * BLOCK_SECTOR_SIZE, b->data, BLOCK_SECTOR_SIZE);
+	}
+	i686_RestoreInterrupts(flags);
+	return done;
+}
+
+uint32_t bcacheRead(void *buffer, uint64_t lba, uint32_t count, device_t *device)
+{
+	if (count >= BCACHE_BYPASS_SECTORS)
+		return bcacheReadDirect(buffer, lba, count, device);
+
+	bcache_buffer *batch[BCACHE_BYPASS_SECTORS];
+	uint8_t *dst = (uint8_t *)buffer;
+	uint32_t done = 0;
+	while (done < count)
+	{
+		// grab as many buffers as possible without sleeping on another task's, then read the misses together
+		uint32_t n = 0;
+		while (done + n < count)
+		{
+			bcache_buffer *b = bcacheGet(device, lba + done + n, n > 0);
+			if (b == NULL)
+				break;
+			batch[n++] = b;
+		}
+
+		blockPlug(device);
+		for (uint32_t i = 0; i < n; i++)
+		{
+			if (batch[i]->valid)
+				continue;
+			block_bio *bio = &batch[i]->bio;
+			bio->write = false;
+			bio->lba = batch[i]->lba;
+			bio->count = 1;
+			bio->buffer = batch[i]->data;
+			blockSubmit(device, bio);
+		}
+		blockUnplug(device);
+
+		// copy up to the first sector that could not be read
+		bool ok = true;
+		uint32_t good = 0;
+		for (uint32_t i = 0; i < n; i++)
+		{
+			bcache_buffer *b = batch[i];
+			if (!b->valid)
+			{
+				b->valid = blockWait(device, &b->bio);
+				if (!b->valid)
+					log_err(MODULE, "read of sector %u on %s failed", (uint32_t)b->lba, device->name);
+			}
+			if (ok && b->valid)
+			{
+				memcpy(dst + (done + i) * BLOCK_SECTOR_SIZE, b->data, BLOCK_SECTOR_SIZE);
+				good++;
+			}
+			else
+				ok = false;
+		}
+		for (uint32_t i = 0; i < n; i++)
+			bcacheRelease(batch[i]);
+
+		done += good;
+		if (!ok)
+			break;
+	}
+	return done;
+}
+
+uint32_t bcacheWrite(void *buffer, uint64_t lba, uint32_t count, device_t *device)
+{
+	if (count >= BCACHE_BYPASS_SECTORS)
+	{
+		bcacheInvalidate(device, lba, count);
+		g_BcacheStats.bypassed += count;
+		return blockWrite(buffer, lba, count, device);
+	}
+
+	uint8_t *src = (uint8_t *)buffer;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		// the whole sector is overwritten, there is nothing to read in first
+		bcache_buffer *b = bcacheGet(device, lba + i, false);
+		memcpy(b->data, src + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+
+		uint32_t flags = i686_SaveInterrupts();
+		b->valid = true;
+		if (!b->dirty)
+		{
+			b->dirty = true;
+			b->dirtyTick = timer_ticks;
+			g_BcacheStats.dirty++;
+		}
+		i686_RestoreInterrupts(flags);
+		bcacheRelease(b);
+	}
+	return count;
+}
+
+uint32_t bcachePrefetch(uint64_t lba, uint32_t count, device_t *device)
+{
+	if (device->queue == NULL)
+		return 0;
+
+	uint32_t i = 0;
+	blockPlug(device);
+	for (; i < count; i++)
+	{
+		uint32_t flags = i686_SaveInterrupts();
+		if (hashLookup(device, lba + i))
+		{
+			// cached or on its way already
+			i686_RestoreInterrupts(flags);
+			continue;
+		}
+		// readahead only takes clean buffers and never crowds out the rest of the cache
+		bcache_buffer *b = g_ReadaheadInflight < BCACHE_READAHEAD_INFLIGHT ? bcacheVictim() : NULL;
+		if (b == NULL || b->dirty)
+		{
+			i686_RestoreInterrupts(flags);
+			break;
+		}
+		if (b->device)
+		{
+			hashRemove(b);
+			g_BcacheStats.evictions++;
+		}
+		b->device = device;
+		b->lba = lba + i;
+		b->valid = false;
+		b->busy = true;
+		b->readahead = true;
+		b->prefetched = true;
+		hashInsert(b);
+		lruRemove(b);
+		lruPushHead(b);
+		g_ReadaheadInflight++;
+		g_BcacheStats.readahead++;
+		i686_RestoreInterrupts(flags);
+
+		b->bio.write = false;
+		b->bio.lba = b->lba;
+		b->bio.count = 1;
+		b->bio.buffer = b->data;
+		blockSubmit(device, &b->bio);
+	}
+	// the reader does not wait for readahead, not even on a driver that transfers in submit
+	blockUnplugAsync(device);
+	return i;
+}
+
+// writes back the dirty buffers of one device, only the ones older than the expire time when expiredOnly
+static void bcacheSyncDevice(device_t *device, bool expiredOnly)
+{
+	bcache_buffer *batch[BCACHE_BYPASS_SECTORS];
+	bool wrote = false;
+	uint32_t start = 0;
+
+	while (start < BCACHE_BUFFERS)
+	{
+		uint32_t n = 0;
+		uint32_t flags = i686_SaveInterrupts();
+		for (; start < BCACHE_BUFFERS && n < BCACHE_BYPASS_SECTORS; start++)
+		{
+			bcache_buffer *b = &g_Buffers[start];
+			if (b->device != device || !b->dirty || b->busy)
+				continue;
+			if (expiredOnly && !tickReached(timer_ticks, b->dirtyTick + BCACHE_DIRTY_EXPIRE_TICKS))
+				continue;
+			b->busy = true;
+			batch[n++] = b;
+		}
+		i686_RestoreInterrupts(flags);
+		if (n == 0)
+			break;
+
+		bcacheWriteBack(device, batch, n);
+		for (uint32_t i = 0; i < n; i++)
+			bcacheRelease(batch[i]);
+		wrote = true;
+	}
+
+	if (wrote)
+		blockFlush(device);
+}
+
+// every device that has a dirty buffer, synced one after the other
+static void bcacheSyncAll(bool expiredOnly)
+{
+	device_t *done[16];
+	uint32_t doneCount = 0;
+	while (doneCount < 16)
+	{
+		device_t *device = NULL;
+		uint32_t flags = i686_SaveInterrupts();
+		for (uint32_t i = 0; i < BCACHE_BUFFERS && device == NULL; i++)
+		{
+			bcache_buffer *b = &g_Buffers[i];
+			if (!b->dirty)
+				continue;
+			device = b->device;
+			for (uint32_t j = 0; j < doneCount; j++)
+			{
+				if (done[j] == device)
+					device = NULL;
+			}
+		}
+		i686_RestoreInterrupts(flags);
+		if (device == NULL)
+			break;
+
+		bcacheSyncDevice(device, expiredOnly);
+		done[doneCount++] = device;
+	}
+}
+
+void bcacheSync(device_t *device)
+{
+	if (device)
+		bcacheSyncDevice(device, false);
+	else
+		bcacheSyncAll(false);
+}
+
+static void bcacheFlusher(void *arg)
+{
+	while (true)
+	{
+		sleep_ms(BCACHE_FLUSH_INTERVAL_MS);
+		if (g_BcacheStats.dirty)
+			bcacheSyncAll(true);
+	}
+}
+
+void bcacheInit()
+{
+	g_Buffers = (bcache_buffer *)calloc(BCACHE_BUFFERS, sizeof(bcache_buffer));
+	uint8_t *data = (uint8_t *)malloc(BCACHE_BUFFERS * BLOCK_SECTOR_SIZE);
+	if (g_Buffers == NULL || data == NULL)
+	{
+		log_crit(MODULE, "cannot allocate %u buffers", BCACHE_BUFFERS);
+		return;
+	}
+
+	memset(g_Hash, 0, sizeof(g_Hash));
+	memset(&g_BcacheStats, 0, sizeof(g_BcacheStats));
+	for (uint32_t i = 0; i < BCACHE_BUFFERS; i++)
+	{
+		g_Buffers[i].data = data + i * BLOCK_SECTOR_SIZE;
+		lruPushTail(&g_Buffers[i]);
+	}
+
+	schedCreateKernelThread("bflush", bcacheFlusher, NULL);
+	log_info(MODULE, "%u buffers, %u KiB", BCACHE_BUFFERS, BCACHE_BUFFERS * BLOCK_SECTOR_SIZE / 1024);
+}
+
+void bcachePrintStats()
+{
+	uint32_t lookups = g_BcacheStats.hits + g_BcacheStats.misses;
+	uint32_t rate = lookups ? g_BcacheStats.hits * 100 / lookups : 0;
+	printf("buffer cache: %u buffers, %u dirty\n", BCACHE_BUFFERS, g_BcacheStats.dirty);
+	printf("hits %u, misses %u (%u%% hit), evictions %u, writebacks %u, bypassed %u sectors\n", g_BcacheStats.hits,
+		   g_BcacheStats.misses, rate, g_BcacheStats.evictions, g_BcacheStats.writebacks, g_BcacheStats.bypassed);
+	printf("readahead %u sectors, %u used\n", g_BcacheStats.readahead, g_BcacheStats.readaheadHits);
+}
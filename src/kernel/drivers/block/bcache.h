@@ -0,0 +1,47 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "drivers/device.h"
+
+// one cached sector per buffer, 512 KiB in total
+#define BCACHE_BUFFERS 1024
+#define BCACHE_HASH_SIZE 256
+
+// transfers this large skip the cache, it would only push everything else out
+#define BCACHE_BYPASS_SECTORS 128
+
+// dirty buffers older than this are written back by the flusher thread
+#define BCACHE_DIRTY_EXPIRE_TICKS 2500 // 5 s
+#define BCACHE_FLUSH_INTERVAL_MS 1000
+
+// at most this many buffers wait for readahead at once
+#define BCACHE_READAHEAD_INFLIGHT (BCACHE_BUFFERS / 4)
+
+typedef struct
+{
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t writebacks;
+	uint32_t evictions;
+	uint32_t bypassed; // sectors
+	uint32_t dirty;	   // buffers waiting to be written back
+	uint32_t readahead;	   // sectors
+	uint32_t readaheadHits; // readahead sectors that were asked for later
+} bcache_stats;
+
+extern bcache_stats g_BcacheStats;
+
+void bcacheInit();
+
+// device_t read/write for block devices, the block layer sits below
+uint32_t bcacheRead(void *buffer, uint64_t lba, uint32_t count, device_t *device);
+uint32_t bcacheWrite(void *buffer, uint64_t lba, uint32_t count, device_t *device);
+
+// starts reading the sectors into the cache and returns, stops early when the cache has no clean buffer to spare;
+// returns how many of the first sectors are now cached or on their way, count unless it stopped early
+uint32_t bcachePrefetch(uint64_t lba, uint32_t count, device_t *device);
+
+// writes back every dirty buffer of device, or of all devices when it is NULL
+void bcacheSync(device_t *device);
+
+void bcachePrintStats();
@@ -0,0 +1,411 @@
+#include "block.h"
+#include "debug.h"
+#include "stdio.h"
+#include "memory.h"
+#include "arch/i686/pit.h"
+#include "task/sched.h"
+
+#define MODULE "BLOCK"
+
+/*
+ * Block request queues
+ *
+ * Filesystems hand the queue bios (lba, count, buffer) instead of calling the
+ * driver. A bio that continues or precedes a pending request in the same
+ * direction is merged into it, so a cluster chain laid out on disk in order
+ * turns into a few large requests. Pending requests are kept sorted by LBA
+ * and dispatched in one sweep direction (C-LOOK), unless one of them is past
+ * its deadline; reads expire much sooner than writes.
+ *
+ * Dispatching only happens in task context: on submit, on unplug and while
+ * waiting. Drivers may complete requests from their IRQ handler. A driver
+ * whose submit does the transfer itself (synchronous) makes the dispatching
+ * task wait for it, so requests nobody waits on yet, like readahead, are
+ * dispatched by the kblockd thread instead.
+ */
+
+static block_queue *g_Queues = NULL;
+
+static task_t *g_Worker = NULL;
+static bool g_WorkerStarting = false;
+static volatile bool g_WorkerKicked = false;
+static wait_queue_t g_WorkerWait = WAIT_QUEUE_INIT;
+
+static inline bool tickReached(uint32_t now, uint32_t deadline)
+{
+	return (int32_t)(now - deadline) >= 0;
+}
+
+block_queue *blockCreateQueue(device_t *device, block_submit_t submit, uint32_t depth, uint32_t maxSectors)
+{
+	block_queue *queue = (block_queue *)calloc(1, sizeof(block_queue));
+	if (queue == NULL)
+		return NULL;
+	queue->device = device;
+	queue->submit = submit;
+	queue->depth = depth ? depth : 1;
+	queue->maxSectors = maxSectors ? maxSectors : BLOCK_MAX_SECTORS;
+	waitQueueInit(&queue->wait);
+
+	device->queue = queue;
+	queue->nextQueue = g_Queues;
+	g_Queues = queue;
+	return queue;
+}
+
+// interrupts off
+static bool blockMerge(block_queue *queue, block_bio *bio)
+{
+	for (block_request *req = queue->pending; req; req = req->next)
+	{
+		if (req->write != bio->write || req->count + bio->count > queue->maxSectors)
+			continue;
+
+		if (req->lba + req->count == bio->lba)
+		{
+			req->last->next = bio;
+			req->last = bio;
+			req->count += bio->count;
+			queue->merges++;
+			return true;
+		}
+		if (bio->lba + bio->count == req->lba)
+		{
+			bio->next = req->first;
+			req->first = bio;
+			req->lba = bio->lba;
+			req->count += bio->count;
+			queue->merges++;
+			return true;
+		}
+	}
+	return false;
+}
+
+// interrupts off
+static bool blockQueueBio(block_queue *queue, block_bio *bio)
+{
+	if (blockMerge(queue, bio))
+		return true;
+
+	block_request *req = (block_request *)calloc(1, sizeof(block_request));
+	if (req == NULL)
+		return false;
+	req->write = bio->write;
+	req->lba = bio->lba;
+	req->count = bio->count;
+	req->first = bio;
+	req->last = bio;
+	req->queue = queue;
+	req->deadline = timer_ticks + (bio->write ? BLOCK_WRITE_EXPIRE_TICKS : BLOCK_READ_EXPIRE_TICKS);
+
+	block_request **link = &queue->pending;
+	while (*link && (*link)->lba < req->lba)
+		link = &(*link)->next;
+	req->next = *link;
+	*link = req;
+	return true;
+}
+
+// interrupts off, takes the next request off the queue
+static block_request *blockPick(block_queue *queue)
+{
+	block_request **pick = NULL;
+
+	// the request that expired first wins
+	for (block_request **link = &queue->pending; *link; link = &(*link)->next)
+	{
+		if (!tickReached(timer_ticks, (*link)->deadline))
+			continue;
+		if (pick == NULL || (int32_t)((*link)->deadline - (*pick)->deadline) < 0)
+			pick = link;
+	}
+	if (pick)
+		queue->expired++;
+
+	// otherwise keep going up from where the last request ended, then start over at the bottom
+	if (pick == NULL)
+	{
+		for (block_request **link = &queue->pending; *link; link = &(*link)->next)
+		{
+			if ((*link)->lba >= queue->position)
+			{
+				pick = link;
+				break;
+			}
+		}
+	}
+	if (pick == NULL)
+		pick = &queue->pending;
+
+	block_request *req = *pick;
+	*pick = req->next;
+	req->next = NULL;
+	return req;
+}
+
+// points req->buffer at the bios, or at a bounce buffer when they are not one piece of memory
+static bool blockPrepare(block_queue *queue, block_request *req)
+{
+	uint8_t *expect = (uint8_t *)req->first->buffer;
+	bool contiguous = true;
+	for (block_bio *bio = req->first; bio; bio = bio->next)
+	{
+		if ((uint8_t *)bio->buffer != expect)
+		{
+			contiguous = false;
+			break;
+		}
+		expect += bio->count * BLOCK_SECTOR_SIZE;
+	}
+	if (contiguous)
+	{
+		req->buffer = req->first->buffer;
+		req->bounce = false;
+		return true;
+	}
+
+	req->buffer = malloc(req->count * BLOCK_SECTOR_SIZE);
+	if (req->buffer == NULL)
+		return false;
+	req->bounce = true;
+	queue->bounced++;
+	if (req->write)
+	{
+		uint8_t *dst = (uint8_t *)req->buffer;
+		for (block_bio *bio = req->first; bio; bio = bio->next)
+		{
+			memcpy(dst, bio->buffer, bio->count * BLOCK_SECTOR_SIZE);
+			dst += bio->count * BLOCK_SECTOR_SIZE;
+		}
+	}
+	return true;
+}
+
+static void blockDispatch(block_queue *queue, bool force)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	while (queue->pending && queue->inflight < queue->depth && (force || queue->plugged == 0))
+	{
+		block_request *req = blockPick(queue);
+		queue->inflight++;
+		queue->dispatched++;
+		queue->position = req->lba + req->count;
+		i686_RestoreInterrupts(flags);
+
+		if (!blockPrepare(queue, req) || !queue->submit(queue->device, req))
+		{
+			log_err(MODULE, "%s of %u sectors at %u failed to start", req->write ? "write" : "read", req->count, (uint32_t)req->lba);
+			blockComplete(req, false);
+		}
+
+		flags = i686_SaveInterrupts();
+	}
+	i686_RestoreInterrupts(flags);
+}
+
+void blockComplete(block_request *req, bool ok)
+{
+	block_queue *queue = req->queue;
+	if (req->bounce)
+	{
+		uint8_t *src = (uint8_t *)req->buffer;
+		for (block_bio *bio = req->first; ok && !req->write && bio; bio = bio->next)
+		{
+			memcpy(bio->buffer, src, bio->count * BLOCK_SECTOR_SIZE);
+			src += bio->count * BLOCK_SECTOR_SIZE;
+		}
+		free(req->buffer);
+	}
+
+	uint32_t flags = i686_SaveInterrupts();
+	block_bio *bio = req->first;
+	while (bio)
+	{
+		// the owner may reuse the bio as soon as it is done
+		block_bio *next = bio->next;
+		bio->error = !ok;
+		bio->done = true;
+		bio = next;
+	}
+	queue->inflight--;
+	waitWakeAll(&queue->wait);
+	i686_RestoreInterrupts(flags);
+	free(req);
+}
+
+void blockPlug(device_t *device)
+{
+	block_queue *queue = device->queue;
+	uint32_t flags = i686_SaveInterrupts();
+	queue->plugged++;
+	i686_RestoreInterrupts(flags);
+}
+
+void blockUnplug(device_t *device)
+{
+	block_queue *queue = device->queue;
+	uint32_t flags = i686_SaveInterrupts();
+	queue->plugged--;
+	i686_RestoreInterrupts(flags);
+	blockDispatch(queue, false);
+}
+
+static void blockWorker(void *arg)
+{
+	while (true)
+	{
+		waitEvent(&g_WorkerWait, g_WorkerKicked);
+		g_WorkerKicked = false;
+		for (block_queue *queue = g_Queues; queue; queue = queue->nextQueue)
+		{
+			if (queue->synchronous)
+				blockDispatch(queue, false);
+		}
+	}
+}
+
+void blockUnplugAsync(device_t *device)
+{
+	block_queue *queue = device->queue;
+	uint32_t flags = i686_SaveInterrupts();
+	queue->plugged--;
+	bool start = queue->synchronous && g_Worker == NULL && !g_WorkerStarting;
+	if (start)
+		g_WorkerStarting = true;
+	i686_RestoreInterrupts(flags);
+
+	if (!queue->synchronous)
+	{
+		blockDispatch(queue, false);
+		return;
+	}
+	if (start)
+		g_Worker = schedCreateKernelThread("kblockd", blockWorker, NULL);
+	if (g_Worker == NULL)
+	{
+		// the requests still go out, only in this task
+		blockDispatch(queue, false);
+		return;
+	}
+	flags = i686_SaveInterrupts();
+	g_WorkerKicked = true;
+	waitWakeAll(&g_WorkerWait);
+	i686_RestoreInterrupts(flags);
+}
+
+void blockSubmit(device_t *device, block_bio *bio)
+{
+	block_queue *queue = device->queue;
+	bio->done = false;
+	bio->error = false;
+	bio->next = NULL;
+
+	uint32_t flags = i686_SaveInterrupts();
+	queue->bios++;
+	bool queued = blockQueueBio(queue, bio);
+	i686_RestoreInterrupts(flags);
+	if (!queued)
+	{
+		bio->error = true;
+		bio->done = true;
+		return;
+	}
+	blockDispatch(queue, false);
+}
+
+bool blockWait(device_t *device, block_bio *bio)
+{
+	block_queue *queue = device->queue;
+	while (true)
+	{
+		// a plugged queue must not hold back a request someone waits on
+		blockDispatch(queue, true);
+		if (queue->poll)
+			queue->poll(device);
+
+		uint32_t flags = i686_SaveInterrupts();
+		if (bio->done)
+		{
+			i686_RestoreInterrupts(flags);
+			break;
+		}
+		if (queue->poll)
+			waitSleepTimeout(&queue->wait, timer_ticks + 1);
+		else
+			waitSleep(&queue->wait);
+		i686_RestoreInterrupts(flags);
+	}
+	return !bio->error;
+}
+
+// splits the transfer into bios of maxSectors and keeps all of them queued
+static uint32_t blockTransfer(void *buffer, uint64_t lba, uint32_t count, device_t *device, bool write)
+{
+	block_queue *queue = device->queue;
+	if (queue == NULL || count == 0)
+		return 0;
+
+	uint32_t bioCount = (count + queue->maxSectors - 1) / queue->maxSectors;
+	block_bio single;
+	block_bio *bios = bioCount == 1 ? &single : (block_bio *)calloc(bioCount, sizeof(block_bio));
+	if (bios == NULL)
+		return 0;
+
+	blockPlug(device);
+	for (uint32_t i = 0; i < bioCount; i++)
+	{
+		uint32_t offset = i * queue->maxSectors;
+		bios[i].write = write;
+		bios[i].lba = lba + offset;
+		bios[i].count = count - offset < queue->maxSectors ? count - offset : queue->maxSectors;
+		bios[i].buffer = (uint8_t *)buffer + offset * BLOCK_SECTOR_SIZE;
+		blockSubmit(device, &bios[i]);
+	}
+	blockUnplug(device);
+
+	// only the part up to the first failure counts
+	uint32_t done = 0;
+	bool failed = false;
+	for (uint32_t i = 0; i < bioCount; i++)
+	{
+		if (!blockWait(device, &bios[i]))
+			failed = true;
+		else if (!failed)
+			done += bios[i].count;
+	}
+
+	if (bios != &single)
+		free(bios);
+	return done;
+}
+
+uint32_t blockRead(void *buffer, uint64_t lba, uint32_t count, device_t *device)
+{
+	return blockTransfer(buffer, lba, count, device, false);
+}
+
+uint32_t blockWrite(void *buffer, uint64_t lba, uint32_t count, device_t *device)
+{
+	uint32_t written = blockTransfer(buffer, lba, count, device, true);
+	if (written)
+		blockFlush(device);
+	return written;
+}
+
+bool blockFlush(device_t *device)
+{
+	block_queue *queue = device->queue;
+	if (queue == NULL || queue->flush == NULL)
+		return true;
+	return queue->flush(device);
+}
+
+void blockPrintStats()
+{
+	for (block_queue *queue = g_Queues; queue; queue = queue->nextQueue)
+	{
+		printf("%s: %u bios, %u merged, %u requests, %u expired, %u bounced, depth %u\n", queue->device->name,
+			   queue->bios, queue->merges, queue->dispatched, queue->expired, queue->bounced, queue->depth);
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "drivers/device.h"
+#include "task/wait.h"
+
+#define BLOCK_SECTOR_SIZE 512
+
+// merged requests stop growing at 512 KiB
+#define BLOCK_MAX_SECTORS 1024
+
+// deadlines in PIT ticks, a request that waited this long goes out ahead of the elevator
+#define BLOCK_READ_EXPIRE_TICKS 250	  // 500 ms
+#define BLOCK_WRITE_EXPIRE_TICKS 2500 // 5 s
+
+// one caller's transfer, it belongs to the caller until done is set
+typedef struct block_bio
+{
+	bool write;
+	uint64_t lba;
+	uint32_t count; // sectors
+	void *buffer;
+
+	volatile bool done;
+	volatile bool error;
+	struct block_bio *next; // next bio of the same request
+} block_bio;
+
+// what the driver sees, bios for adjacent sectors merged into one transfer
+typedef struct block_request
+{
+	bool write;
+	uint64_t lba;
+	uint32_t count;
+	void *buffer; // the bio buffers when they follow each other in memory, a bounce buffer otherwise
+	bool bounce;
+
+	block_bio *first;
+	block_bio *last;
+	uint32_t deadline;
+	struct block_queue *queue;
+	void *driverData; // the driver's, between submit and blockComplete
+
+	struct block_request *next;
+} block_request;
+
+// starts the transfer and returns, blockComplete may be called before or after it does
+typedef bool (*block_submit_t)(device_t *device, block_request *req);
+
+typedef struct block_queue
+{
+	device_t *device;
+	block_submit_t submit;
+	void (*poll)(device_t *device);	  // optional, called every tick while someone waits
+	bool (*flush)(device_t *device);  // optional, writes the drive cache back
+	uint32_t depth;					  // requests the driver takes at once
+	uint32_t maxSectors;
+	bool synchronous;				  // submit does the whole transfer before it returns
+
+	block_request *pending; // sorted by LBA
+	volatile uint32_t inflight;
+	uint64_t position; // sector after the last dispatched request
+	uint32_t plugged;
+	wait_queue_t wait;
+
+	uint32_t bios;
+	uint32_t merges;
+	uint32_t dispatched;
+	uint32_t expired;
+	uint32_t bounced;
+
+	struct block_queue *nextQueue;
+} block_queue;
+
+block_queue *blockCreateQueue(device_t *device, block_submit_t submit, uint32_t depth, uint32_t maxSectors);
+
+// bios submitted while the queue is plugged are held back so they can be merged
+void blockPlug(device_t *device);
+void blockUnplug(device_t *device);
+// unplugs without dispatching on a synchronous queue, kblockd starts the held back requests instead
+void blockUnplugAsync(device_t *device);
+
+void blockSubmit(device_t *device, block_bio *bio);
+bool blockWait(device_t *device, block_bio *bio);
+
+// called by the driver once a request is finished, interrupts can be off
+void blockComplete(block_request *req, bool ok);
+
+// device_t read/write for drivers with a queue
+uint32_t blockRead(void *buffer, uint64_t lba, uint32_t count, device_t *device);
+uint32_t blockWrite(void *buffer, uint64_t lba, uint32_t count, device_t *device);
+bool blockFlush(device_t *device);
+
+void blockPrintStats();
@@ -67,4 +67,9 @@ device_t *GetDeviceUsingId(uint32_t id)
 device_t *GetDevice(uint32_t id)
 {
 	return devices[id];
-}
\ No newline at end of file
+}
+
+uint32_t GetDeviceCount()
+{
+	return lastid;
+}
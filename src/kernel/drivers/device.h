@@ -12,6 +12,7 @@ typedef enum __device_type {
 } device_type;
 
 struct device_t;
+struct block_queue;
 
 typedef struct __device_t
 {
@@ -21,20 +22,33 @@ typedef struct __device_t
 	device_type dev_type;
     uint32_t (*read)(void* buffer, uint64_t offset , uint32_t len, struct __device_t* device);
 	uint32_t (*write)(void *buffer, uint64_t offset, uint32_t len, struct __device_t* device);
+	uint32_t (*prefetch)(uint64_t offset, uint32_t len, struct __device_t* device); // optional, starts a read and returns, gives the sectors it covered
+	struct block_queue *queue; // request queue of a block driver, see drivers/block
 	void* priv;
 } device_t;
 
+struct MountPoint_t;
+
 typedef struct __fs_t {
 	char *name;
 	bool (*probe)(device_t* dev);
-	bool (*read)(char *, uint8_t *, device_t* dev, void *);
-	bool (*read_dir)(char *, uint8_t *, device_t* dev, void *);
+	bool (*read_dir)(char *, uint8_t *, device_t* dev, void *); // fills a DirectoryEntries and allocates its entries
 	bool (*find_entry)(char *, void*, device_t* dev, void *);
 	bool (*touch)(char *fn, device_t* dev, void *);
-	bool (*writefile)(char *fn, uint8_t *buf, uint32_t len, device_t* dev, void *);
 	bool (*exist)(char *filename, device_t* dev,  void *);
 	bool (*mount)(device_t* dev, void *);
 	bool (*getRoot)(void*, device_t* dev, void *);
+	// an open handle and reads/writes at an offset in it, a file opened without a handle gets a temporary one for each transfer
+	bool (*open)(char *fn, void **handle, device_t* dev, void *);
+	void (*close)(void *handle, device_t* dev, void *);
+	int32_t (*read_at)(void *handle, uint8_t *buf, uint32_t offset, uint32_t len, device_t* dev, void *);
+	int32_t (*write_at)(void *handle, uint8_t *buf, uint32_t offset, uint32_t len, device_t* dev, void *);
+	bool (*truncate)(void *handle, uint32_t size, device_t* dev, void *);
+	bool (*mkdir)(char *fn, device_t* dev, void *);
+	bool (*unlink)(char *fn, device_t* dev, void *);
+	// optional, called by UmountDevice once no file is open and the cache is synced, frees what probe and mount set up
+	void (*umount)(struct MountPoint_t *mount);
+	bool caseInsensitive; // names that only differ in case are the same file
 	bool *priv_data;
 } filesystemInfo_t;
 
@@ -43,3 +57,4 @@ void PrintDeviceOut();
 int addDevice(device_t* dev);
 device_t *GetDeviceUsingId(uint32_t id);
 device_t *GetDevice(uint32_t id);
+uint32_t GetDeviceCount();
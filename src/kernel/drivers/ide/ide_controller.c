@@ -1,13 +1,17 @@
+#define LOG_LEVEL LVL_INFO
 
 #include "ide_controller.h"
 
 #include "arch/i686/io.h"
 #include "arch/i686/i8259.h"
 #include "arch/i686/pit.h"
+#include "arch/i686/memory_i686.h"
+#include "task/wait.h"
 
 #include "debug.h"
 #include "memory.h"
 #include "stdio.h"
+#include "string.h"
 
 #define MODULE "IDE"
 
@@ -15,6 +19,9 @@
 #define LBA28 1
 #define LBA48 2
 
+// 2 s at 500 Hz
+#define IDE_IRQ_TIMEOUT_TICKS 1000
+
 #define NoDMA 0
 #define HasDMA 1
 
@@ -28,6 +35,14 @@ uint16_t ide_drive_type;
 uint32_t ide_drive_size;
 
 volatile static uint8_t ide_irq_invoked = 0;
+static wait_queue_t ide_irq_queue = WAIT_QUEUE_INIT;
+
+// one command at a time per channel, the registers are shared by master and slave
+static volatile bool ide_channel_busy[2];
+static wait_queue_t ide_channel_queue[2] = {WAIT_QUEUE_INIT, WAIT_QUEUE_INIT};
+
+bool ide_dma_enabled = true;
+static ide_prd *ide_prd_tables[2];
 static uint8_t atapi_packet[12] = {0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 uint8_t package[1] = {0};
 
@@ -123,7 +138,7 @@ void ide_400ns_delay(uint8_t channel)
 {
     // log_debug(MODULE, "enter ide_400ns_delay(channel: %x) file %s:%u", channel, __FILE__, __LINE__);
     for (int i = 0; i < 4; i++)
-        i686_inb(channel + ATA_REG_ALTSTATUS); // Reading the Alternate Status port wastes 100ns; loop four times.
+        ide_read(channel, ATA_REG_ALTSTATUS); // Reading the Alternate Status port wastes 100ns; loop four times.
 }
 
 uint8_t ide_polling(uint8_t channel, uint32_t advanced_check)
@@ -260,6 +275,10 @@ bool ide_initialize(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t BAR3,
 
     uint8_t ide_buf[0x200];
 
+    // the PCI scan may have probed the controller already
+    memset(ide_devices, 0, sizeof(ide_devices));
+    ide_devices_count = 0;
+
     // 1- Detect I/O Ports which interface IDE Controller:
     channels[ATA_PRIMARY].base = (BAR0 & 0xFFFFFFFC) + 0x1F0 * (!BAR0);
     channels[ATA_PRIMARY].ctrl = (BAR1 & 0xFFFFFFFC) + 0x3F6 * (!BAR1);
@@ -267,6 +286,20 @@ bool ide_initialize(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t BAR3,
     channels[ATA_SECONDARY].ctrl = (BAR3 & 0xFFFFFFFC) + 0x376 * (!BAR3);
     channels[ATA_PRIMARY].bmide = (BAR4 & 0xFFFFFFFC) + 0;   // Bus Master IDE
     channels[ATA_SECONDARY].bmide = (BAR4 & 0xFFFFFFFC) + 8; // Bus Master IDE
+    if (!(BAR4 & 0xFFFFFFFC))
+    {
+        channels[ATA_PRIMARY].bmide = 0;
+        channels[ATA_SECONDARY].bmide = 0;
+    }
+
+    // a page never crosses the 64 KiB boundary a PRD table must not cross
+    for (i = 0; i < 2; i++)
+    {
+        if (channels[i].bmide && ide_prd_tables[i] == NULL)
+        {
+            ide_prd_tables[i] = (ide_prd *)pmalloc(IDE_PRD_COUNT * sizeof(ide_prd));
+        }
+    }
 
     // 2- Disable IRQs:
     ide_write(ATA_PRIMARY, ATA_REG_CONTROL, 2);
@@ -406,7 +439,6 @@ bool ide_initialize(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t BAR3,
 
 uint8_t GetCmd(uint8_t lba_mode, uint8_t dma, uint8_t direction)
 {
-    log_debug(MODULE, "file %s:%u", __FILE__, __LINE__);
     if (dma == NoDMA)
     {
         if (direction == ATA_READ)
@@ -472,22 +504,116 @@ uint8_t GetCmd(uint8_t lba_mode, uint8_t dma, uint8_t direction)
     return false;
 }
 
-uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t numsects, uint16_t selector, uint32_t edi)
+static void ide_lock_channel(uint8_t channel)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    while (ide_channel_busy[channel])
+        waitSleep(&ide_channel_queue[channel]);
+    ide_channel_busy[channel] = true;
+    i686_RestoreInterrupts(flags);
+}
+
+static void ide_unlock_channel(uint8_t channel)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    ide_channel_busy[channel] = false;
+    waitWakeOne(&ide_channel_queue[channel]);
+    i686_RestoreInterrupts(flags);
+}
+
+// fills the channel's PRD table for size bytes at buffer, false if it does not fit
+static bool ide_dma_prepare(uint8_t channel, uint32_t buffer, uint32_t size)
+{
+    ide_prd *prd = ide_prd_tables[channel];
+    if (prd == NULL || (buffer & 1))
+        return false;
+
+    int n = 0;
+    uint32_t lastPhys = 0, lastSize = 0;
+    while (size)
+    {
+        uint32_t phys = pagingTranslate(buffer);
+        uint32_t chunk = 0x1000 - (buffer & 0xFFF);
+        if (chunk > size)
+            chunk = size;
+        if (phys == 0)
+            return false;
+
+        // grow the last entry while the memory is contiguous and inside one 64 KiB block
+        if (n > 0 && phys == lastPhys + lastSize && (lastPhys & 0xFFFF0000) == ((phys + chunk - 1) & 0xFFFF0000))
+        {
+            lastSize += chunk;
+            prd[n - 1].count = (uint16_t)lastSize;
+        }
+        else
+        {
+            if (n == IDE_PRD_COUNT)
+                return false;
+            prd[n].phys = phys;
+            prd[n].count = (uint16_t)chunk;
+            prd[n].flags = 0;
+            lastPhys = phys;
+            lastSize = chunk;
+            n++;
+        }
+        buffer += chunk;
+        size -= chunk;
+    }
+    prd[n - 1].flags = IDE_PRD_EOT;
+
+    i686_outd(channels[channel].bmide + ATA_BM_PRDT, pagingTranslate((uint32_t)prd));
+    return true;
+}
+
+// sleeps until the drive raises its IRQ, checks the bus master status every tick in case it never comes
+static uint8_t ide_dma_wait(uint8_t channel)
+{
+    uint32_t deadline = timer_ticks + IDE_IRQ_TIMEOUT_TICKS;
+    uint8_t bmStatus;
+    while (true)
+    {
+        bmStatus = ide_read(channel, ATA_REG_BMSTATUS);
+        if (bmStatus & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR))
+            break;
+        if ((int32_t)(timer_ticks - deadline) >= 0)
+        {
+            log_warn(MODULE, "DMA on channel %u timed out, status %x", channel, bmStatus);
+            ide_write(channel, ATA_REG_BMCOMMAND, 0);
+            return 3;
+        }
+
+        uint32_t flags = i686_SaveInterrupts();
+        if (!ide_irq_invoked)
+            waitSleepTimeout(&ide_irq_queue, timer_ticks + 1);
+        i686_RestoreInterrupts(flags);
+    }
+    ide_irq_invoked = 0;
+
+    ide_write(channel, ATA_REG_BMCOMMAND, 0);
+    ide_write(channel, ATA_REG_BMSTATUS, ATA_BM_SR_IRQ | ATA_BM_SR_ERR); // write 1 to clear
+
+    uint8_t state = ide_read(channel, ATA_REG_STATUS);
+    if ((bmStatus & ATA_BM_SR_ERR) || (state & ATA_SR_ERR))
+        return 2;
+    if (state & ATA_SR_DF)
+        return 1;
+    return 0;
+}
+
+static uint8_t ide_ata_access_locked(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t numsects, uint16_t selector, uint32_t edi)
 {
-    log_debug(MODULE, "file %s:%u", __FILE__, __LINE__);
     uint8_t lba_mode /* 0: CHS, 1:LBA28, 2: LBA48 */, dma /* 0: No DMA, 1: DMA */, cmd;
     uint8_t lba_io[6];
     uint32_t channel = ide_devices[drive].Channel; // Read the Channel.
     uint32_t slavebit = ide_devices[drive].Drive;  // Read the Drive [Master/Slave]
     uint32_t bus = channels[channel].base;         // Bus Base, like 0x1F0 which is also data port.
     uint32_t words = 256;                          // Almost every ATA drive has a sector-size of 512-byte.
+    uint32_t sectors = numsects ? numsects : 256;
     uint16_t cyl, i;
     uint8_t head, sect, err;
 
-    ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = (ide_irq_invoked = 0x0) + 0x02);
-
     // (I) Select one from LBA28, LBA48 or CHS;
-    if (lba >= 0x10000000)
+    if (lba + sectors > 0x10000000)
     { // Sure Drive should support LBA in this case, or you are
         // giving a wrong LBA.
         // LBA48:
@@ -500,7 +626,7 @@ uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t n
         lba_io[5] = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
         head = 0;      // Lower 4-bits of HDDEVSEL are not used here.
     }
-    else if (ide_devices[drive].Capabilities & 0x200)
+    else if (ide_devices[drive].Capabilities & IDE_CAP_LBA)
     { // Drive supports LBA?
         // LBA28:
         lba_mode = LBA28;
@@ -528,7 +654,19 @@ uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t n
     }
 
     // (II) See if drive supports DMA or not;
-    dma = NoDMA; // We don't support DMA
+    // in LBA48 a sector count of 0 means 65536, not 256
+    if (lba_mode == LBA48 && numsects == 0)
+        return 3;
+    dma = NoDMA;
+    if (ide_dma_enabled && channels[channel].bmide && (ide_devices[drive].Capabilities & IDE_CAP_DMA) &&
+        ide_dma_prepare(channel, edi, sectors * words * 2))
+    {
+        dma = HasDMA;
+    }
+
+    // DMA completes with an IRQ, PIO is polled
+    ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = (dma ? 0x00 : 0x02));
+    ide_irq_invoked = 0x0;
 
     // (III) Wait if the drive is busy;
     while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY)
@@ -569,18 +707,24 @@ uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t n
     // If (!DMA & !LBA#)   DO_PIO_CHS;
 
     cmd = GetCmd(lba_mode, dma, direction);
-    ide_write(channel, ATA_REG_COMMAND, cmd); // Send the Command.
-
     if (dma)
-        if (direction == 0)
-            ;
-        // DMA Read.
-        else
-            ;
-    // DMA Write.
-    else if (direction == 0)
-        // PIO Read.
-        for (i = 0; i < numsects; i++)
+    {
+        // the direction has to be set before the engine starts
+        uint8_t bmCommand = (direction == ATA_READ) ? ATA_BM_CMD_READ : 0;
+        ide_write(channel, ATA_REG_BMCOMMAND, bmCommand);
+        ide_write(channel, ATA_REG_BMSTATUS, ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+        ide_write(channel, ATA_REG_COMMAND, cmd); // Send the Command.
+        ide_write(channel, ATA_REG_BMCOMMAND, bmCommand | ATA_BM_CMD_START);
+
+        err = ide_dma_wait(channel);
+        if (err)
+            return err;
+    }
+    else if (direction == ATA_READ)
+    {
+        // PIO Read, one DRQ block per sector with rep insw.
+        ide_write(channel, ATA_REG_COMMAND, cmd); // Send the Command.
+        for (i = 0; i < sectors; i++)
         {
             err = ide_polling(channel, 1);
             if (err)
@@ -589,34 +733,54 @@ uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t n
 
             edi += (words * 2);
         }
+    }
     else
     {
         // PIO Write.
-        for (i = 0; i < numsects; i++)
+        ide_write(channel, ATA_REG_COMMAND, cmd); // Send the Command.
+        for (i = 0; i < sectors; i++)
         {
             ide_polling(channel, 0); // Polling.
             // Send data via outsw
             SendData(bus, selector, words, edi);
             edi += (words * 2);
         }
+    }
+
+    if (direction == ATA_WRITE)
+    {
+        ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0x02);
         ide_write(channel, ATA_REG_COMMAND, (char[]){ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
         ide_polling(channel, 0); // Polling.
     }
-    log_debug(MODULE, "exit file %s:%u", __FILE__, __LINE__);
     return 0; // Easy, isn't it?
 }
 
+// numsects 0 is 256 sectors, edi has to be mapped, it is handed to the DMA engine by physical address
+uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t numsects, uint16_t selector, uint32_t edi)
+{
+    uint8_t channel = ide_devices[drive].Channel;
+    ide_lock_channel(channel);
+    uint8_t err = ide_ata_access_locked(direction, drive, lba, numsects, selector, edi);
+    ide_unlock_channel(channel);
+    return err;
+}
+
 void ide_wait_irq()
 {
     log_debug(MODULE, "file %s:%u", __FILE__, __LINE__);
-    while (!ide_irq_invoked)
-        ;
+    bool timedOut;
+    waitEventTimeout(&ide_irq_queue, ide_irq_invoked, timer_ticks + IDE_IRQ_TIMEOUT_TICKS, timedOut);
+    if (timedOut)
+    {
+        log_warn(MODULE, "timed out waiting for an IRQ");
+    }
     ide_irq_invoked = 0;
 }
 void ide_irq()
 {
-    log_debug(MODULE, "file %s:%u", __FILE__, __LINE__);
     ide_irq_invoked = 1;
+    waitWakeAll(&ide_irq_queue);
 }
 
 uint8_t ide_atapi_read(uint8_t drive, uint32_t lba, uint8_t numsects, uint16_t selector, uint32_t edi)
@@ -77,6 +77,29 @@ extern uint8_t *ide_buf;
 #define ATA_REG_CONTROL    0x0C
 #define ATA_REG_ALTSTATUS  0x0C
 #define ATA_REG_DEVADDRESS 0x0D
+#define ATA_REG_BMCOMMAND  0x0E
+#define ATA_REG_BMSTATUS   0x10
+
+// Bus master IDE, offsets from BAR4
+#define ATA_BM_PRDT        0x04
+
+#define ATA_BM_CMD_START   0x01
+#define ATA_BM_CMD_READ    0x08    // device to memory
+
+#define ATA_BM_SR_ACTIVE   0x01
+#define ATA_BM_SR_ERR      0x02
+#define ATA_BM_SR_IRQ      0x04
+
+// Physical region descriptor, one per physically contiguous piece of the buffer
+typedef struct
+{
+    uint32_t phys;
+    uint16_t count; // bytes, 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed)) ide_prd;
+
+#define IDE_PRD_EOT        0x8000
+#define IDE_PRD_COUNT      (4096 / sizeof(ide_prd))
 
 // Channels:
 #define      ATA_PRIMARY      0x00
@@ -114,14 +137,18 @@ typedef struct ide_device
     char Model[41];     // Model in string.
 } ide_device;
 
+#define IDE_CAP_DMA 0x100
+#define IDE_CAP_LBA 0x200
+
 typedef struct
 {
-    uint16_t drive;
+    uint16_t drive; // index into ide_devices, the port number for AHCI
 } ide_private_data;
 
 extern ide_device ide_devices[4];
 extern IDEChannelRegisters channels[2];
 extern uint8_t ide_devices_count;
+extern bool ide_dma_enabled;
 
 void ide_write(uint8_t channel, uint8_t reg, uint8_t data);
 uint8_t ide_read(uint8_t channel, uint8_t reg);
@@ -137,6 +164,9 @@ void ide_400ns_delay(uint8_t channel);
 uint8_t ide_polling(uint8_t channel, uint32_t advanced_check);
 uint8_t ide_print_error(uint32_t drive, uint8_t err);
 bool ide_initialize(uint32_t BAR0, uint32_t BAR1, uint32_t BAR2, uint32_t BAR3, uint32_t BAR4);
+uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba, uint8_t numsects, uint16_t selector, uint32_t edi);
+void ide_wait_irq();
+void ide_irq();
 
 void __attribute__((cdecl)) SendData(uint32_t bus, uint16_t selector, uint32_t words, uint32_t edi);
 void __attribute__((cdecl)) ReceiveData(uint32_t bus, uint16_t selector, uint32_t words, uint32_t edi);
@@ -134,6 +134,38 @@ uint16_t getSubClassId(uint16_t bus, uint16_t device, uint16_t function)
     return r0;
 }
 
+// finds the first function of a class, pciScan only looks at function 0
+bool pciFindClass(uint8_t classID, uint8_t subclassID, uint32_t *bus, uint32_t *device, uint32_t *function)
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        for (uint32_t d = 0; d < 32; d++)
+        {
+            if (getVendorID(b, d, 0) == 0xFFFF)
+            {
+                continue;
+            }
+            bool multiFunction = (pciReadDword(b, d, 0, 0x0C) & 0x00800000) != 0;
+            for (uint32_t f = 0; f < (multiFunction ? 8u : 1u); f++)
+            {
+                if (getVendorID(b, d, f) == 0xFFFF)
+                {
+                    continue;
+                }
+                uint32_t classReg = pciReadDword(b, d, f, 0x08);
+                if (((classReg >> 24) & 0xFF) == classID && ((classReg >> 16) & 0xFF) == subclassID)
+                {
+                    *bus = b;
+                    *device = d;
+                    *function = f;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
 void pciScan(void)
 {
     // initalize values that are used to determine presence of devices
@@ -314,11 +346,10 @@ bool pciScanDevice(pci_device *pciDevice, uint32_t bus, uint32_t slot, uint32_t
             {
                 log_debug(MODULE, "AHCI controller");
                 pciEnableMMIOBusmastering(bus, slot, function);
-                pciDisableInterrupts(bus, slot, function);
 
                 uint32_t mmioBase = pciReadMMIOBar(bus, slot, function, PCI_BAR5);
                 log_debug(MODULE, "AHCI MMIO Base: 0x%x", mmioBase);
-                AHCI_init(mmioBase);
+                AHCI_init(mmioBase, pciDevice->header.header0.InterruptLine);
 
                 number_of_storage_controllers++;
                 return true;
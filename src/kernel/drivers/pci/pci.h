@@ -162,5 +162,6 @@ void pciDisableInterrupts(uint32_t bus, uint32_t device, uint32_t function);
 uint32_t getStorageBAR(uint32_t bus, uint32_t device, uint32_t function, uint8_t barIndex);
 
 void pciScan(void);
+bool pciFindClass(uint8_t classID, uint8_t subclassID, uint32_t *bus, uint32_t *device, uint32_t *function);
 bool pciScanDevice(pci_device *pciDevice, uint32_t bus, uint32_t device, uint32_t function);
 uint8_t *get_pci_vendor_string(uint32_t vendor_id);
\ No newline at end of file
@@ -5,52 +5,204 @@
 #include "hal/vfs.h"
 #include "hal/hal.h"
 #include "memory.h"
+#include "debug.h"
+#include "drivers/block/block.h"
 
 #include "devfs.h"
 
 #define MODULE                  "DEVFS"
 
-#define UNUSED __attribute__((unused))
+/*
+ * devfs
+ *
+ * Every block and character device shows up as a file in the root of the
+ * mount, diskN and charN after the device id. Reads and writes go straight
+ * to the device at the file offset; block devices only move whole sectors, so
+ * the partial sectors at either end go through a bounce buffer.
+ */
 
-uint8_t devfs_read()
+static device_t g_DevfsDevice;
+static filesystemInfo_t g_Devfs;
+
+static bool devfs_name(device_t *dev, char *name, size_t size)
+{
+	if (dev->dev_type == DEVICE_BLOCK)
+		snprintf(name, size, "disk%u", dev->id);
+	else if (dev->dev_type == DEVICE_CHAR)
+		snprintf(name, size, "char%u", dev->id);
+	else
+		return false;
+	return true;
+}
+
+static device_t *devfs_lookup(const char *path)
+{
+	char name[32];
+	while (*path == '/')
+		path++;
+	for (uint32_t i = 0; i < GetDeviceCount(); i++)
+	{
+		device_t *dev = GetDevice(i);
+		if (dev && devfs_name(dev, name, sizeof(name)) && strcmp(name, path) == 0)
+			return dev;
+	}
+	return NULL;
+}
+
+static bool devfs_isRoot(const char *path)
+{
+	while (*path == '/')
+		path++;
+	return *path == '\0';
+}
+
+bool devfs_read_dir(char *path, uint8_t *buffer, device_t *dev, void *priv)
+{
+	DirectoryEntries *out = (DirectoryEntries *)buffer;
+	out->entries = NULL;
+	out->entryCount = 0;
+	if (!devfs_isRoot(path))
+		return false;
+
+	uint32_t count = GetDeviceCount();
+	if (count == 0)
+		return true;
+	out->entries = (DirectoryEntry *)calloc(count, sizeof(DirectoryEntry));
+	if (out->entries == NULL)
+		return false;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		device_t *device = GetDevice(i);
+		DirectoryEntry *entry = &out->entries[out->entryCount];
+		if (device && devfs_name(device, entry->name, sizeof(entry->name)))
+		{
+			entry->inode = (uint32_t)device;
+			out->entryCount++;
+		}
+	}
+	return true;
+}
+
+bool devfs_find_entry(char *path, void *ret, device_t *dev, void *priv)
+{
+	DirectoryEntry *entry = (DirectoryEntry *)ret;
+	device_t *device = devfs_lookup(path);
+	if (device == NULL)
+		return false;
+	devfs_name(device, entry->name, sizeof(entry->name));
+	entry->IsDirectory = false;
+	entry->size = 0; // devices do not report their capacity
+	entry->inode = (uint32_t)device; // registered devices are never freed
+	return true;
+}
+
+bool devfs_open(char *path, void **handle, device_t *dev, void *priv)
 {
-	return 0;
+	device_t *device = devfs_lookup(path);
+	if (device == NULL)
+		return false;
+	*handle = device;
+	return true;
 }
 
-uint8_t devfs_read_dir()
+void devfs_close(void *handle, device_t *dev, void *priv)
 {
-	printf(".\n..\n");
-	return 0;
 }
 
-uint8_t devfs_exist(char *f)
+static int32_t devfs_transfer(device_t *device, uint8_t *buf, uint32_t offset, uint32_t len, bool write)
 {
-	if(strcmp(f, "/") == 0)
-		return 1;
-	return 0;
+	uint32_t (*io)(void *, uint64_t, uint32_t, device_t *) = write ? device->write : device->read;
+	if (io == NULL)
+		return -1;
+	// character devices take the byte offset as it is
+	if (device->dev_type != DEVICE_BLOCK)
+		return (int32_t)io(buf, offset, len, device);
+
+	uint8_t *bounce = NULL;
+	uint32_t done = 0;
+	while (done < len)
+	{
+		uint32_t position = offset + done;
+		uint32_t lba = position / BLOCK_SECTOR_SIZE;
+		uint32_t within = position % BLOCK_SECTOR_SIZE;
+		uint32_t left = len - done;
+
+		if (within == 0 && left >= BLOCK_SECTOR_SIZE)
+		{
+			uint32_t sectors = left / BLOCK_SECTOR_SIZE;
+			uint32_t moved = io(buf + done, lba, sectors, device);
+			done += moved * BLOCK_SECTOR_SIZE;
+			if (moved != sectors)
+				break;
+			continue;
+		}
+
+		if (bounce == NULL && (bounce = (uint8_t *)malloc(BLOCK_SECTOR_SIZE)) == NULL)
+			break;
+		uint32_t part = BLOCK_SECTOR_SIZE - within < left ? BLOCK_SECTOR_SIZE - within : left;
+		if (device->read(bounce, lba, 1, device) != 1)
+			break;
+		if (write)
+		{
+			memcpy(bounce + within, buf + done, part);
+			if (device->write(bounce, lba, 1, device) != 1)
+				break;
+		}
+		else
+		{
+			memcpy(buf + done, bounce + within, part);
+		}
+		done += part;
+	}
+	free(bounce);
+	return done ? (int32_t)done : -1;
 }
 
+int32_t devfs_read_at(void *handle, uint8_t *buf, uint32_t offset, uint32_t len, device_t *dev, void *priv)
+{
+	return devfs_transfer((device_t *)handle, buf, offset, len, false);
+}
+
+int32_t devfs_write_at(void *handle, uint8_t *buf, uint32_t offset, uint32_t len, device_t *dev, void *priv)
+{
+	return devfs_transfer((device_t *)handle, buf, offset, len, true);
+}
+
+bool devfs_probe(device_t *dev)
+{
+	if (dev != &g_DevfsDevice)
+		return false;
+	dev->fs = &g_Devfs;
+	return true;
+}
+
+// devfs keeps nothing of its own, the devices it lists stay registered
+void devfs_umount(MountPoint *mount)
+{
+	mount->dev->fs = NULL;
+}
 
 void devfs_init()
 {
-	/*
-	filesystem_t *fs = (filesystem_t *)malloc(sizeof(filesystem_t));
-	printf("Mounting /dev filesystem.\n");
-	fs->name = "DEVFS";
-	fs->probe = devfs_probe;
-	fs->read = devfs_read;
-	fs->read_dir = devfs_read_dir;
-	fs->exist = devfs_exist;
-	fs->mount = devfs_mount;
-	device_t *dev_dev = (device_t *)malloc(sizeof(device_t));
-	dev_dev->name = "DEVDEV";
-	dev_dev->unique_id = 11;
-	dev_dev->dev_type = DEVICE_BLOCK;
-	dev_dev->fs = fs;
-	dev_dev->read = 0;
-	dev_dev->write = 0;
-	device_add(dev_dev);
-	dev_dev = device_get_by_id(11);
-	device_try_to_mount(dev_dev, "/dev/");
-	*/
-}
\ No newline at end of file
+	g_Devfs.name = "devfs";
+	g_Devfs.probe = devfs_probe;
+	g_Devfs.read_dir = devfs_read_dir;
+	g_Devfs.find_entry = devfs_find_entry;
+	g_Devfs.open = devfs_open;
+	g_Devfs.close = devfs_close;
+	g_Devfs.read_at = devfs_read_at;
+	g_Devfs.write_at = devfs_write_at;
+	g_Devfs.umount = devfs_umount;
+
+	// the device only exists to be mounted, devfs lists nothing for it
+	g_DevfsDevice.name = "devfs";
+	g_DevfsDevice.id = 0xFFFFFFFF;
+	g_DevfsDevice.dev_type = DEVICE_UNKNOWN;
+	addDevice(&g_DevfsDevice);
+
+	VFS_RegisterFilesystem("devfs", devfs_probe);
+	if (!MountDevice(&g_DevfsDevice, "/dev"))
+	{
+		log_err(MODULE, "Unable to mount /dev");
+	}
+}
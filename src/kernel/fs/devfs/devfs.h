@@ -1,4 +1,5 @@
 #pragma once
 #include <stdint.h>
 
+// registers devfs and mounts it on /dev
 void devfs_init();
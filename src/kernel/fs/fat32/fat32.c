@@ -10,6 +10,8 @@
 
 #include "math.h"
 #include "drivers/Keyboard/keyboard.h"
+#include "drivers/CMOS.h"
+#include "drivers/block/bcache.h"
 
 #define MODULE "FAT32"
 
@@ -20,10 +22,11 @@
 #define GETSECTORWC(High, Low) FatData->FirstDataSector + ((GETCLUSTER(High, Low) - 2) * BOOTSECTOR.SectorsPerCluster)
 #define GETSECTOR(Cluster) FatData->FirstDataSector + ((Cluster - 2) * BOOTSECTOR.SectorsPerCluster)
 
-#define FATREADFAT(FATsector, dev) dev->read(FatData->FatCache, FATsector, FAT_CACHE_SIZE, dev)
-
 FAT_Data *FatData = 0;
 
+// every open handle, a file that one of them refers to cannot be deleted
+static FAT_FileData *g_OpenFiles = NULL;
+
 void getLFNBlock(FAT_LongFileEntry *entry, FAT_LFNBlock *block)
 {
 	block->Order = entry->Order;
@@ -97,18 +100,6 @@ void GetName(char *shortName, char *output)
 	output[namelen + extlen + 1] = '\0';
 }
 
-void FAT_GetFATName(char *name, char *ret, bool needLFN)
-{
-	if (needLFN)
-	{
-		// Just copy the name as-is (for actual use, you'd need to encode it in LFN entries)
-		strncpy(ret, name, 255); // LFN max length is 255 characters
-		ret[255] = '\0';		 // Ensure null termination
-		return;
-	}
-	getShortName(name, ret);
-}
-
 bool FAT_ReadSectors(void *buf, uint32_t sector, uint32_t length, device_t *dev, fatPrivData *priv)
 {
 #if debugFAT == 1
@@ -128,24 +119,29 @@ bool FAT_WriteSectors(void *buf, uint32_t sector, uint32_t length, device_t *dev
 uint32_t FAT_Read(void *buf, uint32_t sector, uint32_t byteCount, device_t *dev, fatPrivData *priv)
 {
 	uint8_t *result = (uint8_t *)buf;
-
-	uint32_t bytesRead = 0;
-	uint32_t count = 0;
-	while (byteCount > bytesRead)
-	{
-		uint32_t leftToRead = min(SECTOR_SIZE, byteCount - bytesRead);
-		uint32_t take = min(byteCount, leftToRead);
+	uint32_t sectors = byteCount / SECTOR_SIZE;
+	uint32_t tail = byteCount % SECTOR_SIZE;
 #if debugFAT == 1
-		log_debug(MODULE, "bytesRead: %u - leftToRead: %u - take: %u - ", bytesRead, leftToRead, take);
+	log_debug(MODULE, "FAT_Read %u bytes, %u sectors + %u", byteCount, sectors, tail);
 #endif
 
-		FAT_ReadSectors(result, sector + count, 1, dev, priv);
-		result += take;
-		bytesRead += take;
-		count++;
+	// whole sectors go straight into buf in one request
+	if (sectors && !FAT_ReadSectors(result, sector, sectors, dev, priv))
+	{
+		return 0;
+	}
+
+	if (tail)
+	{
+		uint8_t sectorBuffer[SECTOR_SIZE];
+		if (!FAT_ReadSectors(sectorBuffer, sector + sectors, 1, dev, priv))
+		{
+			return sectors * SECTOR_SIZE;
+		}
+		memcpy(result + sectors * SECTOR_SIZE, sectorBuffer, tail);
 	}
 
-	return bytesRead;
+	return byteCount;
 }
 
 bool FAT_ReadEntry(FAT_FileEntry *dirEntry, uint32_t sector, device_t *dev, fatPrivData *priv)
@@ -171,63 +167,47 @@ uint32_t FAT_GetFatEOF()
 	return 0;
 }
 
-void FAT_readBootsector(device_t *dev, fatPrivData *priv)
-{
-	dev->read(FatData->BS.BootSectorBytes, 0, 1, dev);
-}
-
-void FAT_GetDir(FAT_DirectoryEntry *entry, FAT_Directory *dir, uint8_t *buffer, device_t *dev, fatPrivData *priv)
-{
-#if debugFAT == 1
-	log_debug(MODULE, "file %s:%u", __FILE__, __LINE__);
-#endif
-	FAT_readBootsector(dev, priv);
-	uint32_t firstSector = GETSECTORWC(entry->FirstClusterHigh, entry->FirstClusterLow);
-#if debugFAT == 1
-	log_info(MODULE, "FAT_ReadSectors(%p, %u, %u, %p, %p)", dir->entries, firstSector, BOOTSECTOR.SectorsPerCluster, dev, priv);
-#endif
-	FAT_ReadSectors((void *)dir->entries, firstSector, BOOTSECTOR.SectorsPerCluster, dev, priv);
-}
-
-uint32_t FAT_NextCluster(uint32_t currentCluster, device_t *dev)
+// the page of the FAT holding byte offset, read in on first use and kept
+static uint8_t *FAT_TablePage(uint32_t offset, device_t *dev)
 {
-	uint32_t fatIndex;
-	if (FatData->FATType == FAT12)
-	{
-		fatIndex = currentCluster * 3 / 2;
-	}
-	else if (FatData->FATType == FAT16)
-	{
-		fatIndex = currentCluster * 2;
-	}
-	else if (FatData->FATType == FAT32)
+	uint32_t page = offset / (FAT_TABLE_PAGE_SECTORS * SECTOR_SIZE);
+	if (page >= FatData->FatPageCount)
 	{
-		fatIndex = currentCluster * 4;
+		log_err(MODULE, "FAT offset %u is past the table", offset);
+		return NULL;
 	}
-#if debugFAT == 1
-	log_info(MODULE, "BytesPerSector %u", BOOTSECTOR.BytesPerSector);
-	log_info(MODULE, "fatIndex %u", fatIndex);
-#endif
-	uint32_t fatIndexSector = fatIndex / BOOTSECTOR.BytesPerSector;
-	if (fatIndexSector < FatData->FatCachePosition || fatIndexSector >= FatData->FatCachePosition + FAT_CACHE_SIZE)
+
+	if (FatData->FatPages[page] == NULL)
 	{
-		FATREADFAT(fatIndexSector, dev);
-		FatData->FatCachePosition = fatIndexSector;
+		uint32_t firstSector = page * FAT_TABLE_PAGE_SECTORS;
+		uint32_t sectors = min(FAT_TABLE_PAGE_SECTORS, FatData->FATSize - firstSector);
+		uint8_t *data = (uint8_t *)malloc(FAT_TABLE_PAGE_SECTORS * SECTOR_SIZE);
+		if (!data || !FAT_ReadSectors(data, FatData->FATSector + firstSector, sectors, dev, NULL))
+		{
+			log_err(MODULE, "cannot read FAT page %u", page);
+			free(data);
+			return NULL;
+		}
+		FatData->FatPages[page] = data;
 	}
+	return FatData->FatPages[page] + offset % (FAT_TABLE_PAGE_SECTORS * SECTOR_SIZE);
+}
 
-	fatIndex -= FatData->FatCachePosition * BOOTSECTOR.BytesPerSector;
+uint32_t FAT_NextCluster(uint32_t currentCluster, device_t *dev)
+{
 	uint32_t nextCluster;
 	if (FatData->FATType == FAT12)
 	{
-		if (currentCluster % 2 == 0)
+		// 12 bit entries can straddle two pages
+		uint32_t fatIndex = currentCluster * 3 / 2;
+		uint8_t *low = FAT_TablePage(fatIndex, dev);
+		uint8_t *high = FAT_TablePage(fatIndex + 1, dev);
+		if (!low || !high)
 		{
-			nextCluster = (*(uint16_t *)(FatData->FatCache + fatIndex)) & 0x0FFF;
+			return 0xFFFFFFFF;
 		}
-		else
-		{
-			nextCluster = (*(uint16_t *)(FatData->FatCache + fatIndex)) >> 4;
-		}
-
+		uint16_t value = *low | (*high << 8);
+		nextCluster = currentCluster % 2 == 0 ? value & 0x0FFF : value >> 4;
 		if (nextCluster >= 0xFF8)
 		{
 			nextCluster |= 0xFFFFF000;
@@ -235,784 +215,2112 @@ uint32_t FAT_NextCluster(uint32_t currentCluster, device_t *dev)
 	}
 	else if (FatData->FATType == FAT16)
 	{
-		nextCluster = *(uint16_t *)(FatData->FatCache + fatIndex);
+		uint16_t *entry = (uint16_t *)FAT_TablePage(currentCluster * 2, dev);
+		if (!entry)
+		{
+			return 0xFFFFFFFF;
+		}
+		nextCluster = *entry;
 		if (nextCluster >= 0xFFF8)
 		{
 			nextCluster |= 0xFFFF0000;
 		}
 	}
-	else if (FatData->FATType == FAT32)
+	else
 	{
-		nextCluster = *(uint32_t *)(FatData->FatCache + fatIndex);
+		// the top 4 bits are reserved
+		uint32_t *entry = (uint32_t *)FAT_TablePage(currentCluster * 4, dev);
+		if (!entry)
+		{
+			return 0xFFFFFFFF;
+		}
+		nextCluster = *entry & 0x0FFFFFFF;
+		if (nextCluster >= 0x0FFFFFF8)
+		{
+			nextCluster |= 0xF0000000;
+		}
 	}
 
 	return nextCluster;
 }
 
-bool FAT_ReadClusters(uint8_t *buf, uint32_t firstCluster, uint32_t size, device_t *dev, fatPrivData *priv)
+static bool FAT_BuildExtentMap(FAT_ExtentMap *map, uint32_t firstCluster, device_t *dev)
 {
 	uint32_t FatEOF = FAT_GetFatEOF();
+	map->FirstCluster = firstCluster;
+	map->ClusterCount = 0;
+	map->Count = 0;
+
 	uint32_t cluster = firstCluster;
-	uint32_t bytesRead = 0;
-	while (cluster < FatEOF && bytesRead < size)
+	// a damaged FAT can loop, no chain is longer than the volume
+	while (cluster >= 2 && cluster < FatEOF && map->ClusterCount <= FatData->CountofClusters)
 	{
-		uint32_t sector = GETSECTOR(cluster);
-
-		FAT_ReadSectors(buf + bytesRead, sector, BOOTSECTOR.SectorsPerCluster, dev, priv);
-
-		bytesRead += priv->BytesPerCluster;
+		FAT_Extent *last = map->Count ? &map->Extents[map->Count - 1] : NULL;
+		if (last && last->FirstCluster + last->Length == cluster)
+		{
+			last->Length++;
+		}
+		else
+		{
+			if (map->Count == map->Capacity)
+			{
+				uint32_t capacity = map->Capacity ? map->Capacity * 2 : 4;
+				FAT_Extent *extents = (FAT_Extent *)realloc(map->Extents, capacity * sizeof(FAT_Extent));
+				if (!extents)
+				{
+					return false;
+				}
+				map->Extents = extents;
+				map->Capacity = capacity;
+			}
+			FAT_Extent *extent = &map->Extents[map->Count++];
+			extent->FileCluster = map->ClusterCount;
+			extent->FirstCluster = cluster;
+			extent->Length = 1;
+		}
+		map->ClusterCount++;
 		cluster = FAT_NextCluster(cluster, dev);
 	}
 	return true;
 }
 
-bool FAT_WriteClusters(uint8_t *buf, uint32_t firstCluster, uint32_t size, device_t *dev, fatPrivData *priv)
+// the extents of the chain starting at firstCluster, built on the first request and kept
+FAT_ExtentMap *FAT_GetExtentMap(uint32_t firstCluster, device_t *dev)
 {
-	uint32_t FatEOF = FAT_GetFatEOF();
-	uint32_t cluster = firstCluster;
-	uint32_t bytesRead = 0;
-	while (cluster < FatEOF && bytesRead < size)
+	if (firstCluster < 2)
 	{
-		uint32_t sector = GETSECTOR(cluster);
-
-		FAT_WriteSectors(buf + bytesRead, sector, BOOTSECTOR.SectorsPerCluster, dev, priv);
+		return NULL;
+	}
 
-		bytesRead += priv->BytesPerCluster;
-		cluster = FAT_NextCluster(cluster, dev);
+	FAT_ExtentMap *victim = &FatData->ExtentMaps[0];
+	for (int i = 0; i < FAT_EXTENT_CACHE_SIZE; i++)
+	{
+		FAT_ExtentMap *map = &FatData->ExtentMaps[i];
+		if (map->FirstCluster == firstCluster)
+		{
+			map->LastUse = ++FatData->ExtentClock;
+			return map;
+		}
+		if (map->FirstCluster == 0 || (victim->FirstCluster != 0 && map->LastUse < victim->LastUse))
+		{
+			victim = map;
+		}
 	}
-	return true;
-}
 
-int FAT_CompareLFNBlocks(const void *blockA, const void *blockB)
-{
-	FAT_LFNBlock *a = (FAT_LFNBlock *)blockA;
-	FAT_LFNBlock *b = (FAT_LFNBlock *)blockB;
-	return ((int)a->Order) - ((int)b->Order);
+	if (!FAT_BuildExtentMap(victim, firstCluster, dev))
+	{
+		victim->FirstCluster = 0;
+		return NULL;
+	}
+	victim->LastUse = ++FatData->ExtentClock;
+#if debugFAT == 1
+	log_debug(MODULE, "chain at %u: %u clusters in %u extents", firstCluster, victim->ClusterCount, victim->Count);
+#endif
+	return victim;
 }
 
-void FAT_GetLfn(FAT_LongFileEntry *lfnEntries, int entryCount, char *output)
+// index of the extent holding the file's fileCluster'th cluster, -1 past the end of the chain
+int FAT_FindExtent(FAT_ExtentMap *map, uint32_t fileCluster)
 {
-	// log_debug(MODULE, "file %s:%u", __FILE__, __LINE__);
-	if (entryCount <= 0 || !lfnEntries || !output)
+	if (fileCluster >= map->ClusterCount)
 	{
-		log_err("FAT32 LONG", "Exit error: entryCount: %u ", entryCount);
-		*output = '\0';
-		return;
+		return -1;
 	}
 
-	// Sort LFN entries by Order (increasing)
-	qsort(lfnEntries, entryCount, sizeof(FAT_LongFileEntry), FAT_CompareLFNBlocks);
-
-	FAT_LFNBlock *LFNBlock = (FAT_LFNBlock *)malloc(sizeof(FAT_LFNBlock));
-	char *outPtr = output;
-	for (int i = 0; i < entryCount; i++)
+	int low = 0;
+	int high = map->Count - 1;
+	while (low < high)
 	{
-		FAT_LongFileEntry *entry = &lfnEntries[i];
-
-		getLFNBlock(entry, LFNBlock);
-		int16_t *utf16_chars = LFNBlock->Chars;
-
-		for (int j = 0; j < 13; j++)
+		int mid = (low + high + 1) / 2;
+		if (map->Extents[mid].FileCluster <= fileCluster)
 		{
-			if (utf16_chars[j] == 0xFFFF || utf16_chars[j] == 0x0000)
-			{
-				*outPtr = '\0';
-				free(LFNBlock);
-				return; // End of name
-			}
+			low = mid;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+	return low;
+}
 
-			int codepoint;
-			utf16_to_codepoint((uint16_t *)&utf16_chars[j], &codepoint);
-			outPtr = codepoint_to_utf8(codepoint, outPtr);
+// drops the kept extents of a chain that changed, all of them when firstCluster is 0
+void FAT_InvalidateExtents(uint32_t firstCluster)
+{
+	for (int i = 0; i < FAT_EXTENT_CACHE_SIZE; i++)
+	{
+		FAT_ExtentMap *map = &FatData->ExtentMaps[i];
+		if (firstCluster == 0 || map->FirstCluster == firstCluster)
+		{
+			map->FirstCluster = 0;
 		}
 	}
+}
 
-	*outPtr = '\0'; // Null-terminate the string
-	free(LFNBlock);
-	return;
+// the value that ends a chain
+static uint32_t FAT_EndOfChain()
+{
+	if (FatData->FATType == FAT12)
+	{
+		return 0xFFF;
+	}
+	if (FatData->FATType == FAT16)
+	{
+		return 0xFFFF;
+	}
+	return 0x0FFFFFFF;
 }
 
-uint32_t fat32GetRootCount(device_t *dev)
+static void FAT_MarkTableDirty(uint32_t offset)
 {
-	uint32_t result = 0;
-	uint32_t currentFat = FAT_NextCluster(0, dev);
+	uint32_t page = offset / (FAT_TABLE_PAGE_SECTORS * SECTOR_SIZE);
+	FatData->FatPageDirty[page] |= 1 << ((offset % (FAT_TABLE_PAGE_SECTORS * SECTOR_SIZE)) / SECTOR_SIZE);
+}
 
-	while (currentFat < FAT32_EOC)
+static void FAT_MarkFree(uint32_t cluster, bool free)
+{
+	if (!FatData->FreeMap)
 	{
-		result++;
-
-		if (currentFat == 0)
-			break; // Error or end
-		currentFat = FAT_NextCluster(currentFat, dev);
+		return;
+	}
+	uint32_t bit = 1u << (cluster % 32);
+	bool wasFree = (FatData->FreeMap[cluster / 32] & bit) == 0;
+	if (free && !wasFree)
+	{
+		FatData->FreeMap[cluster / 32] &= ~bit;
+		FatData->FreeCount++;
+		FatData->FSInfoDirty = true;
+	}
+	else if (!free && wasFree)
+	{
+		FatData->FreeMap[cluster / 32] |= bit;
+		FatData->FreeCount--;
+		FatData->FSInfoDirty = true;
 	}
-
-	return result;
 }
 
-void fatReadRootEntryCount(device_t *dev, fatPrivData *priv)
+// changes the FAT in memory, FAT_FlushTable writes it out
+static bool FAT_SetCluster(uint32_t cluster, uint32_t value, device_t *dev)
 {
-	if (FatData->FATType == FAT32)
+	if (FatData->FATType == FAT12)
 	{
-		priv->RootDirSizeSec = 2;
-#if debugFAT == 1
-		log_debug(MODULE, "fatReadRootEntryCount: FAT32 got %u", priv->RootDirSizeSec);
-#endif
+		uint32_t fatIndex = cluster * 3 / 2;
+		uint8_t *low = FAT_TablePage(fatIndex, dev);
+		uint8_t *high = FAT_TablePage(fatIndex + 1, dev);
+		if (!low || !high)
+		{
+			return false;
+		}
+		if (cluster % 2 == 0)
+		{
+			*low = value & 0xFF;
+			*high = (*high & 0xF0) | ((value >> 8) & 0x0F);
+		}
+		else
+		{
+			*low = (*low & 0x0F) | ((value << 4) & 0xF0);
+			*high = (value >> 4) & 0xFF;
+		}
+		FAT_MarkTableDirty(fatIndex);
+		FAT_MarkTableDirty(fatIndex + 1);
+	}
+	else if (FatData->FATType == FAT16)
+	{
+		uint16_t *entry = (uint16_t *)FAT_TablePage(cluster * 2, dev);
+		if (!entry)
+		{
+			return false;
+		}
+		*entry = value;
+		FAT_MarkTableDirty(cluster * 2);
 	}
 	else
 	{
-		priv->RootDirSizeSec = ((BOOTSECTOR.DirEntryCount * DIR_ENTRY_SIZE) + (BOOTSECTOR.BytesPerSector - 1)) / BOOTSECTOR.BytesPerSector;
-#if debugFAT == 1
-		log_debug(MODULE, "fatReadRootEntryCount: FAT16/12 got %u", priv->RootDirSizeSec);
-#endif
+		uint32_t *entry = (uint32_t *)FAT_TablePage(cluster * 4, dev);
+		if (!entry)
+		{
+			return false;
+		}
+		*entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+		FAT_MarkTableDirty(cluster * 4);
 	}
+	FAT_MarkFree(cluster, value == 0);
+	return true;
 }
 
-bool FAT_ReadRootDirectory(char *filename, device_t *dev, fatPrivData *priv)
+static void FAT_WriteFSInfo(device_t *dev)
 {
-	fatReadRootEntryCount(dev, priv);
-
-	// Calculate the first sector of the root directory
-	uint32_t rootDirSector = FatData->RootDirSector;
-	// log_debug(MODULE, "rootDirSector = %u", rootDirSector);
+	if (FatData->FATType != FAT32 || BOOTSECTOR.EBR32.FSInfoSector == 0 || BOOTSECTOR.EBR32.FSInfoSector == 0xFFFF)
+	{
+		return;
+	}
+	uint32_t *sector = (uint32_t *)malloc(SECTOR_SIZE);
+	FAT_FSInfo *info = (FAT_FSInfo *)sector;
+	if (sector && FAT_ReadSectors(sector, BOOTSECTOR.EBR32.FSInfoSector, 1, dev, NULL) &&
+		info->LeadSignature == FSINFO_LEAD_SIGNATURE && info->StructSignature == FSINFO_STRUCT_SIGNATURE)
+	{
+		info->FreeCount = FatData->FreeCount;
+		info->NextFree = FatData->NextFree;
+		FAT_WriteSectors(sector, BOOTSECTOR.EBR32.FSInfoSector, 1, dev, NULL);
+	}
+	free(sector);
+}
 
-	// Read the first sector of the root directory (this contains the entries)
-	// log_debug(MODULE, "root size = %u", priv->RootDirSizeSec);
-	uint8_t *buffer = (uint8_t *)malloc(priv->RootDirSizeSec * (BOOTSECTOR.BytesPerSector * BOOTSECTOR.SectorsPerCluster));
-	if (!buffer)
+// writes the changed FAT sectors to every copy of the FAT, runs of them in one request each
+bool FAT_FlushTable(device_t *dev)
+{
+	bool ok = true;
+	for (uint32_t page = 0; page < FatData->FatPageCount; page++)
 	{
-		free(buffer);
-		return false;
+		uint8_t dirty = FatData->FatPageDirty[page];
+		uint32_t sector = 0;
+		while (dirty && sector < FAT_TABLE_PAGE_SECTORS)
+		{
+			if ((dirty & (1 << sector)) == 0)
+			{
+				sector++;
+				continue;
+			}
+			uint32_t run = 1;
+			while (sector + run < FAT_TABLE_PAGE_SECTORS && (dirty & (1 << (sector + run))))
+			{
+				run++;
+			}
+
+			uint32_t fatSector = page * FAT_TABLE_PAGE_SECTORS + sector;
+			for (uint32_t copy = 0; copy < BOOTSECTOR.FatCount; copy++)
+			{
+				uint32_t lba = FatData->FATSector + copy * FatData->FATSize + fatSector;
+				if (!FAT_WriteSectors(FatData->FatPages[page] + sector * SECTOR_SIZE, lba, run, dev, NULL))
+				{
+					log_err(MODULE, "cannot write FAT sector %u of copy %u", fatSector, copy);
+					ok = false;
+				}
+			}
+			sector += run;
+		}
+		FatData->FatPageDirty[page] = 0;
 	}
-	// log_debug(MODULE, "rootDirSector = %u", rootDirSector / priv->SectorsPerBlock); // for debuging things
-	FAT_ReadSectors(buffer, rootDirSector, priv->RootDirSizeSec, dev, priv);
-	// log_debug(MODULE, "FatData = %p rootDirSector = %u", FatData, rootDirSector); // for debuging things
 
-	// Parse the buffer to get directory entries
-	uint32_t entryOffset = 0;
-	uint8_t index = 0;
+	if (FatData->FSInfoDirty)
+	{
+		FAT_WriteFSInfo(dev);
+		FatData->FSInfoDirty = false;
+	}
+	return ok;
+}
 
-	FatData->RootDirectory.entries = (FAT_FileEntry *)buffer;
-	FAT_Directory *rootDir = &FatData->RootDirectory;
+// scans the FAT once for the free bitmap, the FSInfo hint says where to start allocating
+static bool FAT_LoadFreeMap(device_t *dev)
+{
+	if (FatData->FreeMap)
+	{
+		return true;
+	}
 
-	while (entryOffset < rootDirSector * BOOTSECTOR.BytesPerSector)
+	uint32_t clusters = FatData->CountofClusters + 2;
+	uint32_t *map = (uint32_t *)calloc((clusters + 31) / 32, sizeof(uint32_t));
+	if (!map)
 	{
-		FAT_DirectoryEntry entry = rootDir->entries[index].Entry;
-		// log_info(MODULE, "      entry: %s 0x%X", entry.Name, entry.Attributes); // for debuging things
-		// Check if the entry is empty (which marks the end of the directory)
-		if (entry.Name[0] == 0x00)
+		return false;
+	}
+	// clusters 0 and 1 are reserved
+	map[0] = 3;
+	uint32_t freeCount = 0;
+	for (uint32_t cluster = 2; cluster < clusters; cluster++)
+	{
+		if (FAT_NextCluster(cluster, dev) != 0)
 		{
-			break;
+			map[cluster / 32] |= 1u << (cluster % 32);
 		}
+		else
+		{
+			freeCount++;
+		}
+	}
+	FatData->FreeMap = map;
+	FatData->FreeCount = freeCount;
+	FatData->NextFree = 2;
 
-		// Move to the next directory entry
-		if ((uint32_t)(filename) == 1)
+	if (FatData->FATType == FAT32 && BOOTSECTOR.EBR32.FSInfoSector != 0 && BOOTSECTOR.EBR32.FSInfoSector != 0xFFFF)
+	{
+		uint32_t *sector = (uint32_t *)malloc(SECTOR_SIZE);
+		FAT_FSInfo *info = (FAT_FSInfo *)sector;
+		if (sector && FAT_ReadSectors(sector, BOOTSECTOR.EBR32.FSInfoSector, 1, dev, NULL) &&
+			info->LeadSignature == FSINFO_LEAD_SIGNATURE && info->StructSignature == FSINFO_STRUCT_SIGNATURE)
 		{
-			FatData->RootDirectory.entryCount++;
+			if (info->NextFree >= 2 && info->NextFree < clusters)
+			{
+				FatData->NextFree = info->NextFree;
+			}
+			// the count there may be stale, the scan is not
+			FatData->FSInfoDirty = info->FreeCount != freeCount;
 		}
-		entryOffset += sizeof(FAT_DirectoryEntry);
-		index++;
+		free(sector);
+	}
+	log_info(MODULE, "%u of %u clusters free", freeCount, FatData->CountofClusters);
+	return true;
+}
+
+static uint32_t FAT_FindFree(uint32_t start)
+{
+	uint32_t clusters = FatData->CountofClusters + 2;
+	if (start < 2 || start >= clusters)
+	{
+		start = 2;
+	}
+	// from start to the end, then from the beginning up to start
+	for (int pass = 0; pass < 2; pass++)
+	{
+		uint32_t cluster = pass == 0 ? start : 2;
+		uint32_t end = pass == 0 ? clusters : start;
+		while (cluster < end)
+		{
+			uint32_t word = FatData->FreeMap[cluster / 32];
+			if (word == 0xFFFFFFFF)
+			{
+				cluster = (cluster / 32 + 1) * 32;
+				continue;
+			}
+			if ((word & (1u << (cluster % 32))) == 0)
+			{
+				return cluster;
+			}
+			cluster++;
+		}
+	}
+	return 0;
+}
+
+// frees the chain starting at cluster
+static void FAT_FreeChain(uint32_t cluster, device_t *dev)
+{
+	uint32_t FatEOF = FAT_GetFatEOF();
+	uint32_t freed = 0;
+	if (cluster >= 2)
+	{
+		FAT_InvalidateExtents(cluster);
+	}
+	while (cluster >= 2 && cluster < FatEOF && freed <= FatData->CountofClusters)
+	{
+		uint32_t next = FAT_NextCluster(cluster, dev);
+		FAT_SetCluster(cluster, 0, dev);
+		if (cluster < FatData->NextFree)
+		{
+			FatData->NextFree = cluster;
+		}
+		cluster = next;
+		freed++;
+	}
+}
+
+// allocates count clusters as one chain and hangs it after the cluster after, 0 when it starts a new chain;
+// they are taken right behind after when they are free there, so the file stays one extent
+static uint32_t FAT_AllocateClusters(uint32_t count, uint32_t after, device_t *dev)
+{
+	if (count == 0 || !FAT_LoadFreeMap(dev))
+	{
+		return 0;
+	}
+	if (FatData->FreeCount < count)
+	{
+		log_err(MODULE, "no space left, %u clusters needed and %u free", count, FatData->FreeCount);
+		return 0;
+	}
+
+	uint32_t first = 0;
+	uint32_t previous = after;
+	uint32_t hint = after ? after + 1 : FatData->NextFree;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t cluster = FAT_FindFree(hint);
+		if (cluster == 0 || !FAT_SetCluster(cluster, FAT_EndOfChain(), dev))
+		{
+			// give back what was taken so far
+			if (first)
+			{
+				FAT_FreeChain(first, dev);
+			}
+			if (after)
+			{
+				FAT_SetCluster(after, FAT_EndOfChain(), dev);
+			}
+			return 0;
+		}
+		if (previous)
+		{
+			FAT_SetCluster(previous, cluster, dev);
+		}
+		if (!first)
+		{
+			first = cluster;
+		}
+		previous = cluster;
+		hint = cluster + 1;
+	}
+	FatData->NextFree = hint;
+	FatData->FSInfoDirty = true;
+	return first;
+}
+
+// moves sectorCount sectors of the chain, starting at its startSector'th; one device call per extent
+static bool FAT_TransferSectors(uint8_t *buf, uint32_t firstCluster, uint32_t startSector, uint32_t sectorCount, bool write, device_t *dev, fatPrivData *priv)
+{
+	if (sectorCount == 0)
+	{
+		return true;
+	}
+	FAT_ExtentMap *map = FAT_GetExtentMap(firstCluster, dev);
+	if (!map)
+	{
+		return false;
+	}
+
+	uint32_t sectorsPerCluster = BOOTSECTOR.SectorsPerCluster;
+	int index = FAT_FindExtent(map, startSector / sectorsPerCluster);
+	uint32_t done = 0;
+	while (index >= 0 && index < map->Count && done < sectorCount)
+	{
+		FAT_Extent *extent = &map->Extents[index];
+		uint32_t skip = startSector + done - extent->FileCluster * sectorsPerCluster;
+		uint32_t run = min(extent->Length * sectorsPerCluster - skip, sectorCount - done);
+
+		uint32_t sector = GETSECTOR(extent->FirstCluster) + skip;
+		bool ok = write ? FAT_WriteSectors(buf + done * SECTOR_SIZE, sector, run, dev, priv)
+						: FAT_ReadSectors(buf + done * SECTOR_SIZE, sector, run, dev, priv);
+		if (!ok)
+		{
+			return false;
+		}
+		done += run;
+		index++;
+	}
+	return done == sectorCount;
+}
+
+// starts reading sectorCount sectors of the chain into the device's cache without waiting for them,
+// returns how many of them from startSector on are cached or in flight
+static uint32_t FAT_PrefetchSectors(uint32_t firstCluster, uint32_t startSector, uint32_t sectorCount, device_t *dev)
+{
+	FAT_ExtentMap *map = FAT_GetExtentMap(firstCluster, dev);
+	if (!map || !dev->prefetch)
+	{
+		return 0;
+	}
+
+	uint32_t sectorsPerCluster = BOOTSECTOR.SectorsPerCluster;
+	int index = FAT_FindExtent(map, startSector / sectorsPerCluster);
+	uint32_t done = 0;
+	while (index >= 0 && index < map->Count && done < sectorCount)
+	{
+		FAT_Extent *extent = &map->Extents[index];
+		uint32_t skip = startSector + done - extent->FileCluster * sectorsPerCluster;
+		uint32_t run = min(extent->Length * sectorsPerCluster - skip, sectorCount - done);
+		uint32_t covered = dev->prefetch(GETSECTOR(extent->FirstCluster) + skip, run, dev);
+		done += covered;
+		if (covered < run)
+		{
+			// the cache has nothing to spare right now
+			break;
+		}
+		index++;
+	}
+	return done;
+}
+
+int FAT_CompareLFNBlocks(const void *blockA, const void *blockB)
+{
+	FAT_LFNBlock *a = (FAT_LFNBlock *)blockA;
+	FAT_LFNBlock *b = (FAT_LFNBlock *)blockB;
+	return ((int)a->Order) - ((int)b->Order);
+}
+
+void FAT_GetLfn(FAT_LongFileEntry *lfnEntries, int entryCount, char *output)
+{
+	// log_debug(MODULE, "file %s:%u", __FILE__, __LINE__);
+	if (entryCount <= 0 || !lfnEntries || !output)
+	{
+		log_err("FAT32 LONG", "Exit error: entryCount: %u ", entryCount);
+		*output = '\0';
+		return;
+	}
+
+	// Sort LFN entries by Order (increasing)
+	qsort(lfnEntries, entryCount, sizeof(FAT_LongFileEntry), FAT_CompareLFNBlocks);
+
+	FAT_LFNBlock *LFNBlock = (FAT_LFNBlock *)malloc(sizeof(FAT_LFNBlock));
+	char *outPtr = output;
+	for (int i = 0; i < entryCount; i++)
+	{
+		FAT_LongFileEntry *entry = &lfnEntries[i];
+
+		getLFNBlock(entry, LFNBlock);
+		int16_t *utf16_chars = LFNBlock->Chars;
+
+		for (int j = 0; j < 13; j++)
+		{
+			if ((uint16_t)utf16_chars[j] == 0xFFFF || utf16_chars[j] == 0x0000)
+			{
+				*outPtr = '\0';
+				free(LFNBlock);
+				return; // End of name
+			}
+
+			int codepoint;
+			utf16_to_codepoint((uint16_t *)&utf16_chars[j], &codepoint);
+			outPtr = codepoint_to_utf8(codepoint, outPtr);
+		}
+	}
+
+	*outPtr = '\0'; // Null-terminate the string
+	free(LFNBlock);
+	return;
+}
+
+uint32_t fat32GetRootCount(device_t *dev)
+{
+	uint32_t result = 0;
+	uint32_t currentFat = FAT_NextCluster(0, dev);
+
+	while (currentFat < FAT32_EOC)
+	{
+		result++;
+
+		if (currentFat == 0)
+			break; // Error or end
+		currentFat = FAT_NextCluster(currentFat, dev);
+	}
+
+	return result;
+}
+
+void fatReadRootEntryCount(device_t *dev, fatPrivData *priv)
+{
+	if (FatData->FATType == FAT32)
+	{
+		priv->RootDirSizeSec = 2;
+#if debugFAT == 1
+		log_debug(MODULE, "fatReadRootEntryCount: FAT32 got %u", priv->RootDirSizeSec);
+#endif
+	}
+	else
+	{
+		priv->RootDirSizeSec = ((BOOTSECTOR.DirEntryCount * DIR_ENTRY_SIZE) + (BOOTSECTOR.BytesPerSector - 1)) / BOOTSECTOR.BytesPerSector;
+#if debugFAT == 1
+		log_debug(MODULE, "fatReadRootEntryCount: FAT16/12 got %u", priv->RootDirSizeSec);
+#endif
+	}
+}
+
+bool FAT_ReadRootDirectory(char *filename, device_t *dev, fatPrivData *priv)
+{
+	fatReadRootEntryCount(dev, priv);
+
+	// Calculate the first sector of the root directory
+	uint32_t rootDirSector = FatData->RootDirSector;
+	// log_debug(MODULE, "rootDirSector = %u", rootDirSector);
+
+	// Read the first sector of the root directory (this contains the entries)
+	// log_debug(MODULE, "root size = %u", priv->RootDirSizeSec);
+	uint8_t *buffer = (uint8_t *)malloc(priv->RootDirSizeSec * (BOOTSECTOR.BytesPerSector * BOOTSECTOR.SectorsPerCluster));
+	if (!buffer)
+	{
+		free(buffer);
+		return false;
+	}
+	// log_debug(MODULE, "rootDirSector = %u", rootDirSector / priv->SectorsPerBlock); // for debuging things
+	FAT_ReadSectors(buffer, rootDirSector, priv->RootDirSizeSec, dev, priv);
+	// log_debug(MODULE, "FatData = %p rootDirSector = %u", FatData, rootDirSector); // for debuging things
+
+	// Parse the buffer to get directory entries
+	uint32_t entryOffset = 0;
+	uint8_t index = 0;
+
+	// the root directory keeps the buffer until the next time it is read
+	if (FatData->RootDirectory.entries)
+		free(FatData->RootDirectory.entries);
+	FatData->RootDirectory.entries = (FAT_FileEntry *)buffer;
+	FatData->RootDirectory.entryCount = 0;
+	FAT_Directory *rootDir = &FatData->RootDirectory;
+
+	while (entryOffset < rootDirSector * BOOTSECTOR.BytesPerSector)
+	{
+		FAT_DirectoryEntry entry = rootDir->entries[index].Entry;
+		// log_info(MODULE, "      entry: %s 0x%X", entry.Name, entry.Attributes); // for debuging things
+		// Check if the entry is empty (which marks the end of the directory)
+		if (entry.Name[0] == 0x00)
+		{
+			break;
+		}
+
+		// Move to the next directory entry
+		if ((uint32_t)(filename) == 1)
+		{
+			FatData->RootDirectory.entryCount++;
+		}
+		entryOffset += sizeof(FAT_DirectoryEntry);
+		index++;
+	}
+
+	if (filename && (uint32_t)filename != 1)
+		return false;
+	return true;
+}
+
+static uint32_t FAT_RootCluster()
+{
+	return FatData->FATType == FAT32 ? BOOTSECTOR.EBR32.RootDirectoryCluster : 0;
+}
+
+// the disk sector holding a directory's index'th sector, false past its end
+static bool FAT_DirSector(uint32_t dirCluster, uint32_t index, uint32_t *sector, device_t *dev)
+{
+	if (dirCluster == 0)
+	{
+		// the FAT12/16 root has a fixed place and size
+		uint32_t rootSectors = (BOOTSECTOR.DirEntryCount * DIR_ENTRY_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		if (index >= rootSectors)
+		{
+			return false;
+		}
+		*sector = FatData->RootDirSector + index;
+		return true;
+	}
+
+	FAT_ExtentMap *map = FAT_GetExtentMap(dirCluster, dev);
+	if (!map)
+	{
+		return false;
+	}
+	uint32_t sectorsPerCluster = BOOTSECTOR.SectorsPerCluster;
+	int found = FAT_FindExtent(map, index / sectorsPerCluster);
+	if (found < 0)
+	{
+		return false;
+	}
+	FAT_Extent *extent = &map->Extents[found];
+	*sector = GETSECTOR(extent->FirstCluster + index / sectorsPerCluster - extent->FileCluster) + index % sectorsPerCluster;
+	return true;
+}
+
+#define FAT_ENTRIES_PER_SECTOR (SECTOR_SIZE / DIR_ENTRY_SIZE)
+
+// cluster numbers have 28 bits at most, inodes with the top bit set are places of entries
+#define FAT_INODE_ENTRY 0x80000000
+
+// the inode of an entry is its first cluster, or for an empty file without one where its short entry is on disk
+static uint32_t FAT_EntryInode(const FAT_DirectoryEntry *entry, uint32_t dirCluster, uint32_t index, device_t *dev)
+{
+	uint32_t cluster = GETCLUSTER(entry->FirstClusterHigh, entry->FirstClusterLow);
+	if (cluster)
+	{
+		return cluster;
+	}
+	// ".." pointing at the root, which FAT_GetRoot numbers 0
+	if (entry->Attributes & FAT_ATTRIBUTE_DIRECTORY)
+	{
+		return 0;
+	}
+	uint32_t sector;
+	if (!FAT_DirSector(dirCluster, index / FAT_ENTRIES_PER_SECTOR, &sector, dev))
+	{
+		return 0;
+	}
+	return FAT_INODE_ENTRY | (sector * FAT_ENTRIES_PER_SECTOR + index % FAT_ENTRIES_PER_SECTOR);
+}
+
+// FNV-1a over the name without case, names are compared the same way
+static uint32_t FAT_HashName(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name; name++)
+	{
+		hash ^= (uint8_t)tolower(*name);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void FAT_FreeDirIndex(FAT_DirIndex *index)
+{
+	free(index->Entries);
+	free(index->Names);
+	free(index->Buckets);
+	free(index->Pool);
+	memset(index, 0, sizeof(FAT_DirIndex));
+}
+
+static void FAT_DropDirIndex(uint32_t dirCluster)
+{
+	for (int i = 0; i < FAT_DIR_INDEX_CACHE; i++)
+	{
+		if (FatData->DirIndexes[i].Valid && FatData->DirIndexes[i].DirCluster == dirCluster)
+		{
+			FAT_FreeDirIndex(&FatData->DirIndexes[i]);
+		}
+	}
+}
+
+// makes room for one more element of size in a growing array
+static bool FAT_IndexReserve(void **array, uint32_t *capacity, uint32_t count, uint32_t size)
+{
+	if (count < *capacity)
+	{
+		return true;
+	}
+	uint32_t grown = *capacity ? *capacity * 2 : 64;
+	void *larger = realloc(*array, grown * size);
+	if (!larger)
+	{
+		return false;
+	}
+	*array = larger;
+	*capacity = grown;
+	return true;
+}
+
+static bool FAT_IndexRehash(FAT_DirIndex *index, uint32_t bucketCount)
+{
+	uint32_t *buckets = (uint32_t *)malloc(bucketCount * sizeof(uint32_t));
+	if (!buckets)
+	{
+		return false;
+	}
+	memset(buckets, 0xFF, bucketCount * sizeof(uint32_t));
+	for (uint32_t i = 0; i < index->NameCount; i++)
+	{
+		FAT_IndexName *name = &index->Names[i];
+		uint32_t *bucket = &buckets[name->Hash & (bucketCount - 1)];
+		name->Next = *bucket;
+		*bucket = i;
+	}
+	free(index->Buckets);
+	index->Buckets = buckets;
+	index->BucketCount = bucketCount;
+	return true;
+}
+
+static bool FAT_IndexAddName(FAT_DirIndex *index, uint32_t entry, const char *text)
+{
+	uint32_t length = strlen(text) + 1;
+	if (index->PoolSize + length > index->PoolCapacity)
+	{
+		uint32_t capacity = max(index->PoolCapacity * 2, max(index->PoolSize + length, 1024u));
+		char *pool = (char *)realloc(index->Pool, capacity);
+		if (!pool)
+		{
+			return false;
+		}
+		index->Pool = pool;
+		index->PoolCapacity = capacity;
+	}
+	if (!FAT_IndexReserve((void **)&index->Names, &index->NameCapacity, index->NameCount, sizeof(FAT_IndexName)))
+	{
+		return false;
+	}
+	// at most one name per bucket on average
+	if (index->NameCount >= index->BucketCount && !FAT_IndexRehash(index, index->BucketCount ? index->BucketCount * 2 : 64))
+	{
+		return false;
+	}
+
+	FAT_IndexName *name = &index->Names[index->NameCount];
+	name->Hash = FAT_HashName(text);
+	name->Entry = entry;
+	name->Text = index->PoolSize;
+	memcpy(index->Pool + index->PoolSize, text, length);
+	index->PoolSize += length;
+
+	uint32_t *bucket = &index->Buckets[name->Hash & (index->BucketCount - 1)];
+	name->Next = *bucket;
+	*bucket = index->NameCount++;
+	return true;
+}
+
+// adds the short entry at slot under its long name, if it has one, and its short name
+static bool FAT_IndexAdd(FAT_DirIndex *index, const FAT_DirectoryEntry *entry, uint32_t slot, uint32_t longCount, const char *longName)
+{
+	if (!FAT_IndexReserve((void **)&index->Entries, &index->EntryCapacity, index->EntryCount, sizeof(FAT_IndexEntry)))
+	{
+		return false;
+	}
+	char shortName[13];
+	GetName((char *)entry->Name, shortName);
+
+	uint32_t number = index->EntryCount++;
+	FAT_IndexEntry *indexed = &index->Entries[number];
+	memcpy(&indexed->Entry, entry, sizeof(FAT_DirectoryEntry));
+	indexed->Slot = slot;
+	indexed->LongCount = longCount;
+	indexed->Name = index->NameCount;
+	indexed->NameCount = 0;
+
+	if (longName[0])
+	{
+		if (!FAT_IndexAddName(index, number, longName))
+		{
+			return false;
+		}
+		indexed->NameCount++;
+	}
+	if (!longName[0] || strcasecmp(longName, shortName) != 0)
+	{
+		if (!FAT_IndexAddName(index, number, shortName))
+		{
+			return false;
+		}
+		indexed->NameCount++;
+	}
+	return true;
+}
+
+static void FAT_IndexRemove(FAT_DirIndex *index, FAT_IndexEntry *entry)
+{
+	// the names stay in their buckets until the index is built again, lookups skip them
+	for (uint32_t i = 0; i < entry->NameCount; i++)
+	{
+		index->Names[entry->Name + i].Entry = FAT_INDEX_NONE;
+	}
+	entry->Slot = FAT_INDEX_NONE;
+}
+
+static FAT_IndexEntry *FAT_IndexFind(FAT_DirIndex *index, const char *text)
+{
+	if (index->BucketCount == 0)
+	{
+		return NULL;
+	}
+	uint32_t hash = FAT_HashName(text);
+	for (uint32_t i = index->Buckets[hash & (index->BucketCount - 1)]; i != FAT_INDEX_NONE; i = index->Names[i].Next)
+	{
+		FAT_IndexName *name = &index->Names[i];
+		if (name->Hash == hash && name->Entry != FAT_INDEX_NONE && strcasecmp(index->Pool + name->Text, text) == 0)
+		{
+			return &index->Entries[name->Entry];
+		}
+	}
+	return NULL;
+}
+
+// reads the whole directory a cluster at a time and indexes every name in it
+static bool FAT_BuildDirIndex(FAT_DirIndex *index, uint32_t dirCluster, device_t *dev)
+{
+	uint32_t sectorsPerCluster = BOOTSECTOR.SectorsPerCluster;
+	uint32_t *buffer = (uint32_t *)malloc(sectorsPerCluster * SECTOR_SIZE);
+	FAT_LongFileEntry *longEntries = (FAT_LongFileEntry *)malloc(FAT_MAX_LFN_ENTRIES * sizeof(FAT_LongFileEntry));
+	char *longName = (char *)malloc(MAX_PATH_SIZE);
+	if (!buffer || !longEntries || !longName)
+	{
+		free(buffer);
+		free(longEntries);
+		free(longName);
+		return false;
+	}
+	index->Valid = true;
+	index->DirCluster = dirCluster;
+
+	FAT_FileEntry *entries = (FAT_FileEntry *)buffer;
+	uint32_t longCount = 0;
+	bool ok = true;
+	bool end = false;
+	uint32_t first;
+	for (uint32_t sectorIndex = 0; ok && !end && FAT_DirSector(dirCluster, sectorIndex, &first, dev);)
+	{
+		// the sectors of a cluster, or of the FAT12/16 root, follow each other
+		uint32_t sectors = 1;
+		uint32_t sector;
+		while (sectors < sectorsPerCluster && FAT_DirSector(dirCluster, sectorIndex + sectors, &sector, dev) && sector == first + sectors)
+		{
+			sectors++;
+		}
+		if (!FAT_ReadSectors(buffer, first, sectors, dev, NULL))
+		{
+			ok = false;
+			break;
+		}
+
+		for (uint32_t i = 0; i < sectors * FAT_ENTRIES_PER_SECTOR; i++)
+		{
+			FAT_FileEntry *entry = &entries[i];
+			if (entry->Entry.Name[0] == 0x00)
+			{
+				end = true;
+				break;
+			}
+			if (entry->Entry.Name[0] == FAT_DELETED)
+			{
+				longCount = 0;
+				continue;
+			}
+			if (entry->Entry.Attributes == FAT_ATTRIBUTE_LFN)
+			{
+				if (entry->LongEntry.Order & FAT_LFN_LAST)
+				{
+					longCount = 0;
+				}
+				if (longCount < FAT_MAX_LFN_ENTRIES)
+				{
+					longEntries[longCount++] = entry->LongEntry;
+				}
+				continue;
+			}
+			if (entry->Entry.Attributes & FAT_ATTRIBUTE_VOLUME_ID)
+			{
+				longCount = 0;
+				continue;
+			}
+
+			longName[0] = '\0';
+			if (longCount)
+			{
+				FAT_GetLfn(longEntries, longCount, longName);
+			}
+			if (!FAT_IndexAdd(index, &entry->Entry, sectorIndex * FAT_ENTRIES_PER_SECTOR + i, longCount, longName))
+			{
+				ok = false;
+				break;
+			}
+			longCount = 0;
+		}
+		sectorIndex += sectors;
+	}
+
+	free(longName);
+	free(longEntries);
+	free(buffer);
+	if (!ok)
+	{
+		FAT_FreeDirIndex(index);
+	}
+	return ok;
+}
+
+// the name index of a directory, built on first use and kept in step by FAT_EditEntries
+static FAT_DirIndex *FAT_GetDirIndex(uint32_t dirCluster, device_t *dev)
+{
+	FAT_DirIndex *victim = &FatData->DirIndexes[0];
+	for (int i = 0; i < FAT_DIR_INDEX_CACHE; i++)
+	{
+		FAT_DirIndex *index = &FatData->DirIndexes[i];
+		if (index->Valid && index->DirCluster == dirCluster)
+		{
+			index->LastUse = ++FatData->DirIndexClock;
+			return index;
+		}
+		if (!index->Valid || (victim->Valid && index->LastUse < victim->LastUse))
+		{
+			victim = index;
+		}
+	}
+
+	FAT_FreeDirIndex(victim);
+	if (!FAT_BuildDirIndex(victim, dirCluster, dev))
+	{
+		log_err(MODULE, "cannot index directory at cluster %u", dirCluster);
+		return NULL;
+	}
+	victim->LastUse = ++FatData->DirIndexClock;
+#if debugFAT == 1
+	log_debug(MODULE, "directory at %u: %u entries, %u names", dirCluster, victim->EntryCount, victim->NameCount);
+#endif
+	return victim;
+}
+
+static FAT_IndexEntry *FAT_IndexAtSlot(FAT_DirIndex *index, uint32_t slot)
+{
+	for (uint32_t i = 0; i < index->EntryCount; i++)
+	{
+		if (index->Entries[i].Slot == slot)
+		{
+			return &index->Entries[i];
+		}
+	}
+	return NULL;
+}
+
+// applies a write of count entries at slot, entries NULL deleting them, to the directory's index if it has one
+static void FAT_IndexEdit(uint32_t dirCluster, uint32_t slot, uint32_t count, const FAT_FileEntry *entries)
+{
+	FAT_DirIndex *index = NULL;
+	for (int i = 0; i < FAT_DIR_INDEX_CACHE; i++)
+	{
+		if (FatData->DirIndexes[i].Valid && FatData->DirIndexes[i].DirCluster == dirCluster)
+		{
+			index = &FatData->DirIndexes[i];
+		}
+	}
+	if (!index)
+	{
+		return;
+	}
+
+	FAT_LongFileEntry longEntries[FAT_MAX_LFN_ENTRIES];
+	char longName[MAX_PATH_SIZE];
+	uint32_t longCount = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		FAT_IndexEntry *old = FAT_IndexAtSlot(index, slot + i);
+		const FAT_DirectoryEntry *entry = entries ? &entries[i].Entry : NULL;
+		bool isShort = entry && entry->Name[0] != 0x00 && entry->Name[0] != FAT_DELETED &&
+					   entry->Attributes != FAT_ATTRIBUTE_LFN && !(entry->Attributes & FAT_ATTRIBUTE_VOLUME_ID);
+
+		// the same file with new size, cluster or times
+		if (old && isShort && memcmp(old->Entry.Name, entry->Name, 11) == 0)
+		{
+			memcpy(&old->Entry, entry, sizeof(FAT_DirectoryEntry));
+			longCount = 0;
+			continue;
+		}
+		if (old)
+		{
+			FAT_IndexRemove(index, old);
+		}
+		if (entry && entry->Attributes == FAT_ATTRIBUTE_LFN && longCount < FAT_MAX_LFN_ENTRIES)
+		{
+			longEntries[longCount++] = entries[i].LongEntry;
+			continue;
+		}
+		if (isShort)
+		{
+			longName[0] = '\0';
+			if (longCount)
+			{
+				FAT_GetLfn(longEntries, longCount, longName);
+			}
+			if (!FAT_IndexAdd(index, entry, slot + i, longCount, longName))
+			{
+				// built again on the next lookup
+				FAT_FreeDirIndex(index);
+				return;
+			}
+		}
+		longCount = 0;
+	}
+}
+
+// looks name up in one directory, matching the long or the short name without case
+static bool FAT_DirectoryLookup(uint32_t dirCluster, const char *name, FAT_DirectoryEntry *out, FAT_EntryLocation *loc, char *nameOut, device_t *dev)
+{
+	FAT_DirIndex *index = FAT_GetDirIndex(dirCluster, dev);
+	FAT_IndexEntry *entry = index ? FAT_IndexFind(index, name) : NULL;
+	if (!entry)
+	{
+		return false;
+	}
+	if (out)
+	{
+		memcpy(out, &entry->Entry, sizeof(FAT_DirectoryEntry));
+	}
+	if (loc)
+	{
+		loc->DirCluster = dirCluster;
+		loc->Index = entry->Slot;
+		loc->LongCount = entry->LongCount;
+	}
+	if (nameOut)
+	{
+		strcpy(nameOut, index->Pool + index->Names[entry->Name].Text);
+	}
+	return true;
+}
+
+// walks path from the root directory, false for the root itself
+static bool FAT_WalkPath(const char *path, FAT_DirectoryEntry *out, FAT_EntryLocation *loc, char *nameOut, device_t *dev)
+{
+	char name[MAX_PATH_SIZE];
+	uint32_t dirCluster = FAT_RootCluster();
+	bool found = false;
+	while (true)
+	{
+		while (*path == '/')
+		{
+			path++;
+		}
+		if (*path == '\0')
+		{
+			break;
+		}
+
+		if (found)
+		{
+			if (!(out->Attributes & FAT_ATTRIBUTE_DIRECTORY))
+			{
+				return false;
+			}
+			dirCluster = GETCLUSTER(out->FirstClusterHigh, out->FirstClusterLow);
+			// ".." of a directory in the root points at cluster 0
+			if (dirCluster == 0)
+			{
+				dirCluster = FAT_RootCluster();
+			}
+		}
+
+		size_t length = 0;
+		while (path[length] && path[length] != '/')
+		{
+			length++;
+		}
+		if (length >= MAX_PATH_SIZE)
+		{
+			return false;
+		}
+		memcpy(name, path, length);
+		name[length] = '\0';
+		path += length;
+
+		if (!FAT_DirectoryLookup(dirCluster, name, out, loc, nameOut, dev))
+		{
+			return false;
+		}
+		found = true;
+	}
+	return found;
+}
+
+// first cluster of the directory at path, the root's for "/"
+static bool FAT_DirectoryCluster(const char *path, uint32_t *cluster, device_t *dev)
+{
+	FAT_DirectoryEntry entry;
+	const char *p = path;
+	while (*p == '/')
+	{
+		p++;
+	}
+	if (*p == '\0')
+	{
+		*cluster = FAT_RootCluster();
+		return true;
+	}
+	if (!FAT_WalkPath(path, &entry, NULL, NULL, dev) || !(entry.Attributes & FAT_ATTRIBUTE_DIRECTORY))
+	{
+		return false;
+	}
+	*cluster = GETCLUSTER(entry.FirstClusterHigh, entry.FirstClusterLow);
+	if (*cluster == 0)
+	{
+		*cluster = FAT_RootCluster();
+	}
+	return true;
+}
+
+// lists the directory at path into out, out->entries is allocated for the caller
+bool FAT_ReadDirectory(char *path, DirectoryEntries *out, device_t *dev, fatPrivData *priv)
+{
+	out->entries = NULL;
+	out->entryCount = 0;
+	uint32_t dirCluster;
+	if (!FAT_DirectoryCluster(path, &dirCluster, dev))
+	{
+		log_err(MODULE, "%s is not a directory", path);
+		return false;
+	}
+	FAT_DirIndex *index = FAT_GetDirIndex(dirCluster, dev);
+	if (!index)
+	{
+		return false;
+	}
+
+	out->entries = (DirectoryEntry *)calloc(max(index->EntryCount, 1u), sizeof(DirectoryEntry));
+	if (!out->entries)
+	{
+		return false;
+	}
+	for (uint32_t i = 0; i < index->EntryCount; i++)
+	{
+		FAT_IndexEntry *entry = &index->Entries[i];
+		if (entry->Slot == FAT_INDEX_NONE)
+		{
+			continue;
+		}
+		DirectoryEntry *listed = &out->entries[out->entryCount++];
+		strncpy(listed->name, index->Pool + index->Names[entry->Name].Text, MAX_PATH_SIZE - 1);
+		listed->IsDirectory = (entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) != 0;
+		listed->size = entry->Entry.Size;
+		listed->inode = FAT_EntryInode(&entry->Entry, index->DirCluster, entry->Slot, dev);
+	}
+	return true;
+}
+
+// splits "/a/b/c" into "/a/b" and "c"
+static bool FAT_SplitPath(const char *path, char *parent, char *name)
+{
+	size_t length = strlen(path);
+	while (length > 1 && path[length - 1] == '/')
+	{
+		length--;
+	}
+	size_t slash = length;
+	while (slash > 0 && path[slash - 1] != '/')
+	{
+		slash--;
+	}
+	if (slash == length || length - slash >= MAX_PATH_SIZE)
+	{
+		return false;
+	}
+	memcpy(name, path + slash, length - slash);
+	name[length - slash] = '\0';
+	if (slash <= 1)
+	{
+		strcpy(parent, "/");
+	}
+	else
+	{
+		memcpy(parent, path, slash - 1);
+		parent[slash - 1] = '\0';
+	}
+	return true;
+}
+
+static bool FAT_ReadDirEntry(uint32_t dirCluster, uint32_t index, FAT_FileEntry *out, device_t *dev)
+{
+	uint32_t sector;
+	uint32_t *buffer = (uint32_t *)malloc(SECTOR_SIZE);
+	bool ok = buffer && FAT_DirSector(dirCluster, index / FAT_ENTRIES_PER_SECTOR, &sector, dev) &&
+			  FAT_ReadSectors(buffer, sector, 1, dev, NULL);
+	if (ok)
+	{
+		memcpy(out, (FAT_FileEntry *)buffer + index % FAT_ENTRIES_PER_SECTOR, sizeof(FAT_FileEntry));
+	}
+	free(buffer);
+	return ok;
+}
+
+// writes count entries starting at index, or marks them deleted when entries is NULL; one write per sector
+static bool FAT_EditEntries(uint32_t dirCluster, uint32_t index, uint32_t count, const FAT_FileEntry *entries, device_t *dev)
+{
+	uint32_t *buffer = (uint32_t *)malloc(SECTOR_SIZE);
+	if (!buffer)
+	{
+		return false;
+	}
+	FAT_FileEntry *sectorEntries = (FAT_FileEntry *)buffer;
+	uint32_t sector = 0;
+	bool loaded = false;
+	bool ok = true;
+	for (uint32_t i = 0; i < count && ok; i++)
+	{
+		uint32_t entry = index + i;
+		if (!loaded || entry % FAT_ENTRIES_PER_SECTOR == 0)
+		{
+			if (loaded)
+			{
+				ok = FAT_WriteSectors(buffer, sector, 1, dev, NULL);
+			}
+			ok = ok && FAT_DirSector(dirCluster, entry / FAT_ENTRIES_PER_SECTOR, &sector, dev) &&
+				 FAT_ReadSectors(buffer, sector, 1, dev, NULL);
+			loaded = ok;
+			if (!ok)
+			{
+				break;
+			}
+		}
+		if (entries)
+		{
+			memcpy(&sectorEntries[entry % FAT_ENTRIES_PER_SECTOR], &entries[i], sizeof(FAT_FileEntry));
+		}
+		else
+		{
+			sectorEntries[entry % FAT_ENTRIES_PER_SECTOR].Entry.Name[0] = FAT_DELETED;
+		}
+	}
+	if (loaded && ok)
+	{
+		ok = FAT_WriteSectors(buffer, sector, 1, dev, NULL);
+	}
+	free(buffer);
+	if (ok)
+	{
+		FAT_IndexEdit(dirCluster, index, count, entries);
+	}
+	else
+	{
+		FAT_DropDirIndex(dirCluster);
+	}
+	return ok;
+}
+
+static bool FAT_ZeroClusters(uint32_t cluster, uint32_t count, device_t *dev)
+{
+	uint32_t sectorsPerCluster = BOOTSECTOR.SectorsPerCluster;
+	uint8_t *zero = (uint8_t *)calloc(sectorsPerCluster, SECTOR_SIZE);
+	if (!zero)
+	{
+		return false;
+	}
+	bool ok = true;
+	for (uint32_t i = 0; i < count && ok && cluster >= 2; i++)
+	{
+		ok = FAT_WriteSectors(zero, GETSECTOR(cluster), sectorsPerCluster, dev, NULL);
+		cluster = FAT_NextCluster(cluster, dev);
+	}
+	free(zero);
+	return ok;
+}
+
+// finds count free entries in a row, growing the directory by zeroed clusters when it is full
+static bool FAT_FindFreeEntries(uint32_t dirCluster, uint32_t count, uint32_t *index, device_t *dev)
+{
+	uint32_t *buffer = (uint32_t *)malloc(SECTOR_SIZE);
+	if (!buffer)
+	{
+		return false;
+	}
+	FAT_FileEntry *entries = (FAT_FileEntry *)buffer;
+	uint32_t run = 0;
+	uint32_t runStart = 0;
+	uint32_t sectorIndex = 0;
+	uint32_t sector;
+	for (; FAT_DirSector(dirCluster, sectorIndex, &sector, dev); sectorIndex++)
+	{
+		if (!FAT_ReadSectors(buffer, sector, 1, dev, NULL))
+		{
+			free(buffer);
+			return false;
+		}
+		for (uint32_t i = 0; i < FAT_ENTRIES_PER_SECTOR; i++)
+		{
+			uint8_t first = entries[i].Entry.Name[0];
+			if (first != 0x00 && first != FAT_DELETED)
+			{
+				run = 0;
+				continue;
+			}
+			if (run == 0)
+			{
+				runStart = sectorIndex * FAT_ENTRIES_PER_SECTOR + i;
+			}
+			if (++run == count)
+			{
+				*index = runStart;
+				free(buffer);
+				return true;
+			}
+		}
+	}
+	free(buffer);
+
+	if (dirCluster == 0)
+	{
+		log_err(MODULE, "the root directory is full");
+		return false;
+	}
+
+	FAT_ExtentMap *map = FAT_GetExtentMap(dirCluster, dev);
+	if (!map || map->Count == 0)
+	{
+		return false;
+	}
+	FAT_Extent *last = &map->Extents[map->Count - 1];
+	uint32_t lastCluster = last->FirstCluster + last->Length - 1;
+	uint32_t entriesPerCluster = BOOTSECTOR.SectorsPerCluster * FAT_ENTRIES_PER_SECTOR;
+	uint32_t clusters = (count - run + entriesPerCluster - 1) / entriesPerCluster;
+	if (run == 0)
+	{
+		runStart = sectorIndex * FAT_ENTRIES_PER_SECTOR;
+	}
+
+	uint32_t added = FAT_AllocateClusters(clusters, lastCluster, dev);
+	FAT_InvalidateExtents(dirCluster);
+	if (!added || !FAT_ZeroClusters(added, clusters, dev))
+	{
+		return false;
+	}
+	*index = runStart;
+	return true;
+}
+
+// true when nothing but "." and ".." is left in the directory
+static bool FAT_DirectoryIsEmpty(uint32_t dirCluster, device_t *dev)
+{
+	uint32_t *buffer = (uint32_t *)malloc(SECTOR_SIZE);
+	if (!buffer)
+	{
+		return false;
+	}
+	FAT_FileEntry *entries = (FAT_FileEntry *)buffer;
+	uint32_t sector;
+	for (uint32_t sectorIndex = 0; FAT_DirSector(dirCluster, sectorIndex, &sector, dev); sectorIndex++)
+	{
+		if (!FAT_ReadSectors(buffer, sector, 1, dev, NULL))
+		{
+			free(buffer);
+			return false;
+		}
+		for (uint32_t i = 0; i < FAT_ENTRIES_PER_SECTOR; i++)
+		{
+			FAT_DirectoryEntry *entry = &entries[i].Entry;
+			if (entry->Name[0] == 0x00)
+			{
+				free(buffer);
+				return true;
+			}
+			if (entry->Name[0] == FAT_DELETED || entry->Name[0] == '.' || entry->Attributes == FAT_ATTRIBUTE_LFN)
+			{
+				continue;
+			}
+			free(buffer);
+			return false;
+		}
+	}
+	free(buffer);
+	return true;
+}
+
+static bool FAT_IsShortNameChar(char c)
+{
+	return c > ' ' && c != '.' && !strchr("\"*+,/:;<=>?[\\]|", c);
+}
+
+// true when name fits 8.3 as it is, apart from case
+static bool FAT_IsShortName(const char *name)
+{
+	const char *dot = strchr(name, '.');
+	size_t base = dot ? (size_t)(dot - name) : strlen(name);
+	if (base == 0 || base > 8 || (dot && (strlen(dot + 1) == 0 || strlen(dot + 1) > 3)))
+	{
+		return false;
+	}
+	for (const char *c = name; *c; c++)
+	{
+		if (c != dot && !FAT_IsShortNameChar(*c))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// the 11 bytes of a short entry name, base padded to 8 and extension to 3
+static void FAT_PackShortName(const char *base, const char *ext, uint8_t *out)
+{
+	memset(out, ' ', 11);
+	for (int i = 0; i < 8 && base[i]; i++)
+	{
+		out[i] = toupper(base[i]);
+	}
+	for (int i = 0; ext && i < 3 && ext[i]; i++)
+	{
+		out[8 + i] = toupper(ext[i]);
+	}
+}
+
+// a short alias like "LONGNA~1.TXT" that is not taken in the directory yet
+static bool FAT_MakeAlias(uint32_t dirCluster, const char *name, uint8_t *out, device_t *dev)
+{
+	char stem[7] = {'\0'};
+	char ext[4] = {'\0'};
+	const char *dot = strrchr(name, '.');
+	size_t length = 0;
+	for (const char *c = name; *c && c != dot && length < 6; c++)
+	{
+		if (*c != ' ' && *c != '.')
+		{
+			stem[length++] = FAT_IsShortNameChar(*c) ? *c : '_';
+		}
+	}
+	if (length == 0)
+	{
+		stem[length++] = '_';
+	}
+	length = 0;
+	for (const char *c = dot ? dot + 1 : ""; *c && length < 3; c++)
+	{
+		if (*c != ' ')
+		{
+			ext[length++] = FAT_IsShortNameChar(*c) ? *c : '_';
+		}
+	}
+
+	// the stem gives way to longer numeric tails, the way VFAT counts on
+	for (uint32_t n = 1, limit = 10, digits = 1; n < 1000000; n++)
+	{
+		if (n == limit)
+		{
+			limit *= 10;
+			digits++;
+		}
+		char base[9];
+		char alias[13];
+		sprintf(base, "%.*s~%u", (int)min(strlen(stem), 7 - digits), stem, n);
+		sprintf(alias, ext[0] ? "%s.%s" : "%s", base, ext);
+		if (!FAT_DirectoryLookup(dirCluster, alias, NULL, NULL, NULL, dev))
+		{
+			FAT_PackShortName(base, ext, out);
+			return true;
+		}
+	}
+	log_err(MODULE, "no free short name for %s", name);
+	return false;
+}
+
+static uint8_t FAT_ShortNameChecksum(const uint8_t *name)
+{
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++)
+	{
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	}
+	return sum;
+}
+
+// fills count long name entries in the order they go on disk, the last part of the name first
+static void FAT_BuildLongEntries(const char *name, uint32_t count, uint8_t checksum, FAT_FileEntry *entries)
+{
+	size_t length = strlen(name);
+	for (uint32_t part = 0; part < count; part++)
+	{
+		uint16_t chars[13];
+		for (uint32_t c = 0; c < 13; c++)
+		{
+			size_t at = part * 13 + c;
+			// the name ends with one 0 and the rest is 0xFFFF
+			chars[c] = at < length ? (uint8_t)name[at] : at == length ? 0x0000 : 0xFFFF;
+		}
+
+		FAT_LongFileEntry *entry = &entries[count - 1 - part].LongEntry;
+		memset(entry, 0, sizeof(FAT_LongFileEntry));
+		entry->Order = (part + 1) | (part == count - 1 ? FAT_LFN_LAST : 0);
+		entry->Attribute = FAT_ATTRIBUTE_LFN;
+		entry->Checksum = checksum;
+		for (int c = 0; c < 5; c++)
+		{
+			entry->name1[c] = chars[c];
+		}
+		for (int c = 0; c < 6; c++)
+		{
+			entry->name2[c] = chars[5 + c];
+		}
+		for (int c = 0; c < 2; c++)
+		{
+			entry->name3[c] = chars[11 + c];
+		}
+	}
+}
+
+static void FAT_Now(uint16_t *date, uint16_t *time)
+{
+	datetime now;
+	rtc_read_datetime(&now);
+	*date = ((now.year + 2000 - 1980) << 9) | (now.month << 5) | now.day;
+	*time = ((now.hour & 0x7F) << 11) | ((now.minute % 60) << 5) | (now.second / 2);
+}
+
+// creates an empty file, or a directory with its "." and ".." entries
+static bool FAT_CreateEntry(char *path, uint8_t attributes, device_t *dev)
+{
+	char parent[MAX_PATH_SIZE];
+	char name[MAX_PATH_SIZE];
+	uint32_t dirCluster;
+	if (!FAT_SplitPath(path, parent, name) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	{
+		log_err(MODULE, "cannot create %s", path);
+		return false;
+	}
+	if (!FAT_DirectoryCluster(parent, &dirCluster, dev))
+	{
+		log_err(MODULE, "%s is not a directory", parent);
+		return false;
+	}
+	if (FAT_DirectoryLookup(dirCluster, name, NULL, NULL, NULL, dev))
+	{
+		log_err(MODULE, "%s exists already", path);
+		return false;
+	}
+
+	uint8_t shortName[11];
+	uint32_t longCount = 0;
+	if (FAT_IsShortName(name))
+	{
+		const char *dot = strchr(name, '.');
+		char base[9] = {'\0'};
+		memcpy(base, name, dot ? (size_t)(dot - name) : strlen(name));
+		FAT_PackShortName(base, dot ? dot + 1 : NULL, shortName);
+	}
+	else
+	{
+		longCount = (strlen(name) + 12) / 13;
+		if (longCount > FAT_MAX_LFN_ENTRIES || !FAT_MakeAlias(dirCluster, name, shortName, dev))
+		{
+			log_err(MODULE, "cannot name %s", path);
+			return false;
+		}
+	}
+
+	FAT_FileEntry *entries = (FAT_FileEntry *)calloc(longCount + 1, sizeof(FAT_FileEntry));
+	if (!entries)
+	{
+		return false;
+	}
+	FAT_BuildLongEntries(name, longCount, FAT_ShortNameChecksum(shortName), entries);
+	FAT_DirectoryEntry *entry = &entries[longCount].Entry;
+	memcpy(entry->Name, shortName, 11);
+	entry->Attributes = attributes;
+	uint16_t date, time;
+	FAT_Now(&date, &time);
+	entry->CreatedDate = entry->ModifiedDate = entry->AccessedDate = date;
+	entry->CreatedTime = entry->ModifiedTime = time;
+
+	uint32_t cluster = 0;
+	if (attributes & FAT_ATTRIBUTE_DIRECTORY)
+	{
+		cluster = FAT_AllocateClusters(1, 0, dev);
+		if (!cluster || !FAT_ZeroClusters(cluster, 1, dev))
+		{
+			free(entries);
+			return false;
+		}
+		entry->FirstClusterHigh = cluster >> 16;
+		entry->FirstClusterLow = cluster & 0xFFFF;
+
+		FAT_FileEntry dots[2];
+		memset(dots, 0, sizeof(dots));
+		dots[0].Entry = *entry;
+		memcpy(dots[0].Entry.Name, ".          ", 11);
+		dots[1].Entry = *entry;
+		memcpy(dots[1].Entry.Name, "..         ", 11);
+		uint32_t parentCluster = dirCluster == FAT_RootCluster() ? 0 : dirCluster;
+		dots[1].Entry.FirstClusterHigh = parentCluster >> 16;
+		dots[1].Entry.FirstClusterLow = parentCluster & 0xFFFF;
+		FAT_EditEntries(cluster, 0, 2, dots, dev);
+	}
+
+	uint32_t index;
+	bool ok = FAT_FindFreeEntries(dirCluster, longCount + 1, &index, dev) &&
+			  FAT_EditEntries(dirCluster, index, longCount + 1, entries, dev);
+	if (!ok && cluster)
+	{
+		FAT_FreeChain(cluster, dev);
+	}
+	free(entries);
+	return FAT_FlushTable(dev) && ok;
+}
+
+static bool FAT_LookupEntry(char *path, FAT_DirectoryEntry *ret, FAT_EntryLocation *loc, char *nameOut, device_t *dev)
+{
+	if (!path || path[0] != '/')
+	{
+		log_crit(MODULE, "Only absolute paths are supported");
+		return false;
+	}
+	return FAT_WalkPath(path, ret, loc, nameOut, dev);
+}
+
+bool FAT_FindEntry(char *path, void *ret, device_t *dev, fatPrivData *priv)
+{
+	DirectoryEntry *dirRet = (DirectoryEntry *)ret;
+	FAT_DirectoryEntry entry;
+	FAT_EntryLocation loc;
+	if (!FAT_LookupEntry(path, &entry, &loc, dirRet->name, dev))
+	{
+		return false;
 	}
 
-	free(buffer);
-
-	if (filename && (uint32_t)filename != 1)
-		return false;
+	dirRet->IsDirectory = (entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) == FAT_ATTRIBUTE_DIRECTORY;
+	dirRet->size = entry.Size;
+	dirRet->inode = FAT_EntryInode(&entry, loc.DirCluster, loc.Index, dev);
 	return true;
 }
-bool FAT_ReadDirectory(char *filename, uint8_t *tempDir, device_t *dev, fatPrivData *priv)
+
+bool FAT_Open(char *path, void **handle, device_t *dev, fatPrivData *priv)
 {
-#if debugFAT == 1
-	log_debug(MODULE, "entered FAT_ReadDirectory(%s, %p, %p, %p)", filename, tempDir, dev, priv);
-#endif
-	FAT_Directory *dir = (FAT_Directory *)tempDir;
-	if (!filename || !tempDir || !dev || !priv)
+	FAT_DirectoryEntry entry;
+	FAT_EntryLocation loc;
+	if (!FAT_LookupEntry(path, &entry, &loc, NULL, dev))
 	{
-		log_crit(MODULE, "Invalid arguments");
 		return false;
 	}
 
-	if (filename[0] != '/')
+	FAT_FileData *file = (FAT_FileData *)calloc(1, sizeof(FAT_FileData));
+	if (!file)
 	{
-		log_crit(MODULE, "Only absolute paths are supported %s", filename);
 		return false;
 	}
-
-	if (!filename)
+	file->Buffer = (uint8_t *)malloc(SECTOR_SIZE);
+	if (!file->Buffer)
 	{
-		log_crit(MODULE, "filename is null, Filepath is invalid");
+		free(file);
 		return false;
 	}
+	file->Opened = true;
+	file->Public.IsDirectory = (entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) == FAT_ATTRIBUTE_DIRECTORY;
+	file->Public.Size = entry.Size;
+	file->FirstCluster = GETCLUSTER(entry.FirstClusterHigh, entry.FirstClusterLow);
+	file->Location = loc;
+	file->NextOpen = g_OpenFiles;
+	g_OpenFiles = file;
+	*handle = file;
+	return true;
+}
 
-	FAT_ReadRootDirectory((char *)1, dev, priv);
-	if (FatData->RootDirectory.entryCount == 0)
+void FAT_Close(void *handle, device_t *dev, fatPrivData *priv)
+{
+	FAT_FileData *file = (FAT_FileData *)handle;
+	if (!file)
 	{
-		log_crit(MODULE, "Root directory has no entries");
-		return false;
+		return;
 	}
-
-	char *segment = strtok(filename, "/");
-	log_debug(MODULE, "segment = %s from %s", segment, filename);
-	if (segment == NULL)
+	FAT_FileData **link = &g_OpenFiles;
+	while (*link && *link != file)
 	{
-		log_crit(MODULE, "Filepath is invalid");
-		return false;
+		link = &(*link)->NextOpen;
 	}
+	if (*link)
+	{
+		*link = file->NextOpen;
+	}
+	free(file->Buffer);
+	free(file);
+}
 
-	FAT_FileEntry *entry = NULL;
-	FAT_Directory currentDir = FatData->RootDirectory;
-
-	while (segment)
+// whole sectors move straight between buf and the disk, the partial ones at either end go through file->Buffer
+static int32_t FAT_TransferAt(FAT_FileData *file, uint8_t *buf, uint32_t offset, uint32_t length, bool write, device_t *dev, fatPrivData *priv)
+{
+	if (file->Public.IsDirectory || offset >= file->Public.Size)
 	{
-		char shortName[13] = {' '};
-		getShortName(segment, shortName);
-#if debugFAT == 1
-		log_debug(MODULE, "shortName = %s segment = %s", shortName, segment);
+		return 0;
+	}
+	length = min(length, file->Public.Size - offset);
 
-		log_debug(MODULE, "currentDir count %u", currentDir.entryCount);
-#endif
+	uint32_t done = 0;
+	bool failed = false;
+	while (done < length && !failed)
+	{
+		uint32_t position = offset + done;
+		uint32_t sector = position / SECTOR_SIZE;
+		uint32_t within = position % SECTOR_SIZE;
 
-		for (int i = 0; i < currentDir.entryCount; i++)
+		if (within == 0 && length - done >= SECTOR_SIZE)
 		{
-			FAT_FileEntry *dirEntry = &currentDir.entries[i];
-			log_debug(MODULE, "%u: %s 0x%X", i, dirEntry->Entry.Name, dirEntry->Entry.Attributes);
-
-			if ((dirEntry->Entry.Attributes & FAT_ATTRIBUTE_LFN) == 0) // short name 8.3
-			{
-				char entryName[13] = {' '};
-				memcpy(entryName, dirEntry->Entry.Name, 11);
-
-				log_debug(MODULE, "entry name: %s segment: %s", entryName, shortName);
-
-				if (strcmp(shortName, entryName) == 0)
-				{
-					entry = dirEntry;
-					log_info(MODULE, "Found %s", shortName);
-					break;
-				}
-			}
-			else
+			uint32_t sectors = (length - done) / SECTOR_SIZE;
+			failed = !FAT_TransferSectors(buf + done, file->FirstCluster, sector, sectors, write, dev, priv);
+			if (!failed)
 			{
+				done += sectors * SECTOR_SIZE;
 			}
+			continue;
 		}
 
-		if (!entry)
-		{
-			log_crit(MODULE, "File or directory not found: %s", segment);
-			return false;
-		}
-
-		char *segment1 = strtok(NULL, "/");
-		// If this is the last segment, we've found the file
-		if (segment1 == NULL)
+		uint32_t part = min(SECTOR_SIZE - within, length - done);
+		failed = !FAT_TransferSectors(file->Buffer, file->FirstCluster, sector, 1, false, dev, priv);
+		if (failed)
 		{
 			break;
 		}
-		segment = segment1;
-
-		// Otherwise, move into the directory
-		if (!(entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY))
+		if (write)
 		{
-			log_crit(MODULE, "%s is not a directory", segment);
-			return false;
-		}
-		uint8_t *buffer = (uint8_t *)malloc(priv->BytesPerCluster);
-		FAT_GetDir(&entry->Entry, &currentDir, buffer, dev, priv);
-		segment = strtok(NULL, "/");
-		free(buffer);
-	}
-#if debugFAT == 1
-	log_info(MODULE, "entry: name: %s, attr: %X, size: %u", entry->Entry.Name, entry->Entry.Attributes, entry->Entry.Size);
-#endif
-	// Read file data
-	if ((entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) == FAT_ATTRIBUTE_DIRECTORY)
-	{
-		log_info(MODULE, "Reading file %s", entry->Entry.Name);
-		uint32_t firstCluster = GETCLUSTER(entry->Entry.FirstClusterHigh, entry->Entry.FirstClusterLow);
-		log_info(MODULE, "FAT_ReadClusters(%p, %u, 1)", dir->entries, firstCluster);
-		FAT_ReadClusters((uint8_t *)dir->entries, firstCluster, 1, dev, priv);
-		int index = 0;
-		dir->entryCount = 0;
-		while (true)
-		{
-			log_info(MODULE, "entry: name: %s, attr: %X, size: %u", dir->entries[index].Entry.Name, dir->entries[index].Entry.Attributes, dir->entries[index].Entry.Size);
-			if (dir->entries[index].Entry.Name[0] != '\0')
+			memcpy(file->Buffer + within, buf + done, part);
+			failed = !FAT_TransferSectors(file->Buffer, file->FirstCluster, sector, 1, true, dev, priv);
+			if (failed)
 			{
-				index++;
-				dir->entryCount++;
-				continue;
+				break;
 			}
-			break;
 		}
-
-		return true;
-	}
-	log_crit(MODULE, "found nothing in FAT_ReadDirectory");
-	return false;
-}
-bool FAT_ReadFile(char *fileName, uint8_t *buffer, device_t *dev, fatPrivData *priv)
-{
-#if debugFAT == 1
-	log_debug(MODULE, "entered FAT_ReadFile(%s, %p, %p, %p)", fileName, buffer, dev, priv);
-#endif
-	if (!fileName || !buffer || !dev || !priv)
-	{
-		log_crit(MODULE, "Invalid arguments");
-		return false;
+		else
+		{
+			memcpy(buf + done, file->Buffer + within, part);
+		}
+		done += part;
 	}
 
-	if (fileName[0] != '/')
+	file->Public.Position = offset + done;
+	if (failed && done == 0)
 	{
-		log_crit(MODULE, "Only absolute paths are supported %s", fileName);
-		return false;
+		log_err(MODULE, "%s of %u bytes at %u failed", write ? "write" : "read", length, offset);
+		return -1;
 	}
+	return done;
+}
 
-	if (!fileName)
-	{
-		log_crit(MODULE, "fileName is null, Filepath is invalid");
-		return false;
-	}
+bool FAT_Create(char *path, device_t *dev, fatPrivData *priv)
+{
+	return FAT_CreateEntry(path, FAT_ATTRIBUTE_ARCHIVE, dev);
+}
+
+bool FAT_Mkdir(char *path, device_t *dev, fatPrivData *priv)
+{
+	return FAT_CreateEntry(path, FAT_ATTRIBUTE_DIRECTORY, dev);
+}
 
-	FAT_ReadRootDirectory((char *)1, dev, priv);
-	if (FatData->RootDirectory.entryCount == 0)
+// removes a file or an empty directory, its long name entries go with it
+bool FAT_Delete(char *path, device_t *dev, fatPrivData *priv)
+{
+	char parent[MAX_PATH_SIZE];
+	char name[MAX_PATH_SIZE];
+	// "." and ".." are the directory itself and its parent, removing them would free clusters still in use
+	if (!FAT_SplitPath(path, parent, name) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
 	{
-		log_crit(MODULE, "Root directory has no entries");
+		log_err(MODULE, "cannot remove %s", path);
 		return false;
 	}
-	char *copyPath = malloc(MAX_PATH_SIZE);
-	strcpy(copyPath, fileName);
 
-	char *segment = strtok(fileName, "/");
-	log_debug(MODULE, "segment = %s from %s", segment, fileName);
-	if (segment == NULL)
+	FAT_DirectoryEntry entry;
+	FAT_EntryLocation loc;
+	if (!FAT_WalkPath(path, &entry, &loc, NULL, dev))
 	{
-		strcpy(fileName, copyPath);
-		free(copyPath);
-		log_crit(MODULE, "Filepath is invalid");
+		log_err(MODULE, "%s not found", path);
 		return false;
 	}
-
-	FAT_FileEntry *entry = NULL;
-	FAT_Directory currentDir = FatData->RootDirectory;
-
-	int i = 0;
-	while (segment)
+	for (FAT_FileData *open = g_OpenFiles; open; open = open->NextOpen)
 	{
-		// init things
-		log_debug(MODULE, "currentDir count %u", currentDir.entryCount);
-
-		for (i = 0; i < currentDir.entryCount; i++)
-		{
-			char entryName[MAX_PATH_SIZE] = {'\0'};
-			char segmentName[MAX_PATH_SIZE] = {'\0'};
-			FAT_FileEntry *dirEntry = &currentDir.entries[i];
-			log_debug(MODULE, "%u: %s 0x%X", i, dirEntry->Entry.Name, dirEntry->Entry.Attributes);
-			if ((dirEntry->Entry.Attributes & FAT_ATTRIBUTE_LFN) == 0)
-			{
-				strncpy(entryName, (char *)dirEntry->Entry.Name, 11);
-				FAT_GetFATName(segment, segmentName, false);
-			}
-			else
-			{
-				int LFNcount = dirEntry->Entry.Name[0] - 0x40;
-				FAT_GetFATName(segment, segmentName, true);
-				if (LFNcount == 1)
-				{
-					segmentName[0] = '\0';
-					continue;
-				}
-				// log_debug(MODULE, "name: %s, %u, count %u", dirEntry->Entry.Name, dirEntry->Entry.Name[0], LFNcount);
-				FAT_LongFileEntry LFNentries[LFNcount];
-				for (size_t d = 0; d < LFNcount; d++)
-				{
-					LFNentries[d] = currentDir.entries[i].LongEntry;
-					i++;
-				}
-
-				FAT_GetLfn(LFNentries, LFNcount, entryName);
-			}
-
-			if (entryName[0] != '\0' && segmentName[0] != '\0')
-			{
-#if debugFAT == 1
-				fprintf(VFS_FD_DEBUG, "entryName = \"");
-				for (size_t c = 0; c < 13; c++)
-				{
-					if (entryName[c + 1] == '\0')
-					{
-						fprintf(VFS_FD_DEBUG, "%X", entryName[c]);
-						break;
-					}
-					fprintf(VFS_FD_DEBUG, "%X ", entryName[c]);
-				}
-				fprintf(VFS_FD_DEBUG, "\" segment = \"");
-				for (size_t c = 0; c < 13; c++)
-				{
-					if (segmentName[c + 1] == '\0')
-					{
-						fprintf(VFS_FD_DEBUG, "%X", segmentName[c]);
-						break;
-					}
-					fprintf(VFS_FD_DEBUG, "%X ", segmentName[c]);
-				}
-				fprintf(VFS_FD_DEBUG, "\"\n");
-
-				log_debug(MODULE, "entryName = %s segment = %s", entryName, segmentName);
-#endif
-				if (strcmp(segmentName, entryName) == 0)
-				{
-					log_info(MODULE, "Found %s", segmentName);
-					entry = dirEntry;
-					break;
-				}
-			}
-		}
-		if (!entry)
-		{
-			strcpy(fileName, copyPath);
-			free(copyPath);
-			log_crit(MODULE, "File or directory not found: %s", segment);
-			return false;
-		}
-
-		char *segment1 = strtok(NULL, "/");
-		log_debug(MODULE, "segment1 = %s", segment1);
-		// If this is the last segment, we've found the file
-		if (segment1 == NULL)
-		{
-			break;
-		}
-		segment = segment1;
-
-		// Otherwise, move into the directory
-		if (!(entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY))
+		if (open->Location.DirCluster == loc.DirCluster && open->Location.Index == loc.Index)
 		{
-			strcpy(fileName, copyPath);
-			free(copyPath);
-			log_crit(MODULE, "%s is not a directory", segment1);
+			log_err(MODULE, "%s is busy", path);
 			return false;
 		}
-
-		FAT_GetDir(&entry->Entry, &currentDir, NULL, dev, priv);
 	}
-
-	strcpy(fileName, copyPath);
-	free(copyPath);
-	// Read file data
-	if ((entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) == 0)
+	uint32_t cluster = GETCLUSTER(entry.FirstClusterHigh, entry.FirstClusterLow);
+	if ((entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) && !FAT_DirectoryIsEmpty(cluster, dev))
 	{
-		log_info(MODULE, "Reading file %s", entry->Entry.Name);
-		uint32_t firstCluster = GETCLUSTER(entry->Entry.FirstClusterHigh, entry->Entry.FirstClusterLow);
-		FAT_ReadClusters(buffer, firstCluster, entry->Entry.Size, dev, priv);
-		return true;
+		log_err(MODULE, "%s is not empty", path);
+		return false;
 	}
-	return false;
-}
 
-bool FAT_WriteFile(char *fileName, uint8_t *buffer, device_t *dev, fatPrivData *priv)
-{
-	if (!fileName || !buffer || !dev || !priv)
+	if (!FAT_EditEntries(loc.DirCluster, loc.Index - loc.LongCount, loc.LongCount + 1, NULL, dev))
 	{
-		log_crit(MODULE, "Invalid arguments");
 		return false;
 	}
-
-	if (fileName[0] != '/')
+	if (entry.Attributes & FAT_ATTRIBUTE_DIRECTORY)
 	{
-		log_crit(MODULE, "Only absolute paths are supported %s", fileName);
-		return false;
+		FAT_DropDirIndex(cluster);
 	}
+	FAT_FreeChain(cluster, dev);
+	return FAT_FlushTable(dev);
+}
 
-	if (!fileName)
+// writes size, first cluster and modification time of an open file back to its directory entry
+static bool FAT_UpdateEntry(FAT_FileData *file, device_t *dev)
+{
+	FAT_FileEntry entry;
+	if (!FAT_ReadDirEntry(file->Location.DirCluster, file->Location.Index, &entry, dev))
 	{
-		log_crit(MODULE, "fileName is null, Filepath is invalid");
 		return false;
 	}
+	entry.Entry.Size = file->Public.Size;
+	entry.Entry.FirstClusterHigh = file->FirstCluster >> 16;
+	entry.Entry.FirstClusterLow = file->FirstCluster & 0xFFFF;
+	uint16_t date, time;
+	FAT_Now(&date, &time);
+	entry.Entry.ModifiedDate = date;
+	entry.Entry.ModifiedTime = time;
+	return FAT_EditEntries(file->Location.DirCluster, file->Location.Index, 1, &entry, dev);
+}
 
-	FAT_ReadRootDirectory((char *)1, dev, priv);
-	if (FatData->RootDirectory.entryCount == 0)
+// another handle on the same file may have given it its first cluster or a new size since
+static bool FAT_RefreshHandle(FAT_FileData *file, device_t *dev)
+{
+	FAT_FileEntry entry;
+	if (!FAT_ReadDirEntry(file->Location.DirCluster, file->Location.Index, &entry, dev))
 	{
-		log_crit(MODULE, "Root directory has no entries");
 		return false;
 	}
+	file->FirstCluster = GETCLUSTER(entry.Entry.FirstClusterHigh, entry.Entry.FirstClusterLow);
+	file->Public.Size = entry.Entry.Size;
+	return true;
+}
 
-	char *segment = strtok(fileName, "/");
-	log_debug(MODULE, "segment = %s from %s", segment, fileName);
-	if (segment == NULL)
+// grows or shrinks the cluster chain to hold size bytes, all FAT changes go out in one flush
+static bool FAT_Resize(FAT_FileData *file, uint32_t size, device_t *dev)
+{
+	uint32_t bytesPerCluster = BOOTSECTOR.SectorsPerCluster * SECTOR_SIZE;
+	uint32_t needed = (uint32_t)(((uint64_t)size + bytesPerCluster - 1) / bytesPerCluster);
+	FAT_ExtentMap *map = file->FirstCluster >= 2 ? FAT_GetExtentMap(file->FirstCluster, dev) : NULL;
+	if (file->FirstCluster >= 2 && !map)
 	{
-		log_crit(MODULE, "Filepath is invalid");
 		return false;
 	}
+	uint32_t have = map ? map->ClusterCount : 0;
 
-	FAT_FileEntry *entry = NULL;
-	FAT_Directory currentDir = FatData->RootDirectory;
-
-	while (segment)
+	if (needed > have)
 	{
-		char shortName[13] = {' '};
-		getShortName(segment, shortName);
-		log_debug(MODULE, "shortName = %s segment = %s", shortName, segment);
-
-		log_debug(MODULE, "currentDir count %u", currentDir.entryCount);
-
-		for (int i = 0; i < currentDir.entryCount; i++)
+		uint32_t last = 0;
+		if (have)
 		{
-			FAT_FileEntry *dirEntry = &currentDir.entries[i];
-			log_debug(MODULE, "%u: %s 0x%X", i, dirEntry->Entry.Name, dirEntry->Entry.Attributes);
-
-			if ((dirEntry->Entry.Attributes & FAT_ATTRIBUTE_LFN) == 0) // short name 8.3
-			{
-				char entryName[13] = {' '};
-				memcpy(entryName, dirEntry->Entry.Name, 11);
-
-				log_debug(MODULE, "entry name: %s segment: %s", entryName, shortName);
-
-				if (strcmp(shortName, entryName) == 0)
-				{
-					entry = dirEntry;
-					log_info(MODULE, "Found %s", shortName);
-					break;
-				}
-			}
-			else
-			{
-			}
+			FAT_Extent *extent = &map->Extents[map->Count - 1];
+			last = extent->FirstCluster + extent->Length - 1;
 		}
-
-		if (!entry)
+		uint32_t added = FAT_AllocateClusters(needed - have, last, dev);
+		if (!added)
 		{
-			log_crit(MODULE, "File or directory not found: %s", segment);
+			FAT_FlushTable(dev);
 			return false;
 		}
-
-		char *segment1 = strtok(NULL, "/");
-		// If this is the last segment, we've found the file
-		if (segment1 == NULL)
+		if (have)
 		{
-			break;
+			FAT_InvalidateExtents(file->FirstCluster);
 		}
-		segment = segment1;
-
-		// Otherwise, move into the directory
-		if (!(entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY))
+		else
 		{
-			log_crit(MODULE, "%s is not a directory", segment);
-			return false;
+			file->FirstCluster = added;
 		}
-		uint8_t *buffer = (uint8_t *)malloc(priv->BytesPerCluster);
-		FAT_GetDir(&entry->Entry, &currentDir, buffer, dev, priv);
-		segment = strtok(NULL, "/");
-		free(buffer);
 	}
-
-	// Read file data
-	if ((entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) != FAT_ATTRIBUTE_DIRECTORY)
+	else if (needed < have)
 	{
-		log_info(MODULE, "Writing file %s", entry->Entry.Name);
-		uint32_t firstCluster = GETCLUSTER(entry->Entry.FirstClusterHigh, entry->Entry.FirstClusterLow);
-		FAT_WriteClusters(buffer, firstCluster, entry->Entry.Size, dev, priv);
-		return true;
+		if (needed == 0)
+		{
+			FAT_FreeChain(file->FirstCluster, dev);
+			file->FirstCluster = 0;
+		}
+		else
+		{
+			FAT_Extent *extent = &map->Extents[FAT_FindExtent(map, needed - 1)];
+			uint32_t lastKept = extent->FirstCluster + needed - 1 - extent->FileCluster;
+			uint32_t next = FAT_NextCluster(lastKept, dev);
+			FAT_SetCluster(lastKept, FAT_EndOfChain(), dev);
+			FAT_FreeChain(next, dev);
+			FAT_InvalidateExtents(file->FirstCluster);
+		}
 	}
-	return false;
+
+	file->Public.Size = size;
+	bool ok = FAT_UpdateEntry(file, dev);
+	return FAT_FlushTable(dev) && ok;
 }
 
-bool FAT_FindEntry(char *path, void *ret, device_t *dev, fatPrivData *priv)
+static bool FAT_ZeroRange(FAT_FileData *file, uint32_t from, uint32_t to, device_t *dev, fatPrivData *priv)
 {
-#if debugFAT == 1
-	log_debug(MODULE, "entered FAT_FindEntry(%s, %p, %p)", path, dev, priv);
-#endif
-	if (!path || !dev || !priv)
+	uint32_t chunk = BOOTSECTOR.SectorsPerCluster * SECTOR_SIZE;
+	uint8_t *zero = (uint8_t *)calloc(1, chunk);
+	if (!zero)
 	{
-		log_crit(MODULE, "Invalid arguments");
 		return false;
 	}
-	DirectoryEntry *dirRet = (DirectoryEntry *)ret;
-
-	if (path[0] != '/')
+	bool ok = true;
+	while (from < to && ok)
 	{
-		log_crit(MODULE, "Only absolute paths are supported");
-		return false;
+		uint32_t length = min(chunk, to - from);
+		ok = FAT_TransferAt(file, zero, from, length, true, dev, priv) == (int32_t)length;
+		from += length;
 	}
+	free(zero);
+	return ok;
+}
 
-	if (!path)
+// sets the file size, what it grows by reads back as zeros
+bool FAT_Truncate(void *handle, uint32_t size, device_t *dev, fatPrivData *priv)
+{
+	FAT_FileData *file = (FAT_FileData *)handle;
+	if (file->Public.IsDirectory || !FAT_RefreshHandle(file, dev))
 	{
-		log_crit(MODULE, "fileName is null, Filepath is invalid");
 		return false;
 	}
-
-	FAT_ReadRootDirectory((char *)1, dev, priv);
-	if (FatData->RootDirectory.entryCount == 0)
+	uint32_t oldSize = file->Public.Size;
+	if (!FAT_Resize(file, size, dev))
 	{
-		log_crit(MODULE, "Root directory has no entries");
 		return false;
 	}
-	char *copyPath = malloc(MAX_PATH_SIZE);
-	strcpy(copyPath, path);
-
-	FAT_FileEntry *entry = NULL;
-	FAT_Directory currentDir = FatData->RootDirectory;
-
-	char *segment;
+	return size <= oldSize || FAT_ZeroRange(file, oldSize, size, dev, priv);
+}
 
-	// a count for the number of '/' in path
-	int count = strcount((string)path, '/');
-	segment = strtok(path, "/");
-	if (segment == NULL)
+// keeps a window of sectors in flight ahead of a reader that goes through the file in order
+static void FAT_Readahead(FAT_FileData *file, bool sequential, device_t *dev)
+{
+	if (!sequential)
 	{
-		strcpy(path, copyPath);
-		free(copyPath);
-		log_crit(MODULE, "Filepath is invalid");
-		return false;
+		file->ReadaheadWindow = 0;
+		file->ReadaheadEnd = 0;
+		return;
 	}
-	size_t i = 0;
-	// while (segment != NULL)
-	while (segment)
+	if (file->ReadaheadWindow == 0)
 	{
-		// init things
-
-		for (i = 0; i < currentDir.entryCount; i++)
-		{
-			char entryName[MAX_PATH_SIZE] = {'\0'};
-			char segmentName[MAX_PATH_SIZE] = {'\0'};
-			FAT_FileEntry *dirEntry = &currentDir.entries[i];
-			log_debug(MODULE, "%u: %s 0x%X", i, dirEntry->Entry.Name, dirEntry->Entry.Attributes);
-			if ((dirEntry->Entry.Attributes & FAT_ATTRIBUTE_LFN) == 0)
-			{
-				strncpy(entryName, (char *)dirEntry->Entry.Name, 11);
-				FAT_GetFATName(segment, segmentName, false);
-			}
-			else
-			{
-				int LFNcount = dirEntry->Entry.Name[0] - 0x40;
-				FAT_GetFATName(segment, segmentName, true);
-				if (LFNcount == 1)
-				{
-					segmentName[0] = '\0';
-					continue;
-				}
-				// log_debug(MODULE, "name: %s, %u, count %u", dirEntry->Entry.Name, dirEntry->Entry.Name[0], LFNcount);
-				FAT_LongFileEntry LFNentries[LFNcount];
-				for (size_t d = 0; d < LFNcount; d++)
-				{
-					LFNentries[d] = currentDir.entries[i].LongEntry;
-					i++;
-				}
-
-				FAT_GetLfn(LFNentries, LFNcount, entryName);
-				// log_debug(MODULE, "output from FAT_GetLfn %s", entryName);
-			}
-
-			if (entryName[0] != '\0' && segmentName[0] != '\0')
-			{
-#if debugFAT == 1
-				fprintf(VFS_FD_DEBUG, "entryName = \"");
-				for (size_t c = 0; c < 13; c++)
-				{
-					if (entryName[c + 1] == '\0')
-					{
-						fprintf(VFS_FD_DEBUG, "%X", entryName[c]);
-						break;
-					}
-					fprintf(VFS_FD_DEBUG, "%X ", entryName[c]);
-				}
-				fprintf(VFS_FD_DEBUG, "\" segment = \"");
-				for (size_t c = 0; c < 13; c++)
-				{
-					if (segmentName[c + 1] == '\0')
-					{
-						fprintf(VFS_FD_DEBUG, "%X", segmentName[c]);
-						break;
-					}
-					fprintf(VFS_FD_DEBUG, "%X ", segmentName[c]);
-				}
-				fprintf(VFS_FD_DEBUG, "\"\n");
-
-				log_debug(MODULE, "entryName = %s segment = %s", entryName, segmentName);
-#endif
-				if (strcmp(segmentName, entryName) == 0)
-				{
-					// log_info(MODULE, "Found %s", entryName);
-					entry = dirEntry;
-					log_info(MODULE, "Found %s", segmentName);
-					break;
-				}
-			}
-		}
-		if (!entry)
-		{
-			strcpy(path, copyPath);
-			free(copyPath);
-			log_crit(MODULE, "File or directory not found: %s", segment);
-			return false;
-		}
+		file->ReadaheadWindow = FAT_READAHEAD_MIN;
+	}
 
-		char *segment1 = strtok(NULL, "/");
-		log_debug(MODULE, "segment = %s", segment1);
-		// If this is the last segment, we've found the file
-		if (segment1 == NULL)
-		{
-			break;
-		}
-		segment = segment1;
+	uint32_t next = (file->Public.Position + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	uint32_t fileSectors = (file->Public.Size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if (file->ReadaheadEnd < next)
+	{
+		file->ReadaheadEnd = next;
+	}
+	// top up once the reader is into the second half of the window
+	if (file->ReadaheadEnd - next > file->ReadaheadWindow / 2)
+	{
+		return;
+	}
 
-		// Otherwise, move into the directory
-		if (!(entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY))
+	uint32_t end = min(next + file->ReadaheadWindow, fileSectors);
+	if (end > file->ReadaheadEnd)
+	{
+		// only what really went out counts, the rest is tried again on the next read
+		uint32_t covered = FAT_PrefetchSectors(file->FirstCluster, file->ReadaheadEnd, end - file->ReadaheadEnd, dev);
+		file->ReadaheadEnd += covered;
+		if (file->ReadaheadEnd < end)
 		{
-			strcpy(path, copyPath);
-			free(copyPath);
-			log_info(MODULE, "Found %s %x, %u", entry->Entry.Name, entry->Entry.Attributes, entry->Entry.Size);
-			log_crit(MODULE, "%s is not a directory", segment1);
-			return false;
+			// no point in a wider window while the cache is full
+			return;
 		}
-
-		uint8_t *buffer = (uint8_t *)malloc(priv->BytesPerCluster);
-		FAT_GetDir(&entry->Entry, &currentDir, buffer, dev, priv);
-		free(buffer);
-
-		log_debug(MODULE, "segment = %s from %s", segment, path);
 	}
+	file->ReadaheadWindow = min(file->ReadaheadWindow * 2, FAT_READAHEAD_MAX);
+}
 
-	strcpy(path, copyPath);
-	free(copyPath);
-	if (!entry)
+int32_t FAT_ReadAt(void *handle, uint8_t *buf, uint32_t offset, uint32_t length, device_t *dev, fatPrivData *priv)
+{
+	FAT_FileData *file = (FAT_FileData *)handle;
+	if (!FAT_RefreshHandle(file, dev))
 	{
-		return false;
+		return -1;
 	}
+	bool sequential = offset == file->Public.Position;
+	int32_t read = FAT_TransferAt(file, buf, offset, length, false, dev, priv);
+	if (read > 0 && dev->prefetch)
+	{
+		FAT_Readahead(file, sequential, dev);
+	}
+	return read;
+}
 
-	if ((entry->Entry.Attributes & FAT_ATTRIBUTE_LFN) == 0)
+// a write past the end grows the file first, a gap before offset is zeroed
+int32_t FAT_WriteAt(void *handle, uint8_t *buf, uint32_t offset, uint32_t length, device_t *dev, fatPrivData *priv)
+{
+	FAT_FileData *file = (FAT_FileData *)handle;
+	// the entry is read again under the mount lock, so two handles never both allocate a first cluster
+	if (file->Public.IsDirectory || !FAT_RefreshHandle(file, dev))
 	{
-		getShortName((char *)entry->Entry.Name, dirRet->name);
+		return -1;
 	}
-	else
+	if (offset + length > file->Public.Size)
 	{
-		int LFNcount = entry->Entry.Name[0] - 0x40;
-		FAT_LongFileEntry LFNentries[LFNcount];
-		for (size_t d = 0; d < count; d++)
+		uint32_t oldSize = file->Public.Size;
+		if (offset + length < offset || !FAT_Resize(file, offset + length, dev))
 		{
-			LFNentries[d] = currentDir.entries[i].LongEntry;
-			i++;
+			log_err(MODULE, "cannot grow the file to %u bytes", offset + length);
+			return -1;
+		}
+		if (offset > oldSize && !FAT_ZeroRange(file, oldSize, offset, dev, priv))
+		{
+			return -1;
 		}
-
-		FAT_GetLfn(LFNentries, LFNcount, dirRet->name);
 	}
-
-	dirRet->IsDirectory = (entry->Entry.Attributes & FAT_ATTRIBUTE_DIRECTORY) == FAT_ATTRIBUTE_DIRECTORY;
-	dirRet->size = entry->Entry.Size;
-
-	return true;
+	return FAT_TransferAt(file, buf, offset, length, true, dev, priv);
 }
 
 bool FAT_Probe(device_t *dev)
 {
 	log_info(MODULE, "Probing device %d", dev->id);
-	if (!dev->read)
+	if (dev->dev_type != DEVICE_BLOCK || !dev->read)
 	{
-		printf("Device has no read, skipped.\n");
-		return 0;
+		return false;
+	}
+
+	uint8_t sector[SECTOR_SIZE];
+	if (dev->read(sector, 0, 1, dev) != 1)
+	{
+		return false;
+	}
+	FAT_BootSector *bs = (FAT_BootSector *)sector;
+	if (bs->BytesPerSector != SECTOR_SIZE || bs->SectorsPerCluster == 0 || bs->FatCount == 0)
+	{
+		return false;
+	}
+	// the FAT state is global, a second volume would overwrite the first
+	if (FatData != NULL)
+	{
+		log_warn(MODULE, "%s holds FAT but a FAT volume is already mounted", dev->name);
+		return false;
 	}
 
-	FatData = (FAT_Data *)malloc(sizeof(FAT_Data));
-	FatData->FatCachePosition = -1;
-	dev->read(FatData->BS.BootSectorBytes, 0, 1, dev);
+	FatData = (FAT_Data *)calloc(1, sizeof(FAT_Data));
+	memcpy(FatData->BS.BootSectorBytes, sector, SECTOR_SIZE);
 
 	// getting the sectors per fat
 	if (BOOTSECTOR.SectorsPerFat != 0)
@@ -1023,6 +2331,10 @@ bool FAT_Probe(device_t *dev)
 	{
 		FatData->FATSize = BOOTSECTOR.EBR32.SectorsPerFat;
 	}
+	FatData->FATSector = BOOTSECTOR.ReservedSectors;
+	FatData->FatPageCount = (FatData->FATSize + FAT_TABLE_PAGE_SECTORS - 1) / FAT_TABLE_PAGE_SECTORS;
+	FatData->FatPages = (uint8_t **)calloc(FatData->FatPageCount, sizeof(uint8_t *));
+	FatData->FatPageDirty = (uint8_t *)calloc(FatData->FatPageCount, sizeof(uint8_t));
 
 	// The starting sector of the Data Area (or the Root Directory sector in FAT12/FAT16)
 	uint32_t StartOfDataArea = BOOTSECTOR.ReservedSectors + (BOOTSECTOR.FatCount * FatData->FATSize);
@@ -1052,9 +2364,6 @@ bool FAT_Probe(device_t *dev)
 	// The size of a single cluster in bytes (a cluster consists of one or more sectors)
 	uint32_t ClusterSize = BOOTSECTOR.SectorsPerCluster * BOOTSECTOR.BytesPerSector;
 
-	// The number of directory entries that can fit into one cluster (each entry is 32 bytes)
-	uint32_t EntriesPerCluster = ClusterSize / 32;
-
 	// Total number of clusters available in the data area
 	uint32_t CountofClusters = DataSec / BOOTSECTOR.SectorsPerCluster;
 
@@ -1080,8 +2389,9 @@ bool FAT_Probe(device_t *dev)
 	uint32_t RootDirSector;
 	if (FatData->FATType != FAT32)
 	{
-		priv->RootDirSizeSec = EntriesPerCluster * BOOTSECTOR.SectorsPerCluster;
-		RootDirSector = FirstDataSector + (BOOTSECTOR.EBR32.RootDirectoryCluster - 2) * BOOTSECTOR.SectorsPerCluster;
+		// the FAT12/16 root sits between the FATs and the data area
+		priv->RootDirSizeSec = RootDirCount;
+		RootDirSector = StartOfDataArea;
 	}
 	else
 	{
@@ -1103,7 +2413,7 @@ bool FAT_Probe(device_t *dev)
 	log_debug(MODULE, "FAT sector %u Root sector %u Data sector %u", FatData->FATSector, FatData->RootDirSector, FatData->FirstDataSector);
 	log_debug(MODULE, "RootDirSizeSec %u ", priv->RootDirSizeSec);
 
-	filesystemInfo_t *fs = (filesystemInfo_t *)malloc(sizeof(filesystemInfo_t));
+	filesystemInfo_t *fs = (filesystemInfo_t *)calloc(1, sizeof(filesystemInfo_t));
 	if (FatData->FATType != FAT32)
 	{
 		fs->name = "FAT32";
@@ -1119,10 +2429,18 @@ bool FAT_Probe(device_t *dev)
 
 	fs->probe = (bool (*)(device_t *))FAT_Probe;
 	fs->mount = (bool (*)(device_t *, void *))FAT_Mount;
-	fs->read = (bool (*)(char *, uint8_t *, device_t *, void *))FAT_ReadFile;
-	fs->writefile = (bool (*)(char *, uint8_t *, uint32_t, device_t *, void *))FAT_WriteFile;
 	fs->read_dir = (bool (*)(char *, uint8_t *, device_t *, void *))FAT_ReadDirectory;
 	fs->find_entry = (bool (*)(char *, void *, device_t *, void *))FAT_FindEntry;
+	fs->open = (bool (*)(char *, void **, device_t *, void *))FAT_Open;
+	fs->close = (void (*)(void *, device_t *, void *))FAT_Close;
+	fs->read_at = (int32_t (*)(void *, uint8_t *, uint32_t, uint32_t, device_t *, void *))FAT_ReadAt;
+	fs->write_at = (int32_t (*)(void *, uint8_t *, uint32_t, uint32_t, device_t *, void *))FAT_WriteAt;
+	fs->truncate = (bool (*)(void *, uint32_t, device_t *, void *))FAT_Truncate;
+	fs->touch = (bool (*)(char *, device_t *, void *))FAT_Create;
+	fs->mkdir = (bool (*)(char *, device_t *, void *))FAT_Mkdir;
+	fs->unlink = (bool (*)(char *, device_t *, void *))FAT_Delete;
+	fs->umount = FAT_Umount;
+	fs->caseInsensitive = true;
 
 	fs->priv_data = (void *)priv;
 
@@ -1143,6 +2461,52 @@ bool FAT_Mount(device_t *dev, void *privd)
 	return 0;
 }
 
+// the VFS only unmounts once every handle is closed, everything probe and mount built goes so the next probe starts over
+void FAT_Umount(MountPoint *mount)
+{
+	device_t *dev = mount->dev;
+	filesystemInfo_t *fs = dev->fs;
+	log_info(MODULE, "Unmounting device %s (%d)", dev->name, dev->id);
+
+	// every change already writes the table through, this catches one whose write failed
+	FAT_FlushTable(dev);
+	if (dev->queue)
+	{
+		bcacheSync(dev);
+	}
+
+	while (g_OpenFiles)
+	{
+		FAT_FileData *file = g_OpenFiles;
+		g_OpenFiles = file->NextOpen;
+		free(file->Buffer);
+		free(file);
+	}
+
+	for (uint32_t page = 0; page < FatData->FatPageCount; page++)
+	{
+		free(FatData->FatPages[page]);
+	}
+	free(FatData->FatPages);
+	free(FatData->FatPageDirty);
+	for (int i = 0; i < FAT_EXTENT_CACHE_SIZE; i++)
+	{
+		free(FatData->ExtentMaps[i].Extents);
+	}
+	for (int i = 0; i < FAT_DIR_INDEX_CACHE; i++)
+	{
+		FAT_FreeDirIndex(&FatData->DirIndexes[i]);
+	}
+	free(FatData->FreeMap);
+	free(FatData->RootDirectory.entries);
+	free(FatData);
+	FatData = NULL;
+
+	free(fs->priv_data);
+	free(fs);
+	dev->fs = NULL;
+}
+
 bool FAT_GetRoot(void *node, device_t *dev, void *privd)
 {
 	log_debug(MODULE, "node: %p, dev: %p, priv. %p", node, dev, privd);
@@ -7,9 +7,19 @@
 #pragma once
 
 #define SECTOR_SIZE             512
-#define FAT_CACHE_SIZE          5
+#define FAT_TABLE_PAGE_SECTORS  8 // the FAT is read in and kept 4 KiB at a time
+#define FAT_EXTENT_CACHE_SIZE   16
+#define FAT_READAHEAD_MIN       8   // sectors read ahead once reads look sequential
+#define FAT_READAHEAD_MAX       128 // the window doubles up to this
+#define FAT_DIR_INDEX_CACHE     8   // directories with a name index at once
 #define DIR_ENTRY_SIZE          32
 #define FAT32_EOC               0x0FFFFFF8 // End of Cluster marker for FAT32
+#define FAT_DELETED             0xE5       // first name byte of a free directory entry
+#define FAT_MAX_LFN_ENTRIES     20         // 255 characters, 13 per entry
+
+#define FSINFO_LEAD_SIGNATURE   0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_UNKNOWN          0xFFFFFFFF
 
 typedef struct 
 {
@@ -48,7 +58,6 @@ typedef union
 
 #define FAT_LFN_LAST            0x40
                   
-// not in use
 typedef struct 
 {
     int Handle;
@@ -107,15 +116,38 @@ typedef struct
 
 } __attribute__((packed)) FAT_BootSector;
 
-// not in use
+// where a short entry is on disk
+typedef struct
+{
+    uint32_t DirCluster; // first cluster of the directory, 0 for the FAT12/16 root
+    uint32_t Index;      // of the short entry within the directory
+    uint32_t LongCount;  // long name entries right in front of it
+} FAT_EntryLocation;
+
 typedef struct
+{
+    uint32_t LeadSignature;
+    uint8_t _Reserved1[480];
+    uint32_t StructSignature;
+    uint32_t FreeCount;
+    uint32_t NextFree;
+    uint8_t _Reserved2[12];
+    uint32_t TrailSignature;
+} __attribute__((packed)) FAT_FSInfo;
+
+// an open file, the handle the VFS keeps in its file descriptor
+typedef struct FAT_FileData
 {
     FAT_File Public;
     bool Opened;
     uint32_t FirstCluster;
     uint32_t CurrentCluster;
     uint32_t CurrentSectorInCluster;
-    uint8_t* Buffer;
+    uint8_t* Buffer; // one sector, for reads and writes that do not cover a whole one
+    uint32_t ReadaheadWindow; // sectors, 0 while reads jump around
+    uint32_t ReadaheadEnd;    // file sector the readahead got to
+    FAT_EntryLocation Location;
+    struct FAT_FileData *NextOpen;
 
 } FAT_FileData;
 
@@ -130,6 +162,64 @@ typedef struct
     uint32_t entryCount;     // Track number of entries
 } FAT_Directory; 
 
+// a run of clusters that follow each other on disk
+typedef struct
+{
+    uint32_t FileCluster;  // index of the run's first cluster within the file
+    uint32_t FirstCluster; // cluster number on disk
+    uint32_t Length;       // clusters
+} FAT_Extent;
+
+// a cluster chain as a sorted list of runs, built once and kept in FAT_Data
+typedef struct
+{
+    uint32_t FirstCluster; // 0 while the slot is unused
+    uint32_t ClusterCount;
+    uint32_t Count;
+    uint32_t Capacity;
+    FAT_Extent *Extents;
+    uint32_t LastUse;
+} FAT_ExtentMap;
+
+// a directory entry as the name index keeps it
+typedef struct
+{
+    FAT_DirectoryEntry Entry;
+    uint32_t Slot;      // index of the short entry within the directory, FAT_INDEX_NONE once it is gone
+    uint32_t LongCount; // long name entries right in front of it
+    uint32_t Name;      // first of its names, the one readdir shows
+    uint32_t NameCount; // 1, or 2 when the long name is not just the short one
+} FAT_IndexEntry;
+
+typedef struct
+{
+    uint32_t Hash;
+    uint32_t Next;  // next name in the same bucket
+    uint32_t Entry; // FAT_INDEX_NONE once the entry is gone
+    uint32_t Text;  // offset in the pool
+} FAT_IndexName;
+
+#define FAT_INDEX_NONE 0xFFFFFFFF
+
+// hash table of the names in one directory, built by a single scan on the first lookup there
+typedef struct
+{
+    bool Valid;
+    uint32_t DirCluster;
+    FAT_IndexEntry *Entries; // in directory order, apart from entries added later
+    uint32_t EntryCount;
+    uint32_t EntryCapacity;
+    FAT_IndexName *Names;
+    uint32_t NameCount;
+    uint32_t NameCapacity;
+    uint32_t *Buckets; // a power of two of them
+    uint32_t BucketCount;
+    char *Pool;
+    uint32_t PoolSize;
+    uint32_t PoolCapacity;
+    uint32_t LastUse;
+} FAT_DirIndex;
+
 typedef enum __FatType
 {
     FAT12,
@@ -157,9 +247,24 @@ typedef struct
     FAT_LFNBlock* LFNBlocks;
     int LFNCount;
 
-    // this is where the last read was at
-    uint8_t FatCache[FAT_CACHE_SIZE * SECTOR_SIZE];
-    uint32_t FatCachePosition;
+    // FAT_TABLE_PAGE_SECTORS of the FAT each, NULL until the first lookup there
+    uint8_t **FatPages;
+    uint32_t FatPageCount;
+
+    FAT_ExtentMap ExtentMaps[FAT_EXTENT_CACHE_SIZE];
+    uint32_t ExtentClock;
+
+    FAT_DirIndex DirIndexes[FAT_DIR_INDEX_CACHE];
+    uint32_t DirIndexClock;
+
+    // one bit per FAT sector of each page, written to every copy of the FAT by FAT_FlushTable
+    uint8_t *FatPageDirty;
+
+    // one bit per cluster, set while it is in use; built on the first allocation
+    uint32_t *FreeMap;
+    uint32_t FreeCount;
+    uint32_t NextFree; // where the search for a free cluster starts, the FSInfo hint
+    bool FSInfoDirty;
 
 } FAT_Data;
 
@@ -185,6 +290,23 @@ enum FAT_Attributes
 /// @param name is the a normal format
 void GetName(char* shortName, char *name);
 
+FAT_ExtentMap *FAT_GetExtentMap(uint32_t firstCluster, device_t *dev);
+int FAT_FindExtent(FAT_ExtentMap *map, uint32_t fileCluster);
+void FAT_InvalidateExtents(uint32_t firstCluster);
+
 bool FAT_Probe(device_t* dev);
 bool FAT_Mount(device_t *dev, void *priv);
-bool FAT_GetRoot(void* node, device_t* dev, void *priv);
\ No newline at end of file
+void FAT_Umount(MountPoint *mount);
+bool FAT_GetRoot(void* node, device_t* dev, void *priv);
+
+bool FAT_ReadDirectory(char *path, DirectoryEntries *out, device_t *dev, fatPrivData *priv);
+
+bool FAT_Open(char *path, void **handle, device_t *dev, fatPrivData *priv);
+void FAT_Close(void *handle, device_t *dev, fatPrivData *priv);
+int32_t FAT_ReadAt(void *handle, uint8_t *buf, uint32_t offset, uint32_t length, device_t *dev, fatPrivData *priv);
+int32_t FAT_WriteAt(void *handle, uint8_t *buf, uint32_t offset, uint32_t length, device_t *dev, fatPrivData *priv);
+bool FAT_Truncate(void *handle, uint32_t size, device_t *dev, fatPrivData *priv);
+
+bool FAT_Create(char *path, device_t *dev, fatPrivData *priv);
+bool FAT_Mkdir(char *path, device_t *dev, fatPrivData *priv);
+bool FAT_Delete(char *path, device_t *dev, fatPrivData *priv);
\ No newline at end of file
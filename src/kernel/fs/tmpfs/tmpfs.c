@@ -0,0 +1,476 @@
+#include <stdint.h>
+
+#include "stdio.h"
+#include "string.h"
+#include "memory.h"
+#include "debug.h"
+#include "hal/vfs.h"
+
+#include "tmpfs.h"
+
+#define MODULE "TMPFS"
+
+/*
+ * tmpfs
+ *
+ * Files and directories that only live in kernel memory. A file is an array
+ * of page pointers, pages are allocated on first write and a missing one
+ * reads as zeros. Every directory hashes its children by name, so looking up
+ * a name does not depend on how many siblings it has. The pages of one
+ * instance are capped at the size it was created with.
+ */
+
+#define TMPFS_MAGIC 0x544D5046 // "TMPF"
+
+static filesystemInfo_t g_Tmpfs;
+
+static uint32_t tmpfs_hash(const char *name, size_t length)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static tmpfs_t *tmpfs_of(device_t *dev)
+{
+	return (tmpfs_t *)dev->priv;
+}
+
+static tmpfs_node *tmpfs_newNode(const char *name, size_t length, bool isDirectory)
+{
+	if (length >= TMPFS_NAME_SIZE)
+		return NULL;
+	tmpfs_node *node = (tmpfs_node *)calloc(1, sizeof(tmpfs_node));
+	if (node == NULL)
+		return NULL;
+	memcpy(node->name, name, length);
+	node->hash = tmpfs_hash(name, length);
+	node->isDirectory = isDirectory;
+	if (isDirectory)
+	{
+		node->buckets = (tmpfs_node **)calloc(TMPFS_MIN_BUCKETS, sizeof(tmpfs_node *));
+		if (node->buckets == NULL)
+		{
+			free(node);
+			return NULL;
+		}
+		node->bucketCount = TMPFS_MIN_BUCKETS;
+	}
+	return node;
+}
+
+static tmpfs_node *tmpfs_child(tmpfs_node *dir, const char *name, size_t length)
+{
+	uint32_t hash = tmpfs_hash(name, length);
+	for (tmpfs_node *child = dir->buckets[hash % dir->bucketCount]; child; child = child->hashNext)
+	{
+		if (child->hash == hash && strncmp(child->name, name, length) == 0 && child->name[length] == '\0')
+			return child;
+	}
+	return NULL;
+}
+
+// keeps the chains short by doubling the buckets once there are more children than buckets
+static void tmpfs_link(tmpfs_node *dir, tmpfs_node *node)
+{
+	if (dir->childCount >= dir->bucketCount)
+	{
+		uint32_t count = dir->bucketCount * 2;
+		tmpfs_node **buckets = (tmpfs_node **)calloc(count, sizeof(tmpfs_node *));
+		if (buckets)
+		{
+			for (uint32_t i = 0; i < dir->bucketCount; i++)
+			{
+				tmpfs_node *child = dir->buckets[i];
+				while (child)
+				{
+					tmpfs_node *next = child->hashNext;
+					child->hashNext = buckets[child->hash % count];
+					buckets[child->hash % count] = child;
+					child = next;
+				}
+			}
+			free(dir->buckets);
+			dir->buckets = buckets;
+			dir->bucketCount = count;
+		}
+	}
+	tmpfs_node **bucket = &dir->buckets[node->hash % dir->bucketCount];
+	node->hashNext = *bucket;
+	*bucket = node;
+	node->parent = dir;
+	dir->childCount++;
+}
+
+static void tmpfs_unlinkNode(tmpfs_node *node)
+{
+	tmpfs_node *dir = node->parent;
+	tmpfs_node **link = &dir->buckets[node->hash % dir->bucketCount];
+	while (*link != node)
+		link = &(*link)->hashNext;
+	*link = node->hashNext;
+	node->hashNext = NULL;
+	node->parent = NULL;
+	dir->childCount--;
+}
+
+// walks to the last component of path, which is returned in name/length, NULL when a directory on the way is missing
+static tmpfs_node *tmpfs_walkParent(tmpfs_t *tmp, const char *path, const char **name, size_t *length)
+{
+	tmpfs_node *dir = tmp->root;
+	*name = NULL;
+	*length = 0;
+	while (true)
+	{
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			return dir;
+
+		size_t componentLength = 0;
+		while (path[componentLength] && path[componentLength] != '/')
+			componentLength++;
+		const char *next = path + componentLength;
+		while (*next == '/')
+			next++;
+		if (*next == '\0')
+		{
+			*name = path;
+			*length = componentLength;
+			return dir;
+		}
+
+		tmpfs_node *child = tmpfs_child(dir, path, componentLength);
+		if (child == NULL || !child->isDirectory)
+			return NULL;
+		dir = child;
+		path = next;
+	}
+}
+
+static tmpfs_node *tmpfs_lookup(tmpfs_t *tmp, const char *path)
+{
+	const char *name;
+	size_t length;
+	tmpfs_node *dir = tmpfs_walkParent(tmp, path, &name, &length);
+	if (dir == NULL || name == NULL)
+		return dir;
+	return tmpfs_child(dir, name, length);
+}
+
+// drops the pages from index first on
+static void tmpfs_freePages(tmpfs_t *tmp, tmpfs_node *node, uint32_t first)
+{
+	for (uint32_t i = first; i < node->pageSlots; i++)
+	{
+		if (node->pages[i])
+		{
+			pfree(node->pages[i]);
+			node->pages[i] = NULL;
+			tmp->usedPages--;
+		}
+	}
+}
+
+static void tmpfs_freeNode(tmpfs_t *tmp, tmpfs_node *node)
+{
+	tmpfs_freePages(tmp, node, 0);
+	free(node->pages);
+	free(node->buckets);
+	free(node);
+}
+
+static bool tmpfs_reserveSlots(tmpfs_node *node, uint32_t slots)
+{
+	if (slots <= node->pageSlots)
+		return true;
+	uint32_t count = node->pageSlots ? node->pageSlots : 4;
+	while (count < slots)
+		count *= 2;
+	uint8_t **pages = (uint8_t **)realloc(node->pages, count * sizeof(uint8_t *));
+	if (pages == NULL)
+		return false;
+	memset(pages + node->pageSlots, 0, (count - node->pageSlots) * sizeof(uint8_t *));
+	node->pages = pages;
+	node->pageSlots = count;
+	return true;
+}
+
+bool tmpfs_read_dir(char *path, uint8_t *buffer, device_t *dev, void *priv)
+{
+	DirectoryEntries *out = (DirectoryEntries *)buffer;
+	out->entries = NULL;
+	out->entryCount = 0;
+	tmpfs_node *dir = tmpfs_lookup(tmpfs_of(dev), path);
+	if (dir == NULL || !dir->isDirectory)
+		return false;
+	if (dir->childCount == 0)
+		return true;
+
+	out->entries = (DirectoryEntry *)calloc(dir->childCount, sizeof(DirectoryEntry));
+	if (out->entries == NULL)
+		return false;
+	for (uint32_t i = 0; i < dir->bucketCount; i++)
+	{
+		for (tmpfs_node *child = dir->buckets[i]; child; child = child->hashNext)
+		{
+			DirectoryEntry *entry = &out->entries[out->entryCount++];
+			strcpy(entry->name, child->name);
+			entry->IsDirectory = child->isDirectory;
+			entry->size = child->size;
+			entry->inode = (uint32_t)child;
+		}
+	}
+	return true;
+}
+
+bool tmpfs_find_entry(char *path, void *ret, device_t *dev, void *priv)
+{
+	DirectoryEntry *entry = (DirectoryEntry *)ret;
+	tmpfs_node *node = tmpfs_lookup(tmpfs_of(dev), path);
+	if (node == NULL)
+		return false;
+	strcpy(entry->name, node->name);
+	entry->IsDirectory = node->isDirectory;
+	entry->size = node->size;
+	// a node stays where it is for as long as it is linked
+	entry->inode = (uint32_t)node;
+	return true;
+}
+
+static bool tmpfs_add(char *path, device_t *dev, bool isDirectory)
+{
+	const char *name;
+	size_t length;
+	tmpfs_node *dir = tmpfs_walkParent(tmpfs_of(dev), path, &name, &length);
+	if (dir == NULL || name == NULL)
+	{
+		log_err(MODULE, "cannot create %s, no such directory", path);
+		return false;
+	}
+	if (tmpfs_child(dir, name, length))
+	{
+		log_err(MODULE, "%s already exists", path);
+		return false;
+	}
+	tmpfs_node *node = tmpfs_newNode(name, length, isDirectory);
+	if (node == NULL)
+		return false;
+	tmpfs_link(dir, node);
+	return true;
+}
+
+bool tmpfs_touch(char *path, device_t *dev, void *priv)
+{
+	return tmpfs_add(path, dev, false);
+}
+
+bool tmpfs_mkdir(char *path, device_t *dev, void *priv)
+{
+	return tmpfs_add(path, dev, true);
+}
+
+bool tmpfs_unlink(char *path, device_t *dev, void *priv)
+{
+	tmpfs_t *tmp = tmpfs_of(dev);
+	tmpfs_node *node = tmpfs_lookup(tmp, path);
+	if (node == NULL || node == tmp->root)
+		return false;
+	if (node->isDirectory && node->childCount)
+	{
+		log_err(MODULE, "%s is not empty", path);
+		return false;
+	}
+	tmpfs_unlinkNode(node);
+	if (node->opens == 0)
+		tmpfs_freeNode(tmp, node);
+	return true;
+}
+
+bool tmpfs_open(char *path, void **handle, device_t *dev, void *priv)
+{
+	tmpfs_node *node = tmpfs_lookup(tmpfs_of(dev), path);
+	if (node == NULL || node->isDirectory)
+		return false;
+	node->opens++;
+	*handle = node;
+	return true;
+}
+
+void tmpfs_close(void *handle, device_t *dev, void *priv)
+{
+	tmpfs_node *node = (tmpfs_node *)handle;
+	node->opens--;
+	if (node->opens == 0 && node->parent == NULL)
+		tmpfs_freeNode(tmpfs_of(dev), node);
+}
+
+int32_t tmpfs_read_at(void *handle, uint8_t *buf, uint32_t offset, uint32_t len, device_t *dev, void *priv)
+{
+	tmpfs_node *node = (tmpfs_node *)handle;
+	if (offset >= node->size)
+		return 0;
+	if (len > node->size - offset)
+		len = node->size - offset;
+
+	uint32_t done = 0;
+	while (done < len)
+	{
+		uint32_t position = offset + done;
+		uint32_t within = position % TMPFS_PAGE_SIZE;
+		uint32_t part = TMPFS_PAGE_SIZE - within < len - done ? TMPFS_PAGE_SIZE - within : len - done;
+		uint32_t index = position / TMPFS_PAGE_SIZE;
+		// truncate may have grown the file past its slots
+		uint8_t *page = index < node->pageSlots ? node->pages[index] : NULL;
+		if (page)
+			memcpy(buf + done, page + within, part);
+		else
+			memset(buf + done, 0, part);
+		done += part;
+	}
+	return done;
+}
+
+int32_t tmpfs_write_at(void *handle, uint8_t *buf, uint32_t offset, uint32_t len, device_t *dev, void *priv)
+{
+	tmpfs_t *tmp = tmpfs_of(dev);
+	tmpfs_node *node = (tmpfs_node *)handle;
+	if (len == 0)
+		return 0;
+	if (offset + len < offset || !tmpfs_reserveSlots(node, (offset + len + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE))
+		return -1;
+
+	uint32_t done = 0;
+	while (done < len)
+	{
+		uint32_t position = offset + done;
+		uint32_t index = position / TMPFS_PAGE_SIZE;
+		uint32_t within = position % TMPFS_PAGE_SIZE;
+		uint32_t part = TMPFS_PAGE_SIZE - within < len - done ? TMPFS_PAGE_SIZE - within : len - done;
+		if (node->pages[index] == NULL)
+		{
+			if (tmp->usedPages >= tmp->maxPages)
+			{
+				log_warn(MODULE, "%s is full", dev->name);
+				break;
+			}
+			// pmalloc hands out zeroed pages
+			node->pages[index] = (uint8_t *)pmalloc(TMPFS_PAGE_SIZE);
+			if (node->pages[index] == NULL)
+				break;
+			tmp->usedPages++;
+		}
+		memcpy(node->pages[index] + within, buf + done, part);
+		done += part;
+	}
+	if (offset + done > node->size)
+		node->size = offset + done;
+	return done ? (int32_t)done : -1;
+}
+
+bool tmpfs_truncate(void *handle, uint32_t size, device_t *dev, void *priv)
+{
+	tmpfs_node *node = (tmpfs_node *)handle;
+	if (size < node->size)
+	{
+		uint32_t keep = (size + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE;
+		tmpfs_freePages(tmpfs_of(dev), node, keep);
+		// growing again later must read zeros behind the new end
+		if (size % TMPFS_PAGE_SIZE && keep <= node->pageSlots && node->pages[keep - 1])
+			memset(node->pages[keep - 1] + size % TMPFS_PAGE_SIZE, 0, TMPFS_PAGE_SIZE - size % TMPFS_PAGE_SIZE);
+	}
+	node->size = size;
+	return true;
+}
+
+static void tmpfs_freeTree(tmpfs_t *tmp, tmpfs_node *dir)
+{
+	for (uint32_t i = 0; i < dir->bucketCount; i++)
+	{
+		tmpfs_node *child = dir->buckets[i];
+		while (child)
+		{
+			tmpfs_node *next = child->hashNext;
+			if (child->isDirectory)
+				tmpfs_freeTree(tmp, child);
+			tmpfs_freeNode(tmp, child);
+			child = next;
+		}
+		dir->buckets[i] = NULL;
+	}
+	dir->childCount = 0;
+}
+
+// like any tmpfs the files go with the mount, the device is left holding an empty root to be mounted again
+void tmpfs_umount(MountPoint *mount)
+{
+	tmpfs_t *tmp = tmpfs_of(mount->dev);
+	tmpfs_freeTree(tmp, tmp->root);
+	mount->dev->fs = NULL;
+}
+
+bool tmpfs_probe(device_t *dev)
+{
+	tmpfs_t *tmp = tmpfs_of(dev);
+	if (dev->dev_type != DEVICE_UNKNOWN || tmp == NULL || tmp->magic != TMPFS_MAGIC)
+		return false;
+	dev->fs = &g_Tmpfs;
+	return true;
+}
+
+device_t *tmpfs_create(uint32_t maxBytes)
+{
+	device_t *dev = (device_t *)calloc(1, sizeof(device_t));
+	tmpfs_t *tmp = (tmpfs_t *)calloc(1, sizeof(tmpfs_t));
+	tmpfs_node *root = tmpfs_newNode("", 0, true);
+	if (!dev || !tmp || !root)
+	{
+		free(dev);
+		free(tmp);
+		if (root)
+		{
+			free(root->buckets);
+			free(root);
+		}
+		return NULL;
+	}
+	tmp->magic = TMPFS_MAGIC;
+	tmp->root = root;
+	tmp->maxPages = (maxBytes + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE;
+
+	dev->name = "tmpfs";
+	dev->id = 0xFFFFFFFF;
+	dev->dev_type = DEVICE_UNKNOWN;
+	dev->priv = tmp;
+	addDevice(dev);
+	return dev;
+}
+
+void tmpfs_init()
+{
+	g_Tmpfs.name = "tmpfs";
+	g_Tmpfs.probe = tmpfs_probe;
+	g_Tmpfs.read_dir = tmpfs_read_dir;
+	g_Tmpfs.find_entry = tmpfs_find_entry;
+	g_Tmpfs.touch = tmpfs_touch;
+	g_Tmpfs.mkdir = tmpfs_mkdir;
+	g_Tmpfs.unlink = tmpfs_unlink;
+	g_Tmpfs.open = tmpfs_open;
+	g_Tmpfs.close = tmpfs_close;
+	g_Tmpfs.read_at = tmpfs_read_at;
+	g_Tmpfs.write_at = tmpfs_write_at;
+	g_Tmpfs.truncate = tmpfs_truncate;
+	g_Tmpfs.umount = tmpfs_umount;
+	VFS_RegisterFilesystem("tmpfs", tmpfs_probe);
+
+	device_t *dev = tmpfs_create(TMPFS_DEFAULT_SIZE);
+	if (dev == NULL || !MountDevice(dev, "/tmp"))
+	{
+		log_err(MODULE, "Unable to mount /tmp");
+	}
+}
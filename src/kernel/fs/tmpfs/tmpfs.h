@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "drivers/device.h"
+
+#define TMPFS_PAGE_SIZE 4096
+#define TMPFS_NAME_SIZE 64
+#define TMPFS_MIN_BUCKETS 8
+
+// the /tmp mount made at boot
+#define TMPFS_DEFAULT_SIZE (8 * 1024 * 1024)
+
+typedef struct tmpfs_node
+{
+	char name[TMPFS_NAME_SIZE];
+	uint32_t hash;
+	bool isDirectory;
+	struct tmpfs_node *parent;	 // NULL for the root and once unlinked
+	struct tmpfs_node *hashNext; // in the parent's bucket
+
+	// directories
+	struct tmpfs_node **buckets;
+	uint32_t bucketCount;
+	uint32_t childCount;
+
+	// files, a missing page reads as zeros
+	uint8_t **pages;
+	uint32_t pageSlots;
+	uint32_t size;
+
+	uint32_t opens; // an unlinked file lives until its last close
+} tmpfs_node;
+
+typedef struct
+{
+	uint32_t magic;
+	tmpfs_node *root;
+	uint32_t maxPages;
+	uint32_t usedPages;
+} tmpfs_t;
+
+// a device holding an empty tmpfs of at most maxBytes of file data, ready to be mounted
+device_t *tmpfs_create(uint32_t maxBytes);
+
+// registers tmpfs and mounts one on /tmp
+void tmpfs_init();
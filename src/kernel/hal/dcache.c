@@ -0,0 +1,300 @@
+#include "dcache.h"
+#include "string.h"
+#include "ctype.h"
+#include "stdio.h"
+#include "memory.h"
+#include "debug.h"
+#include "arch/i686/io.h"
+
+#define MODULE "DCACHE"
+
+/*
+ * Directory entry cache
+ *
+ * Maps (parent, name) to what the filesystem said about that name, including
+ * that it does not exist. Path lookups walk it one component at a time and
+ * only ask the filesystem about components that are not cached. Entries are
+ * recycled in LRU order, but only once nothing below them is cached, so a
+ * parent pointer always stays valid.
+ */
+
+dcache_stats g_DcacheStats;
+
+static dentry_t g_Dentries[DCACHE_ENTRIES];
+static dentry_t *g_Hash[DCACHE_HASH_SIZE];
+static dentry_t *g_LruHead = NULL; // most recently used
+static dentry_t *g_LruTail = NULL;
+
+static uint32_t dcacheHash(uint32_t mountId, dentry_t *parent, const char *name)
+{
+	// FNV-1a over the name, seeded with the parent
+	bool foldCase = parent && parent->foldCase;
+	uint32_t hash = 2166136261u ^ (uint32_t)parent ^ (mountId << 24);
+	for (; *name; name++)
+	{
+		hash ^= (uint8_t)(foldCase ? tolower(*name) : *name);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// the list helpers run with interrupts off
+static void lruRemove(dentry_t *d)
+{
+	if (d->lruPrev)
+		d->lruPrev->lruNext = d->lruNext;
+	else
+		g_LruHead = d->lruNext;
+	if (d->lruNext)
+		d->lruNext->lruPrev = d->lruPrev;
+	else
+		g_LruTail = d->lruPrev;
+	d->lruPrev = d->lruNext = NULL;
+}
+
+static void lruPushHead(dentry_t *d)
+{
+	d->lruPrev = NULL;
+	d->lruNext = g_LruHead;
+	if (g_LruHead)
+		g_LruHead->lruPrev = d;
+	else
+		g_LruTail = d;
+	g_LruHead = d;
+}
+
+static void lruPushTail(dentry_t *d)
+{
+	d->lruNext = NULL;
+	d->lruPrev = g_LruTail;
+	if (g_LruTail)
+		g_LruTail->lruNext = d;
+	else
+		g_LruHead = d;
+	g_LruTail = d;
+}
+
+static dentry_t *dcacheFind(uint32_t mountId, dentry_t *parent, const char *name)
+{
+	uint32_t hash = dcacheHash(mountId, parent, name);
+	for (dentry_t *d = g_Hash[hash % DCACHE_HASH_SIZE]; d; d = d->hashNext)
+	{
+		if (d->hash != hash || d->parent != parent || d->mountId != mountId)
+			continue;
+		if ((d->foldCase ? strcasecmp(d->name, name) : strcmp(d->name, name)) == 0)
+			return d;
+	}
+	return NULL;
+}
+
+static void dcacheDrop(dentry_t *d)
+{
+	dentry_t **link = &g_Hash[d->hash % DCACHE_HASH_SIZE];
+	while (*link && *link != d)
+		link = &(*link)->hashNext;
+	if (*link)
+		*link = d->hashNext;
+	if (d->parent)
+		d->parent->children--;
+
+	d->used = false;
+	d->hashNext = NULL;
+	lruRemove(d);
+	lruPushTail(d);
+}
+
+void dcacheInit()
+{
+	memset(g_Dentries, 0, sizeof(g_Dentries));
+	memset(g_Hash, 0, sizeof(g_Hash));
+	memset(&g_DcacheStats, 0, sizeof(g_DcacheStats));
+	g_LruHead = g_LruTail = NULL;
+	for (int i = 0; i < DCACHE_ENTRIES; i++)
+		lruPushTail(&g_Dentries[i]);
+}
+
+static dentry_t *dcacheInsert(uint32_t mountId, dentry_t *parent, const char *name)
+{
+	dentry_t *d = g_LruTail;
+	while (d && d->used && (d->children || d == parent))
+		d = d->lruPrev;
+	if (d == NULL)
+		return NULL;
+	if (d->used)
+	{
+		g_DcacheStats.evictions++;
+		dcacheDrop(d);
+	}
+
+	memset(d->name, 0, sizeof(d->name));
+	strncpy(d->name, name, DCACHE_NAME_SIZE - 1);
+	d->mountId = mountId;
+	d->parent = parent;
+	d->hash = dcacheHash(mountId, parent, name);
+	d->used = true;
+	d->negative = false;
+	d->foldCase = parent ? parent->foldCase : false;
+	d->isDirectory = false;
+	d->size = 0;
+	d->inode = 0;
+	d->children = 0;
+	if (parent)
+		parent->children++;
+
+	d->hashNext = g_Hash[d->hash % DCACHE_HASH_SIZE];
+	g_Hash[d->hash % DCACHE_HASH_SIZE] = d;
+	lruRemove(d);
+	lruPushHead(d);
+	return d;
+}
+
+dentry_t *dcacheRoot(uint32_t mountId, bool foldCase)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	dentry_t *d = dcacheFind(mountId, NULL, "");
+	if (d == NULL)
+	{
+		d = dcacheInsert(mountId, NULL, "");
+		if (d)
+		{
+			d->isDirectory = true;
+			d->foldCase = foldCase;
+		}
+	}
+	i686_RestoreInterrupts(flags);
+	return d;
+}
+
+dentry_t *dcacheLookup(dentry_t *parent, const char *name)
+{
+	if (strlen(name) >= DCACHE_NAME_SIZE)
+		return NULL;
+
+	uint32_t flags = i686_SaveInterrupts();
+	dentry_t *d = dcacheFind(parent->mountId, parent, name);
+	if (d)
+	{
+		if (d->negative)
+			g_DcacheStats.negativeHits++;
+		else
+			g_DcacheStats.hits++;
+		lruRemove(d);
+		lruPushHead(d);
+	}
+	else
+	{
+		g_DcacheStats.misses++;
+	}
+	i686_RestoreInterrupts(flags);
+	return d;
+}
+
+dentry_t *dcacheAdd(dentry_t *parent, const char *name, DirectoryEntry *entry)
+{
+	if (strlen(name) >= DCACHE_NAME_SIZE)
+		return NULL;
+
+	uint32_t flags = i686_SaveInterrupts();
+	// somebody else may have looked it up meanwhile
+	dentry_t *d = dcacheFind(parent->mountId, parent, name);
+	if (d == NULL)
+		d = dcacheInsert(parent->mountId, parent, name);
+	if (d)
+	{
+		d->negative = entry == NULL;
+		d->isDirectory = entry ? entry->IsDirectory : false;
+		d->size = entry ? entry->size : 0;
+		d->inode = entry ? entry->inode : 0;
+	}
+	i686_RestoreInterrupts(flags);
+	return d;
+}
+
+static bool dcacheIsBelow(dentry_t *d, dentry_t *ancestor)
+{
+	for (; d; d = d->parent)
+	{
+		if (d == ancestor)
+			return true;
+	}
+	return false;
+}
+
+// drops target and, children first, everything cached below it
+static void dcacheDropTree(dentry_t *target)
+{
+	bool dropped = true;
+	while (dropped)
+	{
+		dropped = false;
+		for (int i = 0; i < DCACHE_ENTRIES; i++)
+		{
+			dentry_t *d = &g_Dentries[i];
+			if (d->used && d->children == 0 && dcacheIsBelow(d, target))
+			{
+				dcacheDrop(d);
+				dropped = true;
+			}
+		}
+	}
+	g_DcacheStats.invalidations++;
+}
+
+void dcacheInvalidatePath(uint32_t mountId, const char *path)
+{
+	char name[DCACHE_NAME_SIZE];
+	uint32_t flags = i686_SaveInterrupts();
+	dentry_t *d = dcacheFind(mountId, NULL, "");
+	while (d && *path)
+	{
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+
+		size_t length = 0;
+		while (path[length] && path[length] != '/')
+			length++;
+		if (length >= DCACHE_NAME_SIZE)
+		{
+			// never cached, drop everything from its directory down to be safe
+			break;
+		}
+		memcpy(name, path, length);
+		name[length] = '\0';
+		path += length;
+
+		dentry_t *child = dcacheFind(mountId, d, name);
+		if (child == NULL)
+		{
+			d = NULL;
+			break;
+		}
+		d = child;
+	}
+	if (d)
+		dcacheDropTree(d);
+	i686_RestoreInterrupts(flags);
+}
+
+void dcacheInvalidateMount(uint32_t mountId)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	dentry_t *root = dcacheFind(mountId, NULL, "");
+	if (root)
+		dcacheDropTree(root);
+	i686_RestoreInterrupts(flags);
+}
+
+void dcachePrintStats()
+{
+	uint32_t used = 0;
+	for (int i = 0; i < DCACHE_ENTRIES; i++)
+	{
+		if (g_Dentries[i].used)
+			used++;
+	}
+	printf("dentry cache: %u of %u entries\n", used, DCACHE_ENTRIES);
+	printf("hits %u, negative hits %u, misses %u, evictions %u, invalidations %u\n", g_DcacheStats.hits,
+		   g_DcacheStats.negativeHits, g_DcacheStats.misses, g_DcacheStats.evictions, g_DcacheStats.invalidations);
+}
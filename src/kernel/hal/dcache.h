@@ -0,0 +1,53 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "vfs.h"
+
+#define DCACHE_ENTRIES 256
+#define DCACHE_HASH_SIZE 128
+#define DCACHE_NAME_SIZE 64 // longer names are looked up on the filesystem every time
+
+// one path component under its parent directory, a negative entry records that it does not exist
+typedef struct dentry
+{
+	uint32_t mountId;
+	struct dentry *parent; // NULL for the root of a mount
+	char name[DCACHE_NAME_SIZE];
+	uint32_t hash;
+	bool used;
+	bool negative;
+	bool foldCase; // the filesystem ignores case, so the name is hashed and compared without it
+
+	bool isDirectory;
+	uint32_t size;
+	uint32_t inode;
+	uint32_t children; // cached entries below this one, it stays while there are any
+
+	struct dentry *hashNext;
+	struct dentry *lruPrev;
+	struct dentry *lruNext;
+} dentry_t;
+
+typedef struct
+{
+	uint32_t hits;
+	uint32_t negativeHits;
+	uint32_t misses;
+	uint32_t evictions;
+	uint32_t invalidations;
+} dcache_stats;
+
+extern dcache_stats g_DcacheStats;
+
+void dcacheInit();
+
+dentry_t *dcacheRoot(uint32_t mountId, bool foldCase);
+dentry_t *dcacheLookup(dentry_t *parent, const char *name);
+// entry is NULL for a name that does not exist, returns NULL when nothing can be evicted
+dentry_t *dcacheAdd(dentry_t *parent, const char *name, DirectoryEntry *entry);
+
+// path is relative to the mount, the entry and everything below it is dropped
+void dcacheInvalidatePath(uint32_t mountId, const char *path);
+void dcacheInvalidateMount(uint32_t mountId);
+
+void dcachePrintStats();
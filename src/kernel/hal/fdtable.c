@@ -0,0 +1,173 @@
+#include "fdtable.h"
+#include "string.h"
+#include "stdio.h"
+#include "memory.h"
+#include "debug.h"
+#include "arch/i686/io.h"
+
+#define MODULE "FDTABLE"
+
+/*
+ * Per task file descriptor tables
+ *
+ * A table maps descriptors to reference counted open files. Free descriptors
+ * are found in a bitmap a word at a time, starting at the first word that may
+ * have a free bit, so the lowest one is handed out without looking at every
+ * descriptor. Tables double when they run out. Everything runs with
+ * interrupts off, closing a file is left to the caller.
+ */
+
+static bool fdTableInit(fd_table_t *table, uint32_t size)
+{
+	table->files = (open_file_t **)calloc(size, sizeof(open_file_t *));
+	table->used = (uint32_t *)calloc(size / 32, sizeof(uint32_t));
+	if (!table->files || !table->used)
+	{
+		free(table->files);
+		free(table->used);
+		return false;
+	}
+	table->size = size;
+	// the consoles are not in the table
+	table->used[0] = (1u << VFS_FD_START) - 1;
+	table->firstFree = 0;
+	table->open = 0;
+	table->refs = 1;
+	return true;
+}
+
+fd_table_t *fdTableCreate()
+{
+	fd_table_t *table = (fd_table_t *)calloc(1, sizeof(fd_table_t));
+	if (table == NULL || !fdTableInit(table, FD_TABLE_INITIAL))
+	{
+		log_err(MODULE, "cannot allocate a descriptor table");
+		free(table);
+		return NULL;
+	}
+	return table;
+}
+
+fd_table_t *fdTableShare(fd_table_t *table)
+{
+	if (table)
+	{
+		uint32_t flags = i686_SaveInterrupts();
+		table->refs++;
+		i686_RestoreInterrupts(flags);
+	}
+	return table;
+}
+
+void fdTablePut(fd_table_t *table)
+{
+	if (table == NULL)
+		return;
+	uint32_t flags = i686_SaveInterrupts();
+	bool last = --table->refs == 0;
+	i686_RestoreInterrupts(flags);
+	if (!last)
+		return;
+
+	for (uint32_t fd = VFS_FD_START; fd < table->size && table->open; fd++)
+	{
+		open_file_t *file = fdRemove(table, fd);
+		if (file)
+			VFS_PutFile(file);
+	}
+	free(table->files);
+	free(table->used);
+	free(table);
+}
+
+// interrupts off
+static bool fdTableGrow(fd_table_t *table)
+{
+	uint32_t size = table->size * 2;
+	if (size > FD_TABLE_MAX)
+		return false;
+	open_file_t **files = (open_file_t **)realloc(table->files, size * sizeof(open_file_t *));
+	if (files == NULL)
+		return false;
+	table->files = files;
+	uint32_t *used = (uint32_t *)realloc(table->used, size / 32 * sizeof(uint32_t));
+	if (used == NULL)
+		return false;
+	table->used = used;
+
+	memset(table->files + table->size, 0, (size - table->size) * sizeof(open_file_t *));
+	memset(table->used + table->size / 32, 0, (size - table->size) / 32 * sizeof(uint32_t));
+	table->size = size;
+	return true;
+}
+
+fd_t fdInstall(fd_table_t *table, open_file_t *file)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	uint32_t words = table->size / 32;
+	while (table->firstFree < words && table->used[table->firstFree] == 0xFFFFFFFF)
+		table->firstFree++;
+	if (table->firstFree == words && !fdTableGrow(table))
+	{
+		i686_RestoreInterrupts(flags);
+		log_err(MODULE, "no free descriptor among %u", table->size);
+		return VFS_INVALID_FD;
+	}
+
+	uint32_t word = table->firstFree;
+	fd_t fd = word * 32 + __builtin_ctz(~table->used[word]);
+	table->used[word] |= 1u << (fd % 32);
+	table->files[fd] = file;
+	table->open++;
+	file->refs++;
+	i686_RestoreInterrupts(flags);
+	return fd;
+}
+
+open_file_t *fdGet(fd_table_t *table, fd_t fd)
+{
+	if (table == NULL || fd < VFS_FD_START)
+		return NULL;
+	uint32_t flags = i686_SaveInterrupts();
+	open_file_t *file = (uint32_t)fd < table->size ? table->files[fd] : NULL;
+	if (file)
+		file->refs++;
+	i686_RestoreInterrupts(flags);
+	return file;
+}
+
+open_file_t *fdRemove(fd_table_t *table, fd_t fd)
+{
+	if (table == NULL || fd < VFS_FD_START)
+		return NULL;
+	uint32_t flags = i686_SaveInterrupts();
+	open_file_t *file = (uint32_t)fd < table->size ? table->files[fd] : NULL;
+	if (file)
+	{
+		table->files[fd] = NULL;
+		table->used[fd / 32] &= ~(1u << (fd % 32));
+		table->open--;
+		if ((uint32_t)fd / 32 < table->firstFree)
+			table->firstFree = fd / 32;
+	}
+	i686_RestoreInterrupts(flags);
+	return file;
+}
+
+void fdTablePrint(fd_table_t *table)
+{
+	if (table == NULL)
+	{
+		printf("no descriptor table\n");
+		return;
+	}
+	uint32_t flags = i686_SaveInterrupts();
+	printf("%u of %u descriptors open, table shared by %u\n", table->open, table->size, table->refs);
+	for (uint32_t fd = VFS_FD_START; fd < table->size; fd++)
+	{
+		open_file_t *file = table->files[fd];
+		if (file)
+			printf("%u: %s at %u, %u refs\n", fd, file->node ? file->node->name : "?", file->offset, file->refs);
+	}
+	i686_RestoreInterrupts(flags);
+}
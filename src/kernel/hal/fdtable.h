@@ -0,0 +1,42 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "vfs.h"
+
+#define FD_TABLE_INITIAL 32	 // descriptors a table starts with, a multiple of 32
+#define FD_TABLE_MAX 65536	 // it doubles up to this many
+
+// an open file, shared by the descriptors dup'ed from it and by tasks that inherited it
+typedef struct open_file
+{
+	vfs_node_t *node;
+	uint32_t offset;
+	void *handle; // the filesystem's open file, NULL when it has no read_at/write_at
+	uint32_t refs;
+} open_file_t;
+
+// the descriptors of a task, 0 to VFS_FD_START - 1 are the consoles and never in it
+typedef struct fd_table
+{
+	open_file_t **files;
+	uint32_t *used;		// a bit per descriptor
+	uint32_t size;		// descriptors
+	uint32_t firstFree; // no word of used below this one has a free bit
+	uint32_t open;
+	uint32_t refs; // tasks sharing the table
+} fd_table_t;
+
+fd_table_t *fdTableCreate();
+// kernel threads share their creator's table
+fd_table_t *fdTableShare(fd_table_t *table);
+// drops a task's reference, the last one closes every descriptor
+void fdTablePut(fd_table_t *table);
+
+// the lowest free descriptor now refers to file, which the table takes a reference of
+fd_t fdInstall(fd_table_t *table, open_file_t *file);
+// the file with a reference for the caller, NULL when fd is not open
+open_file_t *fdGet(fd_table_t *table, fd_t fd);
+// frees fd and hands its reference of the file to the caller
+open_file_t *fdRemove(fd_table_t *table, fd_t fd);
+
+void fdTablePrint(fd_table_t *table);
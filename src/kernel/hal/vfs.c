@@ -1,14 +1,20 @@
+#define LOG_LEVEL LVL_INFO
+
 #include "vfs.h"
 #include "string.h"
 #include "memory.h"
 #include "fs/devfs/devfs.h"
 // #include "fs/ext2/ext2.h"
 #include "fs/fat32/fat32.h"
+#include "dcache.h"
+#include "drivers/block/bcache.h"
+#include "fdtable.h"
 #include "proc.h"
 #include "debug.h"
 #include "string.h"
 
 #include "syscall/systemcall.h"
+#include "task/sched.h"
 
 #include <drivers/VGA/vga.h>
 #include <drivers/Keyboard/keyboard.h>
@@ -18,24 +24,51 @@
 
 #include "defaultInclude.h"
 
-#define MAX_MOUNTS 16
 #define MODULE "VFS"
 
-typedef struct
-{
-	bool opened; // Is the file opened?
-	vfs_node_t *node;
-	uint32_t offset;
-} file_descriptor_t;
-
-file_descriptor_t *fd_table;
-
+// indexed by mount id, an unmounted slot is NULL
 MountPoint **mountPoints = 0;
-int lastMountId = 0;
+uint32_t lastMountId = 0;
+static uint32_t mountCapacity = 0;
+
+static MountPoint *g_RootMount = NULL;
+static filesystem_type_t *g_Filesystems = NULL;
 
 vfs_node_t *vfs_root;
 
-int Sys_Write(file_descriptor_t *file, void *buffer, size_t size)
+// the handle a transfer on file goes through, under the mount lock; a file opened without one gets a temporary handle
+static void *vfs_transferHandle(open_file_t *file, MountPoint *mountpoint)
+{
+	if (file->handle)
+	{
+		return file->handle;
+	}
+	filesystemInfo_t *fs = mountpoint->dev->fs;
+	if (fs->open == NULL)
+	{
+		return NULL;
+	}
+	// open tokenizes the path it gets
+	char pathCopy[MAX_PATH_SIZE];
+	strcpy(pathCopy, file->node->name);
+	void *handle = NULL;
+	if (!fs->open(pathCopy, &handle, mountpoint->dev, fs->priv_data))
+	{
+		return NULL;
+	}
+	return handle;
+}
+
+static void vfs_dropTransferHandle(open_file_t *file, MountPoint *mountpoint, void *handle)
+{
+	filesystemInfo_t *fs = mountpoint->dev->fs;
+	if (handle != file->handle && fs->close)
+	{
+		fs->close(handle, mountpoint->dev, fs->priv_data);
+	}
+}
+
+int Sys_Write(open_file_t *file, void *buffer, size_t size)
 {
 	if (file == NULL || buffer == NULL || size == 0)
 	{
@@ -69,7 +102,7 @@ int Sys_Write(file_descriptor_t *file, void *buffer, size_t size)
 		return -1; // Filesystem not mounted or write function not defined
 	}
 
-	if (fs->writefile == NULL)
+	if (fs->write_at == NULL)
 	{
 		log_err(MODULE, "Sys_Write: No write function defined for filesystem %s", fs->name);
 		return -1; // No write function defined
@@ -77,9 +110,29 @@ int Sys_Write(file_descriptor_t *file, void *buffer, size_t size)
 
 	log_debug(MODULE, "Sys_Write: Writing from node %s on mount point %s", node->name, mountpoint->loc);
 
-	return fs->writefile(node->name, buffer, size, mountpoint->dev, fs->priv_data);
+	mutexLock(&mountpoint->lock);
+	void *handle = vfs_transferHandle(file, mountpoint);
+	if (handle == NULL)
+	{
+		mutexUnlock(&mountpoint->lock);
+		log_err(MODULE, "Sys_Write: %s cannot open %s", fs->name, node->name);
+		return -1;
+	}
+	int result = fs->write_at(handle, buffer, file->offset, size, mountpoint->dev, fs->priv_data);
+	if (result > 0)
+	{
+		file->offset += result;
+	}
+	if (file->offset > node->size)
+	{
+		node->size = file->offset;
+		dcacheInvalidatePath(node->mountingPointId, node->name);
+	}
+	vfs_dropTransferHandle(file, mountpoint, handle);
+	mutexUnlock(&mountpoint->lock);
+	return result;
 }
-int Sys_Read(file_descriptor_t *file, void *buffer, size_t size)
+int Sys_Read(open_file_t *file, void *buffer, size_t size)
 {
 	if (file == NULL || buffer == NULL || size == 0)
 	{
@@ -113,7 +166,7 @@ int Sys_Read(file_descriptor_t *file, void *buffer, size_t size)
 		return -1; // Filesystem not mounted or read function not defined
 	}
 
-	if (fs->read == NULL)
+	if (fs->read_at == NULL)
 	{
 		log_err(MODULE, "Sys_Read: No read function defined for filesystem %s", fs->name);
 		return -1; // No read function defined
@@ -121,225 +174,429 @@ int Sys_Read(file_descriptor_t *file, void *buffer, size_t size)
 
 	log_debug(MODULE, "Sys_Read: Reading from node %s on mount point %s", node->name, mountpoint->loc);
 
-	return fs->read(node->name, buffer, mountpoint->dev, fs->priv_data);
+	mutexLock(&mountpoint->lock);
+	void *handle = vfs_transferHandle(file, mountpoint);
+	if (handle == NULL)
+	{
+		mutexUnlock(&mountpoint->lock);
+		log_err(MODULE, "Sys_Read: %s cannot open %s", fs->name, node->name);
+		return -1;
+	}
+	int result = fs->read_at(handle, buffer, file->offset, size, mountpoint->dev, fs->priv_data);
+	if (result > 0)
+	{
+		file->offset += result;
+	}
+	vfs_dropTransferHandle(file, mountpoint, handle);
+	mutexUnlock(&mountpoint->lock);
+	return result;
 }
 
 void systemCall_Read(Registers *regs)
 {
 	log_debug(MODULE, "systemCall_Read: regs = %p", regs);
 	fd_t fd = regs->U32.ebx; // File descriptor is in ebx
-	if (fd < 0 || fd >= MAX_FILE_HANDLES)
-	{
-		log_err(MODULE, "Invalid file descriptor: %d", fd);
-		regs->U32.eax = -1;
-		return;
-	}
-
 	regs->U32.eax = VFS_Read(fd, (void *)regs->U32.esi, regs->U32.ecx);
 }
 void systemCall_Write(Registers *regs)
 {
 	fd_t fd = regs->U32.ebx; // File descriptor is in ebx
-	if (fd < 0 || fd >= MAX_FILE_HANDLES)
-	{
-		log_err(MODULE, "Invalid file descriptor: %d", fd);
-		regs->U32.eax = -1;
-		return;
-	}
 	log_debug(MODULE, "fd: %u, buffer: 0x%X, count: %u", fd, regs->U32.esi, regs->U32.ecx);
 	regs->U32.eax = VFS_Write(fd, (void *)regs->U32.esi, regs->U32.ecx);
 }
 
-device_t *checkMountPoint(char *loc)
+
+// asks the filesystem about relPath, the mount relative path up to and including the component
+static bool vfs_findEntry(MountPoint *mountpoint, const char *relPath, DirectoryEntry *entry)
 {
-	for (size_t i = 0; i < lastMountId; i++)
+	filesystemInfo_t *fs = mountpoint->dev->fs;
+	if (fs == NULL || fs->find_entry == NULL)
 	{
-		if (strcmp(loc, mountPoints[i]->loc) == 0)
+		log_err(MODULE, "No find_entry function defined for filesystem");
+		return false;
+	}
+
+	// find_entry tokenizes the path it gets
+	char pathCopy[MAX_PATH_SIZE];
+	strcpy(pathCopy, relPath);
+	mutexLock(&mountpoint->lock);
+	bool found = fs->find_entry(pathCopy, (void *)entry, mountpoint->dev, fs->priv_data);
+	mutexUnlock(&mountpoint->lock);
+	return found;
+}
+
+
+// FNV-1a, extended a path component at a time while paths are walked
+#define VFS_HASH_SEED 2166136261u
+
+static uint32_t vfs_hashAppend(uint32_t hash, const char *text, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (uint8_t)text[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// the mount covering relPath within parent, relPath hashing to hash
+static MountPoint *vfs_childMount(MountPoint *parent, const char *relPath, uint32_t hash)
+{
+	for (MountPoint *child = parent->children; child; child = child->sibling)
+	{
+		if (child->onHash == hash && strcmp(child->on, relPath) == 0)
 		{
-			return mountPoints[i]->dev;
+			return child;
 		}
 	}
 	return NULL;
 }
-MountPoint *getMountPoint(char *loc)
+
+// the deepest mount on path, possibly the root, rest points at what is left of path below it
+static MountPoint *vfs_walkMounts(const char *path, const char **rest)
 {
-	for (size_t i = 0; i < lastMountId; i++)
+	MountPoint *mountpoint = g_RootMount;
+	char relPath[MAX_PATH_SIZE];
+	size_t relLength = 0;
+	uint32_t hash = VFS_HASH_SEED;
+	const char *p = path;
+	*rest = path;
+	while (true)
 	{
-		log_debug(MODULE, "Checking mount point %s against %s", loc, mountPoints[i]->loc);
-		log_debug(MODULE, "Checking mount point %u against %u", strlen(loc), strlen(mountPoints[i]->loc));
-		if (strcmp(loc, mountPoints[i]->loc) == 0)
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+
+		size_t length = 0;
+		while (p[length] && p[length] != '/')
+			length++;
+		if (relLength + length + 1 >= MAX_PATH_SIZE)
+			break;
+		relPath[relLength++] = '/';
+		memcpy(relPath + relLength, p, length);
+		relLength += length;
+		relPath[relLength] = '\0';
+		hash = vfs_hashAppend(vfs_hashAppend(hash, "/", 1), p, length);
+		p += length;
+
+		MountPoint *child = mountpoint->children ? vfs_childMount(mountpoint, relPath, hash) : NULL;
+		if (child)
 		{
-			return mountPoints[i];
+			mountpoint = child;
+			*rest = p;
+			relLength = 0;
+			hash = VFS_HASH_SEED;
 		}
 	}
-	log_crit(MODULE, "Mount point not found for location: %s", loc);
-	return NULL;
+	return mountpoint;
 }
 
-vfs_node_t *vfs_findDir(vfs_node_t *current, char *token)
+// the filesystem mount path is on, rest points at what is left of path below it
+static MountPoint *vfs_findMount(const char *path, const char **rest)
 {
-	log_debug(MODULE, "vfs_findDir: current = %p, token = %s", current, token);
-	if (!current || !token)
+	MountPoint *mountpoint = vfs_walkMounts(path, rest);
+	if (mountpoint == g_RootMount)
 	{
+		log_err(MODULE, "Nothing is mounted on %s", path);
 		return NULL;
 	}
-	MountPoint *mountpoint = mountPoints[current->mountingPointId];
-	if (!mountpoint)
+	return mountpoint;
+}
+
+// walks the path one component at a time through the mount tree and the dentry cache, the filesystem is only asked about misses
+vfs_node_t *vfs_resolve_path(const char *path)
+{
+	if (!path || path[0] != '/' || strlen(path) >= MAX_PATH_SIZE)
 	{
+		log_err(MODULE, "Invalid path: %s", path ? path : "(null)");
 		return NULL;
 	}
 
-	filesystemInfo_t *fs = mountpoint->dev->fs;
+	MountPoint *mountpoint = g_RootMount;
+	const char *p = path;
+	char name[MAX_PATH_SIZE];
+	char relPath[MAX_PATH_SIZE] = {'\0'};
+	size_t relLength = 0;
+	uint32_t hash = VFS_HASH_SEED;
+	dentry_t *current = NULL;
+	bool isDirectory = true;
+	uint32_t size = 0;
+	uint32_t inode = 0;
+	uint32_t depth = 0;
+
+	while (true)
+	{
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+		if (!isDirectory)
+		{
+			log_err(MODULE, "%s is not a directory", relPath);
+			return NULL;
+		}
+
+		size_t length = 0;
+		while (p[length] && p[length] != '/')
+			length++;
+		memcpy(name, p, length);
+		name[length] = '\0';
+		p += length;
+		relPath[relLength++] = '/';
+		memcpy(relPath + relLength, name, length + 1);
+		relLength += length;
+		hash = vfs_hashAppend(vfs_hashAppend(hash, "/", 1), name, length);
+
+		// crossing into a filesystem mounted here
+		MountPoint *child = mountpoint->children ? vfs_childMount(mountpoint, relPath, hash) : NULL;
+		if (child)
+		{
+			mountpoint = child;
+			relPath[0] = '\0';
+			relLength = 0;
+			hash = VFS_HASH_SEED;
+			current = dcacheRoot(child->id, child->dev->fs && child->dev->fs->caseInsensitive);
+			isDirectory = true;
+			depth = 0;
+			continue;
+		}
+		if (mountpoint == g_RootMount)
+		{
+			log_debug(MODULE, "Nothing is mounted on %s", path);
+			return NULL;
+		}
+		depth++;
 
-	if (fs->find_entry == NULL)
+		dentry_t *cached = current ? dcacheLookup(current, name) : NULL;
+		if (cached == NULL)
+		{
+			DirectoryEntry entry;
+			bool found = vfs_findEntry(mountpoint, relPath, &entry);
+			// without a cached parent nothing below can be cached either
+			cached = current ? dcacheAdd(current, name, found ? &entry : NULL) : NULL;
+			if (!found)
+			{
+				log_debug(MODULE, "%s not found", relPath);
+				return NULL;
+			}
+			isDirectory = entry.IsDirectory;
+			size = entry.size;
+			inode = entry.inode;
+		}
+		else if (cached->negative)
+		{
+			return NULL;
+		}
+		else
+		{
+			isDirectory = cached->isDirectory;
+			size = cached->size;
+			inode = cached->inode;
+		}
+		current = cached;
+	}
+
+	if (mountpoint == g_RootMount)
 	{
-		log_err(MODULE, "No find_entry function defined for filesystem");
+		log_err(MODULE, "Empty path after root: %s", path);
 		return NULL;
 	}
-	DirectoryEntry entry;
-	if (!fs->find_entry(token, (void*)&entry, mountpoint->dev, fs->priv_data))
+	vfs_node_t *root = mountpoint->root_node;
+	if (depth == 0)
 	{
-		log_crit(MODULE, "entry not found %s", token);
+		return root;
 	}
 
-	vfs_node_t *node = malloc(sizeof(vfs_node_t));
-
-	node->inode = current->inode + 1;
-	node->size = entry.size; // Size is not defined for directories
-	node->permissions = VFS_READABLE | VFS_WRITABLE;
-	node->permissions = entry.IsDirectory == true ? VFS_DIR : VFS_FILE;
-	strncpy(node->name, token, sizeof(node->name) - 1);
-	node->name[sizeof(node->name) - 1] = '\0'; // Ensure null-termination
-	node->mountingPointId = current->mountingPointId;
+	vfs_node_t *node = (vfs_node_t *)malloc(sizeof(vfs_node_t));
+	if (!node)
+	{
+		return NULL;
+	}
+	memset(node, 0, sizeof(vfs_node_t));
+	strcpy(node->name, relPath);
+	node->size = size;
+	node->inode = inode;
+	node->permissions = isDirectory ? VFS_DIR : VFS_FILE;
+	node->mountingPointId = mountpoint->id;
 	return node;
 }
 
-vfs_node_t *vfs_resolve_path(const char *path)
+// nodes from vfs_resolve_path are the caller's, except for the shared mount roots
+static void vfs_putNode(vfs_node_t *node)
 {
-	if (!path || path[0] != '/')
+	if (node == NULL)
 	{
-		log_err(MODULE, "Invalid path: %s", path ? path : "(null)");
-		return NULL;
+		return;
 	}
+	MountPoint *mountpoint = mountPoints[node->mountingPointId];
+	if (mountpoint && mountpoint->root_node == node)
+	{
+		return;
+	}
+	free(node);
+}
 
-	char path_copy[256];
-	strncpy(path_copy, path, sizeof(path_copy));
-	path_copy[sizeof(path_copy) - 1] = '\0';
+bool VFS_Stat(const char *path, vfs_node_t *out)
+{
+	vfs_node_t *node = vfs_resolve_path(path);
+	if (node == NULL)
+	{
+		return false;
+	}
+	memcpy(out, node, sizeof(vfs_node_t));
+	vfs_putNode(node);
+	return true;
+}
 
-	// Get first token (device name)
-	char *token = strtok(path_copy + 1, "/"); // skip initial '/'
-	if (!token)
+// the mount of path and the path below it, which has to name something
+static MountPoint *vfs_pathTarget(const char *path, char *relPath)
+{
+	if (!path || path[0] != '/' || strlen(path) >= MAX_PATH_SIZE)
 	{
-		log_err(MODULE, "Empty path after root: %s", path);
+		log_err(MODULE, "Invalid path: %s", path ? path : "(null)");
 		return NULL;
 	}
-
-	// Find the mount
-	vfs_node_t *current = NULL;
-	char fullpath[MAX_PATH_SIZE];
+	const char *rest;
+	MountPoint *mountpoint = vfs_findMount(path, &rest);
+	if (!mountpoint || mountpoint->dev->fs == NULL)
 	{
-		memset(fullpath, 0, sizeof(fullpath));
-		fullpath[0] = '/';
-		strcpy(fullpath + 1, token);
-
-		MountPoint *mountpoint = getMountPoint(fullpath);
-		current = mountpoint->root_node;
+		return NULL;
 	}
-
-	if (!current)
+	while (*rest == '/')
+		rest++;
+	if (*rest == '\0')
 	{
-		log_err(MODULE, "Device '%s' not found in mount table", token);
+		log_err(MODULE, "%s is a mount point", path);
 		return NULL;
 	}
+	relPath[0] = '/';
+	strcpy(relPath + 1, rest);
+	return mountpoint;
+}
 
-	int count = strcount((string)path, '/') - 1;
-
-	memset(fullpath, 0, sizeof(fullpath));
-	fullpath[0] = '/';
-	log_debug(MODULE, "Full path: %s", fullpath);
-
-	for (size_t i = 0; i < count; i++)
+bool VFS_Create(const char *path)
+{
+	char relPath[MAX_PATH_SIZE];
+	MountPoint *mountpoint = vfs_pathTarget(path, relPath);
+	if (!mountpoint)
 	{
-		token = strtok(NULL, "/"); // move to next token (subpath)
-		if (token == NULL)
-		{
-			break;
-		}
-		strcat(fullpath, token);
-		if (strcount((string)token, '.') == 0)
-		{
-			strcat(fullpath, "/");
-		}
-		log_debug(MODULE, "Full path: %s", fullpath);
+		return false;
 	}
+	filesystemInfo_t *fs = mountpoint->dev->fs;
+	if (fs->touch == NULL)
+	{
+		log_err(MODULE, "%s cannot create files", fs->name);
+		return false;
+	}
+	mutexLock(&mountpoint->lock);
+	// drops a cached "does not exist"
+	dcacheInvalidatePath(mountpoint->root_node->mountingPointId, relPath);
+	bool ok = fs->touch(relPath, mountpoint->dev, fs->priv_data);
+	mutexUnlock(&mountpoint->lock);
+	return ok;
+}
 
-	while (token && current)
+bool VFS_Mkdir(const char *path)
+{
+	char relPath[MAX_PATH_SIZE];
+	MountPoint *mountpoint = vfs_pathTarget(path, relPath);
+	if (!mountpoint)
 	{
-		current = vfs_findDir(current, fullpath);
-		if (current->name == NULL || current->name[0] == '\0')
-		{
-			log_err(MODULE, "Failed to resolve path component: %s", fullpath);
-			return NULL;
-		}
-		if (!current)
-		{
-			log_err(MODULE, "Failed to resolve component: %s", fullpath);
-			return NULL;
-		}
+		return false;
+	}
+	filesystemInfo_t *fs = mountpoint->dev->fs;
+	if (fs->mkdir == NULL)
+	{
+		log_err(MODULE, "%s cannot create directories", fs->name);
+		return false;
+	}
+	mutexLock(&mountpoint->lock);
+	dcacheInvalidatePath(mountpoint->root_node->mountingPointId, relPath);
+	bool ok = fs->mkdir(relPath, mountpoint->dev, fs->priv_data);
+	mutexUnlock(&mountpoint->lock);
+	return ok;
+}
 
-		token = strtok(NULL, "/");
-		strcat(fullpath, "/");
-		strcpy(fullpath, token);
+bool VFS_Unlink(const char *path)
+{
+	char relPath[MAX_PATH_SIZE];
+	MountPoint *mountpoint = vfs_pathTarget(path, relPath);
+	if (!mountpoint)
+	{
+		return false;
+	}
+	filesystemInfo_t *fs = mountpoint->dev->fs;
+	if (fs->unlink == NULL)
+	{
+		log_err(MODULE, "%s cannot remove files", fs->name);
+		return false;
 	}
-	// strncpy(result->name, fullpath, sizeof(result->name) - 1);
-	// result->name[sizeof(result->name) - 1] = '\0'; // Ensure null-termination
-	return current;
+	mutexLock(&mountpoint->lock);
+	dcacheInvalidatePath(mountpoint->root_node->mountingPointId, relPath);
+	bool ok = fs->unlink(relPath, mountpoint->dev, fs->priv_data);
+	mutexUnlock(&mountpoint->lock);
+	return ok;
 }
 
-int __find_mount(char *filename, int *adjust)
+
+// descriptors of the running task, created on its first open
+static fd_table_t *vfs_files()
 {
-	log_debug(MODULE, "filename %s string length %u", filename, strlen(filename) + 1);
-	char *orig = (char *)calloc(1, strlen(filename) + 1);
-	memcpy(orig, filename, strlen(filename) + 1);
-	if (orig[strlen(orig)] == '/')
+	if (g_CurrentTask->files == NULL)
 	{
-		str_backspace(orig, '/');
+		g_CurrentTask->files = fdTableCreate();
 	}
-	while (1)
+	return g_CurrentTask->files;
+}
+
+// the open file behind fd with a reference the caller drops with VFS_PutFile
+static open_file_t *vfs_getFile(fd_t file)
+{
+	open_file_t *opened = fdGet(vfs_files(), file);
+	if (opened == NULL)
 	{
-		for (int i = 0; i < MAX_MOUNTS; i++)
-		{
-			if (!mountPoints[i])
-				break;
-			if (strcmp(mountPoints[i]->loc, orig) == 0)
-			{
-				/* Adjust the orig to make it relative to fs/dev */
-				*adjust = (strlen(orig) - 1);
-				/*
-				 */
-				log_debug(MODULE, "returning %s (%d) i=%d orig=%s adjust=%d\n", mountPoints[i]->dev->name, mountPoints[i]->dev->id, i, orig, *adjust);
-				free(orig);
-				return i;
-			}
-		}
-		if (strcmp(orig, "/") == 0)
-			break;
-		str_backspace(orig, '/');
+		log_err(MODULE, "File descriptor %d is not opened", file);
 	}
-	free(orig);
-	return false;
+	return opened;
 }
 
-fd_t vfs_findFileDiscriptor()
+open_file_t *VFS_GetFile(fd_t file)
 {
-	for (fd_t i = VFS_FD_START; i < MAX_FILE_HANDLES; i++)
+	return file >= VFS_FD_START ? fdGet(vfs_files(), file) : NULL;
+}
+
+void VFS_PutFile(open_file_t *file)
+{
+	uint32_t flags = i686_SaveInterrupts();
+	bool last = --file->refs == 0;
+	i686_RestoreInterrupts(flags);
+	if (!last)
 	{
-		if (!fd_table[i].opened)
+		return;
+	}
+
+	vfs_node_t *node = file->node;
+	MountPoint *mountpoint = node ? mountPoints[node->mountingPointId] : NULL;
+	if (file->handle && mountpoint)
+	{
+		device_t *dev = mountpoint->dev;
+		if (dev->fs && dev->fs->close)
 		{
-			return i; // Return the first available file descriptor
+			mutexLock(&mountpoint->lock);
+			dev->fs->close(file->handle, dev, dev->fs->priv_data);
+			mutexUnlock(&mountpoint->lock);
 		}
 	}
-	return -1; // No available file descriptor found
+	if (mountpoint)
+	{
+		// the mount cannot go away while this file counts on it
+		flags = i686_SaveInterrupts();
+		mountpoint->openFiles--;
+		i686_RestoreInterrupts(flags);
+	}
+	vfs_putNode(node);
+	free(file);
 }
 
 
@@ -351,8 +608,7 @@ int VFS_Write(fd_t file, uint8_t *data, size_t size)
 		return 0;
 	case VFS_FD_STDOUT:
 	case VFS_FD_STDERR:
-		for (size_t i = 0; i < size; i++)
-			VGA_putc(data[i]);
+		VGA_write((const char *)data, size);
 		return size;
 
 	case VFS_FD_DEBUG:
@@ -362,13 +618,14 @@ int VFS_Write(fd_t file, uint8_t *data, size_t size)
 
 	default:
 		log_debug(MODULE, "VFS_Write: file = %d, data = %p, size = %zu", file, data, size);
-		if (file < 0 || file >= MAX_FILE_HANDLES || &fd_table[file] == NULL)
+		open_file_t *opened = vfs_getFile(file);
+		if (opened == NULL)
 		{
-			log_err(MODULE, "Invalid file descriptor: %d", file);
 			return -1;
 		}
-		file_descriptor_t *node = &fd_table[file];
-		return Sys_Write(node, data, size);
+		int written = Sys_Write(opened, data, size);
+		VFS_PutFile(opened);
+		return written;
 	}
 	return -1;
 }
@@ -386,171 +643,355 @@ int VFS_Read(fd_t file, void *buffer, size_t size)
 
 	default:
 		log_debug(MODULE, "VFS_Read: file = %d, buffer = %p, size = %zu", file, buffer, size);
-		if (file < 0 || file >= MAX_FILE_HANDLES || &fd_table[file] == NULL)
+		open_file_t *opened = vfs_getFile(file);
+		if (opened == NULL)
 		{
-			log_err(MODULE, "Invalid file descriptor: %d", file);
 			return -1;
 		}
-		file_descriptor_t *node = &fd_table[file];
-		return Sys_Read(node, buffer, size);
+		int got = Sys_Read(opened, buffer, size);
+		VFS_PutFile(opened);
+		return got;
 	}
 	return -1;
 }
 
-bool MountDevice(device_t *dev, char *loc)
+bool VFS_RegisterFilesystem(const char *name, bool (*probe)(device_t *dev))
 {
-	if (dev == NULL || (dev->id == 0))
+	filesystem_type_t *type = (filesystem_type_t *)calloc(1, sizeof(filesystem_type_t));
+	if (type == NULL)
 	{
-		log_debug(MODULE, "dev = %p dev.id = %u", dev, dev->id);
 		return false;
 	}
-	log_debug(MODULE, "dev = %p", dev);
-	if (checkMountPoint(loc))
+	type->name = name;
+	type->probe = probe;
+
+	// probed in the order they registered
+	filesystem_type_t **link = &g_Filesystems;
+	while (*link)
 	{
-		return false;
+		link = &(*link)->next;
 	}
-	log_debug(MODULE, "after cheaking Mounting Points");
-	if (FAT_Probe(dev))
+	*link = type;
+	log_debug(MODULE, "filesystem %s registered", name);
+	return true;
+}
+
+static bool vfs_addMount(MountPoint *mountpoint)
+{
+	if (lastMountId == mountCapacity)
 	{
-		log_debug(MODULE, "FAT32 probed successly");
-		if (FAT_Mount(dev, dev->fs->priv_data))
+		uint32_t capacity = mountCapacity ? mountCapacity * 2 : 8;
+		MountPoint **grown = (MountPoint **)realloc(mountPoints, capacity * sizeof(MountPoint *));
+		if (grown == NULL)
 		{
-			MountPoint *m = (MountPoint *)malloc(sizeof(MountPoint));
-			m->loc = loc;
-			m->dev = dev;
-			m->root_node = (vfs_node_t *)malloc(sizeof(vfs_node_t));
+			return false;
+		}
+		memset(grown + mountCapacity, 0, (capacity - mountCapacity) * sizeof(MountPoint *));
+		mountPoints = grown;
+		mountCapacity = capacity;
+	}
+	mountpoint->id = lastMountId++;
+	mountPoints[mountpoint->id] = mountpoint;
+	return true;
+}
 
-			if (FAT_GetRoot(m->root_node, dev, dev->fs->priv_data) == false)
-			{
-				log_crit(MODULE, "FAT_GetRoot failed for %s", loc);
-				free(m);
-				return false;
-			}
+bool MountDevice(device_t *dev, char *loc)
+{
+	if (dev == NULL || loc == NULL || loc[0] != '/' || strlen(loc) >= MAX_PATH_SIZE)
+	{
+		log_err(MODULE, "MountDevice: invalid device or location");
+		return false;
+	}
+	for (uint32_t i = 0; i < lastMountId; i++)
+	{
+		if (mountPoints[i] && mountPoints[i]->dev == dev)
+		{
+			log_err(MODULE, "%s is already mounted on %s", dev->name, mountPoints[i]->loc);
+			return false;
+		}
+	}
 
-			char path_copy[256];
-			strcpy(path_copy, loc);
-			char *token = strtok(path_copy, "/");
-			memset(m->root_node->name, 0, sizeof(m->root_node->name));
-			m->root_node->name[0] = '/';
-			strcat(m->root_node->name, token);
-			strcat(m->root_node->name, "/");
+	// the path the new mount covers within the deepest mount above it
+	const char *rest;
+	MountPoint *parent = vfs_walkMounts(loc, &rest);
+	char on[MAX_PATH_SIZE];
+	size_t onLength = 0;
+	while (*rest)
+	{
+		while (*rest == '/')
+			rest++;
+		if (*rest == '\0')
+			break;
+		on[onLength++] = '/';
+		while (*rest && *rest != '/')
+			on[onLength++] = *rest++;
+	}
+	on[onLength] = '\0';
+	if (onLength == 0)
+	{
+		log_err(MODULE, "%s is already a mount point", loc);
+		return false;
+	}
+	if (parent != g_RootMount)
+	{
+		vfs_node_t node;
+		if (!VFS_Stat(loc, &node) || !(node.permissions & VFS_DIR))
+		{
+			log_err(MODULE, "%s is not a directory", loc);
+			return false;
+		}
+	}
 
-			m->root_node->mountingPointId = lastMountId;
+	filesystem_type_t *type = g_Filesystems;
+	while (type && !type->probe(dev))
+	{
+		type = type->next;
+	}
+	if (type == NULL || dev->fs == NULL)
+	{
+		log_err(MODULE, "no filesystem found on %s", dev->name);
+		return false;
+	}
+	log_debug(MODULE, "%s holds %s", dev->name, type->name);
 
-			lastMountId++;
-			mountPoints[lastMountId - 1] = m;
-			while (token != NULL)
-			{
-				token = strtok(NULL, "/");
-			}
+	filesystemInfo_t *fs = dev->fs;
+	if (fs->mount && !fs->mount(dev, fs->priv_data))
+	{
+		log_err(MODULE, "%s: cannot mount %s", type->name, dev->name);
+		return false;
+	}
 
-			log_debug(MODULE, "good");
-			return true;
-		}
+	MountPoint *m = (MountPoint *)calloc(1, sizeof(MountPoint));
+	vfs_node_t *root = (vfs_node_t *)calloc(1, sizeof(vfs_node_t));
+	char *locCopy = (char *)malloc(strlen(loc) + 1);
+	char *onCopy = (char *)malloc(onLength + 1);
+	if (!m || !root || !locCopy || !onCopy)
+	{
+		free(m);
+		free(root);
+		free(locCopy);
+		free(onCopy);
 		return false;
 	}
-	return false;
+	root->permissions = VFS_DIR | VFS_READABLE;
+	if (fs->getRoot && !fs->getRoot(root, dev, fs->priv_data))
+	{
+		log_crit(MODULE, "%s: no root on %s", type->name, dev->name);
+		free(m);
+		free(root);
+		free(locCopy);
+		free(onCopy);
+		return false;
+	}
+	// node names are relative to their mount
+	strcpy(root->name, "/");
+	strcpy(locCopy, loc);
+	strcpy(onCopy, on);
+
+	m->loc = locCopy;
+	m->dev = dev;
+	m->root_node = root;
+	m->on = onCopy;
+	m->onHash = vfs_hashAppend(VFS_HASH_SEED, on, onLength);
+	m->parent = parent;
+	mutexInit(&m->lock);
+
+	uint32_t flags = i686_SaveInterrupts();
+	bool added = vfs_addMount(m);
+	if (added)
+	{
+		root->mountingPointId = m->id;
+		m->sibling = parent->children;
+		parent->children = m;
+	}
+	i686_RestoreInterrupts(flags);
+	if (!added)
+	{
+		free(m);
+		free(root);
+		free(locCopy);
+		free(onCopy);
+		return false;
+	}
+	log_info(MODULE, "%s mounted on %s as %s", dev->name, loc, type->name);
+	return true;
 }
-bool UmountDevice(char* loc)
+
+bool UmountDevice(char *loc)
 {
-	if (loc == NULL)
+	if (loc == NULL || loc[0] != '/')
+	{
+		log_err(MODULE, "UmountDevice: invalid location");
+		return false;
+	}
+	const char *rest;
+	MountPoint *m = vfs_walkMounts(loc, &rest);
+	while (*rest == '/')
+		rest++;
+	if (m == g_RootMount || *rest != '\0')
+	{
+		log_err(MODULE, "Mount point not found for location: %s", loc);
+		return false;
+	}
+	if (m->children)
 	{
-		log_err(MODULE, "UmountDevice: loc is NULL");
+		log_err(MODULE, "%s has mounts below it", loc);
 		return false;
 	}
-	log_debug(MODULE, "UmountDevice: loc = %s", loc);
-	for (size_t i = 0; i < lastMountId; i++)
+	mutexLock(&m->lock);
+	uint32_t flags = i686_SaveInterrupts();
+	uint32_t openFiles = m->openFiles;
+	if (openFiles == 0)
 	{
-		if (mountPoints[i] && strcmp(mountPoints[i]->loc, loc) == 0)
+		// no open can count on the mount from here on
+		MountPoint **link = &m->parent->children;
+		while (*link != m)
 		{
-			free(mountPoints[i]->root_node);
-			free(mountPoints[i]);
-			mountPoints[i] = NULL;
-			return true;
+			link = &(*link)->sibling;
 		}
+		*link = m->sibling;
+		mountPoints[m->id] = NULL;
+	}
+	i686_RestoreInterrupts(flags);
+	if (openFiles)
+	{
+		mutexUnlock(&m->lock);
+		log_err(MODULE, "%s is busy, %u files are open on it", loc, openFiles);
+		return false;
 	}
-	log_err(MODULE, "Mount point not found for location: %s", loc);
-	return false;
-}
 
-int VFS_GetOffset(fd_t file)
-{
-	file_descriptor_t *fd = &fd_table[file];
-	if (file < 0 || file >= MAX_FILE_HANDLES || fd == NULL)
+	if (m->dev->queue)
 	{
-		log_err(MODULE, "Invalid file descriptor: %d", file);
-		return -1; // Invalid file descriptor
+		bcacheSync(m->dev);
 	}
-	if (!fd->opened)
+	filesystemInfo_t *fs = m->dev->fs;
+	if (fs && fs->umount)
 	{
-		log_err(MODULE, "File descriptor %d is not opened", file);
-		return -1; // File descriptor is not opened
+		fs->umount(m);
 	}
+	mutexUnlock(&m->lock);
+
+	dcacheInvalidateMount(m->id);
+	free(m->root_node);
+	free(m->loc);
+	free(m->on);
+	free(m);
+	return true;
+}
+
+MountPoint *VFS_GetMount(uint32_t id)
+{
+	return id < lastMountId ? mountPoints[id] : NULL;
+}
 
-	return fd->offset; // Return the current offset
+uint32_t VFS_MountCount()
+{
+	return lastMountId;
 }
-int VFS_GetSize(fd_t file)
+
+// one line per mount: location, device, filesystem
+int VFS_FormatMounts(char *buffer, size_t size)
 {
-	file_descriptor_t *fd = &fd_table[file];
-	if (file < 0 || file >= MAX_FILE_HANDLES || fd == NULL)
+	int length = 0;
+	buffer[0] = '\0';
+	for (uint32_t i = 0; i < lastMountId; i++)
 	{
-		log_err(MODULE, "Invalid file descriptor: %d", file);
-		return -1; // Invalid file descriptor
+		MountPoint *m = mountPoints[i];
+		if (m == NULL || m->dev == NULL)
+		{
+			continue;
+		}
+		int added = snprintf(buffer + length, size - length, "%s %s %s\n", m->loc, m->dev->name,
+							 m->dev->fs && m->dev->fs->name ? m->dev->fs->name : "?");
+		if (added < 0 || (size_t)(length + added) >= size)
+		{
+			break;
+		}
+		length += added;
 	}
-	if (!fd->opened)
+	return length;
+}
+
+int VFS_GetOffset(fd_t file)
+{
+	open_file_t *opened = vfs_getFile(file);
+	if (opened == NULL)
 	{
-		log_err(MODULE, "File descriptor %d is not opened", file);
-		return -1; // File descriptor is not opened
+		return -1;
 	}
-
-	vfs_node_t *node = fd->node;
-	if (node == NULL)
+	int offset = opened->offset;
+	VFS_PutFile(opened);
+	return offset;
+}
+int VFS_GetSize(fd_t file)
+{
+	open_file_t *opened = vfs_getFile(file);
+	if (opened == NULL)
 	{
-		log_err(MODULE, "File descriptor %d has no associated node", file);
-		return -1; // No associated node
+		return -1;
 	}
-
-	return node->size; // Return the size of the file
+	int size = opened->node->size;
+	VFS_PutFile(opened);
+	return size;
 }
 
 bool VFS_Seek(fd_t file, uint64_t offset)
 {
-	file_descriptor_t *fd = &fd_table[file];
-	if (file < 0 || file >= MAX_FILE_HANDLES || fd == NULL)
+	open_file_t *opened = vfs_getFile(file);
+	if (opened == NULL)
 	{
-		log_err(MODULE, "Invalid file descriptor: %d", file);
-		return false; // Invalid file descriptor
-	}
-	if (!fd->opened)
-	{
-		log_err(MODULE, "File descriptor %d is not opened", file);
-		return false; // File descriptor is not opened
+		return false;
 	}
-
-	fd->offset = offset; // Set the new offset
+	opened->offset = offset;
 	// TODO check if offset is valid for the file
+	VFS_PutFile(opened);
+	return true;
+}
 
-	return true; // Seek operation successful
+bool VFS_Truncate(fd_t file, uint32_t size)
+{
+	open_file_t *opened = vfs_getFile(file);
+	if (opened == NULL)
+	{
+		return false;
+	}
+	MountPoint *mountpoint = mountPoints[opened->node->mountingPointId];
+	filesystemInfo_t *fs = mountpoint ? mountpoint->dev->fs : NULL;
+	bool ok = false;
+	if (opened->handle == NULL || fs == NULL || fs->truncate == NULL)
+	{
+		log_err(MODULE, "File descriptor %d cannot be truncated", file);
+	}
+	else
+	{
+		mutexLock(&mountpoint->lock);
+		if (fs->truncate(opened->handle, size, mountpoint->dev, fs->priv_data))
+		{
+			opened->node->size = size;
+			dcacheInvalidatePath(opened->node->mountingPointId, opened->node->name);
+			ok = true;
+		}
+		mutexUnlock(&mountpoint->lock);
+	}
+	VFS_PutFile(opened);
+	return ok;
 }
 
 bool VFS_Readdir(fd_t file, DirectoryEntries* buffer)
 {
-    file_descriptor_t *fd = &fd_table[file];
     log_debug(MODULE, "VFS_Readdir: file=%d, buffer=%p", file, buffer);
-
-    if (file < 0 || file >= MAX_FILE_HANDLES || fd == NULL)
+    open_file_t *fd = vfs_getFile(file);
+    if (fd == NULL)
     {
-        log_err(MODULE, "Invalid file descriptor: %d", file);
         return false;
     }
+    // the node's name is all that is needed
+    char pathCopy[MAX_PATH_SIZE];
+    strcpy(pathCopy, fd->node->name);
+    uint32_t mountingPointId = fd->node->mountingPointId;
+    VFS_PutFile(fd);
 
-    if (!fd->opened)
-    {
-        log_err(MODULE, "File descriptor %d is not opened", file);
-        return false;
-    }
-
-    MountPoint *mountpoint = mountPoints[fd->node->mountingPointId];
+    MountPoint *mountpoint = mountPoints[mountingPointId];
     if (!mountpoint)
     {
         log_err(MODULE, "VFS_Readdir: No mountpoint for fd %d", file);
@@ -575,68 +1016,71 @@ bool VFS_Readdir(fd_t file, DirectoryEntries* buffer)
         return false;
     }
 
-    if (strncmp(fs->name, "FAT", 3))
+    // read_dir may tokenize the path it gets
+    mutexLock(&mountpoint->lock);
+    bool read = fs->read_dir(pathCopy, (uint8_t *)buffer, dev, fs->priv_data);
+    mutexUnlock(&mountpoint->lock);
+    if (!read)
     {
-        log_debug(MODULE, "Detected FAT filesystem, reading directory");
-
-        FAT_Directory fatDir;
-        log_debug(MODULE, "Reading directory for node name: %s", fd->node->name);
-/*
-fatDir.entries = mallocToPage0(sizeof(FAT_Directory) * 12);
-if (!fatDir.entries)
-{
-	log_err(MODULE, "Failed to allocate memory for FAT directory");
-	return false;
-}
-*/
-
-        fs->read_dir(fd->node->name, (uint8_t*)&fatDir, dev, dev->priv);
-        log_debug(MODULE, "FAT read_dir returned %d entries", fatDir.entryCount);
-		int count = fatDir.entryCount;
-
-        for (size_t i = 0; i < count; i++)
-        {
-            char normalName[MAX_PATH_SIZE];
-            GetName((char*)fatDir.entries[i].Entry.Name, normalName);
-            log_debug(MODULE, "Entry %zu: raw='%s', normalized='%s'",
-                      i, fatDir.entries[i].Entry.Name, normalName);
-
-            strcpy(buffer->entries[i].name, normalName);
-        }
-
-        buffer->entryCount = count;
-        log_debug(MODULE, "Directory read completed successfully with %d entries", count);
-        return true;
+        log_err(MODULE, "%s: cannot read directory", fs->name);
+        return false;
     }
-
-    log_err(MODULE, "Unsupported filesystem: %s", fs->name);
-    return false;
+    log_debug(MODULE, "Directory read completed successfully with %u entries", buffer->entryCount);
+    return true;
 }
 
 fd_t VFS_Open(char *path)
 {
-	vfs_node_t *node = (vfs_node_t *)malloc(sizeof(vfs_node_t));
-	node = vfs_resolve_path(path);
-
-	fd_t fileDescriptorIndex = vfs_findFileDiscriptor();
-	if (fileDescriptorIndex == -1)
+	vfs_node_t *node = vfs_resolve_path(path);
+	if (node == NULL)
 	{
-		log_err(MODULE, "No available file descriptor found");
-		return -1; // No available file descriptor found
+		return VFS_INVALID_FD;
 	}
-	file_descriptor_t *filed = &fd_table[fileDescriptorIndex];
-	fileDescriptorIndex++;
-	filed->opened = true; // Mark the file descriptor as opened
-	filed->node = node;
-	filed->offset = 0;
-	if (fileDescriptorIndex - 1 >= MAX_FILE_HANDLES)
+
+	open_file_t *opened = (open_file_t *)calloc(1, sizeof(open_file_t));
+	if (opened == NULL)
 	{
-		log_err(MODULE, "No more file descriptors available");
-		return -1; // No more file descriptors available
+		vfs_putNode(node);
+		return VFS_INVALID_FD;
 	}
+	opened->node = node;
+	opened->refs = 1;
 
-	fd_t fd = fileDescriptorIndex - 1;
+	uint32_t flags = i686_SaveInterrupts();
+	MountPoint *mountpoint = mountPoints[node->mountingPointId];
+	if (mountpoint)
+	{
+		mountpoint->openFiles++;
+	}
+	i686_RestoreInterrupts(flags);
+	if (mountpoint == NULL)
+	{
+		// unmounted since the path was resolved
+		VFS_PutFile(opened);
+		return VFS_INVALID_FD;
+	}
+	filesystemInfo_t *fs = mountpoint->dev->fs;
+	if ((node->permissions & VFS_FILE) && fs && fs->open)
+	{
+		// open tokenizes the path it gets
+		char pathCopy[MAX_PATH_SIZE];
+		strcpy(pathCopy, node->name);
+		mutexLock(&mountpoint->lock);
+		bool ok = fs->open(pathCopy, &opened->handle, mountpoint->dev, fs->priv_data);
+		mutexUnlock(&mountpoint->lock);
+		if (!ok)
+		{
+			log_err(MODULE, "%s: cannot open %s", fs->name, path);
+			opened->handle = NULL;
+			VFS_PutFile(opened);
+			return VFS_INVALID_FD;
+		}
+	}
 
+	fd_table_t *files = vfs_files();
+	fd_t fd = files ? fdInstall(files, opened) : VFS_INVALID_FD;
+	// the table holds the only reference now, or none when it had no room
+	VFS_PutFile(opened);
 	return fd;
 }
 void syscall_Open(Registers* regs)
@@ -647,18 +1091,26 @@ void syscall_Open(Registers* regs)
 
 bool VFS_Close(fd_t file)
 {
-	if (file < 0 || file >= MAX_FILE_HANDLES)
+	open_file_t *opened = fdRemove(vfs_files(), file);
+	if (opened == NULL)
 	{
-		log_err(MODULE, "Invalid file descriptor: %d", file);
-		return false; // Invalid file descriptor
+		log_err(MODULE, "File descriptor %d is not opened", file);
+		return false;
 	}
-	if (!fd_table[file].opened)
+	VFS_PutFile(opened);
+	return true;
+}
+
+fd_t VFS_Dup(fd_t file)
+{
+	open_file_t *opened = vfs_getFile(file);
+	if (opened == NULL)
 	{
-		log_err(MODULE, "File descriptor %d is not opened", file);
-		return false; // File descriptor is not opened
+		return VFS_INVALID_FD;
 	}
-	fd_table[file].opened = false; // Mark the file descriptor as closed
-	return true; // Close operation successful
+	fd_t fd = fdInstall(vfs_files(), opened);
+	VFS_PutFile(opened);
+	return fd;
 }
 
 void syscall_Close(Registers* regs)
@@ -666,38 +1118,38 @@ void syscall_Close(Registers* regs)
 	VFS_Close(regs->U32.ebx);
 }
 
+void syscall_Dup(Registers* regs)
+{
+	regs->U32.eax = VFS_Dup(regs->U32.ebx);
+}
+
+// the node stays valid only while file is open
 vfs_node_t *VFS_GetNode(fd_t file)
 {
-	if (file < 0 || file >= MAX_FILE_HANDLES)
-	{
-		log_err(MODULE, "Invalid file descriptor: %d", file);
-		return NULL; // Invalid file descriptor
-	}
-	file_descriptor_t *fd = &fd_table[file];
-	if (fd->node == NULL)
+	open_file_t *opened = vfs_getFile(file);
+	if (opened == NULL)
 	{
-		log_err(MODULE, "File descriptor %d has no associated node", file);
-		return NULL; // No associated node
+		return NULL;
 	}
-	return fd->node;
+	vfs_node_t *node = opened->node;
+	VFS_PutFile(opened);
+	return node;
 }
 
 void VFS_init()
 {
 	printf("Loading VFS\n");
-	mountPoints = (MountPoint **)malloc(sizeof(MountPoint) * MAX_MOUNTS);
-	fd_table = (file_descriptor_t *)malloc(sizeof(file_descriptor_t) * MAX_FILE_HANDLES + VFS_FD_START);
-	fd_table[0].node = NULL; // stdin
-	fd_table[0].offset = 0;	 // stdin
-	fd_table[1].node = NULL; // stdout
-	fd_table[1].offset = 0;	 // stdout
-	fd_table[2].node = NULL; // stderr
-	fd_table[2].offset = 0;	 // stderr
-	fd_table[3].node = NULL; // debug
-	fd_table[3].offset = 0;	 // debug
+	dcacheInit();
+	g_RootMount = (MountPoint *)calloc(1, sizeof(MountPoint));
+	g_RootMount->loc = "/";
+	g_RootMount->on = "";
+	vfs_addMount(g_RootMount);
+	VFS_RegisterFilesystem("fat", FAT_Probe);
+	vfs_files();
 
 	registerSyscall(SYSCALL_READ, systemCall_Read);
 	registerSyscall(SYSCALL_WRITE, systemCall_Write);
 	registerSyscall(SYSCALL_OPEN, syscall_Open);
 	registerSyscall(SYSCALL_CLOSE, syscall_Close);
+	registerSyscall(SYSCALL_DUP, syscall_Dup);
 }
\ No newline at end of file
@@ -2,11 +2,11 @@
 #include "defaultInclude.h"
 #include "fs/disk.h"
 #include "drivers/device.h"
+#include "task/mutex.h"
 
 typedef int fd_t;
 
 #define MAX_PATH_SIZE           256
-#define MAX_FILE_HANDLES        16
 #define ROOT_DIRECTORY_HANDLE   -1
 #define VFS_FD_START (fd_t) 4 // Start from 4 to avoid stdin, stdout, stderr, debug
 
@@ -46,20 +46,41 @@ typedef struct vfs_node
     uint32_t mountingPointId; // ID of the mount point this node belongs to 
 } vfs_node_t;
 
+// a mounted filesystem, mounts form a tree under the root of the VFS
 typedef struct MountPoint_t
 {
-    char *loc;
-    device_t *dev;
+    char *loc; // absolute path it is mounted on
+    device_t *dev; // NULL for the root, which only holds the mounts below it
     vfs_node_t *root_node;
+    uint32_t id;
+
+    char *on; // path within the parent mount it covers
+    uint32_t onHash;
+    struct MountPoint_t *parent;
+    struct MountPoint_t *children;
+    struct MountPoint_t *sibling;
+
+    mutex_t lock; // held around every call into the filesystem, which does not lock itself
+    uint32_t openFiles; // open files on it, UmountDevice refuses while there are any
 } MountPoint;
 
+// a filesystem driver, probe fills in dev->fs when the device holds its filesystem
+typedef struct filesystem_type
+{
+    const char *name;
+    bool (*probe)(device_t *dev);
+    struct filesystem_type *next;
+} filesystem_type_t;
+
 typedef struct DirectoryEntry_t
 {
     char name[MAX_PATH_SIZE];
     bool IsDirectory;
     size_t size;
+    uint32_t inode; // what the filesystem knows the file by, 0 when it has nothing stable
 } DirectoryEntry;
 
+// filled by VFS_Readdir, entries is allocated for the caller to free
 typedef struct DirectoryEntries_t
 {
     DirectoryEntry* entries;
@@ -74,10 +95,29 @@ int VFS_GetOffset(fd_t file);
 int VFS_GetSize(fd_t file);
 
 fd_t VFS_Open(char* path);
+bool VFS_Stat(const char *path, vfs_node_t *out);
+bool VFS_Create(const char *path);
+bool VFS_Mkdir(const char *path);
+bool VFS_Unlink(const char *path);
+bool VFS_Truncate(fd_t file, uint32_t size);
 bool VFS_Close(fd_t file);
 bool VFS_Readdir(fd_t file, DirectoryEntries* buffer);
 void VFS_init();
 
+bool VFS_RegisterFilesystem(const char *name, bool (*probe)(device_t *dev));
 bool MountDevice(device_t *dev, char *loc);
+bool UmountDevice(char *loc);
+MountPoint *VFS_GetMount(uint32_t id);
+uint32_t VFS_MountCount(); // ids are below this
+int VFS_FormatMounts(char *buffer, size_t size);
+
+vfs_node_t *VFS_GetNode(fd_t file);
+fd_t VFS_Dup(fd_t file);
 
-vfs_node_t *VFS_GetNode(fd_t file);
\ No newline at end of file
+struct open_file;
+// the open file behind a descriptor of the running task with a reference, NULL when it is not open
+struct open_file *VFS_GetFile(fd_t file);
+// drops a reference of an open file, the last one closes it
+void VFS_PutFile(struct open_file *file);
+// writes at the offset of an open file, which is what VFS_Write does for a descriptor
+int Sys_Write(struct open_file *file, void *buffer, size_t size);
\ No newline at end of file
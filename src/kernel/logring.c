@@ -0,0 +1,428 @@
+#include "logring.h"
+#include "stdio.h"
+#include "string.h"
+#include "memory.h"
+#include "hal/vfs.h"
+#include "task/sched.h"
+#include "task/wait.h"
+#include "arch/i686/e9.h"
+#include "arch/i686/serial.h"
+#include "arch/i686/pit.h"
+#include "arch/i686/clock.h"
+#include <printfDriver/printf.h>
+
+#define MODULE "LOG"
+
+/*
+ * Kernel log ring
+ *
+ * logWrite claims a slot with a compare-and-swap on the head, formats the
+ * record into it and publishes it by setting its sequence number. Nothing
+ * is locked, so it is safe from interrupt handlers, and a handler that
+ * interrupts a writer simply takes the next slot. A full ring drops the new
+ * record instead of waiting. Only the drain task reads the records in order
+ * and writes them to the sinks, so only it moves the tail and no record is
+ * freed before it is in the file; it stops at a slot that is claimed but not
+ * yet published and picks it up on its next round. A critical record cannot
+ * wait for it: the writer puts the records before it and itself on the
+ * console right away, marks them emitted and leaves them for the file.
+ */
+
+static log_record g_Ring[LOG_RING_RECORDS];
+static volatile uint32_t g_Head = 0; // next position to claim
+static volatile uint32_t g_Tail = 0; // next position to drain, only the drain task moves it
+static volatile uint32_t g_ConsoleTail = 0; // next position not on the console yet, when ahead of the tail
+static volatile uint32_t g_Draining = 0;
+
+log_stats g_LogStats;
+
+static uint32_t g_Sinks = LOG_SINK_E9;
+static bool g_Running = false;
+static task_t *g_DrainTask = NULL;
+static wait_queue_t g_DrainWait = WAIT_QUEUE_INIT;
+static wait_queue_t g_FlushWait = WAIT_QUEUE_INIT;
+static volatile bool g_FlushRequested = false;
+
+static fd_t g_File = VFS_INVALID_FD;
+static char g_FilePath[MAX_PATH_SIZE];
+static volatile bool g_FileChanged = false;
+
+typedef struct
+{
+    const char *name;
+    volatile DebugLevel level; // log sites of the module point here
+    bool pinned;               // set on its own, the default level no longer applies
+} log_module;
+
+static log_module g_Modules[LOG_MAX_MODULES];
+static volatile uint32_t g_ModuleCount = 0;
+static volatile DebugLevel g_DefaultLevel = MIN_LOG_LEVEL; // also the level of modules that did not fit
+
+volatile DebugLevel g_LogUnresolvedLevel = LVL_DEBUG;
+
+static const char *const g_LevelNames[] = {"debug", "info", "warn", "error", "critical"};
+
+static const char *const g_LogSeverityColors[] =
+{
+    [LVL_DEBUG]        = "\033[2;37m",
+    [LVL_INFO]         = "\033[37m",
+    [LVL_WARN]         = "\033[1;33m",
+    [LVL_ERROR]        = "\033[1;31m",
+    [LVL_CRITICAL]     = "\033[1;37;41m",
+};
+
+static const char *const g_ColorReset = "\033[0m";
+
+// runs with interrupts off, copyName when module may not outlive the entry
+static log_module *logFindModule(const char *module, bool add, bool copyName)
+{
+    for (uint32_t i = 0; i < g_ModuleCount; i++)
+    {
+        // module names are string literals, the same name is nearly always the same pointer
+        if (g_Modules[i].name == module || strcmp(g_Modules[i].name, module) == 0)
+            return &g_Modules[i];
+    }
+    if (!add || g_ModuleCount >= LOG_MAX_MODULES)
+        return NULL;
+
+    const char *name = module;
+    if (copyName)
+    {
+        char *copy = (char *)malloc(strlen(module) + 1);
+        if (copy == NULL)
+            return NULL;
+        strcpy(copy, module);
+        name = copy;
+    }
+    log_module *entry = &g_Modules[g_ModuleCount];
+    entry->name = name;
+    entry->level = g_DefaultLevel;
+    entry->pinned = false;
+    g_ModuleCount++;
+    return entry;
+}
+
+volatile DebugLevel *logModuleLevel(const char *module)
+{
+    if (module == NULL)
+        return &g_DefaultLevel;
+    uint32_t flags = i686_SaveInterrupts();
+    log_module *entry = logFindModule(module, true, false);
+    i686_RestoreInterrupts(flags);
+    return entry ? &entry->level : &g_DefaultLevel;
+}
+
+bool logEnabled(const char *module, DebugLevel level)
+{
+    return level >= *logModuleLevel(module);
+}
+
+bool logSetLevel(const char *module, DebugLevel level)
+{
+    if (level > LVL_CRITICAL)
+        return false;
+
+    uint32_t flags = i686_SaveInterrupts();
+    log_module *entry = NULL;
+    if (module == NULL)
+    {
+        g_DefaultLevel = level;
+        for (uint32_t i = 0; i < g_ModuleCount; i++)
+        {
+            if (!g_Modules[i].pinned)
+                g_Modules[i].level = level;
+        }
+    }
+    else
+    {
+        entry = logFindModule(module, true, true);
+        if (entry)
+        {
+            entry->level = level;
+            entry->pinned = true;
+        }
+    }
+    i686_RestoreInterrupts(flags);
+    return module == NULL || entry != NULL;
+}
+
+bool logParseLevel(const char *name, DebugLevel *level)
+{
+    for (uint32_t i = 0; i <= LVL_CRITICAL; i++)
+    {
+        if (strcmp(name, g_LevelNames[i]) == 0 || (name[0] == '0' + i && name[1] == '\0'))
+        {
+            *level = (DebugLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void logEmitString(const char *s, bool toConsole, bool toFile)
+{
+    size_t length = strlen(s);
+    for (size_t i = 0; toConsole && i < length; i++)
+    {
+        if (g_Sinks & LOG_SINK_E9)
+            e9_putc(s[i]);
+        if (g_Sinks & LOG_SINK_SERIAL)
+            serial_putc(SERIAL_COM1, s[i]);
+    }
+    // the VFS holds the mount lock, so this waits for whatever the other tasks do on that filesystem
+    if (toFile && (g_Sinks & LOG_SINK_FILE) && g_File != VFS_INVALID_FD)
+        VFS_Write(g_File, (uint8_t *)s, length);
+}
+
+// the same layout logf always had, behind a timestamp
+static void logEmit(const log_record *record, bool toConsole, bool toFile)
+{
+    char prefix[48];
+    uint32_t us = (uint32_t)(record->timestamp / NSEC_PER_USEC);
+    snprintf(prefix, sizeof(prefix), "%s[%5u.%06u] ", g_LogSeverityColors[record->level], us / 1000000, us % 1000000);
+    logEmitString(prefix, toConsole, toFile);
+    if (record->module)
+    {
+        snprintf(prefix, sizeof(prefix), "[%s] ", record->module);
+        logEmitString(prefix, toConsole, toFile);
+    }
+    logEmitString(record->text, toConsole, toFile);
+    logEmitString(g_ColorReset, toConsole, toFile);
+    logEmitString("\r\n", toConsole, toFile);
+}
+
+// the drain task's round, a console drain that is running makes it wait for the next one
+static void logDrain()
+{
+    if (__atomic_exchange_n(&g_Draining, 1, __ATOMIC_ACQUIRE))
+        return;
+    while (true)
+    {
+        uint32_t position = g_Tail;
+        log_record *record = &g_Ring[position % LOG_RING_RECORDS];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != position + 1)
+            break;
+        logEmit(record, !record->emitted, true);
+        __atomic_store_n(&record->sequence, position + LOG_RING_RECORDS, __ATOMIC_RELEASE);
+        g_Tail = position + 1;
+        g_LogStats.drained++;
+    }
+    if ((int32_t)(g_ConsoleTail - g_Tail) < 0)
+        g_ConsoleTail = g_Tail;
+    __atomic_store_n(&g_Draining, 0, __ATOMIC_RELEASE);
+}
+
+// puts the published records on the console now, they stay in the ring until the drain task has them in the file
+static void logDrainConsole()
+{
+    if (__atomic_exchange_n(&g_Draining, 1, __ATOMIC_ACQUIRE))
+        return;
+    uint32_t position = (int32_t)(g_ConsoleTail - g_Tail) > 0 ? g_ConsoleTail : g_Tail;
+    while (true)
+    {
+        log_record *record = &g_Ring[position % LOG_RING_RECORDS];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != position + 1)
+            break;
+        if (!record->emitted)
+        {
+            logEmit(record, true, false);
+            record->emitted = true;
+        }
+        position++;
+    }
+    g_ConsoleTail = position;
+    __atomic_store_n(&g_Draining, 0, __ATOMIC_RELEASE);
+}
+
+// a free slot at the head for the caller to publish, NULL when the ring is full
+static log_record *logClaim(uint32_t *claimed)
+{
+    uint32_t position = g_Head;
+    while (true)
+    {
+        log_record *record = &g_Ring[position % LOG_RING_RECORDS];
+        int32_t lag = (int32_t)(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0)
+        {
+            if (__atomic_compare_exchange_n(&g_Head, &position, position + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            {
+                *claimed = position;
+                return record;
+            }
+            // position now holds the head somebody else moved on to
+        }
+        else if (lag < 0)
+        {
+            // not drained since the last lap
+            return NULL;
+        }
+        else
+        {
+            position = g_Head;
+        }
+    }
+}
+
+void logWrite(const char *module, DebugLevel level, const char *fmt, va_list args)
+{
+    // the file sink only exists once the drain task does, until then records go straight to the console
+    if (!g_Running)
+    {
+        log_record record;
+        record.timestamp = clock_monotonic_ns();
+        record.module = module;
+        record.level = level;
+        vsnprintf(record.text, LOG_TEXT_SIZE, fmt, args);
+        logEmit(&record, true, false);
+        g_LogStats.written++;
+        return;
+    }
+    // what the drain task logs while writing a file would only feed itself
+    if (g_CurrentTask == g_DrainTask && level < LVL_WARN)
+        return;
+
+    // anything that may be the last words goes to the console right away, behind what is waiting
+    bool now = level >= LVL_CRITICAL;
+    if (now)
+        logDrainConsole();
+
+    uint32_t position;
+    log_record *record = logClaim(&position);
+    if (record == NULL)
+    {
+        g_LogStats.dropped++;
+        if (now)
+        {
+            log_record lost;
+            lost.timestamp = clock_monotonic_ns();
+            lost.module = module;
+            lost.level = level;
+            vsnprintf(lost.text, LOG_TEXT_SIZE, fmt, args);
+            logEmit(&lost, true, false);
+        }
+        return;
+    }
+
+    record->timestamp = clock_monotonic_ns();
+    record->module = module;
+    record->level = level;
+    vsnprintf(record->text, LOG_TEXT_SIZE, fmt, args);
+    record->emitted = now;
+    if (now)
+        logEmit(record, true, false);
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+    g_LogStats.written++;
+
+    if (position - g_Tail == LOG_RING_RECORDS / 2)
+        waitWakeAll(&g_DrainWait);
+}
+
+void logSetSinks(uint32_t sinks)
+{
+    if ((sinks & LOG_SINK_SERIAL) && !(g_Sinks & LOG_SINK_SERIAL) && !serial_init(SERIAL_COM1))
+    {
+        log_warn(MODULE, "no UART at %x", SERIAL_COM1);
+        sinks &= ~LOG_SINK_SERIAL;
+    }
+    g_Sinks = sinks;
+}
+
+bool logSetFile(const char *path)
+{
+    if (path && strlen(path) >= MAX_PATH_SIZE)
+        return false;
+    uint32_t flags = i686_SaveInterrupts();
+    strcpy(g_FilePath, path ? path : "");
+    g_FileChanged = true;
+    i686_RestoreInterrupts(flags);
+    waitWakeAll(&g_DrainWait);
+    return true;
+}
+
+void logFlush()
+{
+    if (!g_Running)
+        return;
+    if (g_CurrentTask == g_DrainTask)
+    {
+        logDrain();
+        return;
+    }
+    // the file belongs to the drain task, so it writes the records and the caller waits until it got past the head
+    uint32_t head = g_Head;
+    g_FlushRequested = true;
+    waitWakeAll(&g_DrainWait);
+    waitEvent(&g_FlushWait, (int32_t)(g_Tail - head) >= 0);
+}
+
+// descriptors belong to tasks, so the drain task opens the file itself
+static void logReopenFile()
+{
+    char path[MAX_PATH_SIZE];
+    uint32_t flags = i686_SaveInterrupts();
+    strcpy(path, g_FilePath);
+    g_FileChanged = false;
+    i686_RestoreInterrupts(flags);
+
+    if (g_File != VFS_INVALID_FD)
+    {
+        VFS_Close(g_File);
+        g_File = VFS_INVALID_FD;
+    }
+    if (path[0] == '\0')
+        return;
+
+    vfs_node_t node;
+    if (!VFS_Stat(path, &node))
+        VFS_Create(path);
+    g_File = VFS_Open(path);
+    if (g_File == VFS_INVALID_FD)
+    {
+        log_err(MODULE, "cannot open %s", path);
+        return;
+    }
+    VFS_Seek(g_File, VFS_GetSize(g_File));
+}
+
+static void logDrainTask(void *arg)
+{
+    uint32_t interval = LOG_DRAIN_INTERVAL_MS * PIT_HZ / 1000;
+    while (true)
+    {
+        bool timedOut;
+        waitEventTimeout(&g_DrainWait, g_FileChanged || g_FlushRequested || g_Head - g_Tail >= LOG_RING_RECORDS / 2,
+                         timer_ticks + (interval ? interval : 1), timedOut);
+        (void)timedOut;
+        g_FlushRequested = false;
+        if (g_FileChanged)
+            logReopenFile();
+        logDrain();
+        waitWakeAll(&g_FlushWait);
+    }
+}
+
+void logInit()
+{
+    for (uint32_t i = 0; i < LOG_RING_RECORDS; i++)
+        g_Ring[i].sequence = i;
+    g_Head = 0;
+    g_Tail = 0;
+    g_ConsoleTail = 0;
+    g_DrainTask = schedCreateKernelThread("klogd", logDrainTask, NULL);
+    g_Running = g_DrainTask != NULL;
+}
+
+void logPrintStats()
+{
+    printf("log ring: %u of %u records waiting, default level %s, %u modules\n", g_Head - g_Tail, LOG_RING_RECORDS,
+           g_LevelNames[g_DefaultLevel], g_ModuleCount);
+    printf("written %u, drained %u, dropped %u, sinks %x\n", g_LogStats.written, g_LogStats.drained,
+           g_LogStats.dropped, g_Sinks);
+}
+
+void logPrintLevels()
+{
+    printf("default: %s\n", g_LevelNames[g_DefaultLevel]);
+    for (uint32_t i = 0; i < g_ModuleCount; i++)
+        printf("%s: %s%s\n", g_Modules[i].name, g_LevelNames[g_Modules[i].level], g_Modules[i].pinned ? "" : " (default)");
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include "debug.h"
+
+#define LOG_RING_RECORDS 256 // a power of two
+#define LOG_TEXT_SIZE 112
+#define LOG_MAX_MODULES 64
+#define LOG_DRAIN_INTERVAL_MS 10
+
+// where the drain task writes records
+#define LOG_SINK_E9 0x01
+#define LOG_SINK_SERIAL 0x02
+#define LOG_SINK_FILE 0x04
+
+typedef struct
+{
+    volatile uint32_t sequence; // position + 1 once the record is complete, position + LOG_RING_RECORDS once drained
+    uint64_t timestamp;         // ns
+    const char *module;         // NULL for a plain string
+    DebugLevel level;
+    bool emitted;               // already on the console, the drain task only appends it to the file
+    char text[LOG_TEXT_SIZE];
+} log_record;
+
+typedef struct
+{
+    uint32_t written;
+    uint32_t dropped; // the ring was full
+    uint32_t drained;
+} log_stats;
+
+extern log_stats g_LogStats;
+
+// starts the drain task, until then records are written out as they come
+void logInit();
+
+// where the runtime level of module lives, NULL is the default level
+volatile DebugLevel *logModuleLevel(const char *module);
+bool logEnabled(const char *module, DebugLevel level);
+// module NULL sets the level of every module without its own, false when the module table is full
+bool logSetLevel(const char *module, DebugLevel level);
+// takes a level name or its number
+bool logParseLevel(const char *name, DebugLevel *level);
+
+void logWrite(const char *module, DebugLevel level, const char *fmt, va_list args);
+
+void logSetSinks(uint32_t sinks);
+bool logSetFile(const char *path); // the file sink appends to path, NULL closes it
+// has the drain task write out everything in the ring and waits for it, not from an interrupt handler
+void logFlush();
+
+void logPrintStats();
+void logPrintLevels();
@@ -2,6 +2,7 @@
 #include "drivers/VGA/vga.h"
 #include "arch/i686/io.h"
 #include "arch/i686/pit.h"
+#include "arch/i686/clock.h"
 
 #include <hal/hal.h>
 
@@ -11,6 +12,7 @@
 #include <debug.h>
 #include "stdio.h"
 #include "memory.h"
+#include "allocator/frame.h"
 #include "string.h"
 #include "ctype.h"
 #include "time.h"
@@ -19,8 +21,13 @@
 #include "CobolCalls.h"
 
 #include "syscall/systemcall.h"
+#include "task/sched.h"
+#include "drivers/block/bcache.h"
+#include "logring.h"
 
 #include "fs/devfs/devfs.h"
+#include "fs/tmpfs/tmpfs.h"
+#include "proc.h"
 #include "fs/disk.h"
 
 #include "drivers/ATA/ATA.h"
@@ -129,8 +136,14 @@ void KernelInits()
     initSystemCall();
     i686_ISR_RegisterHandler(2, debug);
     
+    log_debug("MAIN", "init memory routines");
+    memory_cpu_init();
+
+    log_debug("MAIN", "init frame allocator");
+    frameInit(params->Memory.Regions, params->Memory.RegionCount, (uint32_t)(uint32_t*)&__end);
+
     log_debug("MAIN", "init memory allocator");
-    mmInit((uint32_t)(uint32_t*)&__end);
+    mmInit();
     
     i686_DisableInterrupts();
     pagingInit();
@@ -139,6 +152,18 @@ void KernelInits()
     
     log_debug("MAIN", "init pit");
     pit_init();
+
+    log_debug("MAIN", "init clock");
+    clock_init();
+
+    log_debug("MAIN", "init scheduler");
+    schedInit();
+
+    log_debug("MAIN", "init buffer cache");
+    bcacheInit();
+
+    log_debug("MAIN", "init log ring");
+    logInit();
     
     log_debug("MAIN", "init keyboard");
     keyboard_init();
@@ -217,6 +242,10 @@ void KernelStart(BootParams *bootParams)
         }
     }
 
+    devfs_init();
+    proc_init();
+    tmpfs_init();
+
     log_info("Main", "This is an info msg!");
     log_warn("Main", "This is a warning msg!");
     log_err("Main", "This is an error msg!");
@@ -5,10 +5,11 @@
 #include "arch/i686/memory_i686.h"
 #endif
 
-void mmInit(uint32_t kernel_end);
+void mmInit();
 void mmPrintStatus();
 
 void* pmalloc(size_t size);
+void pfree(void* ptr);
 void* malloc(size_t size);
 void free(void* ptr);
 void* calloc(size_t num, size_t size);
@@ -263,6 +263,29 @@ static inline void putchar_via_gadget(output_gadget_t *gadget, char c)
     }
 }
 
+// A run of characters at once, so a file gadget hands the stream whole spans
+static inline void write_span_via_gadget(output_gadget_t *gadget, const char *s, size_t len)
+{
+    size_t write_pos = gadget->pos;
+    gadget->pos += len;
+    if (write_pos >= gadget->max_chars)
+    {
+        return;
+    }
+    if (len > gadget->max_chars - write_pos)
+    {
+        len = gadget->max_chars - write_pos;
+    }
+    if (gadget->file > -1)
+    {
+        fwrite((void *)s, 1, len, gadget->file);
+    }
+    else
+    {
+        memcpy(gadget->buffer + write_pos, s, len);
+    }
+}
+
 // Possibly-write the string-terminating '\0' character
 void append_termination_with_gadget(output_gadget_t *gadget)
 {
@@ -1014,9 +1037,13 @@ void format_string_loop(output_gadget_t *output, const char *format, va_list arg
     {
         if (*format != '%')
         {
-            // A regular content character
-            putchar_via_gadget(output, *format);
-            format++;
+            // Regular content, up to the next specifier
+            const char *start = format;
+            while (*format && *format != '%')
+            {
+                format++;
+            }
+            write_span_via_gadget(output, start, format - start);
             continue;
         }
         // We're parsing a format specifier: %[flags][width][.precision][length]
@@ -1313,11 +1340,7 @@ void format_string_loop(output_gadget_t *output, const char *format, va_list arg
                     }
                 }
                 // string output
-                while ((*p != 0) && (!(flags & FLAGS_PRECISION) || precision))
-                {
-                    putchar_via_gadget(output, *(p++));
-                    --precision;
-                }
+                write_span_via_gadget(output, p, strnlen(p, (flags & FLAGS_PRECISION) ? precision : PRINTF_MAX_POSSIBLE_BUFFER_SIZE));
                 // post padding
                 if (flags & FLAGS_LEFT)
                 {
@@ -3,103 +3,195 @@
 #include "stdio.h"
 #include "string.h"
 #include "hal/hal.h"
+#include "hal/vfs.h"
 #include "memory.h"
+#include "debug.h"
+#include "arch/i686/clock.h"
 
 #include "proc.h"
-#include "drivers/pci/pci.h"
+
+#define MODULE "PROCFS"
+
 /*
-#define UNUSED __attribute__((unused))
+ * procfs
+ *
+ * A flat directory of generated files. Opening one renders its content into
+ * a buffer that later reads are served from, so a reader sees one consistent
+ * snapshot however small its reads are.
+ */
 
-uint8_t procfs_read(char *fn, char *buffer, device_t *dev UNUSED, void* priv UNUSED)
+typedef struct
 {
-	if(strcmp(fn, "/os/full") == 0)
-	{
-		char *name = "LevOS levex-pc 4.0-rc1 i386";
-		memcpy(buffer, name, strlen(name) + 1);
-		return 1; 
-	}
-	if(strcmp(fn, "/os/arch") == 0)
-	{
-		char *name = "i386";
-		memcpy(buffer, name, strlen(name) + 1);
-		return 1; 
-	}
-	if(strcmp(fn, "/system/pci") == 0)
+	char *data;
+	uint32_t length;
+} procfs_file;
+
+typedef int (*procfs_render_t)(char *buffer, size_t size);
+
+static int procfs_version(char *buffer, size_t size)
+{
+	return snprintf(buffer, size, "BES_os i686, built %s %s\n", __DATE__, __TIME__);
+}
+
+static int procfs_uptime(char *buffer, size_t size)
+{
+	uint64_t ms = clock_monotonic_ns() / NSEC_PER_MSEC;
+	return snprintf(buffer, size, "%u.%03u\n", (uint32_t)(ms / 1000), (uint32_t)(ms % 1000));
+}
+
+static int procfs_devices(char *buffer, size_t size)
+{
+	int length = 0;
+	buffer[0] = '\0';
+	for (uint32_t i = 0; i < GetDeviceCount(); i++)
 	{
-		pci_proc_dump(buffer);
-		return 1;
+		device_t *dev = GetDevice(i);
+		if (dev == NULL || dev->dev_type == DEVICE_UNKNOWN)
+			continue;
+		int added = snprintf(buffer + length, size - length, "%u %s %s\n", dev->id,
+							 dev->dev_type == DEVICE_CHAR ? "char" : "block", dev->name);
+		if (added < 0 || (size_t)(length + added) >= size)
+			break;
+		length += added;
 	}
-	return 0;
+	return length;
 }
 
-uint8_t procfs_read_dir(char *dn, char *buffer UNUSED, device_t *dev UNUSED, void* priv UNUSED)
+static const struct
+{
+	const char *name;
+	procfs_render_t render;
+} g_ProcFiles[] = {
+	{"version", procfs_version},
+	{"uptime", procfs_uptime},
+	{"mounts", VFS_FormatMounts},
+	{"devices", procfs_devices},
+};
+
+#define PROCFS_FILE_COUNT (sizeof(g_ProcFiles) / sizeof(g_ProcFiles[0]))
+
+static device_t g_ProcDevice;
+static filesystemInfo_t g_Procfs;
+
+static int procfs_lookup(const char *path)
 {
-	if(!dn)return 0;
-	if(strcmp(dn, "/") == 0)
+	while (*path == '/')
+		path++;
+	for (uint32_t i = 0; i < PROCFS_FILE_COUNT; i++)
 	{
-			printf(".\n..\nos\nsystem\n");
+		if (strcmp(g_ProcFiles[i].name, path) == 0)
+			return i;
 	}
-	if(strcmp(dn, "/os/") == 0)
+	return -1;
+}
+
+bool procfs_read_dir(char *path, uint8_t *buffer, device_t *dev, void *priv)
+{
+	DirectoryEntries *out = (DirectoryEntries *)buffer;
+	while (*path == '/')
+		path++;
+	out->entries = NULL;
+	out->entryCount = 0;
+	if (*path != '\0')
+		return false;
+
+	out->entries = (DirectoryEntry *)calloc(PROCFS_FILE_COUNT, sizeof(DirectoryEntry));
+	if (out->entries == NULL)
+		return false;
+	for (uint32_t i = 0; i < PROCFS_FILE_COUNT; i++)
 	{
-		printf(".\n..\nfull\narch\n");
+		strcpy(out->entries[i].name, g_ProcFiles[i].name);
+		out->entries[i].inode = i + 1;
 	}
-	if(strcmp(dn, "/system/") == 0)
+	out->entryCount = PROCFS_FILE_COUNT;
+	return true;
+}
+
+bool procfs_find_entry(char *path, void *ret, device_t *dev, void *priv)
+{
+	DirectoryEntry *entry = (DirectoryEntry *)ret;
+	int index = procfs_lookup(path);
+	if (index < 0)
+		return false;
+	strcpy(entry->name, g_ProcFiles[index].name);
+	entry->IsDirectory = false;
+	entry->size = 0; // only known once rendered
+	entry->inode = index + 1;
+	return true;
+}
+
+bool procfs_open(char *path, void **handle, device_t *dev, void *priv)
+{
+	int index = procfs_lookup(path);
+	if (index < 0)
+		return false;
+
+	procfs_file *file = (procfs_file *)calloc(1, sizeof(procfs_file));
+	if (file == NULL)
+		return false;
+	file->data = (char *)malloc(PROCFS_FILE_SIZE);
+	if (file->data == NULL)
 	{
-		printf(".\n..\npci\n");
+		free(file);
+		return false;
 	}
-	return 1;
+	int length = g_ProcFiles[index].render(file->data, PROCFS_FILE_SIZE);
+	file->length = length > 0 ? (uint32_t)length : 0;
+	*handle = file;
+	return true;
 }
 
-uint8_t procfs_exist(char *fn, device_t *dev UNUSED, void *priv UNUSED)
+void procfs_close(void *handle, device_t *dev, void *priv)
 {
-	if(strcmp(fn, "/") == 0)
-		return 1;
-		if(strcmp(fn, "/os/") == 0)
-		return 1;
-		if(strcmp(fn, "/os/full") == 0)
-		return 1;
-		if(strcmp(fn, "/os/arch") == 0)
-		return 1;
-		if(strcmp(fn, "/system/") == 0)
-		return 1;
-		if(strcmp(fn, "/system/pci") == 0)
-		return 1;
+	procfs_file *file = (procfs_file *)handle;
+	free(file->data);
+	free(file);
+}
+
+int32_t procfs_read_at(void *handle, uint8_t *buf, uint32_t offset, uint32_t len, device_t *dev, void *priv)
+{
+	procfs_file *file = (procfs_file *)handle;
+	if (offset >= file->length)
 		return 0;
-	}
-	
-	uint8_t procfs_mount(device_t *dev, void *priv UNUSED)
-	{
-		if(dev->unique_id == 13)
-		return 1;
-	return 0;
+	if (len > file->length - offset)
+		len = file->length - offset;
+	memcpy(buf, file->data + offset, len);
+	return len;
+}
+
+bool procfs_probe(device_t *dev)
+{
+	if (dev != &g_ProcDevice)
+		return false;
+	dev->fs = &g_Procfs;
+	return true;
 }
 
-uint8_t procfs_probe(device_t *dev)
+// the files are rendered on open and freed on close, nothing outlives the mount
+void procfs_umount(MountPoint *mount)
 {
-	if(dev->unique_id == 13)
-	return 1;
-	return 0;
+	mount->dev->fs = NULL;
 }
 
 void proc_init()
 {
-	printf("Mounting /proc filesystem.\n");
-	filesystem_t *fs = (filesystem_t *)malloc(sizeof(filesystem_t));
-	fs->name = "PROCFS";
-	fs->probe = procfs_probe;
-	fs->read = procfs_read;
-	fs->read_dir = procfs_read_dir;
-	fs->exist = procfs_exist;
-	fs->mount = procfs_mount;
-	device_t *proc_dev = (device_t *)malloc(sizeof(device_t));
-	proc_dev->name = "PROCDEV";
-	proc_dev->unique_id = 13;
-	proc_dev->dev_type = DEVICE_BLOCK;
-	proc_dev->fs = fs;
-	proc_dev->read = 0;
-	proc_dev->write = 0;
-	device_add(proc_dev);
-	proc_dev = device_get_by_id(13);
-	device_try_to_mount(proc_dev, "/proc/");
+	g_Procfs.name = "procfs";
+	g_Procfs.probe = procfs_probe;
+	g_Procfs.read_dir = procfs_read_dir;
+	g_Procfs.find_entry = procfs_find_entry;
+	g_Procfs.open = procfs_open;
+	g_Procfs.close = procfs_close;
+	g_Procfs.read_at = procfs_read_at;
+	g_Procfs.umount = procfs_umount;
+
+	g_ProcDevice.name = "proc";
+	g_ProcDevice.id = 0xFFFFFFFF;
+	g_ProcDevice.dev_type = DEVICE_UNKNOWN;
+	addDevice(&g_ProcDevice);
+
+	VFS_RegisterFilesystem("procfs", procfs_probe);
+	if (!MountDevice(&g_ProcDevice, "/proc"))
+	{
+		log_err(MODULE, "Unable to mount /proc");
+	}
 }
-*/
\ No newline at end of file
@@ -1,8 +1,9 @@
-
 #pragma once
 
 #include <stdint.h>
 
-// void proc_init();
-// uint8_t procfs_probe(device_t *dev);
-// uint8_t procfs_mount(device_t *dev, void *priv);
\ No newline at end of file
+// files are rendered into a buffer this large when opened
+#define PROCFS_FILE_SIZE 4096
+
+// registers procfs and mounts it on /proc
+void proc_init();
@@ -8,36 +8,44 @@
 #include "string.h"
 #include "CobolCalls.h"
 #include "task/process.h"
+#include "task/sched.h"
 
 #include "arch/i686/gdt.h"
 #include "arch/i686/idt.h"
 #include "arch/i686/bios.h"
 
 #include "drivers/VGA/vga.h"
+#include "drivers/VGA/vga_text.h"
 #include "drivers/Keyboard/keyboard.h"
 #include "drivers/PS2/8042_controller.h"
+#include "drivers/ATA/ATA.h"
+#include "drivers/ide/ide_controller.h"
+#include "drivers/ahci/ahci.h"
+#include "drivers/block/block.h"
+#include "drivers/block/bcache.h"
 
 #include "syscall/systemcall.h"
 
 #include "hal/vfs.h"
+#include "hal/dcache.h"
+#include "hal/fdtable.h"
+#include "proc.h"
+#include "logring.h"
 
 #include "printfDriver/printf.h"
+#include "arch/i686/pit.h"
+#include "arch/i686/clock.h"
 #include "unistd.h"
 #include "ctype.h"
 
 #define MODULE "SHELL"
-extern uint8_t user_stack_top;
 
 void ReadLine(char *buffer)
 {
     uint8_t bufferIndex = 0;
     while (true)
     {
-        char c = KeyboardGetKey();
-        if (c == 0)
-        {
-            continue;
-        }
+        char c = KeyboardWaitKey();
         if (c == '\n')
         {
             return;
@@ -82,9 +90,355 @@ bool cmpCommand(char *command, char *buffer)
     return true;
 }
 
+static uint32_t BenchElapsedUs(uint64_t startNs)
+{
+    return (uint32_t)((clock_monotonic_ns() - startNs) / NSEC_PER_USEC);
+}
+
+// grows a buffer in small steps, once with realloc and once by hand with malloc+copy+free
+void BenchRealloc(int rounds)
+{
+    const size_t step = 64;
+    const size_t maxSize = 64 * 1024;
+
+    uint64_t start = clock_monotonic_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        uint8_t *buffer = NULL;
+        for (size_t size = step; size <= maxSize; size += step)
+        {
+            buffer = realloc(buffer, size);
+            buffer[size - 1] = (uint8_t)size;
+        }
+        free(buffer);
+    }
+    uint32_t reallocUs = BenchElapsedUs(start);
+
+    start = clock_monotonic_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        uint8_t *buffer = NULL;
+        for (size_t size = step; size <= maxSize; size += step)
+        {
+            uint8_t *newBuffer = malloc(size);
+            if (buffer)
+            {
+                memcpy(newBuffer, buffer, size - step);
+                free(buffer);
+            }
+            buffer = newBuffer;
+            buffer[size - 1] = (uint8_t)size;
+        }
+        free(buffer);
+    }
+    uint32_t copyUs = BenchElapsedUs(start);
+
+    printf("grow to %u bytes in %u byte steps, %d rounds\n", maxSize, step, rounds);
+    printf("realloc:            %u us\n", reallocUs);
+    printf("malloc+copy+free:   %u us\n", copyUs);
+}
+
+static void BenchPrintRate(const char *name, uint64_t bytes, uint32_t us)
+{
+    if (us == 0)
+        us = 1;
+    uint32_t rate = (uint32_t)(bytes * 100 / us); // MB/s * 100
+    printf("%s %u KB in %u us, %u.%02u MB/s\n", name, (uint32_t)(bytes / 1024), us, rate / 100, rate % 100);
+}
+
+// reads the start of the first ATA disk, once with PIO and once with bus master DMA
+void BenchAta(int megabytes)
+{
+    const uint32_t chunkSectors = 128;
+    device_t *dev = GetDevice(ata_Device);
+    if (ide_devices_count == 0 || dev == NULL || dev->read == NULL)
+    {
+        printf("no ATA disk\n");
+        return;
+    }
+
+    uint8_t *buffer = malloc(chunkSectors * 512);
+    uint32_t sectors = (uint32_t)megabytes * 2048;
+    bool dmaWasEnabled = ide_dma_enabled;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        ide_dma_enabled = pass == 1;
+        uint64_t bytes = 0;
+        uint64_t start = clock_monotonic_ns();
+        for (uint32_t lba = 0; lba < sectors; lba += chunkSectors)
+        {
+            uint32_t read = dev->read(buffer, lba, chunkSectors, dev);
+            bytes += read * 512;
+            if (read != chunkSectors)
+                break;
+        }
+        BenchPrintRate(pass == 1 ? "DMA:" : "PIO:", bytes, BenchElapsedUs(start));
+    }
+
+    ide_dma_enabled = dmaWasEnabled;
+    free(buffer);
+}
+
+// scattered reads from the first SATA disk, one command at a time and then with the full NCQ depth
+void BenchAhci(int megabytes)
+{
+    const uint32_t chunkSectors = 64;
+    device_t *dev = AHCI_GetDevice(0);
+    if (dev == NULL)
+    {
+        printf("no SATA disk\n");
+        return;
+    }
+
+    uint32_t maxDepth = ahci_queue_depth(dev);
+    ahci_request *reqs = malloc(sizeof(ahci_request) * maxDepth);
+    uint8_t *buffer = malloc(maxDepth * chunkSectors * 512);
+    uint32_t chunks = (uint32_t)megabytes * 2048 / chunkSectors;
+    printf("queue depth %u\n", maxDepth);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t depth = pass == 0 ? 1 : maxDepth;
+        uint64_t bytes = 0;
+        uint64_t start = clock_monotonic_ns();
+        uint32_t submitted = 0, waited = 0;
+        bool failed = false;
+        while (waited < submitted || (submitted < chunks && !failed))
+        {
+            if (submitted < chunks && !failed && submitted - waited < depth)
+            {
+                ahci_request *req = &reqs[submitted % depth];
+                memset(req, 0, sizeof(ahci_request));
+                // stride through the area so the drive has seeks to reorder
+                req->lba = (uint64_t)((submitted * 37) % chunks) * chunkSectors;
+                req->count = chunkSectors;
+                req->buffer = buffer + (submitted % depth) * chunkSectors * 512;
+                if (ahci_submit(dev, req))
+                    submitted++;
+                else
+                    failed = true;
+                continue;
+            }
+            if (ahci_wait(dev, &reqs[waited % depth]))
+                bytes += chunkSectors * 512;
+            waited++;
+        }
+        BenchPrintRate(pass == 0 ? "QD1:" : "NCQ:", bytes, BenchElapsedUs(start));
+    }
+
+    free(buffer);
+    free(reqs);
+}
+
+// resolves the same path over and over, the first lookup after dropping the mount's dentries goes to the disk
+void BenchLookup(const char *path, int rounds)
+{
+    vfs_node_t node;
+    if (!VFS_Stat(path, &node))
+    {
+        printf("%s not found\n", path);
+        return;
+    }
+
+    dcacheInvalidateMount(node.mountingPointId);
+    uint64_t start = clock_monotonic_ns();
+    VFS_Stat(path, &node);
+    printf("cold: %u us\n", BenchElapsedUs(start));
+
+    start = clock_monotonic_ns();
+    for (int i = 0; i < rounds; i++)
+    {
+        VFS_Stat(path, &node);
+    }
+    uint32_t us = BenchElapsedUs(start);
+    if (us == 0)
+    {
+        us = 1;
+    }
+    printf("warm: %u lookups in %u us, %u lookups/s\n", rounds, us, (uint32_t)((uint64_t)rounds * 1000000 / us));
+    dcachePrintStats();
+}
+
+// opens path count times, keeping every descriptor, then closes them again
+void BenchOpen(char *path, int count)
+{
+    fd_t *fds = (fd_t *)malloc(count * sizeof(fd_t));
+    if (fds == NULL)
+    {
+        return;
+    }
+    uint64_t start = clock_monotonic_ns();
+    int opened = 0;
+    while (opened < count)
+    {
+        fds[opened] = VFS_Open(path);
+        if (fds[opened] == VFS_INVALID_FD)
+        {
+            break;
+        }
+        opened++;
+    }
+    uint32_t openUs = BenchElapsedUs(start);
+    printf("%u of %u opens in %u us, highest fd %d, table of %u\n", opened, count, openUs, opened ? fds[opened - 1] : -1,
+           g_CurrentTask->files ? g_CurrentTask->files->size : 0);
+
+    start = clock_monotonic_ns();
+    for (int i = 0; i < opened; i++)
+    {
+        VFS_Close(fds[i]);
+    }
+    printf("closed in %u us\n", BenchElapsedUs(start));
+    free(fds);
+}
+
+// writes a scratch file in 4 KiB chunks, reads it back and removes it
+void BenchFile(char *path, int kb)
+{
+    uint8_t *chunk = (uint8_t *)malloc(4096);
+    if (chunk == NULL)
+    {
+        return;
+    }
+    memset(chunk, 0xA5, 4096);
+    VFS_Create(path);
+    fd_t file = VFS_Open(path);
+    if (file == VFS_INVALID_FD)
+    {
+        printf("bench-file: cannot open %s\n", path);
+        free(chunk);
+        return;
+    }
+    VFS_Truncate(file, 0);
+
+    uint64_t start = clock_monotonic_ns();
+    uint32_t written = 0;
+    for (int i = 0; i < kb / 4; i++)
+    {
+        int result = VFS_Write(file, chunk, 4096);
+        if (result <= 0)
+        {
+            break;
+        }
+        written += result;
+    }
+    uint32_t writeUs = BenchElapsedUs(start);
+
+    VFS_Seek(file, 0);
+    start = clock_monotonic_ns();
+    uint32_t read = 0;
+    while (read < written)
+    {
+        int result = VFS_Read(file, chunk, 4096);
+        if (result <= 0)
+        {
+            break;
+        }
+        read += result;
+    }
+    uint32_t readUs = BenchElapsedUs(start);
+    VFS_Close(file);
+    VFS_Unlink(path);
+
+    printf("wrote %u KiB in %u us (%u KiB/s)\n", written / 1024, writeUs,
+           writeUs ? (uint32_t)((uint64_t)written * 1000000 / 1024 / writeUs) : 0);
+    printf("read %u KiB in %u us (%u KiB/s)\n", read / 1024, readUs,
+           readUs ? (uint32_t)((uint64_t)read * 1000000 / 1024 / readUs) : 0);
+    free(chunk);
+}
+
+// prints the same listing one character per write, one line per write and through printf
+void BenchConsole(int lines)
+{
+    char line[81];
+    fflush(stdout);
+    uint64_t start = clock_monotonic_ns();
+    for (int i = 0; i < lines; i++)
+    {
+        int length = snprintf(line, sizeof(line), "%5d the quick brown fox jumps over the lazy dog 0123456789\n", i);
+        for (int j = 0; j < length; j++)
+        {
+            VFS_Write(VFS_FD_STDOUT, (uint8_t *)&line[j], 1);
+        }
+    }
+    uint32_t charUs = BenchElapsedUs(start);
+
+    start = clock_monotonic_ns();
+    for (int i = 0; i < lines; i++)
+    {
+        int length = snprintf(line, sizeof(line), "%5d the quick brown fox jumps over the lazy dog 0123456789\n", i);
+        VFS_Write(VFS_FD_STDOUT, (uint8_t *)line, length);
+    }
+    uint32_t lineUs = BenchElapsedUs(start);
+
+    start = clock_monotonic_ns();
+    for (int i = 0; i < lines; i++)
+    {
+        printf("%5d the quick brown fox jumps over the lazy dog %s\n", i, "0123456789");
+    }
+    uint32_t printfUs = BenchElapsedUs(start);
+    printf("%d lines: %u us by character, %u us by line, %u us by printf\n", lines, charUs, lineUs, printfUs);
+}
+
+typedef void *(*BenchCopyFn)(void *, const void *, size_t);
+typedef void *(*BenchFillFn)(void *, int, size_t);
+
+// MB/s of one variant, moving about 32 MiB in total
+static uint32_t BenchMemoryRate(BenchCopyFn copy, BenchFillFn fill, uint8_t *dst, uint8_t *src, size_t size)
+{
+    uint32_t rounds = (32 * 1024 * 1024) / size;
+    uint64_t start = clock_monotonic_ns();
+    for (uint32_t i = 0; i < rounds; i++)
+    {
+        if (copy)
+            copy(dst, src, size);
+        else
+            fill(dst, (int)i, size);
+    }
+    uint32_t us = BenchElapsedUs(start);
+    return us ? (uint32_t)((uint64_t)rounds * size / us) : 0;
+}
+
+// memcpy and memset variants across sizes, dst is one byte off to show the head alignment
+void BenchMemory()
+{
+    static const size_t sizes[] = {16, 64, 256, 1024, 4096, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    const size_t maxSize = 4 * 1024 * 1024;
+    bool nontemporal = memory_has_nontemporal();
+
+    uint8_t *src = (uint8_t *)pmalloc(maxSize);
+    uint8_t *dst = (uint8_t *)pmalloc(maxSize + 4096);
+    if (src == NULL || dst == NULL)
+    {
+        printf("not enough memory\n");
+        if (src)
+            pfree(src);
+        if (dst)
+            pfree(dst);
+        return;
+    }
+
+    printf("MB/s        size    bytes   dwords  non-temp  memcpy/memset\n");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t size = sizes[i];
+        printf("memcpy %9u %8u %8u %9u %8u\n", size, BenchMemoryRate(memcpy_bytes, NULL, dst + 1, src, size),
+               BenchMemoryRate(memcpy_dwords, NULL, dst + 1, src, size),
+               nontemporal ? BenchMemoryRate(memcpy_nontemporal, NULL, dst + 1, src, size) : 0,
+               BenchMemoryRate(memcpy, NULL, dst + 1, src, size));
+        printf("memset %9u %8u %8u %9u %8u\n", size, BenchMemoryRate(NULL, memset_bytes, dst + 1, NULL, size),
+               BenchMemoryRate(NULL, memset_dwords, dst + 1, NULL, size),
+               nontemporal ? BenchMemoryRate(NULL, memset_nontemporal, dst + 1, NULL, size) : 0,
+               BenchMemoryRate(NULL, memset, dst + 1, NULL, size));
+    }
+    if (!nontemporal)
+        printf("no SSE2, the non-temporal variants were skipped\n");
+
+    pfree(src);
+    pfree(dst);
+}
+
 extern char __userProg_start[];
-extern void setSS(uint32_t ss);
-extern uint32_t kernelStack;
 
 void EnterShell()
 {
@@ -175,6 +529,179 @@ void EnterShell()
             {
                 mmPrintStatus();
             }
+            if (cmpCommand("tasks", argv[1]) == true)
+            {
+                schedPrintTasks();
+            }
+            if (cmpCommand("clock", argv[1]) == true)
+            {
+                uint64_t ns = clock_monotonic_ns();
+                printf("uptime %u.%06u s, ", (uint32_t)(ns / NSEC_PER_SEC), (uint32_t)((ns % NSEC_PER_SEC) / NSEC_PER_USEC));
+                if (clock_uses_tsc())
+                    printf("TSC at %u kHz\n", (uint32_t)(clock_tsc_frequency() / 1000));
+                else
+                    printf("PIT\n");
+            }
+            if (cmpCommand("bench-ata", argv[1]) == true)
+            {
+                int megabytes = 16;
+                if (count >= 2)
+                {
+                    atoi(argv[2], &megabytes);
+                }
+                BenchAta(megabytes);
+            }
+            if (cmpCommand("block", argv[1]) == true)
+            {
+                blockPrintStats();
+                bcachePrintStats();
+            }
+            if (cmpCommand("dcache", argv[1]) == true)
+            {
+                dcachePrintStats();
+            }
+            if (cmpCommand("bench-lookup", argv[1]) == true)
+            {
+                int rounds = 10000;
+                if (count >= 3)
+                {
+                    atoi(argv[3], &rounds);
+                }
+                if (count >= 2)
+                {
+                    BenchLookup(argv[2], rounds);
+                }
+                else
+                {
+                    printf("usage: cmd bench-lookup <path> [count]\n");
+                }
+            }
+            if (cmpCommand("bench-open", argv[1]) == true)
+            {
+                int files = 256;
+                if (count >= 3)
+                {
+                    atoi(argv[3], &files);
+                }
+                if (count >= 2)
+                {
+                    char *path = (char *)calloc(1, MAX_PATH_SIZE);
+                    sprintf(path, "%s/%s", cmdPath, argv[2]);
+                    BenchOpen(path, files);
+                    free(path);
+                }
+                else
+                {
+                    printf("usage: cmd bench-open <file> [count]\n");
+                }
+            }
+            if (cmpCommand("bench-file", argv[1]) == true)
+            {
+                int kb = 1024;
+                if (count >= 3)
+                {
+                    atoi(argv[3], &kb);
+                }
+                if (count >= 2)
+                {
+                    char *path = (char *)calloc(1, MAX_PATH_SIZE);
+                    sprintf(path, "%s/%s", cmdPath, argv[2]);
+                    BenchFile(path, kb);
+                    free(path);
+                }
+                else
+                {
+                    printf("usage: cmd bench-file <file> [KiB]\n");
+                }
+            }
+            if (cmpCommand("bench-console", argv[1]) == true)
+            {
+                int lines = 200;
+                if (count >= 2)
+                {
+                    atoi(argv[2], &lines);
+                }
+                BenchConsole(lines);
+                continue;
+            }
+            if (cmpCommand("back", argv[1]) == true)
+            {
+                // shows older output until a key is pressed
+                int lines = ScreenHeight / 2;
+                if (count >= 2)
+                {
+                    atoi(argv[2], &lines);
+                }
+                VGA_ScrollView(lines);
+                KeyboardWaitKey();
+                VGA_ScrollView(-VGA_SCROLLBACK_LINES);
+                continue;
+            }
+            if (cmpCommand("klog", argv[1]) == true)
+            {
+                // cmd klog [flush | sinks <mask> | file <path> | level [<module> | *] [<level>]]
+                if (count >= 2 && cmpCommand("level", argv[2]) == true)
+                {
+                    if (count >= 4)
+                    {
+                        DebugLevel level;
+                        const char *module = strcmp(argv[3], "*") == 0 ? NULL : argv[3];
+                        if (!logParseLevel(argv[4], &level))
+                            printf("levels are debug, info, warn, error and critical\n");
+                        else if (!logSetLevel(module, level))
+                            printf("no room for another module\n");
+                    }
+                    logPrintLevels();
+                    continue;
+                }
+                if (count >= 2 && cmpCommand("flush", argv[2]) == true)
+                {
+                    logFlush();
+                }
+                else if (count >= 3 && cmpCommand("sinks", argv[2]) == true)
+                {
+                    int sinks = LOG_SINK_E9;
+                    atoi(argv[3], &sinks);
+                    logSetSinks(sinks);
+                }
+                else if (count >= 3 && cmpCommand("file", argv[2]) == true)
+                {
+                    if (!logSetFile(argv[3]))
+                        printf("path too long\n");
+                }
+                logPrintStats();
+                continue;
+            }
+            if (cmpCommand("fds", argv[1]) == true)
+            {
+                fdTablePrint(g_CurrentTask->files);
+            }
+            if (cmpCommand("sync", argv[1]) == true)
+            {
+                bcacheSync(NULL);
+            }
+            if (cmpCommand("bench-ahci", argv[1]) == true)
+            {
+                int megabytes = 16;
+                if (count >= 2)
+                {
+                    atoi(argv[2], &megabytes);
+                }
+                BenchAhci(megabytes);
+            }
+            if (cmpCommand("bench-realloc", argv[1]) == true)
+            {
+                int rounds = 10;
+                if (count >= 2)
+                {
+                    atoi(argv[2], &rounds);
+                }
+                BenchRealloc(rounds);
+            }
+            if (cmpCommand("bench-mem", argv[1]) == true)
+            {
+                BenchMemory();
+            }
             if (cmpCommand("call", argv[1]) == true)
             {
                 cob_init(count + 1, argv);
@@ -227,6 +754,87 @@ void EnterShell()
                 free(path);
                 continue;
             }
+            if (cmpCommand("touch", argv[1]) == true || cmpCommand("mkdir", argv[1]) == true ||
+                cmpCommand("rm", argv[1]) == true)
+            {
+                if (count < 2)
+                {
+                    printf("Usage: %s <name>\n", argv[1]);
+                    continue;
+                }
+                char *path = (char *)calloc(1, MAX_PATH_SIZE);
+                sprintf(path, "%s/%s", cmdPath, argv[2]);
+                bool ok;
+                if (cmpCommand("touch", argv[1]) == true)
+                    ok = VFS_Create(path);
+                else if (cmpCommand("mkdir", argv[1]) == true)
+                    ok = VFS_Mkdir(path);
+                else
+                    ok = VFS_Unlink(path);
+                if (!ok)
+                {
+                    printf("%s: %s failed\n", argv[1], path);
+                }
+                free(path);
+                continue;
+            }
+            if (cmpCommand("ls", argv[1]) == true)
+            {
+                char *path = (char *)calloc(1, MAX_PATH_SIZE);
+                if (count >= 2)
+                    sprintf(path, "%s/%s", cmdPath, argv[2]);
+                else
+                    strcpy(path, cmdPath);
+                fd_t dir = VFS_Open(path);
+                DirectoryEntries entries = {NULL, 0};
+                if (dir == VFS_INVALID_FD || !VFS_Readdir(dir, &entries))
+                {
+                    printf("ls: cannot list %s\n", path);
+                }
+                for (uint32_t i = 0; i < entries.entryCount; i++)
+                {
+                    if (entries.entries[i].IsDirectory)
+                        printf("%s/\n", entries.entries[i].name);
+                    else
+                        printf("%s %u\n", entries.entries[i].name, entries.entries[i].size);
+                }
+                if (dir != VFS_INVALID_FD)
+                    VFS_Close(dir);
+                free(entries.entries);
+                free(path);
+                continue;
+            }
+            if (cmpCommand("write", argv[1]) == true)
+            {
+                if (count < 3)
+                {
+                    printf("Usage: write <file> <text>\n");
+                    continue;
+                }
+                char *path = (char *)calloc(1, MAX_PATH_SIZE);
+                sprintf(path, "%s/%s", cmdPath, argv[2]);
+                fd_t file = VFS_Open(path);
+                if (file == VFS_INVALID_FD && VFS_Create(path))
+                {
+                    file = VFS_Open(path);
+                }
+                if (file == VFS_INVALID_FD)
+                {
+                    printf("write: cannot open %s\n", path);
+                    free(path);
+                    continue;
+                }
+                // appends the rest of the line
+                VFS_Seek(file, VFS_GetSize(file));
+                for (int i = 3; i < argc; i++)
+                {
+                    VFS_Write(file, (uint8_t *)argv[i], strlen(argv[i]));
+                    VFS_Write(file, (uint8_t *)(i + 1 < argc ? " " : "\n"), 1);
+                }
+                VFS_Close(file);
+                free(path);
+                continue;
+            }
             if (cmpCommand("read", argv[1]) == true)
             {
                 if (count < 2)
@@ -276,6 +884,27 @@ void EnterShell()
                 atoi(argv[2], &fd);
                 fprintf(fd, "\nBufferSize = %u\n", bufferSize);
             }
+            if (cmpCommand("mtab", argv[1]) == true)
+            {
+                char *text = (char *)malloc(PROCFS_FILE_SIZE);
+                VFS_FormatMounts(text, PROCFS_FILE_SIZE);
+                printf("%s", text);
+                free(text);
+                continue;
+            }
+            if (cmpCommand("umount", argv[1]) == true)
+            {
+                if (count < 2)
+                {
+                    printf("Usage: umount <loc>\n");
+                    continue;
+                }
+                if (!UmountDevice(argv[2]))
+                {
+                    printf("Failed to unmount %s\n", argv[2]);
+                }
+                continue;
+            }
             if (cmpCommand("mount", argv[1]) == true)
             {
                 if (count < 2)
@@ -324,8 +953,7 @@ void EnterShell()
             sprintf(path, "%s/bin/%s", cmdPath, fileName);
             sprintf(binpath, "%s/bin", cmdPath);
             fd_t binDirFD = open(binpath, 0);
-            DirectoryEntries binDir;
-            binDir.entries = calloc(sizeof(DirectoryEntry), 12);
+            DirectoryEntries binDir = {NULL, 0};
             VFS_Readdir(binDirFD, &binDir);
             uint32_t bytesRead;
             for (size_t i = 0; i < binDir.entryCount; i++)
@@ -346,14 +974,19 @@ void EnterShell()
 
                     while (bytesRead < size)
                     {
-                        bytesRead += VFS_Read(file, buffer, 512);
-                        lseek(file, (sector * 2) * 512, SEEK_CUR);
+                        int got = VFS_Read(file, (uint8_t *)buffer + bytesRead, size - bytesRead);
+                        if (got <= 0)
+                        {
+                            break;
+                        }
+                        bytesRead += got;
                     }
                     VFS_Close(file);
                 }
             }
 
             VFS_Close(binDirFD);
+            free(binDir.entries);
 
             if (cmpCommand("CEXE", buffer))
             {
@@ -391,28 +1024,17 @@ void EnterShell()
                 memcpy(__userProg_start, buffer, bytesRead);
             }
             usermodeFunc = (uint32_t)__userProg_start;
-            __asm__("pusha");
-            __asm__("mov %%esp, %0" : "=r"(kernelStack));
-            process_t* process = makeProcess(usermodeFunc, (uint32_t)(&user_stack_top));
+            // the image is loaded at the one address programs are linked for, so the shell waits for it
+            process_t* process = makeProcess(usermodeFunc);
             log_debug(MODULE, "bytesRead = %u, usermodeFunc = 0x%p", bytesRead, usermodeFunc);
             printf("Starting usermode program at 0x%p\n", (void *)usermodeFunc);
-            runProcess(process);
-            // __asm__("mov %%esi, %0" : : "r"(kernelStack));
-            setSS(i686_GDT_DATA_SEGMENT);
-            log_debug(MODULE, "return back from user");
-            ASM_INT2();
-
-            IDT_Load();
-
-            ps2_probe();
-
-            fprintf(VFS_FD_DEBUG, "Back in kernel mode\n");
-            uint32_t data;
-            __asm__("mov %%gs:0x0100000, %0" : "=r"(data));
-            fprintf(VFS_FD_DEBUG, "at [0x0100000] = %x\n", data);
-            __asm__("mov %%gs:0x0, %0" : "=r"(data));
-            fprintf(VFS_FD_DEBUG, "at [0] = %x\n", data);
-
+            if (process == NULL || !runProcess(process, fileName))
+            {
+                printf("Cannot start %s\n", fileName);
+                continue;
+            }
+            int status = waitProcess(process);
+            log_debug(MODULE, "%s exited with %d", fileName, status);
 
             continue;
         }
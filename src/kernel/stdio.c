@@ -9,29 +9,284 @@
 #include <printfDriver/printf.h>
 
 #include <hal/vfs.h>
+#include <hal/fdtable.h>
+#include "memory.h"
+#include "string.h"
 
 #define MODULE "stdio"
 
+/*
+ * Streams
+ *
+ * Writes to a stream collect in its buffer and reach VFS_Write in one piece:
+ * when the buffer fills, at a newline for a line buffered stream, on fflush
+ * and before anything that needs the file to be up to date (seek, read,
+ * close). stdout and the debug port are line buffered, stderr is not
+ * buffered. Other descriptors only get a stream from fopen or setvbuf, all
+ * others are written straight through. Descriptors belong to a task, so the
+ * stream of a file is found through its open file, which every descriptor
+ * dup'ed or inherited from it shares.
+ */
+
+typedef struct
+{
+    bool used;
+    fd_t fd;           // the console, VFS_INVALID_FD for a file
+    open_file_t *file; // NULL for a console, otherwise the stream holds a reference of it
+    int mode;          // _IOFBF, _IOLBF or _IONBF
+    char *buffer;
+    size_t size;
+    size_t length; // bytes waiting to be written
+    bool ownsBuffer;
+} stdio_stream;
+
+static char g_StdoutBuffer[STDIO_CONSOLE_BUFSIZ];
+static char g_DebugBuffer[STDIO_CONSOLE_BUFSIZ];
+
+static stdio_stream g_Streams[STDIO_MAX_STREAMS] = {
+    [VFS_FD_STDIN] = {true, VFS_FD_STDIN, NULL, _IONBF, NULL, 0, 0, false},
+    [VFS_FD_STDOUT] = {true, VFS_FD_STDOUT, NULL, _IOLBF, g_StdoutBuffer, STDIO_CONSOLE_BUFSIZ, 0, false},
+    [VFS_FD_STDERR] = {true, VFS_FD_STDERR, NULL, _IONBF, NULL, 0, 0, false},
+    [VFS_FD_DEBUG] = {true, VFS_FD_DEBUG, NULL, _IOLBF, g_DebugBuffer, STDIO_CONSOLE_BUFSIZ, 0, false},
+};
+
+static stdio_stream *stdio_find(fd_t file)
+{
+    if (file >= 0 && file < VFS_FD_START)
+        return &g_Streams[file];
+    open_file_t *opened = VFS_GetFile(file);
+    if (opened == NULL)
+        return NULL;
+    stdio_stream *found = NULL;
+    for (int i = VFS_FD_START; i < STDIO_MAX_STREAMS; i++)
+    {
+        if (g_Streams[i].used && g_Streams[i].file == opened)
+        {
+            found = &g_Streams[i];
+            break;
+        }
+    }
+    // a stream that was found keeps the file open on its own
+    VFS_PutFile(opened);
+    return found;
+}
+
+// the console streams are shared with interrupt handlers that log, they are only touched with interrupts off
+static inline uint32_t stdio_lock(stdio_stream *stream)
+{
+    return stream->file == NULL ? i686_SaveInterrupts() : 0;
+}
+
+static inline void stdio_unlock(stdio_stream *stream, uint32_t flags)
+{
+    if (stream->file == NULL)
+        i686_RestoreInterrupts(flags);
+}
+
+// through the open file when there is one, the descriptor may belong to another task
+static bool stdio_writeAll(fd_t file, open_file_t *opened, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        int written = opened ? Sys_Write(opened, (void *)data, size) : VFS_Write(file, (uint8_t *)data, size);
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+static bool stdio_flushStream(stdio_stream *stream)
+{
+    size_t length = stream->length;
+    stream->length = 0;
+    return length == 0 || stdio_writeAll(stream->fd, stream->file, stream->buffer, length);
+}
+
+static size_t stdio_write(fd_t file, const char *data, size_t size)
+{
+    stdio_stream *stream = stdio_find(file);
+    if (stream == NULL || stream->mode == _IONBF || stream->buffer == NULL)
+    {
+        if (stream && stream->length)
+        {
+            stdio_flushStream(stream);
+        }
+        return stdio_writeAll(file, NULL, data, size) ? size : 0;
+    }
+
+    uint32_t flags = stdio_lock(stream);
+    bool ok = true;
+    if (stream->length + size > stream->size)
+    {
+        ok = stdio_flushStream(stream);
+    }
+    if (size >= stream->size)
+    {
+        // it would not fit anyway
+        ok = ok && stdio_writeAll(file, NULL, data, size);
+    }
+    else
+    {
+        memcpy(stream->buffer + stream->length, data, size);
+        stream->length += size;
+        if (stream->mode == _IOLBF && memchr(data, '\n', size))
+        {
+            ok = stdio_flushStream(stream) && ok;
+        }
+    }
+    stdio_unlock(stream, flags);
+    return ok ? size : 0;
+}
+
+int setvbuf(fd_t stream, char *buffer, int mode, size_t size)
+{
+    if (stream < 0 || (mode != _IOFBF && mode != _IOLBF && mode != _IONBF))
+    {
+        return EOF;
+    }
+    if (mode != _IONBF && size == 0)
+    {
+        size = BUFSIZ;
+    }
+
+    stdio_stream *slot = stdio_find(stream);
+    open_file_t *opened = NULL;
+    if (slot == NULL)
+    {
+        // the reference the new stream keeps
+        opened = VFS_GetFile(stream);
+        if (opened == NULL)
+        {
+            return EOF;
+        }
+        for (int i = VFS_FD_START; slot == NULL && i < STDIO_MAX_STREAMS; i++)
+        {
+            if (!g_Streams[i].used)
+            {
+                slot = &g_Streams[i];
+            }
+        }
+    }
+    if (slot == NULL)
+    {
+        log_warn(MODULE, "setvbuf: no stream left for %d", stream);
+        VFS_PutFile(opened);
+        return EOF;
+    }
+
+    char *owned = NULL;
+    if (mode != _IONBF && buffer == NULL)
+    {
+        owned = (char *)malloc(size);
+        if (owned == NULL)
+        {
+            if (opened)
+            {
+                VFS_PutFile(opened);
+            }
+            return EOF;
+        }
+        buffer = owned;
+    }
+
+    if (opened)
+    {
+        slot->fd = VFS_INVALID_FD;
+        slot->file = opened;
+    }
+    uint32_t flags = stdio_lock(slot);
+    if (slot->used)
+    {
+        stdio_flushStream(slot);
+    }
+    if (slot->ownsBuffer)
+    {
+        free(slot->buffer);
+    }
+    slot->used = true;
+    slot->mode = mode;
+    slot->buffer = mode == _IONBF ? NULL : buffer;
+    slot->size = mode == _IONBF ? 0 : size;
+    slot->length = 0;
+    slot->ownsBuffer = owned != NULL;
+    stdio_unlock(slot, flags);
+    return 0;
+}
+
+void setbuf(fd_t stream, char *buffer)
+{
+    setvbuf(stream, buffer, buffer ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+static int stdio_flushLocked(stdio_stream *stream)
+{
+    if (stream->length == 0)
+    {
+        return 0;
+    }
+    uint32_t flags = stdio_lock(stream);
+    bool ok = stdio_flushStream(stream);
+    stdio_unlock(stream, flags);
+    return ok ? 0 : EOF;
+}
+
+int fflush(fd_t stream)
+{
+    if (stream == VFS_INVALID_FD)
+    {
+        // every stream, like fflush(NULL)
+        int result = 0;
+        for (int i = 0; i < STDIO_MAX_STREAMS; i++)
+        {
+            if (g_Streams[i].used && stdio_flushLocked(&g_Streams[i]) == EOF)
+                result = EOF;
+        }
+        return result;
+    }
+
+    stdio_stream *found = stdio_find(stream);
+    return found ? stdio_flushLocked(found) : 0;
+}
+
+// flushes and forgets the stream of a descriptor that is being closed
+static void stdio_release(fd_t file)
+{
+    stdio_stream *stream = file >= VFS_FD_START ? stdio_find(file) : NULL;
+    if (stream == NULL)
+    {
+        return;
+    }
+    stdio_flushStream(stream);
+    if (stream->ownsBuffer)
+    {
+        free(stream->buffer);
+    }
+    VFS_PutFile(stream->file);
+    memset(stream, 0, sizeof(stdio_stream));
+}
+
 char fputc(char c, fd_t file)
 {
-    VFS_Write(file, (uint8_t*)&c, sizeof(c));
+    stdio_write(file, &c, sizeof(c));
     return c;
 }
 
 int fputs(const char* str, fd_t file)
 {
-    int count = 0;
-    while(*str)
-    {
-        fputc(*str, file);
-        str++;
-        count++;
-    }
-    return count;
+    size_t length = strlen(str);
+    stdio_write(file, str, length);
+    return length;
 }
 
 int fgetc(fd_t file)
 {
+    // whatever asked for the input should be on the screen first
+    if (file == VFS_FD_STDIN)
+        fflush(VFS_FD_STDOUT);
+    else
+        fflush(file);
     uint8_t c;
     int ret = VFS_Read(file, &c, sizeof(c));
     if (ret <= 0)
@@ -180,7 +435,7 @@ void print_buffer(const char* msg, const void* buffer, uint32_t count)
 
 fd_t fileno(fd_t stream)
 {
-    if (stream < VFS_FD_START || stream >= MAX_FILE_HANDLES)
+    if (stream < VFS_FD_START)
     {
         log_err(MODULE, "fileno: Invalid file descriptor: %d", stream);
         return VFS_INVALID_FD; // Invalid file descriptor
@@ -194,6 +449,7 @@ int fread(const void* buf, size_t size, size_t count, fd_t stream)
     size_t bytes_to_read = size * count;
     uint8_t* u8Buffer = (uint8_t*)buf;
 
+    fflush(stream);
     while (bytes_to_read > 0)
     {
         size_t read = VFS_Read(stream, u8Buffer + total_read, bytes_to_read);
@@ -214,33 +470,23 @@ size_t read(fd_t stream, void* buf, size_t count)
 
 int fwrite(void* buf, size_t size, size_t count, fd_t stream)
 {
-    size_t total_read = 0;
-    size_t bytes_to_read = size * count;
-    uint8_t* u8Buffer = (uint8_t*)buf;
-
-    while (bytes_to_read > 0)
-    {
-        size_t read = VFS_Write(stream, u8Buffer + total_read, bytes_to_read);
-        if (read <= 0)
-            break; // EOF or error
-        total_read += read;
-        bytes_to_read -= read;
-    }
-
-    return total_read / size; // return number of items read
+    if (size == 0)
+        return 0;
+    return stdio_write(stream, (const char*)buf, size * count) / size;
 }
 
 size_t write(fd_t stream, void* buf, size_t count)
 {
-    fwrite(buf, 1, count, stream);
-    return count; // Return the number of bytes written
+    // unbuffered, but after what the stream still holds
+    fflush(stream);
+    return stdio_writeAll(stream, NULL, (const char*)buf, count) ? count : 0;
 }
 
 int lseek(fd_t stream, int offset, int whence)
 {
     uint64_t new_offset = 0;
 
-    
+    fflush(stream);
 
     switch (whence)
     {
@@ -275,12 +521,14 @@ int fseek(fd_t stream, int offset, int whence)
 
 void rewind(fd_t stream)
 {
+    fflush(stream);
     VFS_Seek(stream, 0); // Reset the file offset to the beginning
 }
 
 int ftell(fd_t stream)
 {
     log_debug(MODULE, "ftell: stream = %d", stream);
+    fflush(stream);
     int offset = VFS_GetOffset(stream);
     if (offset < 0)
     {
@@ -306,11 +554,41 @@ fd_t open(const char* filename, int flags, ...)
     return VFS_Open((char*)filename);
 }
 
+// "r", "w" and "a", with or without '+', the stream is fully buffered
 fd_t fopen(const char* filename, const char* mode)
 {
     log_debug(MODULE, "fopen: filename = %s, mode = %s", filename, mode);
-    FUNC_NOT_IMPLEMENTED(MODULE, "fopen");
-    return VFS_INVALID_FD; // Placeholder for fopen function, should be implemented
+    vfs_node_t node;
+    bool exists = VFS_Stat(filename, &node);
+    if (mode[0] == 'r' && !exists)
+    {
+        return VFS_INVALID_FD;
+    }
+    if ((mode[0] == 'w' || mode[0] == 'a') && !exists && !VFS_Create(filename))
+    {
+        return VFS_INVALID_FD;
+    }
+    if (mode[0] != 'r' && mode[0] != 'w' && mode[0] != 'a')
+    {
+        log_err(MODULE, "fopen: invalid mode %s", mode);
+        return VFS_INVALID_FD;
+    }
+
+    fd_t file = VFS_Open((char*)filename);
+    if (file == VFS_INVALID_FD)
+    {
+        return VFS_INVALID_FD;
+    }
+    if (mode[0] == 'w')
+    {
+        VFS_Truncate(file, 0);
+    }
+    else if (mode[0] == 'a')
+    {
+        VFS_Seek(file, VFS_GetSize(file));
+    }
+    setvbuf(file, NULL, _IOFBF, BUFSIZ);
+    return file;
 }
 
 fd_t fdopen(fd_t fildes, const char* mode)
@@ -322,6 +600,7 @@ fd_t fdopen(fd_t fildes, const char* mode)
 
 int close(fd_t stream)
 {
+    stdio_release(stream);
     if (VFS_Close(stream) == false)
     {
         log_err(MODULE, "fclose: Failed to close stream %d", stream);
@@ -335,22 +614,10 @@ int fclose(fd_t stream)
     return close(stream); // Delegate to close
 }
 
-int fflush(fd_t stream)
-{
-    log_debug(MODULE, "fflush: stream = %d", stream);
-    if (stream < VFS_FD_START || stream >= MAX_FILE_HANDLES)
-    {
-        log_err(MODULE, "fflush: Invalid file descriptor: %d", stream);
-        return EOF; // Invalid file descriptor
-    }
-    // In this case, we assume that flushing is a no-op for the VFS
-    return 0; // Return 0 on success, as per the standard
-}
-
 void clearerr(fd_t stream)
 {
     log_debug(MODULE, "clearerr: stream = %d", stream);
-    if (stream < VFS_FD_START || stream >= MAX_FILE_HANDLES)
+    if (stream < VFS_FD_START)
     {
         log_err(MODULE, "clearerr: Invalid file descriptor: %d", stream);
         return; // Invalid file descriptor
@@ -362,7 +629,7 @@ void clearerr(fd_t stream)
 int feof(fd_t stream)
 {
     log_debug(MODULE, "feof: stream = %d", stream);
-    if (stream < VFS_FD_START || stream >= MAX_FILE_HANDLES)
+    if (stream < VFS_FD_START)
     {
         log_err(MODULE, "feof: Invalid file descriptor: %d", stream);
         return EOF; // Invalid file descriptor
@@ -374,7 +641,7 @@ int feof(fd_t stream)
 int ferror(fd_t stream)
 {
     log_debug(MODULE, "ferror: stream = %d", stream);
-    if (stream < VFS_FD_START || stream >= MAX_FILE_HANDLES)
+    if (stream < VFS_FD_START)
     {
         log_err(MODULE, "ferror: Invalid file descriptor: %d", stream);
         return EOF; // Invalid file descriptor
@@ -16,6 +16,15 @@ static __attribute__((unused)) fd_t const stddebug = (fd_t)VFS_FD_DEBUG;
 #define EOF (-1)
 #endif
 
+// buffering modes for setvbuf
+#define _IOFBF 0
+#define _IOLBF 1
+#define _IONBF 2
+
+#define BUFSIZ 1024
+#define STDIO_CONSOLE_BUFSIZ 512
+#define STDIO_MAX_STREAMS 32 // open files that can have a buffered stream at once, the standard descriptors included
+
 char fputc(char c, fd_t file);
 char putc(char c);
 
@@ -64,7 +73,10 @@ fd_t fdopen(fd_t fildes, const char *mode);
 int close(fd_t stream);
 int fclose(fd_t stream);
 
+// flushes every stream when stream is VFS_INVALID_FD
 int fflush(fd_t stream);
+int setvbuf(fd_t stream, char *buffer, int mode, size_t size);
+void setbuf(fd_t stream, char *buffer);
 
 void clearerr(fd_t stream);
 int feof(fd_t stream);
@@ -0,0 +1,15 @@
+#include "clock.h"
+
+#include "time.h"
+
+// EBX = clock id, ESI = struct timespec*, EAX = 0 or -1
+void systemClockGettime(Registers* regs)
+{
+    struct timespec* tp = (struct timespec*)regs->U32.esi;
+    if (tp == NULL)
+    {
+        regs->U32.eax = (uint32_t)-1;
+        return;
+    }
+    regs->U32.eax = (uint32_t)clock_gettime((clockid_t)regs->U32.ebx, tp);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "arch/i686/isr.h"
+
+void systemClockGettime(Registers* regs);
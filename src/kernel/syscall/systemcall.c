@@ -7,6 +7,7 @@
 #include "memory.h"
 
 #include "syscall/exit/exit.h"
+#include "syscall/clock/clock.h"
 
 #include "testcall.h"
 
@@ -65,4 +66,5 @@ void initSystemCall()
     
 
     registerSyscall(SYSCALL_EXIT, systemExit); // Register test syscall
+    registerSyscall(SYSCALL_CLOCK_GETTIME, systemClockGettime);
 }
\ No newline at end of file
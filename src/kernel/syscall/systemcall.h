@@ -13,6 +13,8 @@ typedef void (*SystemCall)(Registers* regs);
 #define SYSCALL_EXIT 2
 #define SYSCALL_OPEN 3
 #define SYSCALL_CLOSE 4
+#define SYSCALL_CLOCK_GETTIME 5
+#define SYSCALL_DUP 6
 
 void initregs(IntRegisters *reg);
 void registerSyscall(uint32_t syscallId, SystemCall syscallHandler);
@@ -0,0 +1,43 @@
+#include "mutex.h"
+#include "debug.h"
+
+#define MODULE "MUTEX"
+
+void mutexInit(mutex_t *mutex)
+{
+    mutex->owner = NULL;
+    mutex->depth = 0;
+    waitQueueInit(&mutex->waiters);
+}
+
+void mutexLock(mutex_t *mutex)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    if (mutex->depth && mutex->owner == g_CurrentTask)
+    {
+        mutex->depth++;
+    }
+    else
+    {
+        while (mutex->depth)
+            waitSleep(&mutex->waiters);
+        mutex->owner = g_CurrentTask;
+        mutex->depth = 1;
+    }
+    i686_RestoreInterrupts(flags);
+}
+
+void mutexUnlock(mutex_t *mutex)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    if (mutex->depth == 0 || mutex->owner != g_CurrentTask)
+    {
+        log_err(MODULE, "unlock by a task that does not hold it");
+    }
+    else if (--mutex->depth == 0)
+    {
+        mutex->owner = NULL;
+        waitWakeOne(&mutex->waiters);
+    }
+    i686_RestoreInterrupts(flags);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "wait.h"
+
+// a lock that sleeps instead of spinning, the owner may take it again
+typedef struct mutex
+{
+    task_t *owner;
+    uint32_t depth;
+    wait_queue_t waiters;
+} mutex_t;
+
+#define MUTEX_INIT {NULL, 0, WAIT_QUEUE_INIT}
+
+void mutexInit(mutex_t *mutex);
+
+// not from interrupt handlers
+void mutexLock(mutex_t *mutex);
+void mutexUnlock(mutex_t *mutex);
@@ -1,39 +1,118 @@
 #include "process.h"
 #include "memory.h"
-#include "arch/i686/gdt.h"
+#include "debug.h"
+#include "allocator/frame.h"
+#include "arch/i686/io.h"
+#include "arch/i686/memory_i686.h"
 
-process_t* Process[MAX_PROCESS];
-int nextProcessIndex = 0;
+#define MODULE "PROCESS"
 
-process_t* makeProcess(uint32_t address, uint32_t userStack)
+/*
+ * User processes
+ *
+ * A process is a user task of the scheduler plus the memory it runs in: the
+ * program image and a user stack of its own, whose frames are opened to
+ * ring 3 while it lives. The exit syscall ends the task and wakes whoever
+ * waits for the process; the waiter frees what is left.
+ */
+
+process_t* g_Processes = NULL;
+static uint32_t g_NextPid = 1;
+
+process_t* makeProcess(uint32_t address)
 {
-    if (Process[nextProcessIndex] == NULL)
+    process_t* process = (process_t*)calloc(1, sizeof(process_t));
+    if (process == NULL)
+        return NULL;
+
+    uint32_t frames = PROCESS_USER_STACK_SIZE / FRAME_SIZE;
+    process->stackBase = frameAllocRange(frames);
+    if (process->stackBase == 0)
     {
-        Process[nextProcessIndex] = malloc(sizeof(process_t));
+        log_err(MODULE, "no frames for a user stack");
+        free(process);
+        return NULL;
     }
+    pagingSetUser(process->stackBase, PROCESS_USER_STACK_SIZE, true);
+
+    process->processAddress = address;
+    process->code = (uint8_t*)address;
+    process->stack = process->stackBase + PROCESS_USER_STACK_SIZE;
+    waitQueueInit(&process->exitWait);
+
+    uint32_t flags = i686_SaveInterrupts();
+    process->pid = g_NextPid++;
+    process->next = g_Processes;
+    g_Processes = process;
+    i686_RestoreInterrupts(flags);
+    return process;
+}
+
+bool runProcess(process_t* process, const char *name)
+{
+    process->task = schedCreateUserTask(name, process->processAddress, process->stack);
+    if (process->task == NULL)
+        return false;
+    log_debug(MODULE, "process %u runs as task %u", process->pid, process->task->id);
+    return true;
+}
 
-    Process[nextProcessIndex]->processAddress = address;
-    Process[nextProcessIndex]->code = (uint8_t*)address;
-    Process[nextProcessIndex]->stack = userStack;
-    return Process[nextProcessIndex];
+// interrupts off
+static void processUnlink(process_t* process)
+{
+    process_t** link = &g_Processes;
+    while (*link && *link != process)
+        link = &(*link)->next;
+    if (*link)
+        *link = process->next;
 }
 
-void runProcess(process_t* process)
+int waitProcess(process_t* process)
 {
-    Jump_usermode(process->processAddress, process->stack);
+    waitEvent(&process->exitWait, process->exited);
+
+    uint32_t flags = i686_SaveInterrupts();
+    processUnlink(process);
+    i686_RestoreInterrupts(flags);
+
+    int code = process->exitCode;
+    free(process);
+    return code;
 }
 
-void killProcess(int id)
+void exitProcess(int code)
 {
-    process_t* currentProcess = Process[id];
-    if (currentProcess == NULL)
+    process_t* process = NULL;
+    uint32_t flags = i686_SaveInterrupts();
+    for (process_t* p = g_Processes; p; p = p->next)
     {
+        if (p->task == g_CurrentTask)
+        {
+            process = p;
+            break;
+        }
+    }
+    i686_RestoreInterrupts(flags);
 
+    if (process == NULL)
+    {
+        log_err(MODULE, "task %u exits but is no process", g_CurrentTask->id);
+        schedExit();
+        return;
     }
 
-    // free()
+    // the task never goes back to ring 3, its stack can go
+    pagingSetUser(process->stackBase, PROCESS_USER_STACK_SIZE, false);
+    frameFreeRange(process->stackBase, PROCESS_USER_STACK_SIZE / FRAME_SIZE);
+    process->stackBase = 0;
+    log_debug(MODULE, "process %u exited with %d", process->pid, code);
 
-    free(currentProcess);
-    Process[nextProcessIndex] = NULL;
-    nextProcessIndex--;
-}
\ No newline at end of file
+    flags = i686_SaveInterrupts();
+    process->exitCode = code;
+    process->exited = true;
+    waitWakeAll(&process->exitWait);
+    i686_RestoreInterrupts(flags);
+
+    // the waiter may free the process from here on
+    schedExit();
+}
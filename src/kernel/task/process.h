@@ -3,23 +3,37 @@
 #include "defaultInclude.h"
 #include "arch/i686/isr.h"
 #include "allocator/memory_allocator.h"
+#include "sched.h"
+#include "wait.h"
 
-#define MAX_PROCESS 1
+#define PROCESS_USER_STACK_SIZE 8192
 
 typedef struct process
 {
     uint32_t pid;
-    Registers *regs;
     uint32_t processAddress;
     Page* memoryPage;
-    uint32_t stack;
+    uint32_t stack;     // top of the user stack
+    uint32_t stackBase; // frames of the user stack, the process owns them
     uint8_t* code;
     uint8_t* data;
     uint8_t* roData;
+
+    task_t *task; // NULL until runProcess
+    volatile bool exited;
+    int exitCode;
+    wait_queue_t exitWait;
+
+    struct process *next;
 } process_t;
 
-extern process_t* Process[MAX_PROCESS];
+// every process that was made and not yet waited for
+extern process_t* g_Processes;
 
-process_t* makeProcess(uint32_t address, uint32_t userStack);
-void runProcess(process_t* process);
-void killProcess(int id);
+process_t* makeProcess(uint32_t address);
+// puts the process on the run queue, it starts on the next switch
+bool runProcess(process_t* process, const char *name);
+// sleeps until the process exits, frees it and returns its exit code
+int waitProcess(process_t* process);
+// ends the calling process, never returns
+void exitProcess(int code);
@@ -0,0 +1,289 @@
+#include "sched.h"
+#include "memory.h"
+#include "string.h"
+#include "stdio.h"
+#include "debug.h"
+#include "arch/i686/gdt.h"
+#include "arch/i686/io.h"
+#include "hal/fdtable.h"
+
+#define MODULE "SCHED"
+
+/*
+ * Round-robin scheduler
+ *
+ * Tasks are switched on the interrupt return path: every interrupt saves a
+ * Registers frame on the current kernel stack, and isr_common resumes whatever
+ * frame i686_ISR_Handler returns. schedSwitch hands back the next task's frame
+ * when the time slice ran out or the current task yielded or blocked.
+ */
+
+task_t *g_CurrentTask = NULL;
+
+task_t *g_RunQueueHead = NULL;
+task_t *g_RunQueueTail = NULL;
+task_t *g_DeadTasks = NULL;
+task_t *g_IdleTask = NULL;
+
+uint32_t g_NextTaskId = 0;
+uint32_t g_TimeSlice = SCHED_TIME_SLICE_TICKS;
+bool g_NeedResched = false;
+
+extern uint8_t stack_top;
+
+static void runQueuePush(task_t *task)
+{
+    task->next = NULL;
+    if (g_RunQueueTail)
+        g_RunQueueTail->next = task;
+    else
+        g_RunQueueHead = task;
+    g_RunQueueTail = task;
+}
+
+static task_t *runQueuePop()
+{
+    task_t *task = g_RunQueueHead;
+    if (task)
+    {
+        g_RunQueueHead = task->next;
+        if (g_RunQueueHead == NULL)
+            g_RunQueueTail = NULL;
+        task->next = NULL;
+    }
+    return task;
+}
+
+static task_t *taskAlloc(const char *name)
+{
+    task_t *task = (task_t *)calloc(1, sizeof(task_t));
+    task->id = g_NextTaskId++;
+    strncpy(task->name, name, TASK_NAME_LENGTH - 1);
+    task->state = TASK_READY;
+    task->ticksLeft = g_TimeSlice;
+    return task;
+}
+
+// stacks of dead tasks are freed from another task, never from their own
+static void reapDeadTasks()
+{
+    uint32_t flags = i686_SaveInterrupts();
+    while (g_DeadTasks)
+    {
+        task_t *task = g_DeadTasks;
+        g_DeadTasks = task->next;
+        free(task->kernelStack);
+        free(task);
+    }
+    i686_RestoreInterrupts(flags);
+}
+
+static Registers *schedSwitch(Registers *regs)
+{
+    if (!g_NeedResched || g_CurrentTask == NULL)
+        return regs;
+    g_NeedResched = false;
+
+    task_t *prev = g_CurrentTask;
+    prev->regs = regs;
+
+    task_t *next = runQueuePop();
+    if (next == NULL)
+    {
+        // nothing else wants to run
+        if (prev->state == TASK_RUNNING)
+        {
+            prev->ticksLeft = g_TimeSlice;
+            return regs;
+        }
+        next = g_IdleTask;
+    }
+
+    if (prev->state == TASK_RUNNING)
+    {
+        prev->state = TASK_READY;
+        if (prev != g_IdleTask)
+            runQueuePush(prev);
+    }
+    else if (prev->state == TASK_DEAD)
+    {
+        prev->next = g_DeadTasks;
+        g_DeadTasks = prev;
+    }
+
+    next->state = TASK_RUNNING;
+    next->ticksLeft = g_TimeSlice;
+    g_CurrentTask = next;
+    set_kernel_stack(next->kernelStackTop);
+    return next->regs;
+}
+
+// first code a new kernel thread runs, iret lands here
+static void taskTrampoline()
+{
+    i686_EnableInterrupts();
+    reapDeadTasks();
+    g_CurrentTask->entry(g_CurrentTask->arg);
+    schedExit();
+}
+
+static void idleThread(void *arg)
+{
+    while (true)
+    {
+        reapDeadTasks();
+        i686_HLT();
+    }
+}
+
+static void schedYieldHandler(Registers *regs)
+{
+    g_NeedResched = true;
+}
+
+// builds the frame isr_common pops when the task is switched to the first time
+static task_t *taskCreate(const char *name, bool user, uint32_t eip, uint32_t userStack)
+{
+    task_t *task = taskAlloc(name);
+    task->user = user;
+    task->kernelStack = (uint8_t *)malloc(TASK_KERNEL_STACK_SIZE);
+    task->kernelStackTop = (uint32_t)task->kernelStack + TASK_KERNEL_STACK_SIZE;
+
+    Registers *regs = (Registers *)(task->kernelStackTop - sizeof(Registers));
+    memset(regs, 0, sizeof(Registers));
+    regs->eip = eip;
+    regs->eflags = 0x202; // interrupts on
+    if (user)
+    {
+        // iret drops to ring 3 and takes esp and ss from the frame
+        regs->ds = i686_GDT_USER_DATA_SEGMENT | 3;
+        regs->cs = i686_GDT_USER_CODE_SEGMENT | 3;
+        regs->ss = i686_GDT_USER_DATA_SEGMENT | 3;
+        regs->esp = userStack;
+    }
+    else
+    {
+        // no privilege change, iret leaves esp just above eflags
+        regs->ds = i686_GDT_DATA_SEGMENT;
+        regs->cs = i686_GDT_CODE_SEGMENT;
+    }
+    task->regs = regs;
+    return task;
+}
+
+task_t *schedCreateKernelThread(const char *name, task_entry_t entry, void *arg)
+{
+    task_t *task = taskCreate(name, false, (uint32_t)taskTrampoline, 0);
+    task->entry = entry;
+    task->arg = arg;
+    task->files = fdTableShare(g_CurrentTask->files);
+
+    uint32_t flags = i686_SaveInterrupts();
+    runQueuePush(task);
+    i686_RestoreInterrupts(flags);
+    log_debug(MODULE, "kernel thread %u '%s' created", task->id, task->name);
+    return task;
+}
+
+task_t *schedCreateUserTask(const char *name, uint32_t entry, uint32_t userStack)
+{
+    task_t *task = taskCreate(name, true, entry, userStack);
+    // the program works on its parent's descriptors, like the shell's own commands do
+    task->files = fdTableShare(g_CurrentTask->files);
+
+    uint32_t flags = i686_SaveInterrupts();
+    runQueuePush(task);
+    i686_RestoreInterrupts(flags);
+    log_debug(MODULE, "user task %u '%s' created at %x", task->id, task->name, entry);
+    return task;
+}
+
+void schedTick()
+{
+    if (g_CurrentTask == NULL)
+        return;
+    if (g_CurrentTask->ticksLeft > 0)
+        g_CurrentTask->ticksLeft--;
+    if (g_CurrentTask->ticksLeft == 0 || g_CurrentTask == g_IdleTask)
+        g_NeedResched = true;
+}
+
+void schedYield()
+{
+    __asm__ volatile("int %0" : : "i"(SCHED_YIELD_INTERRUPT) : "memory");
+}
+
+void schedExit()
+{
+    // closing the last reference of a file may have to wait for the disk
+    fd_table_t *files = g_CurrentTask->files;
+    g_CurrentTask->files = NULL;
+    fdTablePut(files);
+
+    i686_DisableInterrupts();
+    log_debug(MODULE, "task %u '%s' exited", g_CurrentTask->id, g_CurrentTask->name);
+    g_CurrentTask->state = TASK_DEAD;
+    schedYield();
+    // a dead task is never picked again
+    for (;;)
+        i686_HLT();
+}
+
+// the caller puts the task on a wait queue first, with interrupts off
+void schedBlock()
+{
+    if (g_CurrentTask == NULL)
+        return;
+    uint32_t flags = i686_SaveInterrupts();
+    g_CurrentTask->state = TASK_BLOCKED;
+    schedYield();
+    i686_RestoreInterrupts(flags);
+}
+
+void schedWakeup(task_t *task)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    if (task->state == TASK_BLOCKED)
+    {
+        task->state = TASK_READY;
+        runQueuePush(task);
+        // the idle task gives way right away
+        if (g_CurrentTask == g_IdleTask)
+            g_NeedResched = true;
+    }
+    i686_RestoreInterrupts(flags);
+}
+
+void schedSetTimeSlice(uint32_t ticks)
+{
+    g_TimeSlice = ticks ? ticks : 1;
+}
+
+void schedPrintTasks()
+{
+    static const char *const states[] = {"ready", "running", "blocked", "dead"};
+    uint32_t flags = i686_SaveInterrupts();
+    printf("%u: %s %s (current)\n", g_CurrentTask->id, g_CurrentTask->name, states[g_CurrentTask->state]);
+    for (task_t *task = g_RunQueueHead; task; task = task->next)
+    {
+        printf("%u: %s %s\n", task->id, task->name, states[task->state]);
+    }
+    i686_RestoreInterrupts(flags);
+}
+
+void schedInit()
+{
+    // the code running now becomes the boot task
+    task_t *boot = taskAlloc("kernel");
+    boot->state = TASK_RUNNING;
+    boot->kernelStack = NULL;
+    boot->kernelStackTop = (uint32_t)&stack_top;
+    g_CurrentTask = boot;
+
+    g_IdleTask = taskCreate("idle", false, (uint32_t)taskTrampoline, 0);
+    g_IdleTask->entry = idleThread;
+
+    i686_ISR_RegisterHandler(SCHED_YIELD_INTERRUPT, schedYieldHandler);
+    i686_ISR_RegisterSwitchHandler(schedSwitch);
+    log_info(MODULE, "Scheduler running, time slice %u ticks", g_TimeSlice);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "arch/i686/isr.h"
+
+#define TASK_NAME_LENGTH 16
+#define TASK_KERNEL_STACK_SIZE 16384
+
+// default time slice, in PIT ticks (2 ms each at 500 Hz)
+#define SCHED_TIME_SLICE_TICKS 10
+
+// software interrupt used to give up the CPU
+#define SCHED_YIELD_INTERRUPT 0x81
+
+typedef enum
+{
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_BLOCKED,
+    TASK_DEAD,
+} task_state;
+
+typedef void (*task_entry_t)(void *arg);
+
+typedef struct task
+{
+    uint32_t id;
+    char name[TASK_NAME_LENGTH];
+    task_state state;
+    bool user;
+
+    Registers *regs;         // saved frame, on this task's kernel stack
+    uint8_t *kernelStack;    // NULL for the boot task, it runs on the linker stack
+    uint32_t kernelStackTop; // loaded into TSS esp0 when the task runs
+    uint32_t ticksLeft;
+
+    task_entry_t entry;
+    void *arg;
+
+    struct task *next; // run queue or wait queue
+
+    struct wait_queue *waitQueue; // queue the task is blocked on
+    uint32_t wakeTick;            // deadline while on the sleeper list
+    bool sleeping;
+    struct task *sleepNext;
+
+    struct fd_table *files; // NULL until the task opens its first file
+} task_t;
+
+extern task_t *g_CurrentTask;
+
+void schedInit();
+task_t *schedCreateKernelThread(const char *name, task_entry_t entry, void *arg);
+// a ring 3 task starting at entry, its kernel stack is its own and esp0 follows it on every switch
+task_t *schedCreateUserTask(const char *name, uint32_t entry, uint32_t userStack);
+
+void schedTick();
+void schedYield();
+void schedExit();
+
+void schedBlock();
+void schedWakeup(task_t *task);
+
+void schedSetTimeSlice(uint32_t ticks);
+void schedPrintTasks();
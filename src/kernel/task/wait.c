@@ -0,0 +1,180 @@
+#include "wait.h"
+#include "debug.h"
+#include "arch/i686/pit.h"
+
+#define MODULE "WAIT"
+
+/*
+ * Wait queues
+ *
+ * A task that waits is taken off the run queue (schedBlock) and put on a wait
+ * queue. Waits with a deadline are also put on g_Sleepers, kept sorted by
+ * deadline so the PIT only has to look at the head of the list on each tick.
+ * Whichever comes first, the wakeup or the deadline, makes the task runnable
+ * again and the task takes itself off the other list when it runs.
+ */
+
+task_t *g_Sleepers = NULL;
+
+static inline bool tickReached(uint32_t now, uint32_t deadline)
+{
+    return (int32_t)(now - deadline) >= 0;
+}
+
+static void queuePush(wait_queue_t *queue, task_t *task)
+{
+    task->next = NULL;
+    if (queue->tail)
+        queue->tail->next = task;
+    else
+        queue->head = task;
+    queue->tail = task;
+}
+
+static void queueRemove(wait_queue_t *queue, task_t *task)
+{
+    task_t *prev = NULL;
+    for (task_t *it = queue->head; it; prev = it, it = it->next)
+    {
+        if (it != task)
+            continue;
+        if (prev)
+            prev->next = it->next;
+        else
+            queue->head = it->next;
+        if (queue->tail == it)
+            queue->tail = prev;
+        it->next = NULL;
+        return;
+    }
+}
+
+static void sleeperAdd(task_t *task)
+{
+    task_t **link = &g_Sleepers;
+    while (*link && tickReached(task->wakeTick, (*link)->wakeTick))
+        link = &(*link)->sleepNext;
+    task->sleepNext = *link;
+    *link = task;
+    task->sleeping = true;
+}
+
+static void sleeperRemove(task_t *task)
+{
+    for (task_t **link = &g_Sleepers; *link; link = &(*link)->sleepNext)
+    {
+        if (*link == task)
+        {
+            *link = task->sleepNext;
+            break;
+        }
+    }
+    task->sleepNext = NULL;
+    task->sleeping = false;
+}
+
+// before the scheduler runs there is only the boot code, it just waits for the next interrupt
+static void waitIdle()
+{
+    __asm__ volatile("sti; hlt; cli" : : : "memory");
+}
+
+void waitQueueInit(wait_queue_t *queue)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+void waitSleep(wait_queue_t *queue)
+{
+    task_t *task = g_CurrentTask;
+    if (task == NULL)
+    {
+        waitIdle();
+        return;
+    }
+
+    task->waitQueue = queue;
+    queuePush(queue, task);
+    schedBlock();
+}
+
+bool waitSleepTimeout(wait_queue_t *queue, uint32_t deadline)
+{
+    if (tickReached(timer_ticks, deadline))
+        return false;
+
+    task_t *task = g_CurrentTask;
+    if (task == NULL)
+    {
+        waitIdle();
+        return !tickReached(timer_ticks, deadline);
+    }
+
+    task->waitQueue = queue;
+    if (queue)
+        queuePush(queue, task);
+    task->wakeTick = deadline;
+    sleeperAdd(task);
+
+    schedBlock();
+
+    // woken by one of the two, leave the other
+    if (task->sleeping)
+        sleeperRemove(task);
+    if (task->waitQueue)
+    {
+        queueRemove(task->waitQueue, task);
+        task->waitQueue = NULL;
+    }
+    return !tickReached(timer_ticks, deadline);
+}
+
+void waitWakeOne(wait_queue_t *queue)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    task_t *task = queue->head;
+    if (task)
+    {
+        queueRemove(queue, task);
+        task->waitQueue = NULL;
+        schedWakeup(task);
+    }
+    i686_RestoreInterrupts(flags);
+}
+
+void waitWakeAll(wait_queue_t *queue)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    while (queue->head)
+    {
+        task_t *task = queue->head;
+        queueRemove(queue, task);
+        task->waitQueue = NULL;
+        schedWakeup(task);
+    }
+    i686_RestoreInterrupts(flags);
+}
+
+void waitTick(uint32_t now)
+{
+    while (g_Sleepers && tickReached(now, g_Sleepers->wakeTick))
+    {
+        task_t *task = g_Sleepers;
+        sleeperRemove(task);
+        if (task->waitQueue)
+        {
+            queueRemove(task->waitQueue, task);
+            task->waitQueue = NULL;
+        }
+        schedWakeup(task);
+    }
+}
+
+void waitUntil(uint32_t deadline)
+{
+    uint32_t flags = i686_SaveInterrupts();
+    while (waitSleepTimeout(NULL, deadline))
+        ;
+    i686_RestoreInterrupts(flags);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "defaultInclude.h"
+#include "sched.h"
+#include "arch/i686/io.h"
+
+typedef struct wait_queue
+{
+    task_t *head;
+    task_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {NULL, NULL}
+
+void waitQueueInit(wait_queue_t *queue);
+
+// both are called with interrupts off, they come back with interrupts off
+void waitSleep(wait_queue_t *queue);
+bool waitSleepTimeout(wait_queue_t *queue, uint32_t deadline); // false once the deadline tick has passed, queue can be NULL
+
+void waitWakeOne(wait_queue_t *queue);
+void waitWakeAll(wait_queue_t *queue);
+
+// called by the PIT on every tick
+void waitTick(uint32_t now);
+
+void waitUntil(uint32_t deadline);
+
+// sleeps until condition is true, the condition is checked with interrupts off so a wakeup cannot be lost
+#define waitEvent(queue, condition)                  \
+    do                                               \
+    {                                                \
+        uint32_t __waitFlags = i686_SaveInterrupts(); \
+        while (!(condition))                         \
+            waitSleep(queue);                        \
+        i686_RestoreInterrupts(__waitFlags);         \
+    } while (0)
+
+// same as waitEvent but gives up at the deadline tick, timedOut is set when it did
+#define waitEventTimeout(queue, condition, deadline, timedOut) \
+    do                                                          \
+    {                                                           \
+        uint32_t __waitFlags = i686_SaveInterrupts();            \
+        (timedOut) = false;                                     \
+        while (!(condition))                                    \
+        {                                                       \
+            if (!waitSleepTimeout(queue, deadline))             \
+            {                                                   \
+                (timedOut) = !(condition);                      \
+                break;                                          \
+            }                                                   \
+        }                                                       \
+        i686_RestoreInterrupts(__waitFlags);                    \
+    } while (0)
@@ -1,6 +1,8 @@
 #include "time.h"
 #include "drivers/CMOS.h"
 #include "memory.h"
+#include "errno.h"
+#include "arch/i686/clock.h"
 
 int daylight;
 long int timezone;
@@ -123,3 +125,41 @@ time_t mktime(struct tm* tm)
     unix_to_datetime(timer, tm);
     return timer;
 }
+
+int clock_gettime(clockid_t clockid, struct timespec* tp)
+{
+    // the RTC only has whole seconds, so it is read once and the monotonic clock runs on from there
+    static bool realtimeSet = false;
+    static uint64_t realtimeBase = 0;
+    static uint64_t realtimeStart = 0;
+
+    uint64_t ns;
+    switch (clockid)
+    {
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_BOOTTIME:
+        ns = clock_monotonic_ns();
+        break;
+    case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+        if (!realtimeSet)
+        {
+            time_t now;
+            time(&now);
+            realtimeBase = (uint64_t)now * NSEC_PER_SEC;
+            realtimeStart = clock_monotonic_ns();
+            realtimeSet = true;
+        }
+        ns = realtimeBase + (clock_monotonic_ns() - realtimeStart);
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    tp->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+    tp->tv_nsec = (long)(ns % NSEC_PER_SEC);
+    return 0;
+}
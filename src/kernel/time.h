@@ -93,4 +93,9 @@ extern long int timezone;
 
 void localtime(time_t __timer, struct tm* time);
 void time(time_t* __timer);
-time_t mktime(struct tm* tm);
\ No newline at end of file
+time_t mktime(struct tm* tm);
+
+typedef int clockid_t;
+
+// 0 on success, -1 with errno set to EINVAL for an unknown clock
+int clock_gettime(clockid_t clockid, struct timespec* tp);
\ No newline at end of file
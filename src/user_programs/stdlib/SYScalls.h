@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stddef.h>
+
 void __attribute__((cdecl)) SystemCall(int interruptIndex, int ebx, int ecx, int edx, int esi, int edi);
 void __attribute__((cdecl)) SYS_Exit(int status);
 void __attribute__((cdecl)) SYS_Write(char* buffer, int count);
 void __attribute__((cdecl)) SYS_Read(char* buffer, int count);
-char* __attribute__((cdecl)) SYS_Map(size_t size)
-int __attribute__((cdecl)) SYS_UnMap(void* address)
\ No newline at end of file
+char* __attribute__((cdecl)) SYS_Map(size_t size);
+int __attribute__((cdecl)) SYS_UnMap(void* address);
+int __attribute__((cdecl)) SYS_ClockGettime(int clockid, void* tp);
\ No newline at end of file
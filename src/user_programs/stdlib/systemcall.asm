@@ -130,4 +130,26 @@ SYS_UnMap:
     pop     ebx
 
     pop     ebp
-    ret
\ No newline at end of file
+    ret
+
+;
+; int SYS_ClockGettime(int clockid, struct timespec* tp)
+;
+global SYS_ClockGettime
+SYS_ClockGettime:
+    push    ebp
+    mov     ebp,            esp
+
+    push    esi
+    push    ebx
+
+    mov     ebx,            [ebp + 8]
+    mov     esi,            [ebp + 12]
+    mov     eax,            5
+    int     0x80
+
+    pop     ebx
+    pop     esi
+
+    pop     ebp
+    ret
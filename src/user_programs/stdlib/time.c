@@ -0,0 +1,7 @@
+#include "time.h"
+#include "SYScalls.h"
+
+int clock_gettime(clockid_t clockid, struct timespec* tp)
+{
+    return SYS_ClockGettime(clockid, tp);
+}
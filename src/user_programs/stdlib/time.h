@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_MONOTONIC_RAW 4
+
+typedef int clockid_t;
+
+struct timespec
+{
+    int32_t tv_sec;
+    int32_t tv_nsec;
+};
+
+int clock_gettime(clockid_t clockid, struct timespec* tp);